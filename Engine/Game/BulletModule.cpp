@@ -6,6 +6,7 @@
 #include "Engine/Game/FluidModule.h"
 #include "Engine/Game/EntityModule.h"
 #include "Engine/Game/EntityQuery.h"
+#include "Engine/Game/Message.h"
 #include "Engine/Graphics/ResourceManager.h"
 #include "Engine/Graphics/Renderer.h"
 #include "Util.h"
@@ -36,6 +37,7 @@ public:
     };
 private:
     typedef stl::vector<LaserParticle> Particles;
+    static const uint32  s_particles_per_frame;
     static const float32 s_speed;
     static const float32 s_lifetime;
     static const float32 s_fadeout_time;
@@ -58,6 +60,7 @@ private:
     typedef stl::vector<CollisionContext> CollisionContexts;
     CollisionContexts m_cctx;
     ist::vector<SingleParticle> m_drawdata;
+    ParticleCont m_fluid; // 当たった粒子から出す流体。レーザー毎にまとめて FluidModule に渡す
 
     istSerializeBlock(
         istSerializeBase(super)
@@ -126,16 +129,47 @@ public:
         return m_state==State_Dead;
     }
 
-    vec3 computeParticlePos(const LaserParticle &p)
+    // computeParticlePos() 用の、レーザー単位で 1 フレームに一度だけ求めておく値
+    struct ParticleFrame
+    {
+        simdvec4 origin;
+        simdvec4 velocity;  // m_dir*s_speed
+        simdvec4 axis;      // 回転軸。正規化済みの m_dir
+    };
+
+    static ParticleFrame computeParticleFrame(const vec3 &pos, const vec3 &dir)
+    {
+        ParticleFrame f;
+        f.origin    = simdvec4(pos, 0.0f);
+        f.velocity  = simdvec4(dir*s_speed, 0.0f);
+        f.axis      = simdvec4(glm::normalize(dir), 0.0f);
+        return f;
+    }
+
+    // 進んだ位置から pos_base を m_dir 周りに time*15 度回転させた位置。
+    // translate/rotate/translate の mat4 を粒子毎に作る代わりに、ロドリゲスの回転公式で直接求める
+    static vec3 computeParticlePos(const ParticleFrame &f, const LaserParticle &p)
+    {
+        float32 angle = glm::radians(p.time*15.0f);
+        float32 c = std::cos(angle);
+        float32 s = std::sin(angle);
+        simdvec4 v(p.pos_base, 0.0f);
+        simdvec4 r = f.origin + f.velocity*p.time + v*c
+            + glm::cross(f.axis, v)*s + f.axis*(glm::simdDot(f.axis, v)*(1.0f-c));
+        return vec3(glm::vec4_cast(r));
+    }
+
+#ifdef atm_enable_Benchmark
+    // 以前の mat4 による計算。比較用
+    static vec3 dbgComputeParticlePosMat4(const vec3 &pos, const vec3 &dir, const LaserParticle &p)
     {
-        vec3 adv = m_dir * (p.time*s_speed);
-        vec3 pos = m_pos + adv;
         mat4 mat;
-        mat = glm::translate(mat, pos);
-        mat = glm::rotate(mat, p.time*15.0f, m_dir);
+        mat = glm::translate(mat, pos + dir*(p.time*s_speed));
+        mat = glm::rotate(mat, p.time*15.0f, dir);
         mat = glm::translate(mat, p.pos_base);
         return vec3(mat * vec4(vec3(0.0f), 1.0f));
     }
+#endif // atm_enable_Benchmark
 
     void update1(float32 dt)
     {
@@ -145,11 +179,10 @@ public:
             return;
         }
 
-        for(size_t i=0; i<6; ++i) {
-            LaserParticle t;
-            t.pos_base = GenRandomVector3()*0.075f * vec3(1.0f,1.0f,0.5f);
-            t.time = 0.0f;
-            m_particles.push_back(t);
+        size_t first = m_particles.size();
+        m_particles.resize(first+s_particles_per_frame);
+        for(size_t i=first; i<m_particles.size(); ++i) {
+            m_particles[i].pos_base = GenRandomVector3()*0.075f * vec3(1.0f,1.0f,0.5f);
         }
         each(m_particles, [&](LaserParticle &p){
             p.time += dt;
@@ -170,9 +203,10 @@ public:
             m_cctx.resize(num_tasks);
         }
 
+        const ParticleFrame frame = computeParticleFrame(m_pos, m_dir);
         parallel_each_with_block_index(m_particles, blocksize, [&](LaserParticle &p, size_t bi){
             CollisionContext &ctx = m_cctx[bi];
-            vec3 pos = computeParticlePos(p);
+            vec3 pos = computeParticlePos(frame, p);
             p.pos_current = pos;
             CollisionSphere sphere;
             sphere.setEntityHandle(m_owner);
@@ -190,23 +224,28 @@ public:
     void update3(float32 dt)
     {
         if(m_state==State_Normal) {
+            m_fluid.clear();
             each(m_particles, [&](LaserParticle &p){
                 if(p.hit_to) {
                     ++m_hitcount;
                     vec3 pos = p.pos_current;
                     float32 d = s_power;
                     if(atmIsEnemy(p.hit_to)) { d*=0.5f; }
-                    atmCall(p.hit_to, damage, d);
+                    DamageMessage dm = {m_owner, p.hit_to, d, 0};
+                    atmSendMessage(dm);
                     atmCall(p.hit_to, pulse, atmArgs(pos, m_dir*s_speed*1000.0f));
                     {
                         psym::Particle particles;
                         istAlign(16) vec4 spos = vec4(pos, 1.0f);
                         particles.position = (psym::simdvec4&)spos;
                         particles.velocity = _mm_set1_ps(0.0f);
-                        atmGetFluidModule()->addFluid(&particles, 1);
+                        m_fluid.push_back(particles);
                     }
                 }
             });
+            if(!m_fluid.empty()) {
+                atmGetFluidModule()->addFluid(&m_fluid[0], m_fluid.size());
+            }
         }
         erase(m_particles, [&](LaserParticle &p){ return p.time>=s_lifetime; });
     }
@@ -271,6 +310,7 @@ public:
     }
 
 };
+const uint32  Laser::s_particles_per_frame = 6;
 const float32 Laser::s_speed = 0.06f;
 const float32 Laser::s_lifetime = 100.0f;
 const float32 Laser::s_fadeout_time = 50.0f;
@@ -402,97 +442,214 @@ atmExportClass(LaserManager)
 
 
 
-struct BulletData
+// 弾のプール。SIMD でまとめて処理できるように、要素ごとに別の配列に持つ (SoA)
+struct BulletPool
 {
-    vec3 pos;
-    vec3 vel;
-    float32 time;
-    EntityHandle owner;
-    CollisionGroup group;
-    EntityHandle hit_to;
-    uint32 flags;
+    typedef ist::raw_vector<float32>        FloatCont;
+    typedef ist::raw_vector<EntityHandle>   HandleCont;
+    typedef ist::raw_vector<CollisionGroup> GroupCont;
+
+    FloatCont   pos_x, pos_y, pos_z;
+    FloatCont   vel_x, vel_y, vel_z;
+    FloatCont   time;
+    HandleCont  owner;
+    GroupCont   group;
+    HandleCont  hit_to;
 
-    BulletData() : time(), owner(), hit_to(), flags() {}
-    BulletData(const vec3 &p, const vec3 &v, EntityHandle o) : pos(p), vel(v), owner(o), hit_to(), flags()
+    istSerializeBlock(
+        istSerialize(pos_x)
+        istSerialize(pos_y)
+        istSerialize(pos_z)
+        istSerialize(vel_x)
+        istSerialize(vel_y)
+        istSerialize(vel_z)
+        istSerialize(time)
+        istSerialize(owner)
+        istSerialize(group)
+        istSerialize(hit_to)
+    )
+
+    uint32 size() const { return (uint32)time.size(); }
+    bool empty() const  { return time.empty(); }
+
+    void reserve(uint32 n)
     {
-        atmQuery(owner, getCollisionGroup, group);
+        pos_x.reserve(n); pos_y.reserve(n); pos_z.reserve(n);
+        vel_x.reserve(n); vel_y.reserve(n); vel_z.reserve(n);
+        time.reserve(n); owner.reserve(n); group.reserve(n); hit_to.reserve(n);
     }
 
-    mat4 computeTransformMatrix() const
+    void clear()
     {
-        const vec3 axis1(0.0f, 1.0f, 0.0f);
-        const vec3 axis2(0.0f, 0.0f, 1.0f);
-        mat4 mat;
-        mat = glm::translate(mat, pos);
-        mat = glm::rotate(mat, 4.5f*time, axis1);
-        mat = glm::rotate(mat, 4.5f*time, axis2);
-        return mat;
+        pos_x.clear(); pos_y.clear(); pos_z.clear();
+        vel_x.clear(); vel_y.clear(); vel_z.clear();
+        time.clear(); owner.clear(); group.clear(); hit_to.clear();
     }
+
+    void push_back(const vec3 &p, const vec3 &v, float32 t, EntityHandle o, CollisionGroup g)
+    {
+        pos_x.push_back(p.x); pos_y.push_back(p.y); pos_z.push_back(p.z);
+        vel_x.push_back(v.x); vel_y.push_back(v.y); vel_z.push_back(v.z);
+        time.push_back(t); owner.push_back(o); group.push_back(g); hit_to.push_back(0);
+    }
+
+    // i 番目を末尾の要素で上書きして詰める。順番は変わる
+    void swapRemove(uint32 i)
+    {
+        uint32 last = size()-1;
+        if(i!=last) {
+            pos_x[i]=pos_x[last]; pos_y[i]=pos_y[last]; pos_z[i]=pos_z[last];
+            vel_x[i]=vel_x[last]; vel_y[i]=vel_y[last]; vel_z[i]=vel_z[last];
+            time[i]=time[last]; owner[i]=owner[last]; group[i]=group[last]; hit_to[i]=hit_to[last];
+        }
+        pos_x.pop_back(); pos_y.pop_back(); pos_z.pop_back();
+        vel_x.pop_back(); vel_y.pop_back(); vel_z.pop_back();
+        time.pop_back(); owner.pop_back(); group.pop_back(); hit_to.pop_back();
+    }
+
+    vec3 getPosition(uint32 i) const { return vec3(pos_x[i], pos_y[i], pos_z[i]); }
+    vec3 getVelocity(uint32 i) const { return vec3(vel_x[i], vel_y[i], vel_z[i]); }
+    void setPosition(uint32 i, const vec3 &v) { pos_x[i]=v.x; pos_y[i]=v.y; pos_z[i]=v.z; }
 };
-atmSerializeRaw(BulletData);
+
+inline mat4 ComputeBulletTransform(const vec3 &pos, float32 time)
+{
+    const vec3 axis1(0.0f, 1.0f, 0.0f);
+    const vec3 axis2(0.0f, 0.0f, 1.0f);
+    mat4 mat;
+    mat = glm::translate(mat, pos);
+    mat = glm::rotate(mat, 4.5f*time, axis1);
+    mat = glm::rotate(mat, 4.5f*time, axis2);
+    return mat;
+}
+
+// [first, last) の弾を pos+=vel*dt, pos.z=z, time+=dt で進める。4 個ずつ SIMD で処理する
+// first は 4 の倍数であること (各配列は 16 byte align されている)
+inline void IntegrateBullets(BulletPool &pool, uint32 first, uint32 last, float32 dt, float32 z)
+{
+    istAssert(first%4==0);
+    float32 *px = pool.pos_x.begin();
+    float32 *py = pool.pos_y.begin();
+    float32 *pz = pool.pos_z.begin();
+    const float32 *vx = pool.vel_x.begin();
+    const float32 *vy = pool.vel_y.begin();
+    float32 *t = pool.time.begin();
+
+    const __m128 dt4 = _mm_set1_ps(dt);
+    const __m128 z4 = _mm_set1_ps(z);
+    uint32 i = first;
+    for(; i+4<=last; i+=4) {
+        _mm_store_ps(px+i, _mm_add_ps(_mm_load_ps(px+i), _mm_mul_ps(_mm_load_ps(vx+i), dt4)));
+        _mm_store_ps(py+i, _mm_add_ps(_mm_load_ps(py+i), _mm_mul_ps(_mm_load_ps(vy+i), dt4)));
+        _mm_store_ps(pz+i, z4);
+        _mm_store_ps(t+i,  _mm_add_ps(_mm_load_ps(t+i), dt4));
+    }
+    for(; i<last; ++i) {
+        px[i] += vx[i]*dt;
+        py[i] += vy[i]*dt;
+        pz[i] = z;
+        t[i] += dt;
+    }
+}
+
+// time>=lifetime の弾を取り除く。寿命判定は SIMD で 4 個ずつ行い、後ろから swap-remove で詰める。
+// (後ろから消していけば、末尾から持ってくる要素は常に生きている)
+inline void CullBullets(BulletPool &pool, float32 lifetime, ist::raw_vector<uint32> &dead)
+{
+    dead.clear();
+    uint32 num = pool.size();
+    const float32 *t = pool.time.begin();
+    const __m128 lifetime4 = _mm_set1_ps(lifetime);
+    uint32 i = 0;
+    for(; i+4<=num; i+=4) {
+        int mask = _mm_movemask_ps(_mm_cmpge_ps(_mm_load_ps(t+i), lifetime4));
+        if(mask!=0) {
+            for(uint32 l=0; l<4; ++l) {
+                if(mask & (1<<l)) { dead.push_back(i+l); }
+            }
+        }
+    }
+    for(; i<num; ++i) {
+        if(t[i]>=lifetime) { dead.push_back(i); }
+    }
+    for(size_t di=dead.size(); di>0; --di) {
+        pool.swapRemove(dead[di-1]);
+    }
+}
 
 class BulletManager : public IBulletManager
 {
 typedef IBulletManager super;
+public:
+    static const float32 s_radius;
+    static const float32 s_lifetime;
+    static const float32 s_power;
+    static const float32 s_height;
+    static const uint32  s_blocksize;
+
 private:
-    typedef stl::vector<BulletData> Bullets;
-    typedef CollisionModule::CollisionContext CollisionContext;
-    typedef stl::vector<CollisionContext> CollisionContexts;
-    Bullets m_bullets;
-    CollisionContexts m_cctx; // serialize 不要
+    typedef ist::vector<SweepSphere> SweepQueries;
+    typedef ist::vector<SweepResult> SweepResults;
+    typedef ist::raw_vector<uint32> IndexCont;
+    BulletPool m_pool;
+
+    // 以下 serialize 不要
+    SweepQueries m_queries;
+    SweepResults m_results;
+    IndexCont    m_dead;
 
     istSerializeBlock(
         istSerializeBase(super)
-        istSerialize(m_bullets)
+        istSerialize(m_pool)
     )
 
 public:
     BulletManager()
     {
-        m_bullets.reserve(512);
+        m_pool.reserve(512);
     }
 
     void update(float32 dt) override
     {
-        const size_t blocksize = 32;
-        const float32 radius = 0.03f;
-        const float32 lifetime = 600.0f;
-        const float32 power = 20.0f;
-
-        size_t num_tasks = ceildiv(m_bullets.size(), blocksize);
-        if(num_tasks>m_cctx.size()) {
-            m_cctx.resize(num_tasks);
+        // 移動前後を結ぶ掃引球で判定し、高速な弾が薄い壁をすり抜けないようにする
+        uint32 num_bullets = m_pool.size();
+        m_queries.resize(num_bullets);
+        m_results.resize(num_bullets);
+        ist::parallel_for(uint32(0), ceildiv(num_bullets, s_blocksize),
+            [&](uint32 bi) {
+                uint32 first = bi*s_blocksize;
+                uint32 last = std::min<uint32>(first+s_blocksize, num_bullets);
+                for(uint32 i=first; i<last; ++i) {
+                    SweepSphere &q = m_queries[i];
+                    q.begin = vec4(m_pool.getPosition(i), s_radius);
+                    q.owner = m_pool.owner[i];
+                    q.group = m_pool.group[i];
+                }
+                IntegrateBullets(m_pool, first, last, dt, s_height);
+                for(uint32 i=first; i<last; ++i) {
+                    m_queries[i].end = vec4(m_pool.getPosition(i), 0.0f);
+                }
+            });
+        if(num_bullets>0) {
+            atmGetCollisionModule()->sweepSpheres(&m_queries[0], &m_results[0], num_bullets);
         }
-
-        parallel_each_with_block_index(m_bullets, blocksize, [&](BulletData &p, size_t bi){
-            vec3 pos = p.pos + p.vel*dt;
-            pos.z = 0.03f;
-            p.time += dt;
-            p.pos = pos;
-
-            CollisionContext &ctx = m_cctx[bi];
-            CollisionSphere sphere;
-            sphere.setEntityHandle(p.owner);
-            sphere.setCollisionGroup(p.group);
-            sphere.pos_r = vec4(pos, radius);
-            sphere.bb.bl = vec4(pos-radius, 0.0f);
-            sphere.bb.ur = vec4(pos+radius, 0.0f);
-            if(atmGetCollisionModule()->collideRecv(&sphere, ctx)) {
-                p.hit_to = ctx.messages.front().from;
-                p.time = lifetime;
-            }
-            ctx.clear();
-        });
-        each(m_bullets, [&](BulletData &p){
-            if(p.hit_to) {
-                float32 d = power;
-                if(atmIsEnemy(p.hit_to)) { d*=0.2f; }
-                atmGetFluidModule()->addFluid(PSET_SPHERE_BULLET, p.computeTransformMatrix());
-                atmCall(p.hit_to, damage, d);
-                atmCall(p.hit_to, pulse, atmArgs(p.pos, p.vel*10000.0f));
-            }
-        });
-        erase(m_bullets, [&](BulletData &p){ return p.time>=lifetime; });
+        for(uint32 i=0; i<num_bullets; ++i) {
+            const SweepResult &r = m_results[i];
+            if(!r.hit_to) { continue; }
+
+            vec3 pos = glm::mix(vec3(m_queries[i].begin), vec3(m_queries[i].end), r.time);
+            m_pool.setPosition(i, pos);
+            m_pool.hit_to[i] = r.hit_to;
+            m_pool.time[i] = s_lifetime;
+
+            float32 d = s_power;
+            if(atmIsEnemy(r.hit_to)) { d*=0.2f; }
+            atmGetFluidModule()->addFluid(PSET_SPHERE_BULLET, ComputeBulletTransform(pos, s_lifetime));
+            DamageMessage dm = {m_pool.owner[i], r.hit_to, d, 0};
+            atmSendMessage(dm);
+            atmCall(r.hit_to, pulse, atmArgs(pos, m_pool.getVelocity(i)*10000.0f));
+        }
+        CullBullets(m_pool, s_lifetime, m_dead);
     }
 
     void asyncupdate(float32 dt) override
@@ -516,31 +673,45 @@ public:
         inst.flash = flash;
         inst.elapsed = 0.0f;
         inst.appear_radius = 10000.0f;
-        each(m_bullets, [&](BulletData &p){
-            inst.transform = inst.rotate = p.computeTransformMatrix();
+        uint32 num_bullets = m_pool.size();
+        for(uint32 i=0; i<num_bullets; ++i) {
+            inst.transform = inst.rotate = ComputeBulletTransform(m_pool.getPosition(i), m_pool.time[i]);
             atmGetFluidPass()->addParticles(PSET_SPHERE_BULLET, inst);
-        });
+        }
         if(atmGetConfig()->lighting_level>=atmE_Lighting_High) {
-            each(m_bullets, [&](BulletData &p){
+            for(uint32 i=0; i<num_bullets; ++i) {
                 PointLight l;
-                l.setPosition(p.pos + vec3(0.0f, 0.0f, 0.10f));
+                l.setPosition(m_pool.getPosition(i) + vec3(0.0f, 0.0f, 0.10f));
                 l.setRadius(0.2f);
                 l.setColor(light);
                 atmGetLightPass()->addLight(l);
-            });
+            }
         }
     }
 
     void shoot(const vec3 &pos, const vec3 &vel, EntityHandle owner)
     {
         atmDbgAssertSyncLock();
-        BulletData bd(pos, vel, owner);
-        m_bullets.push_back(bd);
+        CollisionGroup group = 0;
+        atmQuery(owner, getCollisionGroup, group);
+        m_pool.push_back(pos, vel, 0.0f, owner, group);
     }
 
+    // f(const vec3 &pos)
     template<class F>
-    void eachBullets(const F &f) { each(m_bullets, f); }
+    void eachBullets(const F &f)
+    {
+        uint32 num_bullets = m_pool.size();
+        for(uint32 i=0; i<num_bullets; ++i) {
+            f(m_pool.getPosition(i));
+        }
+    }
 };
+const float32 BulletManager::s_radius = 0.03f;
+const float32 BulletManager::s_lifetime = 600.0f;
+const float32 BulletManager::s_power = 20.0f;
+const float32 BulletManager::s_height = 0.03f;
+const uint32  BulletManager::s_blocksize = 1024;
 atmExportClass(BulletManager)
 
 
@@ -564,10 +735,16 @@ atmExportClass(BulletModule)
 BulletModule::BulletModule()
     : m_lasers(), m_bullets()
 {
+#ifdef atm_enable_Benchmark
+    wdmAddNode("Bullet/dbgBenchmarkBullets()", &BulletModule::dbgBenchmarkBullets, this);
+    wdmAddNode("Bullet/dbgBenchmarkLasers()", &BulletModule::dbgBenchmarkLasers, this);
+#endif // atm_enable_Benchmark
 }
 
 BulletModule::~BulletModule()
 {
+    wdmEraseNode("Bullet/dbgBenchmarkBullets()");
+    wdmEraseNode("Bullet/dbgBenchmarkLasers()");
     each(m_managers, [&](IBulletManager *bm){ istDelete(bm); });
 }
 
@@ -607,8 +784,8 @@ void BulletModule::frameEnd()
 
 void BulletModule::handleStateQuery( EntitiesQueryContext &ctx )
 {
-    m_bullets->eachBullets([&](const BulletData &b){
-        ctx.bullets.push_back(vec2(b.pos));
+    m_bullets->eachBullets([&](const vec3 &pos){
+        ctx.bullets.push_back(vec2(pos));
     });
     m_lasers->eachLasers([&](const Laser *l){
         ctx.lasers.push_back(vec3(vec2(l->getPosition()), 1.0f));
@@ -618,6 +795,11 @@ void BulletModule::handleStateQuery( EntitiesQueryContext &ctx )
 
 void BulletModule::shootBullet(const vec3 &pos, const vec3 &vel, EntityHandle owner)
 {
+    // Entity の並列 update 中は後でまとめて発射する
+    if(EntityCommandBuffer *cb=EntityCommandBuffer::getCurrent()) {
+        cb->defer([=](){ m_bullets->shoot(pos, vel, owner); });
+        return;
+    }
     m_bullets->shoot(pos, vel, owner);
 }
 
@@ -632,4 +814,139 @@ ILaser* BulletModule::getLaser(LaserHandle v)
 }
 
 
+#ifdef atm_enable_Benchmark
+
+void BulletModule::dbgBenchmarkBullets()
+{
+    // 移動と寿命による削除のみを、従来の AoS + erase() と SoA + swap-remove で比較 (衝突判定は共通なので除外)
+    struct AoSBullet
+    {
+        vec3 pos;
+        vec3 vel;
+        float32 time;
+        EntityHandle owner;
+        CollisionGroup group;
+        EntityHandle hit_to;
+        uint32 flags;
+    };
+    const uint32 bullet_counts[] = {1000, 10000, 50000, 100000, 200000};
+    const uint32 num_frames = 60;
+    const float32 dt = 1.0f;
+    const float32 lifetime = BulletManager::s_lifetime;
+    const float32 height = BulletManager::s_height;
+
+    stl::vector<AoSBullet> aos;
+    BulletPool soa;
+    ist::raw_vector<uint32> dead;
+    for(uint32 ci=0; ci<_countof(bullet_counts); ++ci) {
+        uint32 num_bullets = bullet_counts[ci];
+        SFMT rand;
+        rand.initialize(0);
+        aos.clear();
+        soa.clear();
+        for(uint32 i=0; i<num_bullets; ++i) {
+            AoSBullet b;
+            b.pos = vec3(rand.genFloat32()-0.5f, rand.genFloat32()-0.5f, 0.0f) * 3.0f;
+            b.vel = vec3(rand.genFloat32()-0.5f, rand.genFloat32()-0.5f, 0.0f) * 0.02f;
+            b.time = rand.genFloat32()*lifetime;
+            b.owner = b.hit_to = b.flags = 0;
+            b.group = 0;
+            aos.push_back(b);
+            soa.push_back(b.pos, b.vel, b.time, b.owner, b.group);
+        }
+
+        ist::Timer timer;
+        for(uint32 f=0; f<num_frames; ++f) {
+            parallel_each(aos, 32, [&](AoSBullet &b){
+                vec3 pos = b.pos + b.vel*dt;
+                pos.z = height;
+                b.pos = pos;
+                b.time += dt;
+            });
+            erase(aos, [&](AoSBullet &b){ return b.time>=lifetime; });
+        }
+        float32 t_aos = timer.getElapsedMillisec();
+
+        timer.reset();
+        for(uint32 f=0; f<num_frames; ++f) {
+            uint32 num = soa.size();
+            ist::parallel_for(uint32(0), ceildiv(num, BulletManager::s_blocksize),
+                [&](uint32 bi) {
+                    uint32 first = bi*BulletManager::s_blocksize;
+                    IntegrateBullets(soa, first, std::min<uint32>(first+BulletManager::s_blocksize, num), dt, height);
+                });
+            CullBullets(soa, lifetime, dead);
+        }
+        float32 t_soa = timer.getElapsedMillisec();
+
+        // swap-remove で順番は変わるので、位置の集合で比較
+        istAssert(aos.size()==soa.size());
+        stl::vector<float32> ax, sx;
+        each(aos, [&](const AoSBullet &b){ ax.push_back(b.pos.x); });
+        sx.assign(soa.pos_x.begin(), soa.pos_x.end());
+        stl::sort(ax.begin(), ax.end());
+        stl::sort(sx.begin(), sx.end());
+        istAssert(ax==sx);
+        istPrint("bullets %u, %u frames: AoS %.2fms, SoA %.2fms\n", num_bullets, num_frames, t_aos, t_soa);
+    }
+}
+
+void BulletModule::dbgBenchmarkLasers()
+{
+    // 同時に 64 本のレーザーが寿命いっぱいまで粒子を持っている状態で、粒子の位置計算を比較
+    const uint32 num_lasers = 64;
+    const uint32 num_particles = 600; // 6 個/frame * 寿命 100 frame
+    const uint32 num_frames = 10;
+
+    SFMT rand;
+    rand.initialize(0);
+    stl::vector<vec3> positions(num_lasers), directions(num_lasers);
+    stl::vector<LaserParticle> particles(num_lasers*num_particles);
+    for(uint32 li=0; li<num_lasers; ++li) {
+        positions[li] = vec3(rand.genFloat32()-0.5f, rand.genFloat32()-0.5f, 0.0f) * 3.0f;
+        float32 angle = rand.genFloat32()*360.0f;
+        directions[li] = vec3(glm::rotate(mat4(), angle, vec3(0.0f,0.0f,1.0f)) * vec4(1.0f,0.0f,0.0f,0.0f));
+        for(uint32 pi=0; pi<num_particles; ++pi) {
+            LaserParticle &p = particles[li*num_particles+pi];
+            p.pos_base = vec3(rand.genFloat32()-0.5f, rand.genFloat32()-0.5f, rand.genFloat32()-0.5f) * 0.15f;
+            p.time = float32(pi/6);
+        }
+    }
+    stl::vector<vec3> result_mat4(particles.size()), result_frame(particles.size());
+
+    ist::Timer timer;
+    for(uint32 f=0; f<num_frames; ++f) {
+        for(uint32 li=0; li<num_lasers; ++li) {
+            for(uint32 pi=0; pi<num_particles; ++pi) {
+                uint32 i = li*num_particles+pi;
+                result_mat4[i] = Laser::dbgComputeParticlePosMat4(positions[li], directions[li], particles[i]);
+            }
+        }
+    }
+    float32 t_mat4 = timer.getElapsedMillisec();
+
+    timer.reset();
+    for(uint32 f=0; f<num_frames; ++f) {
+        for(uint32 li=0; li<num_lasers; ++li) {
+            const Laser::ParticleFrame frame = Laser::computeParticleFrame(positions[li], directions[li]);
+            for(uint32 pi=0; pi<num_particles; ++pi) {
+                uint32 i = li*num_particles+pi;
+                result_frame[i] = Laser::computeParticlePos(frame, particles[i]);
+            }
+        }
+    }
+    float32 t_frame = timer.getElapsedMillisec();
+
+    float32 max_error = 0.0f;
+    for(size_t i=0; i<particles.size(); ++i) {
+        max_error = std::max<float32>(max_error, glm::length(result_mat4[i]-result_frame[i]));
+    }
+    istAssert(max_error < 0.0001f);
+    istPrint("lasers %u x %u particles, %u frames: mat4 %.2fms, precomputed frame %.2fms, max error %f\n",
+        num_lasers, num_particles, num_frames, t_mat4, t_frame, max_error);
+}
+
+#endif // atm_enable_Benchmark
+
+
 } // namespace atm
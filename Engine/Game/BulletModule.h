@@ -55,6 +55,11 @@ public:
     LaserHandle createLaser(const vec3 &pos, const vec3 &dir, EntityHandle owner);
     ILaser* getLaser(LaserHandle v);
 
+#ifdef atm_enable_Benchmark
+    void dbgBenchmarkBullets();
+    void dbgBenchmarkLasers();
+#endif // atm_enable_Benchmark
+
 private:
     typedef stl::vector<IBulletManager*> managers;
     LaserManager    *m_lasers;
@@ -9,6 +9,7 @@
 #include "Engine/Game/EntityQuery.h"
 #include "Engine/Game/FluidModule.h"
 #include "CollisionModule.h"
+#include "psym/parallel_deterministic_sort.h"
 
 namespace atm {
 
@@ -140,85 +141,92 @@ bool _Collide(const CollisionSphere *sender, const CollisionBox *receiver, Colli
     return false;
 }
 
-bool _Collide(const CollisionBox *sender, const CollisionBox *receiver, CollideMessage &m)
+// 分離軸判定用の OBB。
+// CollisionBox::trans の各軸に size (半径) を掛けたものがその軸方向の半径になる。(UpdateCollisionBox() と同じ規約)
+struct OBB
 {
-    if(!BoundingBoxIntersect(sender->bb, receiver->bb)) { return false; }
+    vec3 center;
+    vec3 axis[3];
+    float32 extent[3];
+
+    OBB(const CollisionBox &b)
     {
-        const vec4 &size = receiver->size;
-        simdmat4 t(receiver->trans);
-        vec4 vertices[] = {
-            glm::vec4_cast(t * simdvec4( size.x, size.y, size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4(-size.x, size.y, size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4(-size.x,-size.y, size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4( size.x,-size.y, size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4( size.x, size.y,-size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4(-size.x, size.y,-size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4(-size.x,-size.y,-size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4( size.x,-size.y,-size.z, 1.0f)),
-        };
-        {
-            CollisionSphere sphere;
-            float32 r = std::abs(vertices[0].x);
-            for(int i=0; i<_countof(vertices); ++i) {
-                r = absmin(r, absmin(absmin(vertices[i].x, vertices[i].y), vertices[i].z));
-            }
-            vec3 center = vec3(receiver->trans[3]);
-            sphere.pos_r = vec4(center, r);
-            sphere.bb.bl = vec4(center-r, 1.0f);
-            sphere.bb.ur = vec4(center+r, 1.0f);
-            if(_Collide(sender, &sphere, m)) {
-                goto HIT;
-            }
+        center = vec3(b.position);
+        for(int i=0; i<3; ++i) {
+            vec3 a = vec3(b.trans[i]);
+            float32 len = glm::length(a);
+            axis[i] = len>0.0f ? a/len : vec3();
+            extent[i] = len * b.size[i];
         }
-        for(size_t i=0; i<_countof(vertices); ++i) {
-            CollisionSphere sphere;
-            sphere.bb.bl = sphere.bb.ur = sphere.pos_r = vec4(vec3(vertices[i]), 0.0f);
-            if(_Collide(sender, &sphere, m)) {
-                goto HIT;
-            }
+    }
+};
+
+// OBB 同士の分離軸判定。
+// 面法線 6 軸 + 辺同士の外積 9 軸を調べ、分離軸が見つかった時点で打ち切る。
+// 全軸で重なっていれば、最もめり込みが浅い軸を押し出し方向 (sender -> receiver) とする。
+bool _Collide(const CollisionBox *sender, const CollisionBox *receiver, CollideMessage &m)
+{
+    if(!BoundingBoxIntersect(sender->bb, receiver->bb)) { return false; }
+
+    // 平行な辺の外積が 0 になって誤判定するのを防ぐため、AbsR には eps を足しておく
+    const float32 eps = 1e-5f;
+    // 辺同士の軸は面の軸とほぼ同じめり込み量の時に選ばれると押し返しがガタつくので、少し不利にしておく
+    const float32 edge_bias = 1.05f;
+
+    const OBB a(*sender);
+    const OBB b(*receiver);
+    const vec3 d = b.center - a.center;
+
+    float32 R[3][3], AbsR[3][3];
+    for(int i=0; i<3; ++i) {
+        for(int j=0; j<3; ++j) {
+            R[i][j] = glm::dot(a.axis[i], b.axis[j]);
+            AbsR[i][j] = std::abs(R[i][j]) + eps;
         }
     }
-    {
-        const vec4 &size = sender->size;
-        simdmat4 t(sender->trans);
-        vec4 vertices[] = {
-            glm::vec4_cast(t * simdvec4( size.x, size.y, size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4(-size.x, size.y, size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4(-size.x,-size.y, size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4( size.x,-size.y, size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4( size.x, size.y,-size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4(-size.x, size.y,-size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4(-size.x,-size.y,-size.z, 1.0f)),
-            glm::vec4_cast(t * simdvec4( size.x,-size.y,-size.z, 1.0f)),
-        };
-        {
-            CollisionSphere sphere;
-            float32 r = std::abs(vertices[0].x);
-            for(int i=0; i<_countof(vertices); ++i) {
-                r = absmin(r, absmin(absmin(vertices[i].x, vertices[i].y), vertices[i].z));
-            }
-            vec3 center = vec3(sender->trans[3]);
-            sphere.pos_r = vec4(center, r);
-            sphere.bb.bl = vec4(center-r, 1.0f);
-            sphere.bb.ur = vec4(center+r, 1.0f);
-            if(_Collide(&sphere, receiver, m)) {
-                goto HIT;
-            }
+
+    // 軸の選択は bias をかけた min_score で比べ、押し出し量にはかける前の min_depth を使う
+    float32 min_score = FLT_MAX;
+    float32 min_depth = 0.0f;
+    vec3 min_axis;
+    auto overlap = [&](const vec3 &L, float32 ra, float32 rb, float32 dist, float32 bias) -> bool {
+        float32 depth = ra + rb - std::abs(dist);
+        if(depth < 0.0f) { return false; }
+        float32 score = depth*bias;
+        if(score < min_score) {
+            min_score = score;
+            min_depth = depth;
+            min_axis = dist<0.0f ? -L : L;
         }
-        for(size_t i=0; i<_countof(vertices); ++i) {
-            CollisionSphere sphere;
-            sphere.bb.bl = sphere.bb.ur = sphere.pos_r = vec4(vec3(vertices[i]), 0.0f);
-            if(_Collide(&sphere, receiver, m)) {
-                goto HIT;
-            }
+        return true;
+    };
+
+    // sender の面
+    for(int i=0; i<3; ++i) {
+        float32 rb = b.extent[0]*AbsR[i][0] + b.extent[1]*AbsR[i][1] + b.extent[2]*AbsR[i][2];
+        if(!overlap(a.axis[i], a.extent[i], rb, glm::dot(d, a.axis[i]), 1.0f)) { return false; }
+    }
+    // receiver の面
+    for(int j=0; j<3; ++j) {
+        float32 ra = a.extent[0]*AbsR[0][j] + a.extent[1]*AbsR[1][j] + a.extent[2]*AbsR[2][j];
+        if(!overlap(b.axis[j], ra, b.extent[j], glm::dot(d, b.axis[j]), 1.0f)) { return false; }
+    }
+    // 辺 x 辺
+    for(int i=0; i<3; ++i) {
+        int i1 = (i+1)%3, i2 = (i+2)%3;
+        for(int j=0; j<3; ++j) {
+            int j1 = (j+1)%3, j2 = (j+2)%3;
+            vec3 L = glm::cross(a.axis[i], b.axis[j]);
+            float32 len = glm::length(L);
+            if(len < eps) { continue; } // 平行。面の軸で判定済み
+            float32 rcp = 1.0f / len;
+            float32 ra = (a.extent[i1]*AbsR[i2][j] + a.extent[i2]*AbsR[i1][j]) * rcp;
+            float32 rb = (b.extent[j1]*AbsR[i][j2] + b.extent[j2]*AbsR[i][j1]) * rcp;
+            if(!overlap(L*rcp, ra, rb, glm::dot(d, L)*rcp, edge_bias)) { return false; }
         }
     }
-    return false;
 
-HIT:
-    //vec3 dir = glm::normalize(vec3(receiver->position)-vec3(sender->position));
-    //(vec3&)m.direction = glm::normalize((vec3&)m.direction+dir);
-    //(vec3&)m.direction = dir;
+    m.direction = vec4(min_axis, min_depth);
     return true;
 }
 
@@ -254,6 +262,101 @@ bool Collide(const CollisionEntity *sender, const CollisionEntity *receiver, Col
 }
 
 
+// 以下掃引球判定。
+// q.begin -> q.end に移動する球が最初に sender に触れる時刻 t (0.0-1.0) と、その時の法線 (sender -> 球) を求める。
+// 開始時点で既に重なっている場合は t=0.0 とする。
+
+bool _Sweep(const CollisionPlane *sender, const SweepSphere &q, float32 &t, vec3 &n)
+{
+    float32 radius = q.begin.w;
+    float32 d0 = glm::dot(vec4(vec3(q.begin), 1.0f), sender->plane) - radius;
+    float32 d1 = glm::dot(vec4(vec3(q.end), 1.0f), sender->plane) - radius;
+    if(d0 > 0.0f && d1 > 0.0f) { return false; }
+    t = d0 > 0.0f ? d0/(d0-d1) : 0.0f;
+    n = vec3(sender->plane);
+    return true;
+}
+
+bool _Sweep(const CollisionSphere *sender, const SweepSphere &q, float32 &t, vec3 &n)
+{
+    // 半径を足した球と線分の交差
+    float32 r = sender->pos_r.w + q.begin.w;
+    vec3 m = vec3(q.begin) - vec3(sender->pos_r);
+    vec3 d = vec3(q.end) - vec3(q.begin);
+    float32 c = glm::dot(m, m) - r*r;
+    if(c <= 0.0f) {
+        t = 0.0f;
+        n = glm::dot(m, m)>0.0f ? glm::normalize(m) : -d;
+        return true;
+    }
+    float32 a = glm::dot(d, d);
+    float32 b = glm::dot(m, d);
+    if(a==0.0f || b >= 0.0f) { return false; } // 静止しているか遠ざかっている
+    float32 disc = b*b - a*c;
+    if(disc < 0.0f) { return false; }
+    t = (-b - std::sqrt(disc)) / a;
+    if(t > 1.0f) { return false; }
+    n = glm::normalize(m + d*t);
+    return true;
+}
+
+bool _Sweep(const CollisionBox *sender, const SweepSphere &q, float32 &t, vec3 &n)
+{
+    // 半径分膨らませた OBB と線分のスラブ判定。
+    // 角は丸めずに扱うので、角付近ではわずかに大きめに当たる。
+    const OBB o(*sender);
+    float32 radius = q.begin.w;
+    vec3 m = vec3(q.begin) - o.center;
+    vec3 d = vec3(q.end) - vec3(q.begin);
+
+    float32 tmin = 0.0f, tmax = 1.0f;
+    int32 enter_axis = -1;
+    float32 enter_sign = 0.0f;
+    float32 inside_depth = FLT_MAX;
+    int32 inside_axis = 0;
+    float32 inside_sign = 1.0f;
+    for(int i=0; i<3; ++i) {
+        float32 p = glm::dot(m, o.axis[i]);
+        float32 v = glm::dot(d, o.axis[i]);
+        float32 e = o.extent[i] + radius;
+        float32 depth = e - std::abs(p);
+        if(depth < inside_depth) {
+            inside_depth = depth;
+            inside_axis = i;
+            inside_sign = p<0.0f ? -1.0f : 1.0f;
+        }
+        if(std::abs(v) < 1e-8f) {
+            if(depth < 0.0f) { return false; }
+            continue;
+        }
+        float32 rcp = 1.0f / v;
+        float32 t1 = (-e - p) * rcp;
+        float32 t2 = ( e - p) * rcp;
+        if(t1 > t2) { stl::swap(t1, t2); }
+        if(t1 > tmin) {
+            tmin = t1;
+            enter_axis = i;
+            enter_sign = v>0.0f ? -1.0f : 1.0f;
+        }
+        tmax = std::min<float32>(tmax, t2);
+        if(tmin > tmax) { return false; }
+    }
+    t = tmin;
+    n = enter_axis>=0 ? o.axis[enter_axis]*enter_sign : o.axis[inside_axis]*inside_sign;
+    return true;
+}
+
+bool Sweep(const CollisionEntity *sender, const SweepSphere &q, float32 &t, vec3 &n)
+{
+    switch(sender->getShapeType()) {
+    case CS_Plane:  return _Sweep(static_cast<const CollisionPlane*>(sender), q, t, n);
+    case CS_Sphere: return _Sweep(static_cast<const CollisionSphere*>(sender), q, t, n);
+    case CS_Box:    return _Sweep(static_cast<const CollisionBox*>(sender), q, t, n);
+    }
+    return false;
+}
+
+
 
 
 
@@ -384,22 +487,138 @@ uint32 CollisionModule::collideRecv(CollisionEntity *receiver, CollisionContext
     return n;
 }
 
+bool CollisionModule::sweepSphere(const SweepSphere &q, SweepResult &r, CollisionContext &ctx)
+{
+    HandleCont &neighbors = ctx.neighbors;
+    float32 radius = q.begin.w;
+
+    BoundingBox bb;
+    bb.bl = vec4(glm::min(vec3(q.begin), vec3(q.end))-radius, 0.0f);
+    bb.ur = vec4(glm::max(vec3(q.begin), vec3(q.end))+radius, 0.0f);
+
+    r = SweepResult();
+    m_grid.getEntities(bb, neighbors);
+    unique_iterator<HandleCont::iterator> iter(neighbors.begin(), neighbors.end());
+    for(; iter!=neighbors.end(); ++iter) {
+        CollisionEntity *sender = getEntity(*iter);
+        if(!sender) { continue; }
+        if((sender->getFlags() & CF_Sender) == 0 ) { continue; }
+        if(q.group!=0 && q.group==sender->getCollisionGroup()) { continue; }
+        if(q.owner==sender->getEntityHandle()) { continue; }
+
+        float32 t;
+        vec3 n;
+        // 同時刻なら handle が小さい方を優先 (neighbors はソート済みなので先に来た方)
+        if(Sweep(sender, q, t, n) && (r.hit_to==0 || t<r.time)) {
+            r.hit_to = sender->getEntityHandle();
+            r.chit_to = sender->getCollisionHandle();
+            r.time = t;
+            r.normal = n;
+        }
+    }
+    return r.hit_to!=0;
+}
+
+void CollisionModule::sweepSpheres(const SweepSphere *queries, SweepResult *results, uint32 num)
+{
+    const uint32 block_size = 32;
+    if(num==0) { return; }
+
+    uint32 num_tasks = ceildiv(num, block_size);
+    while(m_scons.size() < num_tasks) { m_scons.push_back(istNew(CollisionContext)()); }
+
+    ist::parallel_for(uint32(0), num_tasks,
+        [&](uint32 bi) {
+            uint32 first = bi*block_size;
+            uint32 last = std::min<uint32>((bi+1)*block_size, num);
+            CollisionContext &ctx = *m_scons[bi];
+            for(uint32 i=first; i!=last; ++i) {
+                sweepSphere(queries[i], results[i], ctx);
+            }
+            ctx.clear();
+        });
+}
+
+// (to, cto, cfrom) の組は 1 フレーム内で一意なので、非 stable な並列ソートでも結果は決定的になる
+struct LessCollideMessage
+{
+    bool operator()(const CollideMessage &a, const CollideMessage &b) const
+    {
+        if(a.to!=b.to)      { return a.to<b.to; }
+        if(a.cto!=b.cto)    { return a.cto<b.cto; }
+        return a.cfrom<b.cfrom;
+    }
+};
+
+// 各タスクの衝突メッセージを一つの配列に集め、receiver ごとにまとめる
+static void GatherCollideMessages(
+    CollisionModule::CollisionCtxCont &ctxs, uint32 num_ctxs,
+    CollisionModule::MessageCont &out_messages, CollisionModule::ReceiverCont &out_receivers)
+{
+    typedef CollisionModule::ReceiverRange ReceiverRange;
+
+    ist::vector<uint32> offsets(num_ctxs+1);
+    offsets[0] = 0;
+    for(uint32 i=0; i<num_ctxs; ++i) {
+        offsets[i+1] = offsets[i] + ctxs[i]->messages.size();
+    }
+    uint32 num_messages = offsets[num_ctxs];
+    out_messages.resize(num_messages);
+    out_receivers.clear();
+    if(num_messages==0) { return; }
+
+    // 書き込み先が重ならないのでロック不要
+    ist::parallel_for(uint32(0), num_ctxs,
+        [&](uint32 i) {
+            CollisionModule::MessageCont &messages = ctxs[i]->messages;
+            stl::copy(messages.begin(), messages.end(), out_messages.begin()+offsets[i]);
+            messages.clear();
+        });
+    parallel_deterministic_sort(out_messages.begin(), out_messages.end(), LessCollideMessage());
+
+    ReceiverRange r = {out_messages[0].to, 0, 0};
+    for(uint32 i=0; i<num_messages; ++i) {
+        if(out_messages[i].to!=r.to) {
+            out_receivers.push_back(r);
+            r.to = out_messages[i].to;
+            r.begin = i;
+            r.num = 0;
+        }
+        ++r.num;
+    }
+    out_receivers.push_back(r);
+}
+
 CollisionModule::CollisionModule()
     : m_groupgen(0)
+    , m_rigids_rebuild(true)
 {
     m_entities.reserve(1024);
     m_vacant.reserve(1024);
 
     m_entities.push_back(nullptr); // id:0 は無効とする
+
+#ifdef atm_enable_Benchmark
+    wdmAddNode("Collision/dbgBenchmarkBoxBox()", &CollisionModule::dbgBenchmarkBoxBox, this);
+    wdmAddNode("Collision/dbgBenchmarkSweepSpheres()", &CollisionModule::dbgBenchmarkSweepSpheres, this);
+    wdmAddNode("Collision/dbgBenchmarkMessages()", &CollisionModule::dbgBenchmarkMessages, this);
+    wdmAddNode("Collision/dbgBenchmarkRigidExport()", &CollisionModule::dbgBenchmarkRigidExport, this);
+#endif // atm_enable_Benchmark
 }
 
 CollisionModule::~CollisionModule()
 {
     for(uint32 i=0; i<m_acons.size(); ++i) { istDelete(m_acons[i]); }
     m_acons.clear();
+    for(uint32 i=0; i<m_scons.size(); ++i) { istDelete(m_scons[i]); }
+    m_scons.clear();
+    for(uint32 i=0; i<m_cbuffers.size(); ++i) { istDelete(m_cbuffers[i]); }
+    m_cbuffers.clear();
     for(uint32 i=0; i<m_entities.size(); ++i) { deleteEntity(m_entities[i]); }
     m_entities.clear();
     m_vacant.clear();
+
+    wdmEraseNode("Collision");
 }
 
 void CollisionModule::initialize()
@@ -412,16 +631,47 @@ void CollisionModule::frameBegin()
 
 void CollisionModule::update(float32 dt)
 {
-    for(uint32 ti=0; ti<m_acons.size(); ++ti) {
-        MessageCont &messages = m_acons[ti]->messages;
-        uint32 num_messages = messages.size();
-        for(uint32 mi=0; mi<num_messages; ++mi) {
-            if(IEntity *e = atmGetEntity(messages[mi].to)) {
-                atmCall(e, eventCollide, static_cast<const CollideMessage*>(&messages[mi]));
+    // メッセージは asyncupdate() で receiver ごとにまとめ済み。entity の検索と呼び出しは receiver 毎に一回で済む。
+    // canReceiveCollisionInParallel() な receiver にはブロック毎に並列に配り、その間の他の Entity への操作は
+    // ブロック毎の EntityCommandBuffer に積んでブロック順に適用する。(EntityModule::updateEntitiesParallel() と同じ)
+    // それ以外の receiver には、その後 receiver 順に逐次配る。どちらもスレッドの実行順には依存しない
+    uint32 num_receivers = m_receivers.size();
+    if(num_receivers==0) { return; }
+    uint32 num_blocks = ceildiv(num_receivers, DeliverBlockSize);
+    while(m_cbuffers.size() < num_blocks) { m_cbuffers.push_back(istNew(EntityCommandBuffer)()); }
+    m_serial_receivers.resize(num_receivers);
+
+    atmDbgLockSyncMethods();
+    ist::parallel_for(uint32(0), num_blocks,
+        [&](uint32 bi) {
+            EntityCommandBuffer *prev = EntityCommandBuffer::getCurrent();
+            EntityCommandBuffer::setCurrent(m_cbuffers[bi]);
+            uint32 b = bi*DeliverBlockSize;
+            uint32 e = stl::min<uint32>(b+DeliverBlockSize, num_receivers);
+            for(uint32 ri=b; ri<e; ++ri) {
+                const ReceiverRange &r = m_receivers[ri];
+                IEntity *entity = atmGetEntity(r.to);
+                m_serial_receivers[ri] = entity && !entity->canReceiveCollisionInParallel();
+                if(entity && !m_serial_receivers[ri]) {
+                    atmCall(entity, eventCollideBatch, atmArgs(static_cast<const CollideMessage*>(&m_messages[r.begin]), r.num));
+                }
             }
+            EntityCommandBuffer::setCurrent(prev);
+        });
+    atmDbgUnlockSyncMethods();
+    for(uint32 bi=0; bi<num_blocks; ++bi) {
+        m_cbuffers[bi]->flush();
+    }
+
+    for(uint32 ri=0; ri<num_receivers; ++ri) {
+        if(!m_serial_receivers[ri]) { continue; }
+        const ReceiverRange &r = m_receivers[ri];
+        if(IEntity *e = atmGetEntity(r.to)) {
+            atmCall(e, eventCollideBatch, atmArgs(static_cast<const CollideMessage*>(&m_messages[r.begin]), r.num));
         }
-        messages.clear();
     }
+    m_messages.clear();
+    m_receivers.clear();
 }
 
 void CollisionModule::asyncupdate(float32 dt)
@@ -445,6 +695,7 @@ void CollisionModule::asyncupdate(float32 dt)
                 collideSend(m_entities[i], ctx);
             }
         });
+    GatherCollideMessages(m_acons, num_tasks, m_messages, m_receivers);
 }
 
 void CollisionModule::draw()
@@ -455,16 +706,51 @@ void CollisionModule::frameEnd()
 {
 }
 
-void CollisionModule::copyRigitsToPSym()
+// psym の rigid を差分更新する。
+// 形状が変わったものだけを上書きし、rigid の追加/削除があった場合のみ全体を作り直す。
+// (作り直しは handle 順に詰めるので、順序は毎フレーム全部出力していた時と変わらない)
+// Sink は clearRigids(), addRigid(ce), setRigid(i, ce) を持つもの (FluidModule)
+template<class Sink>
+static void ExportRigids(CollisionModule::EntityCont &entities, bool &rebuild, Sink &sink)
 {
-    uint32 num = m_entities.size();
-    for(uint32 i=0; i<num; ++i) {
-        const CollisionEntity *ce = m_entities[i];
-        if(!ce || (ce->getFlags() & CF_SPH_Sender)==0) { continue; }
-        atmGetFluidModule()->addRigid(*ce);
+    uint32 num = entities.size();
+    if(!rebuild) {
+        for(uint32 i=0; i<num; ++i) {
+            CollisionEntity *ce = entities[i];
+            if(!ce || !ce->isRigidDirty()) { continue; }
+            bool sph = (ce->getFlags() & CF_SPH_Sender)!=0;
+            bool exported = ce->getRigidIndex()!=CollisionEntity::InvalidRigidIndex;
+            if(sph!=exported) {
+                rebuild = true;
+                break;
+            }
+            if(exported) {
+                sink.setRigid(ce->getRigidIndex(), *ce);
+            }
+            ce->setRigidDirty(false);
+        }
+    }
+    if(rebuild) {
+        sink.clearRigids();
+        for(uint32 i=0; i<num; ++i) {
+            CollisionEntity *ce = entities[i];
+            if(!ce) { continue; }
+            uint32 ri = CollisionEntity::InvalidRigidIndex;
+            if((ce->getFlags() & CF_SPH_Sender)!=0) {
+                ri = sink.addRigid(*ce);
+            }
+            ce->setRigidIndex(ri);
+            ce->setRigidDirty(false);
+        }
+        rebuild = false;
     }
 }
 
+void CollisionModule::copyRigitsToPSym()
+{
+    ExportRigids(m_entities, m_rigids_rebuild, *atmGetFluidModule());
+}
+
 void CollisionModule::addEntity(CollisionEntity *e)
 {
     atmDbgAssertSyncLock();
@@ -511,9 +797,15 @@ template<> CollisionBox* CollisionModule::createEntity<CollisionBox>()
 
 void CollisionModule::deleteEntity(CollisionHandle h)
 {
+    // Entity の並列 update 中は後でまとめて削除する
+    if(EntityCommandBuffer *cb=EntityCommandBuffer::getCurrent()) {
+        cb->defer([=](){ deleteEntity(h); });
+        return;
+    }
     atmDbgAssertSyncLock();
     CollisionEntity *&ce = m_entities[h];
     if(ce) {
+        if(ce->getRigidIndex()!=CollisionEntity::InvalidRigidIndex) { m_rigids_rebuild=true; }
         ce->release();
         ce = nullptr;
         m_vacant.push_back(h);
@@ -552,4 +844,391 @@ vec4 GetCollisionPosition( CollisionEntity *ce )
     return vec4();
 }
 
+#ifdef atm_enable_Benchmark
+
+// 以前の box-box 判定 (内接球 + 頂点判定による近似)。dbgBenchmarkBoxBox() での比較用
+static bool _CollideBoxBoxApprox(const CollisionBox *sender, const CollisionBox *receiver, CollideMessage &m)
+{
+    if(!BoundingBoxIntersect(sender->bb, receiver->bb)) { return false; }
+    {
+        const vec4 &size = receiver->size;
+        simdmat4 t(receiver->trans);
+        vec4 vertices[] = {
+            glm::vec4_cast(t * simdvec4( size.x, size.y, size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4(-size.x, size.y, size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4(-size.x,-size.y, size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4( size.x,-size.y, size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4( size.x, size.y,-size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4(-size.x, size.y,-size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4(-size.x,-size.y,-size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4( size.x,-size.y,-size.z, 1.0f)),
+        };
+        {
+            CollisionSphere sphere;
+            float32 r = std::abs(vertices[0].x);
+            for(int i=0; i<_countof(vertices); ++i) {
+                r = absmin(r, absmin(absmin(vertices[i].x, vertices[i].y), vertices[i].z));
+            }
+            vec3 center = vec3(receiver->trans[3]);
+            sphere.pos_r = vec4(center, r);
+            sphere.bb.bl = vec4(center-r, 1.0f);
+            sphere.bb.ur = vec4(center+r, 1.0f);
+            if(_Collide(sender, &sphere, m)) {
+                return true;
+            }
+        }
+        for(size_t i=0; i<_countof(vertices); ++i) {
+            CollisionSphere sphere;
+            sphere.bb.bl = sphere.bb.ur = sphere.pos_r = vec4(vec3(vertices[i]), 0.0f);
+            if(_Collide(sender, &sphere, m)) {
+                return true;
+            }
+        }
+    }
+    {
+        const vec4 &size = sender->size;
+        simdmat4 t(sender->trans);
+        vec4 vertices[] = {
+            glm::vec4_cast(t * simdvec4( size.x, size.y, size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4(-size.x, size.y, size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4(-size.x,-size.y, size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4( size.x,-size.y, size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4( size.x, size.y,-size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4(-size.x, size.y,-size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4(-size.x,-size.y,-size.z, 1.0f)),
+            glm::vec4_cast(t * simdvec4( size.x,-size.y,-size.z, 1.0f)),
+        };
+        {
+            CollisionSphere sphere;
+            float32 r = std::abs(vertices[0].x);
+            for(int i=0; i<_countof(vertices); ++i) {
+                r = absmin(r, absmin(absmin(vertices[i].x, vertices[i].y), vertices[i].z));
+            }
+            vec3 center = vec3(sender->trans[3]);
+            sphere.pos_r = vec4(center, r);
+            sphere.bb.bl = vec4(center-r, 1.0f);
+            sphere.bb.ur = vec4(center+r, 1.0f);
+            if(_Collide(&sphere, receiver, m)) {
+                return true;
+            }
+        }
+        for(size_t i=0; i<_countof(vertices); ++i) {
+            CollisionSphere sphere;
+            sphere.bb.bl = sphere.bb.ur = sphere.pos_r = vec4(vec3(vertices[i]), 0.0f);
+            if(_Collide(&sphere, receiver, m)) {
+                return true;
+            }
+        }
+    }
+    return false;
+
+}
+
+static void _DbgSetupBox(CollisionBox &o, const vec3 &pos, float32 rot, const vec3 &axis, const vec3 &size)
+{
+    mat4 t = glm::rotate(glm::translate(mat4(), pos), rot, axis);
+    o.position = vec4(pos, 0.0f);
+    o.trans = t;
+    o.size = vec4(size, 0.0f);
+    o.bb.bl = o.bb.ur = o.position;
+    for(int i=0; i<3; ++i) {
+        vec3 a = vec3(t[i]) * size[i];
+        vec3 n = glm::normalize(a);
+        o.planes[i*2+0] = vec4( n, -size[i]);
+        o.planes[i*2+1] = vec4(-n, -size[i]);
+        o.bb.ur += vec4(glm::abs(a), 0.0f);
+        o.bb.bl -= vec4(glm::abs(a), 0.0f);
+    }
+}
+
+void CollisionModule::dbgBenchmarkBoxBox()
+{
+    // 正しさの確認
+    {
+        CollisionBox a, b;
+        CollideMessage m;
+        // 面同士: x 方向に 0.1 めり込み
+        _DbgSetupBox(a, vec3(0.0f), 0.0f, vec3(0.0f,0.0f,1.0f), vec3(0.5f));
+        _DbgSetupBox(b, vec3(0.9f,0.0f,0.0f), 0.0f, vec3(0.0f,0.0f,1.0f), vec3(0.5f));
+        istAssert(_Collide(&a, &b, m));
+        istAssert(m.direction.x>0.999f && std::abs(m.direction.w-0.1f)<0.001f);
+        istAssert(_Collide(&b, &a, m) && m.direction.x<-0.999f);
+        // 離れている
+        _DbgSetupBox(b, vec3(1.1f,0.0f,0.0f), 0.0f, vec3(0.0f,0.0f,1.0f), vec3(0.5f));
+        istAssert(!_Collide(&a, &b, m));
+        // 辺同士: 45 度傾けた箱の稜線が z 方向に交差。近似版では検出できないケース
+        _DbgSetupBox(a, vec3(0.0f), 45.0f, vec3(0.0f,1.0f,0.0f), vec3(0.5f));
+        _DbgSetupBox(b, vec3(0.0f,0.0f,1.35f), 45.0f, vec3(1.0f,0.0f,0.0f), vec3(0.5f));
+        istAssert(_Collide(&a, &b, m));
+        istAssert(m.direction.z>0.999f && std::abs(m.direction.w-(std::sqrt(2.0f)-1.35f))<0.001f);
+        _DbgSetupBox(b, vec3(0.0f,0.0f,1.45f), 45.0f, vec3(1.0f,0.0f,0.0f), vec3(0.5f));
+        istAssert(!_Collide(&a, &b, m));
+    }
+
+    // 速度比較
+    const uint32 num_boxes = 1000;
+    const uint32 num_pairs = 100;
+    ist::vector<CollisionBox> boxes(num_boxes);
+    SFMT rand;
+    rand.initialize(0);
+    for(uint32 i=0; i<num_boxes; ++i) {
+        vec3 pos = (vec3(rand.genFloat32(), rand.genFloat32(), 0.0f)-0.5f) * 2.0f;
+        vec3 axis = glm::normalize(vec3(rand.genFloat32(), rand.genFloat32(), rand.genFloat32())+0.01f);
+        vec3 size = vec3(rand.genFloat32(), rand.genFloat32(), rand.genFloat32())*0.4f + 0.1f;
+        _DbgSetupBox(boxes[i], pos, rand.genFloat32()*360.0f, axis, size);
+    }
+
+    CollideMessage m;
+    uint32 hits_sat = 0, hits_approx = 0;
+    ist::Timer timer;
+    for(uint32 i=0; i<num_boxes; ++i) {
+        for(uint32 j=1; j<=num_pairs; ++j) {
+            if(_Collide(&boxes[i], &boxes[(i+j)%num_boxes], m)) { ++hits_sat; }
+        }
+    }
+    float32 t_sat = timer.getElapsedMillisec();
+    timer.reset();
+    for(uint32 i=0; i<num_boxes; ++i) {
+        for(uint32 j=1; j<=num_pairs; ++j) {
+            if(_CollideBoxBoxApprox(&boxes[i], &boxes[(i+j)%num_boxes], m)) { ++hits_approx; }
+        }
+    }
+    float32 t_approx = timer.getElapsedMillisec();
+    istPrint("box-box %u pairs: SAT %.2fms (%u hits), approx %.2fms (%u hits)\n",
+        num_boxes*num_pairs, t_sat, hits_sat, t_approx, hits_approx);
+}
+
+void CollisionModule::dbgBenchmarkSweepSpheres()
+{
+    // 正しさの確認
+    {
+        float32 t;
+        vec3 n;
+        SweepSphere q;
+        q.begin = vec4(-1.0f, 0.0f, 0.0f, 0.03f);
+        q.end   = vec4( 2.0f, 0.0f, 0.0f, 0.0f);
+
+        CollisionSphere s;
+        s.pos_r = vec4(1.0f, 0.0f, 0.0f, 0.1f);
+        istAssert(_Sweep(&s, q, t, n));
+        istAssert(std::abs(t-(2.0f-0.13f)/3.0f)<0.001f && n.x<-0.999f);
+        s.pos_r = vec4(1.0f, 0.2f, 0.0f, 0.1f);
+        istAssert(!_Sweep(&s, q, t, n));
+        s.pos_r = vec4(-1.0f, 0.05f, 0.0f, 0.1f); // 開始時点で重なっている
+        istAssert(_Sweep(&s, q, t, n) && t==0.0f);
+
+        // 薄い壁: 始点と終点の静的判定ではすり抜けるケース
+        CollisionBox b;
+        _DbgSetupBox(b, vec3(0.5f,0.0f,0.0f), 0.0f, vec3(0.0f,0.0f,1.0f), vec3(0.01f,0.5f,0.5f));
+        istAssert(_Sweep(&b, q, t, n));
+        istAssert(std::abs(t-(1.5f-0.04f)/3.0f)<0.001f && n.x<-0.999f);
+        q.end = vec4(-2.0f, 0.0f, 0.0f, 0.0f);
+        istAssert(!_Sweep(&b, q, t, n));
+        _DbgSetupBox(b, vec3(0.5f,0.0f,0.0f), 45.0f, vec3(0.0f,0.0f,1.0f), vec3(0.01f,0.5f,0.5f));
+        q.end = vec4(2.0f, 0.0f, 0.0f, 0.0f);
+        istAssert(_Sweep(&b, q, t, n) && n.x<0.0f);
+
+        CollisionPlane p;
+        p.plane = vec4(-1.0f, 0.0f, 0.0f, 1.0f); // x=1 の壁
+        istAssert(_Sweep(&p, q, t, n));
+        istAssert(std::abs(t-(2.0f-0.03f)/3.0f)<0.001f && n.x<-0.999f);
+    }
+
+    // 速度比較。現在のワールドの CollisionGrid に対して行う
+    const uint32 num_bullets = 16384;
+    const float32 radius = 0.03f;
+    ist::vector<SweepSphere> queries(num_bullets);
+    ist::vector<SweepResult> results(num_bullets);
+    SFMT rand;
+    rand.initialize(0);
+    for(uint32 i=0; i<num_bullets; ++i) {
+        vec3 pos = (vec3(rand.genFloat32(), rand.genFloat32(), 0.0f)-0.5f) * vec3(6.0f, 6.0f, 0.0f);
+        vec3 vel = (vec3(rand.genFloat32(), rand.genFloat32(), 0.0f)-0.5f) * vec3(0.4f, 0.4f, 0.0f);
+        pos.z = 0.03f;
+        queries[i].begin = vec4(pos, radius);
+        queries[i].end = vec4(pos+vel, 0.0f);
+    }
+
+    ist::Timer timer;
+    sweepSpheres(&queries[0], &results[0], num_bullets);
+    float32 t_parallel = timer.getElapsedMillisec();
+    uint32 hits_parallel = 0;
+    each(results, [&](const SweepResult &r){ if(r.hit_to) { ++hits_parallel; } });
+
+    CollisionContext ctx;
+    uint32 hits_serial = 0;
+    timer.reset();
+    for(uint32 i=0; i<num_bullets; ++i) {
+        if(sweepSphere(queries[i], results[i], ctx)) { ++hits_serial; }
+        ctx.clear();
+    }
+    float32 t_serial = timer.getElapsedMillisec();
+
+    // 従来の終点のみの静的判定
+    uint32 hits_static = 0;
+    timer.reset();
+    for(uint32 i=0; i<num_bullets; ++i) {
+        CollisionSphere sphere;
+        sphere.pos_r = vec4(vec3(queries[i].end), radius);
+        sphere.updateBoundingBox();
+        if(collideRecv(&sphere, ctx)) { ++hits_static; }
+        ctx.clear();
+    }
+    float32 t_static = timer.getElapsedMillisec();
+
+    istAssert(hits_parallel==hits_serial);
+    istPrint("sweep %u bullets: parallel %.2fms (%u hits), serial %.2fms, static %.2fms (%u hits)\n",
+        num_bullets, t_parallel, hits_parallel, t_serial, t_static, hits_static);
+}
+
+void CollisionModule::dbgBenchmarkMessages()
+{
+    // 実際に eventCollide を呼ぶとゲームに影響が出るので、配送の準備と entity の検索までを計測する
+    const uint32 num_ctxs = 64;
+    const uint32 num_messages_per_ctx = 256;
+    const uint32 num_receivers = 1024;
+
+    CollisionCtxCont ctxs(num_ctxs);
+    for(uint32 i=0; i<num_ctxs; ++i) { ctxs[i] = istNew(CollisionContext)(); }
+    auto fill = [&](){
+        SFMT rand;
+        rand.initialize(0);
+        for(uint32 i=0; i<num_ctxs; ++i) {
+            for(uint32 mi=0; mi<num_messages_per_ctx; ++mi) {
+                CollideMessage m;
+                m.cfrom = i*num_messages_per_ctx + mi;
+                m.from = m.cfrom;
+                m.cto = rand.genInt32() % num_receivers;
+                m.to = m.cto;
+                ctxs[i]->messages.push_back(m);
+            }
+        }
+    };
+
+    // 従来: メッセージ一つ毎に entity を検索
+    fill();
+    uint32 found_serial = 0;
+    ist::Timer timer;
+    for(uint32 i=0; i<num_ctxs; ++i) {
+        MessageCont &messages = ctxs[i]->messages;
+        for(uint32 mi=0; mi<messages.size(); ++mi) {
+            if(atmGetEntity(messages[mi].to)) { ++found_serial; }
+        }
+        messages.clear();
+    }
+    float32 t_serial = timer.getElapsedMillisec();
+
+    // receiver ごとにまとめてから検索
+    fill();
+    MessageCont messages;
+    ReceiverCont receivers;
+    uint32 found_batched = 0;
+    timer.reset();
+    GatherCollideMessages(ctxs, num_ctxs, messages, receivers);
+    float32 t_gather = timer.getElapsedMillisec();
+    each(receivers, [&](const ReceiverRange &r){
+        if(atmGetEntity(r.to)) { found_batched += r.num; }
+    });
+    float32 t_batched = timer.getElapsedMillisec();
+
+    // 正しさと決定性の確認
+    istAssert(messages.size()==num_ctxs*num_messages_per_ctx);
+    istAssert(found_serial==found_batched);
+    uint32 total = 0;
+    each(receivers, [&](const ReceiverRange &r){
+        for(uint32 i=r.begin; i<r.begin+r.num; ++i) { istAssert(messages[i].to==r.to); }
+        total += r.num;
+    });
+    istAssert(total==messages.size());
+    fill();
+    MessageCont messages2;
+    ReceiverCont receivers2;
+    GatherCollideMessages(ctxs, num_ctxs, messages2, receivers2);
+    istAssert(receivers.size()==receivers2.size());
+    istAssert(memcmp(&messages[0], &messages2[0], sizeof(CollideMessage)*messages.size())==0);
+
+    istPrint("collide messages %u to %u receivers: serial %.2fms, batched %.2fms (gather %.2fms)\n",
+        (uint32)messages.size(), (uint32)receivers.size(), t_serial, t_batched, t_gather);
+
+    for(uint32 i=0; i<num_ctxs; ++i) { istDelete(ctxs[i]); }
+}
+
+struct DbgRigidSink
+{
+    psym::World &world;
+    DbgRigidSink(psym::World &w) : world(w) {}
+    void clearRigids() { world.clearRigids(); }
+    uint32 addRigid(const CollisionEntity &v) { return AddRigid(world, v); }
+    void setRigid(uint32 i, const CollisionEntity &v) { SetRigid(world, i, v); }
+};
+
+void CollisionModule::dbgBenchmarkRigidExport()
+{
+    // 静止したブロック多数 + 動くもの少数で、毎フレーム全部出力する場合と差分更新を比較
+    const uint32 num_blocks = 4096;
+    const uint32 num_movers = 16;
+    const uint32 num_frames = 60;
+
+    EntityCont entities;
+    SFMT rand;
+    rand.initialize(0);
+    for(uint32 i=0; i<num_blocks; ++i) {
+        CollisionBox *b = istNew(CollisionBox)();
+        vec3 pos = (vec3(rand.genFloat32(), rand.genFloat32(), 0.0f)-0.5f) * vec3(6.0f, 6.0f, 0.0f);
+        _DbgSetupBox(*b, pos, rand.genFloat32()*360.0f, vec3(0.0f,0.0f,1.0f), vec3(0.05f));
+        entities.push_back(b);
+    }
+    for(uint32 i=0; i<num_movers; ++i) {
+        CollisionSphere *s = istNew(CollisionSphere)();
+        s->pos_r = vec4(0.0f, 0.0f, 0.0f, 0.1f);
+        entities.push_back(s);
+    }
+    auto move = [&](uint32 frame) {
+        for(uint32 i=0; i<num_movers; ++i) {
+            CollisionSphere *s = static_cast<CollisionSphere*>(entities[num_blocks+i]);
+            s->pos_r = vec4(std::cos(frame*0.1f+i)*2.0f, std::sin(frame*0.1f+i)*2.0f, 0.0f, 0.1f);
+            s->updateBoundingBox();
+            s->setRigidDirty();
+        }
+    };
+
+    psym::World *world = istNew(psym::World)();
+    DbgRigidSink sink(*world);
+
+    // 毎フレーム全部出力 (従来の方法)
+    float32 t_full = 0.0f;
+    ist::Timer timer;
+    for(uint32 f=0; f<num_frames; ++f) {
+        move(f);
+        timer.reset();
+        world->clearRigids();
+        each(entities, [&](CollisionEntity *ce){ AddRigid(*world, *ce); });
+        t_full += timer.getElapsedMillisec();
+    }
+    ist::raw_vector<psym::RigidSphere> spheres = world->collision_spheres;
+    ist::raw_vector<psym::RigidBox> boxes = world->collision_boxes;
+
+    // 差分更新
+    float32 t_incremental = 0.0f;
+    bool rebuild = true;
+    world->clearRigids();
+    for(uint32 f=0; f<num_frames; ++f) {
+        move(f);
+        timer.reset();
+        ExportRigids(entities, rebuild, sink);
+        t_incremental += timer.getElapsedMillisec();
+    }
+
+    istAssert(spheres.size()==world->collision_spheres.size() && boxes.size()==world->collision_boxes.size());
+    istAssert(memcmp(&spheres[0], &world->collision_spheres[0], sizeof(psym::RigidSphere)*spheres.size())==0);
+    istAssert(memcmp(&boxes[0], &world->collision_boxes[0], sizeof(psym::RigidBox)*boxes.size())==0);
+    istPrint("rigid export %u blocks + %u movers, %u frames: full %.2fms, incremental %.2fms\n",
+        num_blocks, num_movers, num_frames, t_full, t_incremental);
+
+    istDelete(world);
+    each(entities, [&](CollisionEntity *ce){ ce->release(); });
+}
+
+#endif // atm_enable_Benchmark
+
 } // namespace atm
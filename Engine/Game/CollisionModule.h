@@ -42,6 +42,7 @@ struct istAlign(16) BoundingBox
 atmSerializeRaw(BoundingBox);
 
 class CollisionModule;
+class EntityCommandBuffer;
 
 
 struct CollisionEntity
@@ -55,6 +56,10 @@ private:
     int32           m_flags; // COLLISION_FLAG
 public:
     BoundingBox bb;
+private:
+    // 以下 serialize 不要
+    uint32          m_rigid_index; // psym 側の rigid の index。出力されていなければ InvalidRigidIndex
+    bool            m_rigid_dirty; // 形状が変わったので psym への再出力が必要
 
 private:
     istSerializeBlock(
@@ -72,7 +77,12 @@ protected:
     void setShapeType(CollisionShapeType v) { m_shape_type=v; }
 
 public:
-    CollisionEntity() : m_shape_type(CS_Null), m_handle(0), m_group(0), m_entity_handle(0), m_flags(CF_Receiver|CF_Sender|CF_SPH_Sender) {}
+    static const uint32 InvalidRigidIndex = 0xffffffff;
+
+    CollisionEntity()
+        : m_shape_type(CS_Null), m_handle(0), m_group(0), m_entity_handle(0), m_flags(CF_Receiver|CF_Sender|CF_SPH_Sender)
+        , m_rigid_index(InvalidRigidIndex), m_rigid_dirty(true)
+    {}
     virtual ~CollisionEntity() {}
     void release() { istDelete(this); }
     CollisionShapeType  getShapeType() const        { return m_shape_type; }
@@ -80,10 +90,19 @@ public:
     CollisionGroup      getCollisionGroup() const   { return m_group; }
     EntityHandle        getEntityHandle() const     { return m_entity_handle; }
     int32               getFlags() const            { return m_flags; }
+    uint32              getRigidIndex() const       { return m_rigid_index; }
+    bool                isRigidDirty() const        { return m_rigid_dirty; }
 
     void setCollisionGroup(CollisionGroup v)    { m_group=v; }
     void setEntityHandle(EntityHandle v)        { m_entity_handle=v; }
-    void setFlags(int32 v)                      { m_flags=v; }
+    void setFlags(int32 v)
+    {
+        if((m_flags^v) & CF_SPH_Sender) { m_rigid_dirty=true; }
+        m_flags=v;
+    }
+    void setRigidIndex(uint32 v)                { m_rigid_index=v; }
+    // 形状を直接書き換えた場合は呼ぶこと。UpdateCollisionSphere()/UpdateCollisionBox() は変化があれば自動的に呼ぶ
+    void setRigidDirty(bool v=true)             { m_rigid_dirty=v; }
 };
 
 struct LessCollisionHandle { bool operator()(CollisionEntity *a, CollisionEntity *b) { return a->getCollisionHandle() < b->getCollisionHandle(); }};
@@ -165,6 +184,28 @@ struct CollideMessage
     CollideMessage() : from(0), to(0), cfrom(0), cto(0) {}
 };
 
+// 掃引球判定の入力。begin から end へ移動する半径 begin.w の球 (弾など)
+struct SweepSphere
+{
+    vec4 begin; // w=radius
+    vec4 end;
+    EntityHandle    owner;
+    CollisionGroup  group;
+
+    SweepSphere() : owner(0), group(0) {}
+};
+
+// 掃引球判定の結果。最初に当たった相手が入る
+struct SweepResult
+{
+    EntityHandle    hit_to;     // 0 なら当たりなし
+    CollisionHandle chit_to;
+    float32         time;       // 当たった位置。begin=0.0, end=1.0
+    vec3            normal;     // 相手から球へ向かう向き
+
+    SweepResult() : hit_to(0), chit_to(0), time(1.0f) {}
+};
+
 
 class CollideTask;
 class DistanceTask;
@@ -226,6 +267,16 @@ public:
     };
     typedef ist::vector<CollisionContext*> CollisionCtxCont;
 
+    // m_messages の中の同じ receiver 宛てのメッセージの範囲
+    struct ReceiverRange
+    {
+        EntityHandle to;
+        uint32 begin;
+        uint32 num;
+    };
+    typedef ist::vector<ReceiverRange> ReceiverCont;
+    typedef ist::vector<EntityCommandBuffer*> CommandBufferCont;
+
 public:
     CollisionModule();
     ~CollisionModule();
@@ -238,6 +289,8 @@ public:
     void frameEnd();
 
     void copyRigitsToPSym();
+    // 次の copyRigitsToPSym() で psym 側の rigid を全部作り直させる
+    void requestRigidsRebuild() { m_rigids_rebuild=true; }
 
     CollisionEntity* getEntity(CollisionHandle h);
     template<class T> T* createEntity();
@@ -253,7 +306,21 @@ public:
     uint32 collideSend(CollisionEntity *e, CollisionContext &ctx);
     uint32 collideRecv(CollisionEntity *e, CollisionContext &ctx);
 
+    // 移動中の球が最初に当たる sender を探す。高速な弾のすり抜け対策。
+    bool sweepSphere(const SweepSphere &q, SweepResult &r, CollisionContext &ctx);
+    // sweepSphere() を並列に一括で行う。results は queries と同じ数必要
+    void sweepSpheres(const SweepSphere *queries, SweepResult *results, uint32 num);
+
+#ifdef atm_enable_Benchmark
+    void dbgBenchmarkBoxBox();
+    void dbgBenchmarkSweepSpheres();
+    void dbgBenchmarkMessages();
+    void dbgBenchmarkRigidExport();
+#endif // atm_enable_Benchmark
+
 private:
+    static const uint32 DeliverBlockSize = 32; // 衝突メッセージを並列に配る粒度 (receiver 数)
+
     void addEntity(CollisionEntity *e);
 
     EntityCont      m_entities;
@@ -263,6 +330,12 @@ private:
     // 以下 serialize 不要
     CollisionGrid   m_grid;
     CollisionCtxCont    m_acons;
+    CollisionCtxCont    m_scons; // sweepSpheres() 用
+    bool            m_rigids_rebuild; // psym の rigid を全部作り直す必要がある
+    MessageCont     m_messages;  // receiver 順に並べ替えた衝突メッセージ
+    ReceiverCont    m_receivers;
+    ist::vector<uint8>  m_serial_receivers; // 並列に配れなかった receiver
+    CommandBufferCont   m_cbuffers; // 並列配送のブロック毎
 
     istSerializeBlock(
         istSerializeBase(super)
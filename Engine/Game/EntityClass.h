@@ -115,12 +115,18 @@ istSEnumBlock(EntityClassID,
 // EntityHandle は
 // 上位 3bit がカテゴリ (EntityCategoryID)
 // カテゴリの 3bit も含めた上位 12 bit が class ID (EntityClassID)
-// それ以下が entity table のインデックス
+// 次の 3 bit が世代。slot が再利用される度に増えるので、死んだ Entity の handle で別の Entity を引いてしまうことを防ぐ。
+// ただし同じ slot が EntityMaxGeneration (8) 回再利用されると一周するので、それより古い handle は再び有効に見えうる。
+// (slot は空いた順に再利用するので、一周するのは生きている数に対して生成と削除が非常に多い場合だけ)
+// 下位 17 bit が entity table のインデックス。同時に存在できるのは EntityMaxIndex 個までで、超えると生成に失敗する
+static const uint32 EntityMaxIndex = 0x20000;
+static const uint32 EntityMaxGeneration = 8;
 inline uint32 EntityGetCategory(EntityHandle e)     { return (e & 0xE0000000) >> 29; }
 inline uint32 EntityGetClassID(EntityHandle e)      { return (e & 0xFFF00000) >> 20; }
 inline uint32 EntityGetClassIndex(EntityHandle e)   { return (e & 0x1FF00000) >> 20; }
-inline uint32 EntityGetIndex(EntityHandle e)        { return (e & 0x000FFFFF) >>  0; }
-inline EntityHandle EntityCreateHandle(uint32 classid, uint32 index) { return (classid<<20) | index; }
+inline uint32 EntityGetGeneration(EntityHandle e)   { return (e & 0x000E0000) >> 17; }
+inline uint32 EntityGetIndex(EntityHandle e)        { return (e & 0x0001FFFF) >>  0; }
+inline EntityHandle EntityCreateHandle(uint32 classid, uint32 index, uint32 generation=0) { return (classid<<20) | ((generation&0x7)<<17) | (index&0x1FFFF); }
 
 inline bool atmIsEnemy(EntityHandle e)   { return EntityGetCategory(e)==ECA_Enemy; }
 inline bool atmIsPlayer(EntityHandle e)  { return EntityGetCategory(e)==ECA_Player; }
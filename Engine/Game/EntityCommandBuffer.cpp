@@ -0,0 +1,89 @@
+﻿#include "atmPCH.h"
+#include "types.h"
+#include "Util.h"
+#include "Engine/Game/World.h"
+#include "Engine/Game/EntityModule.h"
+#include "Engine/Game/EntityQuery.h"
+#include "EntityCommandBuffer.h"
+
+namespace atm {
+
+namespace {
+    istThreadLocal EntityCommandBuffer *g_current_cbuffer;
+} // namespace
+
+EntityCommandBuffer* EntityCommandBuffer::getCurrent()      { return g_current_cbuffer; }
+void EntityCommandBuffer::setCurrent(EntityCommandBuffer *v){ g_current_cbuffer=v; }
+
+
+EntityCommandBuffer::EntityCommandBuffer()
+{
+}
+
+void EntityCommandBuffer::clear()
+{
+    m_commands.clear();
+    m_args.clear();
+    m_funcs.clear();
+}
+
+void EntityCommandBuffer::createEntity(EntityClassID cid)
+{
+    Command c = {CT_Create, 0, (uint32)cid, 0, 0};
+    m_commands.push_back(c);
+}
+
+void EntityCommandBuffer::deleteEntity(EntityHandle h)
+{
+    Command c = {CT_Delete, h, 0, 0, 0};
+    m_commands.push_back(c);
+}
+
+void EntityCommandBuffer::defer(const Func &f)
+{
+    Command c = {CT_Func, 0, (uint32)m_funcs.size(), 0, 0};
+    m_commands.push_back(c);
+    m_funcs.push_back(f);
+}
+
+void EntityCommandBuffer::pushCall(EntityHandle h, FunctionID fid, const void *args, uint32 size)
+{
+    // 引数は 16 byte 境界に置く
+    uint32 offset = (uint32)m_args.size();
+    if(size>0) {
+        m_args.resize(offset + ((size+15) & ~15));
+        istMemcpy(&m_args[offset], args, size);
+    }
+    Command c = {h==0 ? CT_CallCreated : CT_Call, h, (uint32)fid, offset, size};
+    m_commands.push_back(c);
+}
+
+void EntityCommandBuffer::flush()
+{
+    EntityModule *em = atmGetEntityModule();
+    IEntity *created = nullptr;
+    for(uint32 i=0; i<m_commands.size(); ++i) {
+        const Command &c = m_commands[i];
+        const void *args = c.arg_size>0 ? &m_args[c.arg_offset] : nullptr;
+        switch(c.type) {
+        case CT_Create:
+            created = em->createEntity((EntityClassID)c.param);
+            break;
+        case CT_Delete:
+            em->deleteEntity(c.target);
+            break;
+        case CT_Call:
+            if(IEntity *e=em->getEntity(c.target)) { e->call((FunctionID)c.param, args); }
+            break;
+        case CT_CallCreated:
+            if(created) { created->call((FunctionID)c.param, args); }
+            break;
+        case CT_Func:
+            m_funcs[c.param]();
+            break;
+        }
+    }
+    clear();
+}
+
+} // namespace atm
@@ -0,0 +1,80 @@
+﻿#ifndef atm_Engine_Game_EntityCommandBuffer_h
+#define atm_Engine_Game_EntityCommandBuffer_h
+
+namespace atm {
+
+class IEntity;
+
+// 並列に update() している間の、Entity の生成/削除や他の Entity の呼び出しなどを溜めておくもの。
+// EntityModule は並列 update のブロック毎にこれを用意し、全ブロックの update が終わった後にブロック順に flush() する。
+// なので、結果はスレッドの実行順に依存しない。
+// 並列 update 中は getCurrent() でそのスレッドのものが得られる。(それ以外の時は nullptr)
+// CollisionModule::update() が衝突メッセージを並列に配る間も同様。
+// EntityModule::deleteEntity()、CollisionModule::deleteEntity()、BulletModule::shootBullet() は自動的にこれに積まれる。
+class atmAPI EntityCommandBuffer
+{
+public:
+    typedef std::function<void ()> Func;
+
+    static EntityCommandBuffer* getCurrent();
+    static void setCurrent(EntityCommandBuffer *v);
+
+public:
+    EntityCommandBuffer();
+    void clear();
+    bool empty() const { return m_commands.empty(); }
+    uint32 getNumCommands() const { return (uint32)m_commands.size(); }
+
+    // 作られるのは flush() 時。続く callCreated() はその Entity に対して呼ばれる
+    void createEntity(EntityClassID cid);
+    void deleteEntity(EntityHandle h);
+    void call(EntityHandle h, FunctionID fid) { pushCall(h, fid, nullptr, 0); }
+    template<class Arg>
+    void call(EntityHandle h, FunctionID fid, const Arg &args) { pushCall(h, fid, &args, sizeof(Arg)); }
+    void callCreated(FunctionID fid) { pushCall(0, fid, nullptr, 0); }
+    template<class Arg>
+    void callCreated(FunctionID fid, const Arg &args) { pushCall(0, fid, &args, sizeof(Arg)); }
+    // 上記以外の同期が必要な処理 (サウンドの再生など)
+    void defer(const Func &f);
+
+    // 積まれた順に実行して空にする
+    void flush();
+
+private:
+    enum CommandType {
+        CT_Create,
+        CT_Delete,
+        CT_Call,
+        CT_CallCreated,
+        CT_Func,
+    };
+    struct Command
+    {
+        CommandType type;
+        EntityHandle target;
+        uint32 param; // CT_Create: EntityClassID, CT_Call: FunctionID, CT_Func: m_funcs の index
+        uint32 arg_offset;
+        uint32 arg_size;
+    };
+    typedef ist::raw_vector<Command> CommandCont;
+    typedef ist::raw_vector<char> ArgCont;
+    typedef ist::vector<Func> FuncCont;
+
+    // 引数は POD であること (memcpy で保存される)
+    void pushCall(EntityHandle h, FunctionID fid, const void *args, uint32 size);
+
+    CommandCont m_commands;
+    ArgCont     m_args;
+    FuncCont    m_funcs;
+};
+
+// 並列 update 中であれば現在の EntityCommandBuffer に積み、そうでなければすぐに実行する
+template<class F>
+inline void DeferIfParallel(const F &f)
+{
+    if(EntityCommandBuffer *cb=EntityCommandBuffer::getCurrent()) { cb->defer(f); }
+    else { f(); }
+}
+
+} // namespace atm
+#endif // atm_Engine_Game_EntityCommandBuffer_h
@@ -0,0 +1,327 @@
+﻿#include "atmPCH.h"
+#include "types.h"
+#include "Util.h"
+#include "Engine/Game/World.h"
+#include "Engine/Game/EntityModule.h"
+#include "Engine/Game/EntityQuery.h"
+#include "Engine/Game/CollisionModule.h"
+#include "EntityComponent.h"
+
+namespace atm {
+
+EntityComponentStore::EntityComponentStore()
+{
+}
+
+void EntityComponentStore::clear()
+{
+    m_handles.clear();
+    m_sparse.clear();
+    m_flags.clear();
+    m_positions.clear();
+    m_velocities.clear();
+    m_transforms.clear();
+    m_collisions.clear();
+}
+
+uint32 EntityComponentStore::attach(EntityHandle h, uint32 flags)
+{
+    uint32 d = getIndex(h);
+    if(d!=InvalidIndex) {
+        m_flags[d] |= flags;
+        return d;
+    }
+
+    uint32 iid = EntityGetIndex(h);
+    if(iid >= m_sparse.size()) {
+        m_sparse.resize(iid+1, InvalidIndex);
+    }
+    d = size();
+    m_sparse[iid] = d;
+    m_handles.push_back(h);
+    m_flags.push_back(flags);
+    m_positions.push_back(vec4(0.0f, 0.0f, 0.0f, 1.0f));
+    m_velocities.push_back(vec4(0.0f));
+    m_transforms.push_back(mat4());
+    m_collisions.push_back(0);
+    return d;
+}
+
+bool EntityComponentStore::detach(EntityHandle h)
+{
+    uint32 d = getIndex(h);
+    if(d==InvalidIndex) { return false; }
+
+    // 末尾の要素を空いた場所に移して詰める
+    uint32 last = size()-1;
+    if(d!=last) {
+        m_handles[d]    = m_handles[last];
+        m_flags[d]      = m_flags[last];
+        m_positions[d]  = m_positions[last];
+        m_velocities[d] = m_velocities[last];
+        m_transforms[d] = m_transforms[last];
+        m_collisions[d] = m_collisions[last];
+        m_sparse[EntityGetIndex(m_handles[d])] = d;
+    }
+    m_handles.pop_back();
+    m_flags.pop_back();
+    m_positions.pop_back();
+    m_velocities.pop_back();
+    m_transforms.pop_back();
+    m_collisions.pop_back();
+    m_sparse[EntityGetIndex(h)] = InvalidIndex;
+    return true;
+}
+
+uint32 EntityComponentStore::getIndex(EntityHandle h) const
+{
+    uint32 iid = EntityGetIndex(h);
+    if(h==0 || iid>=m_sparse.size()) { return InvalidIndex; }
+    uint32 d = m_sparse[iid];
+    // slot が再利用されていれば別の Entity なので無効
+    if(d==InvalidIndex || m_handles[d]!=h) { return InvalidIndex; }
+    return d;
+}
+
+void EntityComponentStore::update(float32 dt)
+{
+    if(m_handles.empty()) { return; }
+    integrate(dt);
+    updateTransforms();
+    syncCollisions();
+}
+
+void EntityComponentStore::integrate(float32 dt)
+{
+    parallelEachBlock([&](uint32 first, uint32 last){
+        const uint32 *flags = m_flags.begin();
+        vec4 *pos = m_positions.begin();
+        const vec4 *vel = m_velocities.begin();
+        for(uint32 i=first; i<last; ++i) {
+            if(flags[i] & ECF_Velocity) {
+                pos[i] += vel[i]*dt;
+            }
+        }
+    });
+}
+
+void EntityComponentStore::updateTransforms()
+{
+    parallelEachBlock([&](uint32 first, uint32 last){
+        const uint32 *flags = m_flags.begin();
+        const vec4 *pos = m_positions.begin();
+        mat4 *trans = m_transforms.begin();
+        for(uint32 i=first; i<last; ++i) {
+            if(flags[i] & ECF_Transform) {
+                trans[i] = glm::translate(mat4(), vec3(pos[i]));
+            }
+        }
+    });
+}
+
+void EntityComponentStore::syncCollisions()
+{
+    parallelEachBlock([&](uint32 first, uint32 last){
+        const uint32 *flags = m_flags.begin();
+        const vec4 *pos = m_positions.begin();
+        const CollisionHandle *collisions = m_collisions.begin();
+        for(uint32 i=first; i<last; ++i) {
+            if((flags[i] & ECF_Collision)==0 || collisions[i]==0) { continue; }
+            CollisionEntity *ce = atmGetCollision(collisions[i]);
+            if(ce && ce->getShapeType()==CS_Sphere) {
+                CollisionSphere &sphere = *static_cast<CollisionSphere*>(ce);
+                vec4 pos_r = vec4(vec3(pos[i]), sphere.pos_r.w);
+                if(pos_r!=sphere.pos_r) {
+                    sphere.pos_r = pos_r;
+                    sphere.updateBoundingBox();
+                    sphere.setRigidDirty();
+                }
+            }
+        }
+    });
+}
+
+
+
+EntityTransformHierarchy::EntityTransformHierarchy()
+    : m_num_updated(0), m_topology_dirty(true)
+{
+}
+
+void EntityTransformHierarchy::clear()
+{
+    m_handles.clear();
+    m_entities.clear();
+    m_parent_entities.clear();
+    m_parent_nodes.clear();
+    m_levels.clear();
+    m_sparse.clear();
+    m_parent_of.clear();
+    m_locals.clear();
+    m_worlds.clear();
+    m_iworlds.clear();
+    m_parent_worlds.clear();
+    m_parent_iworlds.clear();
+    m_changed.clear();
+    m_force.clear();
+    m_num_updated = 0;
+    m_topology_dirty = true;
+}
+
+void EntityTransformHierarchy::onDelete(EntityHandle h)
+{
+    uint32 iid = EntityGetIndex(h);
+    if(iid<m_sparse.size() && m_sparse[iid]!=InvalidIndex && m_handles[m_sparse[iid]]==h) {
+        m_topology_dirty = true;
+    }
+    if(iid<m_parent_of.size() && m_parent_of[iid]==h) {
+        m_topology_dirty = true;
+    }
+}
+
+void EntityTransformHierarchy::update(const EntityHandle *handles, uint32 num, IEntity *const *entities, uint32 num_entities)
+{
+    if(m_topology_dirty) {
+        rebuild(handles, num, entities, num_entities);
+    }
+    updateTransforms();
+}
+
+void EntityTransformHierarchy::rebuild(const EntityHandle *handles, uint32 num, IEntity *const *entities, uint32 num_entities)
+{
+    clear();
+    m_topology_dirty = false;
+    auto lookup = [&](EntityHandle h) -> IEntity* {
+        uint32 iid = EntityGetIndex(h);
+        return h!=0 && iid<num_entities ? entities[iid] : nullptr;
+    };
+
+    // 親を持つものを集める
+    HandleCont handles_tmp, parents_tmp;
+    m_sparse.resize(num_entities, InvalidIndex);
+    m_parent_of.resize(num_entities, 0);
+    for(uint32 i=0; i<num; ++i) {
+        EntityHandle h = handles[i];
+        IEntity *e = lookup(h);
+        EntityHandle parent = 0;
+        if(!e || !atmQuery(e, getParent, parent) || !lookup(parent)) { continue; }
+        m_sparse[EntityGetIndex(h)] = (uint32)handles_tmp.size();
+        m_parent_of[EntityGetIndex(parent)] = parent;
+        handles_tmp.push_back(h);
+        parents_tmp.push_back(parent);
+    }
+    uint32 num_nodes = (uint32)handles_tmp.size();
+
+    // 深さを求めて、深さ順 (同じ深さ内では元の順) に並べる
+    m_tmp_depth.resize(num_nodes);
+    m_tmp_order.resize(num_nodes);
+    for(uint32 ni=0; ni<num_nodes; ++ni) {
+        uint32 depth = 0;
+        uint32 pi = m_sparse[EntityGetIndex(parents_tmp[ni])];
+        while(pi!=InvalidIndex && depth<MaxDepth) {
+            ++depth;
+            pi = m_sparse[EntityGetIndex(parents_tmp[pi])];
+        }
+        m_tmp_depth[ni] = depth;
+        m_tmp_order[ni] = ni;
+    }
+    stl::stable_sort(m_tmp_order.begin(), m_tmp_order.end(),
+        [&](uint32 a, uint32 b){ return m_tmp_depth[a] < m_tmp_depth[b]; });
+    // MaxDepth に達したもの (循環参照) は末尾に集まるので、そこで切る
+    uint32 num_valid = 0;
+    for(uint32 i=0; i<num_nodes; ++i) {
+        uint32 ni = m_tmp_order[i];
+        bool valid = m_tmp_depth[ni]<MaxDepth;
+        m_sparse[EntityGetIndex(handles_tmp[ni])] = valid ? i : InvalidIndex;
+        if(valid) { ++num_valid; }
+    }
+
+    for(uint32 i=0; i<num_valid; ++i) {
+        uint32 ni = m_tmp_order[i];
+        EntityHandle h = handles_tmp[ni];
+        EntityHandle parent = parents_tmp[ni];
+        uint32 depth = m_tmp_depth[ni];
+        while(m_levels.size()<=depth) { m_levels.push_back(i); }
+        m_handles.push_back(h);
+        m_entities.push_back(lookup(h));
+        m_parent_entities.push_back(lookup(parent));
+        m_parent_nodes.push_back(m_sparse[EntityGetIndex(parent)]);
+    }
+    m_levels.push_back(num_valid);
+    num_nodes = num_valid;
+
+    m_locals.resize(num_nodes);
+    m_worlds.resize(num_nodes);
+    m_iworlds.resize(num_nodes);
+    m_parent_worlds.resize(num_nodes);
+    m_parent_iworlds.resize(num_nodes);
+    m_changed.resize(num_nodes, 0);
+    m_force.resize(num_nodes, 1); // 作り直した直後は全部計算し直す
+}
+
+void EntityTransformHierarchy::updateTransforms()
+{
+    // 親の結果を使うので、深さ毎に順に処理する
+    for(uint32 li=0; li+1<m_levels.size(); ++li) {
+        uint32 first = m_levels[li];
+        uint32 last = m_levels[li+1];
+        ist::parallel_for(
+            ist::size_range(size_t(first), size_t(last), 32),
+            [&](const ist::size_range &r) {
+                for(size_t i=r.begin(); i!=r.end(); ++i) {
+                    updateNode((uint32)i);
+                }
+            });
+    }
+    m_num_updated = 0;
+    each(m_changed, [&](uint8 v){ m_num_updated+=v; });
+}
+
+void EntityTransformHierarchy::updateNode(uint32 i)
+{
+    IEntity *e = m_entities[i];
+    IEntity *parent = m_parent_entities[i];
+    uint32 pi = m_parent_nodes[i];
+    m_changed[i] = 0;
+
+    mat4 pmat, ipmat;
+    bool parent_changed = false;
+    if(pi!=InvalidIndex) {
+        pmat = m_worlds[pi];
+        ipmat = m_iworlds[pi];
+        parent_changed = m_changed[pi]!=0;
+    }
+    else {
+        // 親が root の場合、親の行列は親自身の update() で更新済み
+        if(!atmQuery(parent, getTransformMatrix, pmat)) { return; }
+        parent_changed = pmat!=m_parent_worlds[i];
+        if(parent_changed) {
+            if(!atmQuery(parent, getInvTransformMatrix, ipmat)) { ipmat=glm::inverse(pmat); }
+        }
+        else {
+            ipmat = m_parent_iworlds[i];
+        }
+    }
+
+    mat4 local;
+    if(!atmQuery(e, computeLocalTransformMatrix, local)) { return; }
+    if(!m_force[i] && !parent_changed && local==m_locals[i]) { return; }
+
+    mat4 prot;
+    atmQuery(parent, computeRotationMatrix, prot);
+    mat4 world = pmat * local;
+    atmCall(e, setParentTransformMatrix, atmArgs(pmat, ipmat, prot));
+    atmCall(e, setTransformMatrix, world);
+    mat4 iworld;
+    if(!atmQuery(e, getInvTransformMatrix, iworld)) { iworld=glm::inverse(world); }
+
+    m_locals[i] = local;
+    m_worlds[i] = world;
+    m_iworlds[i] = iworld;
+    m_parent_worlds[i] = pmat;
+    m_parent_iworlds[i] = ipmat;
+    m_force[i] = 0;
+    m_changed[i] = 1;
+}
+
+} // namespace atm
@@ -0,0 +1,149 @@
+﻿#ifndef atm_Engine_Game_EntityComponent_h
+#define atm_Engine_Game_EntityComponent_h
+
+namespace atm {
+
+// EntityComponentStore が持つコンポーネントの種類
+enum EntityComponentFlags {
+    ECF_Position    = 1 << 0,
+    ECF_Velocity    = 1 << 1, // 毎フレーム position に加算される
+    ECF_Transform   = 1 << 2, // 毎フレーム position から作り直される
+    ECF_Collision   = 1 << 3, // CollisionSphere であれば position に追従させる
+};
+
+// Entity のデータを種類毎に連続した配列で持つストレージ。
+// 移動や transform の更新などのシステムは、IEntity の仮想関数を経由せずに配列を一括で処理する。
+// IEntity からの移行期間中は共存する: IEntity を持つ Entity にコンポーネントを追加することもできるし、
+// IEntity を持たないコンポーネントだけの Entity も作れる。(EntityModule::createComponentEntity())
+// 削除は swap-remove なので、index は Entity の削除で変わりうる。保持する場合は handle で持つこと。
+// RoutineProgram による行動の状態はここではなく RoutineRunner (EntityModule::getRoutineRunner()) が持つ。
+class atmAPI EntityComponentStore
+{
+public:
+    static const uint32 InvalidIndex = 0xffffffff;
+    static const uint32 BlockSize = 256; // システムを並列に回す時の粒度
+
+    typedef ist::raw_vector<EntityHandle>       HandleCont;
+    typedef ist::raw_vector<uint32>             IndexCont;
+    typedef ist::raw_vector<uint32>             FlagCont;
+    typedef ist::raw_vector<vec4>               PositionCont;
+    typedef ist::raw_vector<mat4>               TransformCont;
+    typedef ist::raw_vector<CollisionHandle>    CollisionCont;
+
+public:
+    EntityComponentStore();
+    void clear();
+
+    // h にコンポーネントを追加する。既にあれば flags が足されるだけ
+    uint32 attach(EntityHandle h, uint32 flags);
+    // h のコンポーネントを全部取り除く。h が無ければ false
+    bool detach(EntityHandle h);
+    uint32 getIndex(EntityHandle h) const;
+    bool has(EntityHandle h) const { return getIndex(h)!=InvalidIndex; }
+
+    uint32          size() const                { return (uint32)m_handles.size(); }
+    EntityHandle    getHandle(uint32 i) const   { return m_handles[i]; }
+    uint32          getFlags(uint32 i) const    { return m_flags[i]; }
+    void            setFlags(uint32 i, uint32 v){ m_flags[i]=v; }
+    vec4&           getPosition(uint32 i)       { return m_positions[i]; }
+    vec4&           getVelocity(uint32 i)       { return m_velocities[i]; }
+    mat4&           getTransform(uint32 i)      { return m_transforms[i]; }
+    CollisionHandle& getCollision(uint32 i)     { return m_collisions[i]; }
+
+    // 全システムを順に更新
+    void update(float32 dt);
+    void integrate(float32 dt);
+    void updateTransforms();
+    void syncCollisions();
+
+    // [first, last) の範囲で f を並列に呼ぶ
+    template<class F>
+    void parallelEachBlock(const F &f)
+    {
+        uint32 num = size();
+        ist::parallel_for(uint32(0), ceildiv(num, BlockSize),
+            [&](uint32 bi) {
+                uint32 first = bi*BlockSize;
+                f(first, stl::min<uint32>(first+BlockSize, num));
+            });
+    }
+
+private:
+    HandleCont      m_handles;  // dense index -> handle
+    IndexCont       m_sparse;   // EntityGetIndex(handle) -> dense index
+    FlagCont        m_flags;
+    PositionCont    m_positions;
+    PositionCont    m_velocities;
+    TransformCont   m_transforms;
+    CollisionCont   m_collisions;
+
+    istSerializeBlock(
+        istSerialize(m_handles)
+        istSerialize(m_sparse)
+        istSerialize(m_flags)
+        istSerialize(m_positions)
+        istSerialize(m_velocities)
+        istSerialize(m_transforms)
+        istSerialize(m_collisions)
+    )
+};
+
+
+class IEntity;
+
+// 親を持つ Entity (TAttr_HaveParent) の world 行列を、毎フレーム一度だけ親から順に更新する。
+// 同じ深さのものはまとめて並列に処理し、ローカル行列も親の world 行列も変わっていないものは飛ばす。
+// 親子関係は setParent() や関係する Entity の削除で dirty になった時だけ作り直す。
+// 関係する Entity が削除されると必ず作り直すので、保持している IEntity* は作り直すまで有効。
+class atmAPI EntityTransformHierarchy
+{
+public:
+    static const uint32 InvalidIndex = 0xffffffff;
+    static const uint32 MaxDepth = 64; // これより深いもの (循環参照など) は無視
+
+    typedef ist::raw_vector<EntityHandle>   HandleCont;
+    typedef ist::raw_vector<IEntity*>       EntityCont;
+    typedef ist::raw_vector<uint32>         IndexCont;
+    typedef ist::raw_vector<mat4>           TransformCont;
+    typedef ist::raw_vector<uint8>          FlagCont;
+
+public:
+    EntityTransformHierarchy();
+    void clear();
+    void setDirty() { m_topology_dirty=true; }
+    void onDelete(EntityHandle h);
+
+    // handles: 対象になりうる Entity 全部、entities: EntityGetIndex() で引ける IEntity* の表
+    void update(const EntityHandle *handles, uint32 num, IEntity *const *entities, uint32 num_entities);
+    void rebuild(const EntityHandle *handles, uint32 num, IEntity *const *entities, uint32 num_entities);
+    void updateTransforms();
+
+    uint32 getNumNodes() const      { return (uint32)m_handles.size(); }
+    uint32 getNumLevels() const     { return m_levels.empty() ? 0 : (uint32)m_levels.size()-1; }
+    uint32 getNumUpdated() const    { return m_num_updated; }
+
+private:
+    void updateNode(uint32 i);
+
+    HandleCont      m_handles;          // 深さ順
+    EntityCont      m_entities;
+    EntityCont      m_parent_entities;
+    IndexCont       m_parent_nodes;     // 親も node であればその index
+    IndexCont       m_levels;           // 深さ毎の開始 index。末尾は node の数
+    IndexCont       m_sparse;           // EntityGetIndex(handle) -> node index
+    HandleCont      m_parent_of;        // EntityGetIndex(handle) -> その Entity が親であれば handle
+    TransformCont   m_locals;
+    TransformCont   m_worlds;
+    TransformCont   m_iworlds;
+    TransformCont   m_parent_worlds;
+    TransformCont   m_parent_iworlds;
+    FlagCont        m_changed;
+    FlagCont        m_force;
+    IndexCont       m_tmp_depth;
+    IndexCont       m_tmp_order;
+    uint32          m_num_updated;
+    bool            m_topology_dirty;
+};
+
+} // namespace atm
+#endif // atm_Engine_Game_EntityComponent_h
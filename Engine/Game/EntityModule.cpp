@@ -2,11 +2,17 @@
 #include "types.h"
 #include "AtomicGame.h"
 #include "Engine/Graphics/ResourceManager.h"
+#include "Engine/Graphics/Renderer.h"
 #include "World.h"
 #include "EntityModule.h"
 #include "EntityQuery.h"
 #include "CollisionModule.h"
+#include "Message.h"
 #include "Task.h"
+#ifdef atm_enable_Benchmark
+#include "Entity/EntityUtil.h"
+#include "Entity/EntityTransform.h"
+#endif // atm_enable_Benchmark
 
 #ifdef atm_enable_StrictHandleCheck
     #define atmStrictHandleCheck(h) if(!isValidHandle(h)) { istAssert("invalid entity handle\n"); }
@@ -79,18 +85,54 @@ atmAPI EntityHandle atmCreateEntityHandle()
     return atmGetWorld() ? atmGetEntityModule()->getGeneratedHandle() : 0;
 }
 
+bool IEntity::queryPosition(vec3 &out)
+{
+    return call(FID_getPosition, nullptr, &out);
+}
+
+bool IEntity::queryTransformMatrix(mat4 &out)
+{
+    return call(FID_getTransformMatrix, nullptr, &out);
+}
+
 atmExportClass(IEntity);
 
 
 atmExportClass(EntityModule);
 
 EntityModule::EntityModule()
+    : m_vacant_head(0)
 {
+#ifdef atm_enable_Benchmark
+    wdmAddNode("Entity/dbgBenchmarkComponents()", &EntityModule::dbgBenchmarkComponents, this);
+    wdmAddNode("Entity/dbgBenchmarkECall()", &EntityModule::dbgBenchmarkECall, this);
+    wdmAddNode("Entity/dbgBenchmarkTransformHierarchy()", &EntityModule::dbgBenchmarkTransformHierarchy, this);
+    wdmAddNode("Entity/dbgBenchmarkSpatialIndex()", &EntityModule::dbgBenchmarkSpatialIndex, this);
+    wdmAddNode("Entity/dbgBenchmarkParallelUpdate()", &EntityModule::dbgBenchmarkParallelUpdate, this);
+    wdmAddNode("Entity/dbgBenchmarkMessages()", &EntityModule::dbgBenchmarkMessages, this);
+    wdmAddNode("Entity/dbgBenchmarkHandles()", &EntityModule::dbgBenchmarkHandles, this);
+    wdmAddNode("Entity/dbgBenchmarkEntityPool()", &EntityModule::dbgBenchmarkEntityPool, this);
+    wdmAddNode("Entity/dbgBenchmarkDraw()", &EntityModule::dbgBenchmarkDraw, this);
+    wdmAddNode("Entity/dbgBenchmarkRoutines()", &EntityModule::dbgBenchmarkRoutines, this);
+#endif // atm_enable_Benchmark
+    m_parallel_update = true;
+    wdmAddNode("Entity/parallel_update", &m_parallel_update);
+    m_dlist_merged = istNew(DrawList)();
+    m_parallel_draw = true;
+    m_sort_draw_list = false;
+    wdmAddNode("Entity/parallel_draw", &m_parallel_draw);
+    wdmAddNode("Entity/sort_draw_list", &m_sort_draw_list);
 }
 
 EntityModule::~EntityModule()
 {
+    wdmEraseNode("Entity");
     finalize();
+    for(uint32 i=0; i<m_cbuffers.size(); ++i) { istDelete(m_cbuffers[i]); }
+    m_cbuffers.clear();
+    for(uint32 i=0; i<m_dlists.size(); ++i) { istDelete(m_dlists[i]); }
+    m_dlists.clear();
+    istSafeDelete(m_dlist_merged);
 }
 
 void EntityModule::initialize()
@@ -106,7 +148,19 @@ void EntityModule::finalize()
     }
     entities.clear();
     m_vacants.clear();
+    m_vacant_head = 0;
+    m_dead.clear();
+    m_dead_prev.clear();
+    m_slot_handles.clear();
+    m_generations.clear();
+    m_dense.clear();
+    m_dense_index.clear();
     m_all.clear();
+    m_components.clear();
+    m_routines.clear();
+    m_hierarchy.clear();
+    m_spatial.clear();
+    if(MessageRouter *router=atmGetMessageRouter()) { router->clear(); }
 }
 
 void EntityModule::frameBegin()
@@ -115,22 +169,36 @@ void EntityModule::frameBegin()
 
 void EntityModule::update( float32 dt )
 {
-    // update
-    for(uint32 i=0; i<m_all.size(); ++i) {
-        if(IEntity *entity = getEntity(m_all[i])) {
-            entity->update(dt);
-        }
-        else {
-            m_all[i] = 0;
-        }
+    // 前フレームの update 以降に送られたメッセージ (弾のダメージなど) を receiver 毎にまとめて渡す
+    if(MessageRouter *router=atmGetMessageRouter()) { router->deliver(); }
+
+    // 近くの Entity の検索用の索引。sync update 中に参照されるのはこの時点の位置
+    if(!m_all.empty()) {
+        m_spatial.build(&m_all[0], (uint32)m_all.size(), &m_entities[0], (uint32)m_entities.size());
     }
 
+    // RoutineProgram で動く Entity を一括で動かす。各 Entity は update() でその位置を受け取る
+    updateRoutines(dt);
+
+    // update
+    updateEntities(m_all, dt);
+
     // erase invalid handles
     m_all.erase(stl::remove(m_all.begin(), m_all.end(), 0), m_all.end());
 
-    m_vacants.insert(m_vacants.end(), m_dead_prev.begin(), m_dead_prev.end());
-    m_dead_prev = m_dead;
-    m_dead.clear();
+    recycleSlots();
+
+    // 親を持つ Entity の world 行列を親から順に確定させる
+    if(!m_all.empty()) {
+        m_hierarchy.update(&m_all[0], (uint32)m_all.size(), &m_entities[0], (uint32)m_entities.size());
+    }
+    // asyncupdate 用に sync update 後の位置で作り直す
+    if(!m_all.empty()) {
+        m_spatial.build(&m_all[0], (uint32)m_all.size(), &m_entities[0], (uint32)m_entities.size());
+    }
+    else {
+        m_spatial.clear();
+    }
 
 
     // asyncupdate
@@ -145,6 +213,77 @@ void EntityModule::update( float32 dt )
             }
         });
     atmDbgUnlockSyncMethods();
+
+    // コンポーネントのシステムを一括更新
+    m_components.update(dt);
+}
+
+void EntityModule::updateEntities(Handles &handles, float32 dt)
+{
+    // canUpdateInParallel() な Entity が連続する区間はまとめて並列に更新する。
+    // update() 中に作られた Entity も同じフレームで更新するため、handles.size() は毎回見る
+    for(uint32 i=0; i<handles.size(); ) {
+        IEntity *entity = getEntity(handles[i]);
+        if(!entity) {
+            handles[i] = 0;
+            ++i;
+        }
+        else if(!m_parallel_update || !entity->canUpdateInParallel()) {
+            entity->update(dt);
+            ++i;
+        }
+        else {
+            uint32 last = i+1;
+            while(last<handles.size()) {
+                IEntity *e = getEntity(handles[last]);
+                if(!e || !e->canUpdateInParallel()) { break; }
+                ++last;
+            }
+            updateEntitiesParallel(handles, i, last, dt);
+            i = last;
+        }
+    }
+}
+
+void EntityModule::updateEntitiesParallel(Handles &handles, uint32 first, uint32 last, float32 dt)
+{
+    // 区間内の生成/削除などはブロック毎の EntityCommandBuffer に積み、区間の更新が全部終わってからブロック順に適用する。
+    // ブロックの分け方は固定なので、結果はスレッドの実行順に依存しない
+    uint32 num_blocks = ceildiv(last-first, UpdateBlockSize);
+    while(m_cbuffers.size() < num_blocks) { m_cbuffers.push_back(istNew(EntityCommandBuffer)()); }
+
+    atmDbgLockSyncMethods();
+    ist::parallel_for(uint32(0), num_blocks,
+        [&](uint32 bi) {
+            // update() 内で parallel_for が使われると、このスレッドで別のブロックが処理されうるので戻せるようにしておく
+            EntityCommandBuffer *prev = EntityCommandBuffer::getCurrent();
+            EntityCommandBuffer::setCurrent(m_cbuffers[bi]);
+            uint32 b = first + bi*UpdateBlockSize;
+            uint32 e = stl::min<uint32>(b+UpdateBlockSize, last);
+            for(uint32 i=b; i<e; ++i) {
+                getEntity(handles[i])->update(dt);
+            }
+            EntityCommandBuffer::setCurrent(prev);
+        });
+    atmDbgUnlockSyncMethods();
+
+    for(uint32 bi=0; bi<num_blocks; ++bi) {
+        m_cbuffers[bi]->flush();
+    }
+}
+
+void EntityModule::updateRoutines(float32 dt)
+{
+    if(m_routines.getNumEntities()==0) { return; }
+    const EntitySpatialIndex::Category &players = m_spatial.getCategory(ECA_Player);
+    m_routine_targets.clear();
+    for(size_t i=0; i<players.handles.size(); ++i) {
+        if(EntityGetClassID(players.handles[i])==EC_Player) {
+            m_routine_targets.push_back(vec3(players.positions[i]));
+        }
+    }
+    m_routines.update(dt, m_routine_targets.empty() ? nullptr : &m_routine_targets[0], (uint32)m_routine_targets.size());
+    m_routines.flushShots();
 }
 
 void EntityModule::asyncupdate(float32 dt)
@@ -153,10 +292,57 @@ void EntityModule::asyncupdate(float32 dt)
 
 void EntityModule::draw()
 {
-    uint32 s = m_entities.size();
+    uint32 num_blocks = 0;
+    if(m_parallel_draw) {
+        num_blocks = drawEntitiesParallel();
+        flushDrawLists(num_blocks);
+    }
+    // 並列にできないものは逐次に直接 pass へ
+    uint32 s = m_dense.size();
     for(uint32 k=0; k<s; ++k) {
-        IEntity *entity = m_entities[k];
-        if(entity) { entity->draw(); }
+        IEntity *entity = m_dense[k];
+        if(num_blocks==0 || !entity->canDrawInParallel()) { entity->draw(); }
+    }
+}
+
+uint32 EntityModule::drawEntitiesParallel()
+{
+    // ブロックの分け方は固定なので、pass に渡る順序はスレッドの実行順に依存しない
+    uint32 s = m_dense.size();
+    uint32 num_blocks = ceildiv(s, DrawBlockSize);
+    while(m_dlists.size() < num_blocks) { m_dlists.push_back(istNew(DrawList)()); }
+
+    atmDbgLockSyncMethods();
+    ist::parallel_for(uint32(0), num_blocks,
+        [&](uint32 bi) {
+            DrawList *prev = DrawList::getCurrent();
+            DrawList::setCurrent(m_dlists[bi]);
+            uint32 b = bi*DrawBlockSize;
+            uint32 e = stl::min<uint32>(b+DrawBlockSize, s);
+            for(uint32 i=b; i<e; ++i) {
+                IEntity *entity = m_dense[i];
+                if(entity->canDrawInParallel()) { entity->draw(); }
+            }
+            DrawList::setCurrent(prev);
+        });
+    atmDbgUnlockSyncMethods();
+    return num_blocks;
+}
+
+void EntityModule::flushDrawLists(uint32 num_blocks)
+{
+    if(m_sort_draw_list) {
+        for(uint32 bi=0; bi<num_blocks; ++bi) {
+            m_dlist_merged->append(*m_dlists[bi]);
+            m_dlists[bi]->clear();
+        }
+        m_dlist_merged->sortByPSet();
+        m_dlist_merged->flush();
+    }
+    else {
+        for(uint32 bi=0; bi<num_blocks; ++bi) {
+            m_dlists[bi]->flush();
+        }
     }
 }
 
@@ -167,49 +353,92 @@ void EntityModule::frameEnd()
 
 IEntity* EntityModule::getEntity( EntityHandle h )
 {
-    if(h==0) { return nullptr; }
-    uint32 cid = EntityGetClassID(h);
-    uint32 iid = EntityGetIndex(h);
-
-    Entities &entities = m_entities;
-    if(iid >= entities.size()) {
-        return nullptr;
-    }
-    return entities[iid];
+    if(!isValidHandle(h)) { return nullptr; }
+    return m_entities[EntityGetIndex(h)];
 }
 
 void EntityModule::deleteEntity( EntityHandle h )
 {
+    // 並列 update 中は後でまとめて削除する
+    if(EntityCommandBuffer *cb=EntityCommandBuffer::getCurrent()) {
+        cb->deleteEntity(h);
+        return;
+    }
     atmDbgAssertSyncLock();
-    uint32 cid = EntityGetClassID(h);
+    // 既に削除されたものや slot が再利用された後の古い handle は無視
+    if(!isValidHandle(h)) { return; }
     uint32 iid = EntityGetIndex(h);
     Entities &entities = m_entities;
-    Handles &vacants = m_vacants;
-    if(iid < entities.size()) {
-        if(IEntity *&e = entities[iid]) {
-            e->finalize();
-            istSafeRelease(entities[iid]);
-            m_dead.push_back(EntityGetIndex(h));
-        }
+    if(IEntity *&e = entities[iid]) {
+        e->finalize();
+        // m_dense は末尾のものを空いた所に移して詰める
+        uint32 di = m_dense_index[iid];
+        IEntity *last = m_dense.back();
+        m_dense[di] = last;
+        m_dense_index[EntityGetIndex(last->getHandle())] = di;
+        m_dense.pop_back();
+        m_dense_index[iid] = InvalidIndex;
+        istSafeRelease(entities[iid]);
     }
+    m_hierarchy.onDelete(h);
+    // コンポーネントだけの Entity もここで slot を解放する
+    m_components.detach(h);
+    m_routines.detach(h);
+    m_slot_handles[iid] = 0;
+    m_generations[iid] = (m_generations[iid]+1) % EntityMaxGeneration;
+    m_dead.push_back(iid);
 }
 
-void EntityModule::generateHandle(EntityClassID classid)
+bool EntityModule::generateHandle(EntityClassID classid)
 {
     atmDbgAssertSyncLock();
     Entities &entities = m_entities;
     Handles &vacant = m_vacants;
-    EntityHandle h = 0;
-    if(!vacant.empty()) {
-        h = vacant.back();
-        vacant.pop_back();
+    uint32 iid = 0;
+    if(m_vacant_head < vacant.size()) {
+        iid = vacant[m_vacant_head++];
+        if(m_vacant_head==vacant.size()) {
+            vacant.clear();
+            m_vacant_head = 0;
+        }
     }
     else {
-        h = entities.size();
+        iid = entities.size();
+        if(iid >= EntityMaxIndex) {
+            // index が世代の bit にはみ出すと古い handle と区別できなくなるので、作らずに失敗させる
+            istPrint("EntityModule::generateHandle(): too many entities (max %u)\n", EntityMaxIndex);
+            m_tmp_handle = 0;
+            return false;
+        }
         entities.push_back(nullptr); // reserve
+        m_slot_handles.push_back(0);
+        m_generations.push_back(0);
+        m_dense_index.push_back(InvalidIndex);
     }
-    h = EntityCreateHandle(classid, h);
+    EntityHandle h = EntityCreateHandle(classid, iid, m_generations[iid]);
+    m_slot_handles[iid] = h;
     m_tmp_handle = h;
+    return true;
+}
+
+void EntityModule::registerEntity(IEntity *e)
+{
+    uint32 iid = EntityGetIndex(e->getHandle());
+    m_entities[iid] = e;
+    m_dense_index[iid] = m_dense.size();
+    m_dense.push_back(e);
+}
+
+void EntityModule::recycleSlots()
+{
+    // 使用済みの先頭部分が大きくなったら詰める
+    if(m_vacant_head>=256 && m_vacant_head*2>=m_vacants.size()) {
+        m_vacants.erase(m_vacants.begin(), m_vacants.begin()+m_vacant_head);
+        m_vacant_head = 0;
+    }
+    m_vacants.insert(m_vacants.end(), m_dead_prev.begin(), m_dead_prev.end());
+    m_dead_prev = m_dead;
+    m_dead.clear();
 }
 
 EntityHandle EntityModule::getGeneratedHandle()
@@ -219,16 +448,24 @@ EntityHandle EntityModule::getGeneratedHandle()
 
 IEntity* EntityModule::createEntity( EntityClassID classid )
 {
-    generateHandle(classid);
+    if(!generateHandle(classid)) { return nullptr; }
     IEntity *e = CreateEntity(classid);
     if(e) {
-        m_entities[EntityGetIndex(e->getHandle())] = e;
+        registerEntity(e);
         m_all.push_back(e->getHandle());
         e->initialize();
     }
     return e;
 }
 
+EntityHandle EntityModule::createComponentEntity(EntityClassID classid, uint32 component_flags)
+{
+    if(!generateHandle(classid)) { return 0; }
+    EntityHandle h = getGeneratedHandle();
+    m_components.attach(h, component_flags);
+    return h;
+}
+
 
 void EntityModule::handleStateQuery( EntitiesQueryContext &ctx )
 {
@@ -286,4 +523,1128 @@ void EntityModule::handleStateQuery( EntitiesQueryContext &ctx )
 }
 
 
+#ifdef atm_enable_Benchmark
+
+void EntityModule::dbgBenchmarkComponents()
+{
+    // 移動 + transform 更新を、個別に new した Entity の仮想関数で行う場合 (従来の IEntity 相当) と
+    // EntityComponentStore のシステムで一括処理する場合で比較
+    class LegacyEntity
+    {
+    public:
+        vec3 pos;
+        vec3 vel;
+        mat4 trans;
+        char others[768]; // 他の attribute の分。実際の Entity と同程度の大きさにする
+
+        virtual ~LegacyEntity() {}
+        virtual void asyncupdate(float32 dt)
+        {
+            pos += vel*dt;
+            trans = glm::translate(mat4(), pos);
+        }
+    };
+    const uint32 entity_counts[] = {1000, 10000, 100000};
+    const uint32 num_frames = 60;
+    const float32 dt = 1.0f;
+
+    for(uint32 ci=0; ci<_countof(entity_counts); ++ci) {
+        uint32 num_entities = entity_counts[ci];
+        SFMT rand;
+        rand.initialize(0);
+
+        stl::vector<LegacyEntity*> legacy;
+        EntityComponentStore store;
+        for(uint32 i=0; i<num_entities; ++i) {
+            vec3 pos = vec3(rand.genFloat32()-0.5f, rand.genFloat32()-0.5f, 0.0f) * 3.0f;
+            vec3 vel = vec3(rand.genFloat32()-0.5f, rand.genFloat32()-0.5f, 0.0f) * 0.01f;
+            LegacyEntity *e = istNew(LegacyEntity)();
+            e->pos = pos;
+            e->vel = vel;
+            legacy.push_back(e);
+            uint32 d = store.attach(EntityCreateHandle(EC_Enemy_Test, i+1), ECF_Position|ECF_Velocity|ECF_Transform);
+            store.getPosition(d) = vec4(pos, 1.0f);
+            store.getVelocity(d) = vec4(vel, 0.0f);
+        }
+        // 生成と削除を繰り返した後のヒープを想定し、巡回順をメモリ上の並びとばらばらにする
+        stl::vector<uint32> order(num_entities);
+        for(uint32 i=0; i<num_entities; ++i) { order[i]=i; }
+        for(uint32 i=num_entities-1; i>0; --i) { stl::swap(order[i], order[rand.genInt32()%(i+1)]); }
+        stl::vector<LegacyEntity*> shuffled(num_entities);
+        for(uint32 i=0; i<num_entities; ++i) { shuffled[i]=legacy[order[i]]; }
+
+        ist::Timer timer;
+        for(uint32 f=0; f<num_frames; ++f) {
+            ist::parallel_for(
+                ist::size_range(size_t(0), shuffled.size(), 32),
+                [&](const ist::size_range &r) {
+                    for(size_t i=r.begin(); i!=r.end(); ++i) {
+                        shuffled[i]->asyncupdate(dt);
+                    }
+                });
+        }
+        float32 t_legacy = timer.getElapsedMillisec();
+
+        timer.reset();
+        for(uint32 f=0; f<num_frames; ++f) {
+            store.integrate(dt);
+            store.updateTransforms();
+        }
+        float32 t_store = timer.getElapsedMillisec();
+
+        for(uint32 i=0; i<num_entities; ++i) {
+            istAssert(glm::length(vec3(store.getTransform(i)[3])-vec3(legacy[i]->trans[3])) < 0.0001f);
+            istDelete(legacy[i]);
+        }
+        istPrint("%u entities, %u frames: virtual %.2fms, components %.2fms\n",
+            num_entities, num_frames, t_legacy, t_store);
+    }
+}
+
+
+// 以前の switch + super の call() の連鎖による実装。比較用
+#define dbgLegacyECallBlock(...) \
+    virtual bool call(FunctionID fid, const void *args, void *ret)\
+    {\
+        typedef std::remove_reference<decltype(*this)>::type this_t;\
+        __VA_ARGS__\
+        return false;\
+    }
+#define dbgLegacyMethodBlock(...)   switch(fid) { __VA_ARGS__ }
+#define dbgLegacyECall(funcname)    case FID_##funcname: ist::BinaryCall(&this_t::funcname, *this, ret, args); return true;
+#define dbgLegacyECallSuper(classname) if(this->classname::call(fid, args, ret)) { return true; }
+
+// Entity の典型的な構成 (transform, model, life) を真似たもの
+#define dbgDefineECallEntity(Prefix, ECallBlock, MethodBlock, ECall, ECallSuper)\
+    class Prefix##Transform\
+    {\
+    public:\
+        vec3 m_pos;\
+        mat4 m_trans;\
+        ECallBlock(MethodBlock(\
+            ECall(getPosition) ECall(setPosition) ECall(move)\
+            ECall(getTransformMatrix) ECall(setTransformMatrix) ECall(updateTransformMatrix)))\
+        const vec3& getPosition() const         { return m_pos; }\
+        void setPosition(const vec3 &v)         { m_pos=v; }\
+        void move(const vec3 &v)                { m_pos+=v; }\
+        const mat4& getTransformMatrix() const  { return m_trans; }\
+        void setTransformMatrix(const mat4 &v)  { m_trans=v; }\
+        void updateTransformMatrix()            { m_trans=glm::translate(mat4(), m_pos); }\
+    };\
+    class Prefix##Model\
+    {\
+    public:\
+        vec4 m_diffuse, m_glow;\
+        ECallBlock(MethodBlock(\
+            ECall(getDiffuseColor) ECall(setDiffuseColor) ECall(getGlowColor) ECall(setGlowColor)))\
+        const vec4& getDiffuseColor() const { return m_diffuse; }\
+        void setDiffuseColor(const vec4 &v) { m_diffuse=v; }\
+        const vec4& getGlowColor() const    { return m_glow; }\
+        void setGlowColor(const vec4 &v)    { m_glow=v; }\
+    };\
+    class Prefix##Life\
+    {\
+    public:\
+        float32 m_life;\
+        ECallBlock(MethodBlock(ECall(getLife) ECall(setLife) ECall(damage)))\
+        float32 getLife() const     { return m_life; }\
+        void setLife(float32 v)     { m_life=v; }\
+        void damage(float32 d)      { m_life-=d; }\
+    };\
+    class Prefix##Entity : public IEntity, public Prefix##Life, public Prefix##Model, public Prefix##Transform\
+    {\
+    public:\
+        ECallBlock(\
+            ECallSuper(IEntity)\
+            ECallSuper(Prefix##Life)\
+            ECallSuper(Prefix##Model)\
+            ECallSuper(Prefix##Transform))\
+    };
+
+dbgDefineECallEntity(DbgECallTable,  atmECallBlock, atmMethodBlock, atmECall, atmECallSuper)
+dbgDefineECallEntity(DbgECallLegacy, dbgLegacyECallBlock, dbgLegacyMethodBlock, dbgLegacyECall, dbgLegacyECallSuper)
+
+void EntityModule::dbgBenchmarkECall()
+{
+    // よく使われるクエリ毎に、表による call() と以前の switch + super の連鎖による call() の秒間呼び出し回数を比較。
+    // atmGetPosition/atmGetTransformMatrix は表の型付きの呼び出しと、以前の call() (IEntity の既定の実装) の比較になる
+    const uint32 num_entities = 1024;
+    const uint32 num_loops = 1000;
+
+    stl::vector<IEntity*> entities[2];
+    for(uint32 i=0; i<num_entities; ++i) {
+        DbgECallTableEntity *t = istNew(DbgECallTableEntity)();
+        DbgECallLegacyEntity *l = istNew(DbgECallLegacyEntity)();
+        t->m_pos = l->m_pos = vec3(float32(i), 0.0f, 0.0f);
+        t->m_life = l->m_life = 1000.0f;
+        t->updateTransformMatrix();
+        l->updateTransformMatrix();
+        entities[0].push_back(t);
+        entities[1].push_back(l);
+    }
+
+    const char *names[] = {"getLife", "getPosition", "getTransformMatrix", "damage", "miss", "atmGetPosition", "atmGetTransformMatrix"};
+    for(uint32 qi=0; qi<_countof(names); ++qi) {
+        float32 elapsed[2];
+        vec3 pos_sum[2];
+        float32 life_sum[2];
+        for(uint32 wi=0; wi<2; ++wi) {
+            vec3 pos_total;
+            float32 life_total = 0.0f;
+            stl::vector<IEntity*> &cont = entities[wi];
+            ist::Timer timer;
+            for(uint32 li=0; li<num_loops; ++li) {
+                for(uint32 i=0; i<num_entities; ++i) {
+                    IEntity *e = cont[i];
+                    switch(qi) {
+                    case 0: { float32 v; atmQuery(e, getLife, v); life_total+=v; } break;
+                    case 1: { vec3 v; atmQuery(e, getPosition, v); pos_total+=v; } break;
+                    case 2: { mat4 v; atmQuery(e, getTransformMatrix, v); pos_total+=vec3(v[3]); } break;
+                    case 3: { atmCall(e, damage, 0.001f); } break;
+                    case 4: { EntityHandle v; if(atmQuery(e, getParent, v)) { life_total+=1.0f; } } break;
+                    case 5: { pos_total+=atmGetPosition(e); } break;
+                    case 6: { pos_total+=vec3(atmGetTransformMatrix(e)[3]); } break;
+                    }
+                }
+            }
+            elapsed[wi] = timer.getElapsedMillisec();
+            pos_sum[wi] = pos_total;
+            life_sum[wi] = life_total;
+        }
+        istAssert(pos_sum[0]==pos_sum[1] && life_sum[0]==life_sum[1]);
+        float32 num_calls = float32(num_entities*num_loops);
+        istPrint("%s: table %.2fM calls/s, switch %.2fM calls/s\n", names[qi],
+            num_calls/elapsed[0]/1000.0f, num_calls/elapsed[1]/1000.0f);
+    }
+    for(uint32 wi=0; wi<2; ++wi) {
+        for(uint32 i=0; i<num_entities; ++i) { istDelete(entities[wi][i]); }
+    }
+}
+
+
+class DbgHierarchyEntity : public IEntity, public TAttr_TransformMatrixI< TAttr_HaveParent<Attr_Transform> >
+{
+typedef IEntity super;
+public:
+    typedef TAttr_TransformMatrixI< TAttr_HaveParent<Attr_Transform> > transform;
+    atmECallBlock(
+        atmECallSuper(transform)
+    )
+};
+
+void EntityModule::dbgBenchmarkTransformHierarchy()
+{
+    // 鎖状の親子関係を持つ Entity の world 行列の更新を、以前の方式 (各 Entity が自分の update() で親に問い合わせる) と
+    // EntityTransformHierarchy で比較。以前の方式は handle 順に更新するため、子が親より先に来ると 1 フレーム遅れる。
+    // 誤差は最後のフレームの正しい行列 (根から順に掛けたもの) と位置の差の最大値
+    if(!atmGetWorld() || atmGetEntityModule()!=this) {
+        istPrint("dbgBenchmarkTransformHierarchy(): world required\n");
+        return;
+    }
+    const uint32 num_nodes = 4096;
+    const uint32 depths[] = {1, 2, 4, 8, 16};
+    const uint32 num_frames = 60;
+
+    EntityTransformHierarchy hierarchy;
+    for(uint32 di=0; di<_countof(depths); ++di) {
+        const uint32 depth = depths[di];
+        const uint32 chain_len = depth+1;
+        const uint32 num_chains = num_nodes/chain_len;
+
+        stl::vector<DbgHierarchyEntity*> entities;
+        stl::vector<EntityHandle> handles;
+        for(uint32 i=0; i<num_chains*chain_len; ++i) {
+            generateHandle(EC_Unknown);
+            DbgHierarchyEntity *e = istNew(DbgHierarchyEntity)();
+            registerEntity(e);
+            entities.push_back(e);
+            handles.push_back(e->getHandle());
+        }
+        // 子が親より先に並ぶよう、j+1 番目を j 番目の親にする (末尾が根)
+        for(uint32 ci=0; ci<num_chains; ++ci) {
+            DbgHierarchyEntity **chain = &entities[ci*chain_len];
+            for(uint32 j=0; j<depth; ++j) {
+                chain[j]->setParent(chain[j+1]->getHandle());
+                chain[j]->setPosition(vec3(0.2f, 0.0f, 0.0f));
+            }
+            chain[depth]->setPosition(vec3(float32(ci)*0.01f, 0.0f, 0.0f));
+        }
+
+        auto animate = [&](uint32 frame) {
+            for(uint32 i=0; i<entities.size(); ++i) {
+                entities[i]->setRotate(float32(frame)*3.0f + float32(i%chain_len)*10.0f);
+            }
+        };
+        auto compute_error = [&]() -> float32 {
+            float32 err = 0.0f;
+            for(uint32 ci=0; ci<num_chains; ++ci) {
+                DbgHierarchyEntity **chain = &entities[ci*chain_len];
+                mat4 ref = chain[depth]->computeLocalTransformMatrix();
+                for(uint32 j=depth; j>0; --j) {
+                    ref = ref * chain[j-1]->computeLocalTransformMatrix();
+                    err = stl::max<float32>(err, glm::length(vec3(ref[3])-vec3(chain[j-1]->getTransformMatrix()[3])));
+                }
+            }
+            return err;
+        };
+
+        const char *scenarios[] = {"moving", "static"};
+        for(uint32 si=0; si<_countof(scenarios); ++si) {
+            bool moving = si==0;
+
+            ist::Timer timer;
+            for(uint32 f=0; f<num_frames; ++f) {
+                if(moving || f==0) { animate(f); }
+                for(uint32 i=0; i<entities.size(); ++i) {
+                    DbgHierarchyEntity *e = entities[i];
+                    if(e->getParent()==0) {
+                        e->updateTransformMatrix();
+                    }
+                    else {
+                        mat4 pmat;
+                        atmQuery(e->getParent(), getTransformMatrix, pmat);
+                        e->setTransformMatrix(pmat * e->computeLocalTransformMatrix());
+                    }
+                }
+            }
+            float32 t_old = timer.getElapsedMillisec();
+            float32 err_old = compute_error();
+
+            hierarchy.rebuild(&handles[0], (uint32)handles.size(), &m_entities[0], (uint32)m_entities.size());
+            timer.reset();
+            for(uint32 f=0; f<num_frames; ++f) {
+                if(moving || f==0) { animate(f); }
+                for(uint32 ci=0; ci<num_chains; ++ci) {
+                    entities[ci*chain_len+depth]->updateTransformMatrix();
+                }
+                hierarchy.updateTransforms();
+            }
+            float32 t_new = timer.getElapsedMillisec();
+            float32 err_new = compute_error();
+
+            istPrint("depth %u, %u nodes, %s: query %.2fms (error %.4f), hierarchy %.2fms (error %.4f, %u updated in last frame)\n",
+                depth, hierarchy.getNumNodes(), scenarios[si], t_old, err_old, t_new, err_new, hierarchy.getNumUpdated());
+        }
+
+        for(uint32 i=0; i<handles.size(); ++i) {
+            deleteEntity(handles[i]);
+        }
+    }
+}
+
+
+class DbgSpatialEntity : public IEntity, public Attr_Position
+{
+typedef IEntity super;
+public:
+    atmECallBlock(
+        atmECallSuper(Attr_Position)
+    )
+};
+
+void EntityModule::dbgBenchmarkSpatialIndex()
+{
+    // 10k の敵がそれぞれ最寄りの player を探す (HomingPlayer など) のを、全 Entity の走査 (以前の GetNearestPlayerPosition()) と
+    // EntitySpatialIndex で比較。敵同士の k-nearest と半径検索もついでに測る
+    if(!atmGetWorld() || atmGetEntityModule()!=this) {
+        istPrint("dbgBenchmarkSpatialIndex(): world required\n");
+        return;
+    }
+    const uint32 num_enemies = 10000;
+    const uint32 num_players = 4;
+    const uint32 k = 8;
+    const float32 radius = 0.3f;
+
+    SFMT rand;
+    rand.initialize(0);
+    stl::vector<EntityHandle> handles;
+    auto create = [&](EntityClassID cid) {
+        generateHandle(cid);
+        DbgSpatialEntity *e = istNew(DbgSpatialEntity)();
+        e->setPosition(vec3(rand.genFloat32()-0.5f, rand.genFloat32()-0.5f, 0.0f) * vec3(6.0f, 4.0f, 0.0f));
+        registerEntity(e);
+        handles.push_back(e->getHandle());
+    };
+    for(uint32 i=0; i<num_enemies; ++i) {
+        create(EC_Enemy_Test);
+        if(i%(num_enemies/num_players)==0) { create(EC_Player); }
+    }
+    uint32 num_entities = (uint32)handles.size();
+    stl::vector<vec3> queries;
+    each(handles, [&](EntityHandle h){
+        if(EntityGetClassID(h)==EC_Enemy_Test) {
+            vec3 pos; atmQuery(getEntity(h), getPosition, pos);
+            queries.push_back(pos);
+        }
+    });
+
+    ist::Timer timer;
+    stl::vector<vec3> nearest_scan(queries.size());
+    for(uint32 qi=0; qi<queries.size(); ++qi) {
+        float32 best = FLT_MAX;
+        for(uint32 i=0; i<num_entities; ++i) {
+            EntityHandle h = handles[i];
+            if(EntityGetClassID(h)!=EC_Player) { continue; }
+            vec3 pos; atmQuery(getEntity(h), getPosition, pos);
+            float32 d2 = glm::dot(pos-queries[qi], pos-queries[qi]);
+            if(d2<best) { best=d2; nearest_scan[qi]=pos; }
+        }
+    }
+    float32 t_scan = timer.getElapsedMillisec();
+
+    EntitySpatialIndex index;
+    timer.reset();
+    index.build(&handles[0], num_entities, &m_entities[0], (uint32)m_entities.size());
+    float32 t_build = timer.getElapsedMillisec();
+
+    timer.reset();
+    uint32 num_mismatch = 0;
+    for(uint32 qi=0; qi<queries.size(); ++qi) {
+        EntitySpatialIndex::Result r;
+        index.findNearest(ECA_Player, queries[qi], r, EC_Player);
+        if(r.pos!=nearest_scan[qi]) { ++num_mismatch; }
+    }
+    float32 t_nearest = timer.getElapsedMillisec();
+
+    timer.reset();
+    uint32 num_knn = 0;
+    for(uint32 qi=0; qi<queries.size(); ++qi) {
+        EntitySpatialIndex::Result r[k];
+        num_knn += index.findKNearest(ECA_Enemy, queries[qi], k, r);
+    }
+    float32 t_knn = timer.getElapsedMillisec();
+
+    timer.reset();
+    uint32 num_in_radius = 0;
+    EntitySpatialIndex::ResultCont results;
+    for(uint32 qi=0; qi<queries.size(); ++qi) {
+        results.clear();
+        num_in_radius += index.findInRadius(ECA_Enemy, queries[qi], radius, results);
+    }
+    float32 t_radius = timer.getElapsedMillisec();
+
+    istPrint("%u enemies, %u players: nearest player by scan %.2fms, index build %.2fms + nearest %.2fms (%u mismatches)\n",
+        num_enemies, num_players, t_scan, t_build, t_nearest, num_mismatch);
+    istPrint("  %u-nearest enemies %.2fms (%u found), radius %.2f %.2fms (%u found)\n",
+        k, t_knn, num_knn, radius, t_radius, num_in_radius);
+    istAssert(num_mismatch==0);
+
+    for(uint32 i=0; i<num_entities; ++i) {
+        deleteEntity(handles[i]);
+    }
+}
+
+
+class DbgParallelEntity : public IEntity, public Attr_Position
+{
+typedef IEntity super;
+public:
+    EntityHandle m_target;
+    uint32 m_frame;
+    uint32 *m_num_deferred;
+
+    atmECallBlock(
+        atmECallSuper(Attr_Position)
+    )
+
+    DbgParallelEntity() : m_target(0), m_frame(0), m_num_deferred(nullptr) {}
+    bool canUpdateInParallel() const override { return true; }
+
+    void update(float32 dt) override
+    {
+        // Routine 程度の計算をして、時々他の Entity を動かす
+        ++m_frame;
+        vec3 pos = getPosition();
+        vec3 acc;
+        for(uint32 i=0; i<64; ++i) {
+            float32 a = float32(i)*0.1f + pos.x*10.0f;
+            acc += vec3(std::sin(a), std::cos(a), 0.0f)*0.001f;
+        }
+        setPosition(pos + acc*0.01f);
+        if(m_frame%4==0) {
+            vec3 d = acc*0.005f;
+            if(EntityCommandBuffer *cb=EntityCommandBuffer::getCurrent()) {
+                cb->call(m_target, FID_move, d);
+            }
+            else {
+                atmCall(m_target, move, d);
+            }
+        }
+        if(m_frame%16==0) {
+            uint32 *n = m_num_deferred;
+            DeferIfParallel([=](){ ++*n; });
+        }
+    }
+};
+
+void EntityModule::dbgBenchmarkParallelUpdate()
+{
+    // 敵が多いステージ相当の数の Entity の update() を、逐次と EntityCommandBuffer を使った並列とで比較。
+    // 並列の結果が実行毎に変わらないことも確認する
+    if(!atmGetWorld() || atmGetEntityModule()!=this) {
+        istPrint("dbgBenchmarkParallelUpdate(): world required\n");
+        return;
+    }
+    const uint32 num_entities = 20000;
+    const uint32 num_frames = 60;
+    const float32 dt = 1.0f;
+
+    SFMT rand;
+    rand.initialize(0);
+    uint32 num_deferred = 0;
+    Handles handles;
+    stl::vector<DbgParallelEntity*> entities;
+    stl::vector<vec3> initial_pos;
+    for(uint32 i=0; i<num_entities; ++i) {
+        generateHandle(EC_Enemy_Test);
+        DbgParallelEntity *e = istNew(DbgParallelEntity)();
+        registerEntity(e);
+        entities.push_back(e);
+        handles.push_back(e->getHandle());
+        initial_pos.push_back(vec3(rand.genFloat32()-0.5f, rand.genFloat32()-0.5f, 0.0f) * 3.0f);
+    }
+    for(uint32 i=0; i<num_entities; ++i) {
+        entities[i]->m_target = handles[rand.genInt32()%num_entities];
+        entities[i]->m_num_deferred = &num_deferred;
+    }
+
+    bool parallel_update = m_parallel_update;
+    auto run = [&](bool parallel, vec3 &checksum) -> float32 {
+        for(uint32 i=0; i<num_entities; ++i) {
+            entities[i]->setPosition(initial_pos[i]);
+            entities[i]->m_frame = 0;
+        }
+        num_deferred = 0;
+        m_parallel_update = parallel;
+        ist::Timer timer;
+        for(uint32 f=0; f<num_frames; ++f) {
+            updateEntities(handles, dt);
+        }
+        float32 t = timer.getElapsedMillisec();
+        checksum = vec3();
+        for(uint32 i=0; i<num_entities; ++i) { checksum += entities[i]->getPosition(); }
+        return t;
+    };
+    vec3 sum_serial, sum_parallel1, sum_parallel2;
+    float32 t_serial = run(false, sum_serial);
+    float32 t_parallel1 = run(true, sum_parallel1);
+    float32 t_parallel2 = run(true, sum_parallel2);
+    m_parallel_update = parallel_update;
+
+    bool deterministic = sum_parallel1==sum_parallel2;
+    istPrint("%u entities x %u frames: serial %.2fms, parallel %.2fms / %.2fms (%s, %u deferred funcs)\n",
+        num_entities, num_frames, t_serial, t_parallel1, t_parallel2,
+        deterministic ? "deterministic" : "NOT deterministic", num_deferred);
+    istAssert(deterministic);
+
+    for(uint32 i=0; i<num_entities; ++i) {
+        deleteEntity(handles[i]);
+    }
+}
+
+
+class DbgDamageEntity : public IEntity
+{
+typedef IEntity super;
+public:
+    uint32 m_count;
+    float32 m_total;
+
+    atmECallBlock(
+        atmMethodBlock(
+            atmECall(damage)
+            atmECall(eventDamageBatch)
+        )
+    )
+
+    DbgDamageEntity() : m_count(0), m_total(0.0f) {}
+    void damage(float32 d) { ++m_count; m_total+=d; }
+    void eventDamageBatch(const DamageMessage *m, uint32 num)
+    {
+        for(uint32 i=0; i<num; ++i) { damage(m[i].damage); }
+    }
+};
+
+void EntityModule::dbgBenchmarkMessages()
+{
+    // 1 フレームに数十万のダメージを、以前の方式 (一つ毎に atmCall()) と MessageStream (並列に送信してまとめて配送) で比較。
+    // 各 receiver が受け取った数が一致すること、MessageStream の結果が実行毎に変わらないことを確認する
+    if(!atmGetWorld() || atmGetEntityModule()!=this) {
+        istPrint("dbgBenchmarkMessages(): world required\n");
+        return;
+    }
+    const uint32 num_receivers = 10000;
+    const uint32 num_messages = 500000;
+    const uint32 block_size = 4096;
+
+    stl::vector<DbgDamageEntity*> entities;
+    stl::vector<EntityHandle> handles;
+    for(uint32 i=0; i<num_receivers; ++i) {
+        generateHandle(EC_Enemy_Test);
+        DbgDamageEntity *e = istNew(DbgDamageEntity)();
+        registerEntity(e);
+        entities.push_back(e);
+        handles.push_back(e->getHandle());
+    }
+    stl::vector<DamageMessage> messages(num_messages);
+    {
+        SFMT rand;
+        rand.initialize(0);
+        for(uint32 i=0; i<num_messages; ++i) {
+            DamageMessage &m = messages[i];
+            m.from = handles[rand.genInt32()%num_receivers];
+            m.to = handles[rand.genInt32()%num_receivers];
+            m.damage = rand.genFloat32();
+            m.attribute = 0;
+        }
+    }
+    auto reset = [&](){ each(entities, [](DbgDamageEntity *e){ e->m_count=0; e->m_total=0.0f; }); };
+
+    reset();
+    ist::Timer timer;
+    for(uint32 i=0; i<num_messages; ++i) {
+        atmCall(messages[i].to, damage, messages[i].damage);
+    }
+    float32 t_call = timer.getElapsedMillisec();
+    stl::vector<uint32> counts_call;
+    each(entities, [&](DbgDamageEntity *e){ counts_call.push_back(e->m_count); });
+
+    MessageStream<DamageMessage> stream;
+    float32 t_push = 0.0f, t_deliver = 0.0f;
+    float32 totals[2];
+    for(uint32 ri=0; ri<2; ++ri) {
+        reset();
+        timer.reset();
+        ist::parallel_for(uint32(0), ceildiv(num_messages, block_size),
+            [&](uint32 bi) {
+                uint32 first = bi*block_size;
+                uint32 last = stl::min<uint32>(first+block_size, num_messages);
+                for(uint32 i=first; i<last; ++i) { stream.push(messages[i]); }
+            });
+        t_push = timer.getElapsedMillisec();
+        timer.reset();
+        stream.deliver();
+        t_deliver = timer.getElapsedMillisec();
+        totals[ri] = 0.0f;
+        each(entities, [&](DbgDamageEntity *e){ totals[ri]+=e->m_total; });
+    }
+    uint32 num_mismatch = 0;
+    for(uint32 i=0; i<num_receivers; ++i) {
+        if(entities[i]->m_count!=counts_call[i]) { ++num_mismatch; }
+    }
+
+    istPrint("%u messages to %u receivers: atmCall() %.2fms, stream push %.2fms + deliver %.2fms (%u mismatches, %s)\n",
+        num_messages, num_receivers, t_call, t_push, t_deliver, num_mismatch,
+        totals[0]==totals[1] ? "deterministic" : "NOT deterministic");
+    istAssert(num_mismatch==0 && totals[0]==totals[1]);
+
+    for(uint32 i=0; i<num_receivers; ++i) {
+        deleteEntity(handles[i]);
+    }
+}
+
+
+class DbgHandleEntity : public IEntity
+{
+typedef IEntity super;
+};
+
+void EntityModule::dbgBenchmarkHandles()
+{
+    // handle の引き方を、以前の方式 (slot をそのまま引く) と世代付きの検証で比較。
+    // 生成/削除を繰り返した後、削除済みの handle が別の Entity を引いてしまわないことを確認する
+    if(!atmGetWorld() || atmGetEntityModule()!=this) {
+        istPrint("dbgBenchmarkHandles(): world required\n");
+        return;
+    }
+    const uint32 num_entities = 32768;
+    const uint32 num_frames = 60;
+    const uint32 num_churn = num_entities/20; // 1 フレームに生成/削除する数
+    const uint32 num_lookups = 1000000;
+
+    SFMT rand;
+    rand.initialize(0);
+    stl::vector<EntityHandle> live;
+    stl::vector<EntityHandle> dead;
+    auto create = [&](){
+        generateHandle(EC_Enemy_Test);
+        IEntity *e = istNew(DbgHandleEntity)();
+        registerEntity(e);
+        live.push_back(e->getHandle());
+    };
+    for(uint32 i=0; i<num_entities; ++i) { create(); }
+
+    ist::Timer timer;
+    for(uint32 fi=0; fi<num_frames; ++fi) {
+        for(uint32 i=0; i<num_churn; ++i) {
+            uint32 r = rand.genInt32() % live.size();
+            dead.push_back(live[r]);
+            deleteEntity(live[r]);
+            live[r] = live.back();
+            live.pop_back();
+        }
+        for(uint32 i=0; i<num_churn; ++i) { create(); }
+        recycleSlots();
+    }
+    float32 t_churn = timer.getElapsedMillisec();
+
+    // 1 割は削除済みの handle
+    stl::vector<EntityHandle> queries(num_lookups);
+    for(uint32 i=0; i<num_lookups; ++i) {
+        queries[i] = i%10==0 ? dead[rand.genInt32()%dead.size()] : live[rand.genInt32()%live.size()];
+    }
+    uint32 num_found_raw = 0, num_stale_raw = 0;
+    timer.reset();
+    for(uint32 i=0; i<num_lookups; ++i) {
+        uint32 iid = EntityGetIndex(queries[i]);
+        IEntity *e = iid<m_entities.size() ? m_entities[iid] : nullptr;
+        if(e) {
+            ++num_found_raw;
+            if(e->getHandle()!=queries[i]) { ++num_stale_raw; }
+        }
+    }
+    float32 t_raw = timer.getElapsedMillisec();
+    uint32 num_found = 0, num_stale = 0;
+    timer.reset();
+    for(uint32 i=0; i<num_lookups; ++i) {
+        if(IEntity *e=getEntity(queries[i])) {
+            ++num_found;
+            if(e->getHandle()!=queries[i]) { ++num_stale; }
+        }
+    }
+    float32 t_checked = timer.getElapsedMillisec();
+
+    istPrint("%u entities, %u frames x %u create/delete: %.2fms (%u slots, %u dense)\n",
+        num_entities, num_frames, num_churn, t_churn, (uint32)m_entities.size(), (uint32)m_dense.size());
+    istPrint("%u lookups: raw %.2fms (%u found, %u stale), checked %.2fms (%u found, %u stale)\n",
+        num_lookups, t_raw, num_found_raw, num_stale_raw, t_checked, num_found, num_stale);
+    istAssert(num_stale==0);
+
+    for(uint32 i=0; i<live.size(); ++i) {
+        deleteEntity(live[i]);
+    }
+}
+
+
+class DbgSpawnEntity : public IEntity
+{
+typedef IEntity super;
+public:
+    vec4 m_data[32]; // 小型の敵と同程度の大きさにする
+    DbgSpawnEntity() { istMemset(m_data, 0, sizeof(m_data)); }
+};
+
+class DbgPooledSpawnEntity : public DbgSpawnEntity
+{
+typedef DbgSpawnEntity super;
+istDefinePoolNewST(DbgPooledSpawnEntity);
+public:
+    static PoolT& dbgGetPool() { return getPool(); }
+};
+
+void EntityModule::dbgBenchmarkEntityPool()
+{
+    // 弾や小型の敵を想定し、毎フレーム大量に生成して数フレーム後に削除するのを繰り返す。
+    // istNew()/istDelete() と istDefinePoolNewST() によるプールで比較する
+    if(!atmGetWorld() || atmGetEntityModule()!=this) {
+        istPrint("dbgBenchmarkEntityPool(): world required\n");
+        return;
+    }
+    const uint32 num_frames = 300;
+    const uint32 num_spawn = 500; // 1 フレームに生成する数
+    const uint32 life = 20;       // 生存フレーム数は life/2 ~ life*3/2
+
+    auto run = [&](const std::function<IEntity* ()> &create) -> float32 {
+        SFMT rand;
+        rand.initialize(0);
+        stl::vector< stl::vector<EntityHandle> > expire(num_frames+life*2);
+        ist::Timer timer;
+        for(uint32 fi=0; fi<expire.size(); ++fi) {
+            for(uint32 i=0; fi<num_frames && i<num_spawn; ++i) {
+                generateHandle(EC_Enemy_Test);
+                IEntity *e = create();
+                registerEntity(e);
+                expire[fi + life/2 + rand.genInt32()%life].push_back(e->getHandle());
+            }
+            each(expire[fi], [&](EntityHandle h){ deleteEntity(h); });
+            expire[fi].clear();
+            recycleSlots();
+        }
+        return timer.getElapsedMillisec();
+    };
+
+    DbgPooledSpawnEntity::PoolT &pool = DbgPooledSpawnEntity::dbgGetPool();
+    pool.clear();
+    pool.resetStats();
+    float32 t_new = run([](){ return istNew(DbgSpawnEntity)(); });
+    float32 t_pool = run([](){ return istNew(DbgPooledSpawnEntity)(); });
+    const ist::PoolBase::Stats &st = pool.getStats();
+
+    istPrint("%u frames x %u spawns (%u bytes): istNew %.2fms, pool %.2fms\n",
+        num_frames, num_spawn, (uint32)sizeof(DbgPooledSpawnEntity), t_new, t_pool);
+    istPrint("  pool: allocated %u, reused %u, recycled %u, peak live %u\n",
+        (uint32)st.num_allocated, (uint32)st.num_reused, (uint32)st.num_recycled, (uint32)st.peak_live);
+    istAssert(st.num_live==0 && st.num_allocated==st.peak_live);
+    pool.clear();
+}
+
+
+class DbgDrawEntity : public IEntity
+{
+typedef IEntity super;
+public:
+    vec3 m_pos;
+    vec3 m_axis;
+    float32 m_angle;
+    PSET_RID m_psid;
+
+    bool canDrawInParallel() const override { return true; }
+    void draw() override
+    {
+        PSetInstance inst;
+        inst.diffuse = vec4(0.6f, 0.6f, 0.6f, 80.0f);
+        inst.glow = vec4(0.2f, 0.0f, 0.0f, 0.0f);
+        inst.flash = vec4();
+        inst.elapsed = m_angle;
+        inst.appear_radius = 10000.0f;
+        inst.transform = inst.rotate = glm::rotate(glm::translate(mat4(), m_pos), m_angle, m_axis);
+        atmGetFluidPass()->addParticles(m_psid, inst);
+        if(m_psid==PSET_SPHERE_BULLET) {
+            PointLight l;
+            l.setPosition(m_pos + vec3(0.0f, 0.0f, 0.1f));
+            l.setColor(vec4(1.0f, 0.4f, 0.2f, 1.0f));
+            l.setRadius(0.2f);
+            atmGetLightPass()->addLight(l);
+        }
+    }
+};
+
+void EntityModule::dbgBenchmarkDraw()
+{
+    // 描画要求の送信を、逐次 (1 つの DrawList に順に積む) と並列 (ブロック毎の DrawList に積んで繋げる) で比較。
+    // DrawList は pass に渡さず捨てるので GPU は関与しない。
+    // 並べ替えない場合の並列の結果が逐次と同じ順序になることを確認する
+    if(!atmGetWorld() || atmGetEntityModule()!=this || !atmGetRenderer()) {
+        istPrint("dbgBenchmarkDraw(): world and renderer required\n");
+        return;
+    }
+    const uint32 num_entities = 20000;
+    const uint32 num_frames = 30;
+    const PSET_RID psids[] = {PSET_CUBE_SMALL, PSET_CUBE_MEDIUM, PSET_SPHERE_SMALL, PSET_SPHERE_BULLET};
+
+    // 既存の Entity は対象外にするため、m_dense を差し替えておく
+    Entities dense;
+    dense.swap(m_dense);
+    SFMT rand;
+    rand.initialize(0);
+    for(uint32 i=0; i<num_entities; ++i) {
+        generateHandle(EC_Enemy_Test);
+        DbgDrawEntity *e = istNew(DbgDrawEntity)();
+        e->m_pos = vec3(rand.genFloat32()-0.5f, rand.genFloat32()-0.5f, 0.0f) * 3.0f;
+        e->m_axis = glm::normalize(vec3(rand.genFloat32(), rand.genFloat32(), rand.genFloat32()) + vec3(0.01f));
+        e->m_angle = rand.genFloat32()*360.0f;
+        e->m_psid = psids[rand.genInt32()%_countof(psids)];
+        registerEntity(e);
+    }
+
+    DrawList serial;
+    ist::Timer timer;
+    for(uint32 fi=0; fi<num_frames; ++fi) {
+        serial.clear();
+        DrawList::setCurrent(&serial);
+        for(uint32 i=0; i<m_dense.size(); ++i) { m_dense[i]->draw(); }
+        DrawList::setCurrent(nullptr);
+    }
+    float32 t_serial = timer.getElapsedMillisec() / num_frames;
+
+    float32 t_parallel = 0.0f, t_merge = 0.0f, t_sort = 0.0f;
+    uint32 num_mismatch = 0;
+    for(uint32 fi=0; fi<num_frames; ++fi) {
+        timer.reset();
+        uint32 num_blocks = drawEntitiesParallel();
+        t_parallel += timer.getElapsedMillisec();
+        timer.reset();
+        m_dlist_merged->clear();
+        for(uint32 bi=0; bi<num_blocks; ++bi) {
+            m_dlist_merged->append(*m_dlists[bi]);
+            m_dlists[bi]->clear();
+        }
+        t_merge += timer.getElapsedMillisec();
+        if(fi==0) {
+            const DrawList::PSetEntries &a = serial.getPSets();
+            const DrawList::PSetEntries &b = m_dlist_merged->getPSets();
+            num_mismatch = (uint32)stl::max(a.size(), b.size()) - (uint32)stl::min(a.size(), b.size());
+            for(uint32 i=0; i<stl::min(a.size(), b.size()); ++i) {
+                if(a[i].psid!=b[i].psid || a[i].inst.transform!=b[i].inst.transform) { ++num_mismatch; }
+            }
+        }
+        timer.reset();
+        m_dlist_merged->sortByPSet();
+        t_sort += timer.getElapsedMillisec();
+    }
+    t_parallel /= num_frames;
+    t_merge /= num_frames;
+    t_sort /= num_frames;
+
+    istPrint("%u entities (%u visible psets): serial %.2fms, parallel %.2fms + merge %.2fms + sort %.2fms (%u mismatches)\n",
+        num_entities, serial.getNumPSets(), t_serial, t_parallel, t_merge, t_sort, num_mismatch);
+    istAssert(num_mismatch==0);
+
+    serial.clear();
+    m_dlist_merged->clear();
+    while(!m_dense.empty()) {
+        deleteEntity(m_dense.back()->getHandle());
+    }
+    m_dense.swap(dense);
+}
+
+
+// 比較用: 従来の IRoutine と同じく敵毎のオブジェクトの仮想関数で、RoutineRunner の組み込みプログラムと同じ動きをするもの
+class DbgVirtualRoutine
+{
+public:
+    EntityHandle m_owner;
+    vec2 m_pos, m_vel, m_aim;
+    float32 m_homing, m_damping;
+    float32 m_wait;
+    bool m_started;
+
+    DbgVirtualRoutine() : m_owner(0), m_aim(0.0f, 1.0f), m_homing(0.0f), m_damping(1.0f), m_wait(0.0f), m_started(false) {}
+    virtual ~DbgVirtualRoutine() {}
+    virtual void update(float32 dt, const vec3 *targets, uint32 num_targets, RoutineRunner::ShotCont &shots)=0;
+
+    // 一番近い対象への方向と移動。待ち時間が終わったら true
+    bool step(float32 dt, const vec3 *targets, uint32 num_targets, vec2 &dir)
+    {
+        float32 best = FLT_MAX;
+        vec2 d;
+        for(uint32 ti=0; ti<num_targets; ++ti) {
+            vec2 t = vec2(targets[ti]) - m_pos;
+            float32 d2 = t.x*t.x + t.y*t.y;
+            if(d2<best) { best=d2; d=t; }
+        }
+        dir = d / std::sqrt(stl::max<float32>(d.x*d.x + d.y*d.y, 1e-12f));
+        m_vel = m_vel*m_damping + dir*m_homing;
+        m_pos += m_vel*dt;
+        m_wait -= dt;
+        return m_wait<=0.0f;
+    }
+    void aim(const vec2 &dir)
+    {
+        if(dir.x!=0.0f || dir.y!=0.0f) { m_aim=dir; }
+    }
+    void shoot(uint32 n, float32 speed, float32 speed_step, RoutineRunner::ShotCont &shots)
+    {
+        for(uint32 k=0; k<n; ++k) {
+            RoutineRunner::Shot s = {vec3(m_pos, 0.0f), vec3(m_aim, 0.0f)*(speed + speed_step*k), m_owner};
+            shots.push_back(s);
+        }
+    }
+    void shootSpread(uint32 n, float32 speed, float32 start, float32 step_angle, RoutineRunner::ShotCont &shots)
+    {
+        float32 base = std::atan2(m_aim.y, m_aim.x);
+        for(uint32 k=0; k<n; ++k) {
+            float32 a = base + start + step_angle*k;
+            RoutineRunner::Shot s = {vec3(m_pos, 0.0f), vec3(std::cos(a), std::sin(a), 0.0f)*speed, m_owner};
+            shots.push_back(s);
+        }
+    }
+};
+
+class DbgVirtualSingleShoot : public DbgVirtualRoutine
+{
+public:
+    void update(float32 dt, const vec3 *targets, uint32 num_targets, RoutineRunner::ShotCont &shots) override
+    {
+        vec2 dir;
+        if(!step(dt, targets, num_targets, dir)) { return; }
+        if(!m_started) { m_started=true; m_homing=0.0035f; m_damping=0.0f; }
+        else { aim(dir); shoot(5, 0.007f, 0.0015f, shots); }
+        m_wait += 150.0f;
+    }
+};
+
+class DbgVirtualCircularShoot : public DbgVirtualRoutine
+{
+public:
+    void update(float32 dt, const vec3 *targets, uint32 num_targets, RoutineRunner::ShotCont &shots) override
+    {
+        vec2 dir;
+        if(!step(dt, targets, num_targets, dir)) { return; }
+        if(!m_started) { m_started=true; m_aim=vec2(1.0f, 0.0f); }
+        else {
+            shoot(10, 0.008f, 0.001f, shots);
+            float32 r = ist::DegToRad(10.0f);
+            float32 c = std::cos(r), s = std::sin(r);
+            m_aim = vec2(m_aim.x*c - m_aim.y*s, m_aim.x*s + m_aim.y*c);
+        }
+        m_wait += 20.0f;
+    }
+};
+
+class DbgVirtualHomingPlayer : public DbgVirtualRoutine
+{
+public:
+    void update(float32 dt, const vec3 *targets, uint32 num_targets, RoutineRunner::ShotCont &shots) override
+    {
+        vec2 dir;
+        if(!step(dt, targets, num_targets, dir)) { return; }
+        m_homing = 0.0002f;
+        m_damping = 0.98f;
+        m_wait = FLT_MAX;
+    }
+};
+
+class DbgVirtualFanShoot : public DbgVirtualRoutine
+{
+public:
+    uint32 m_count;
+    DbgVirtualFanShoot() : m_count(0) {}
+
+    void update(float32 dt, const vec3 *targets, uint32 num_targets, RoutineRunner::ShotCont &shots) override
+    {
+        vec2 dir;
+        if(!step(dt, targets, num_targets, dir)) { return; }
+        if(!m_started) {
+            m_started = true;
+            m_homing = 0.0002f;
+            m_damping = 0.98f;
+            m_wait += 60.0f;
+        }
+        else if(m_count<3) {
+            aim(dir);
+            float32 spread = ist::DegToRad(60.0f);
+            shootSpread(5, 0.01f, -spread*0.5f, spread/4, shots);
+            ++m_count;
+            m_wait += m_count<3 ? 60.0f : 120.0f;
+        }
+        else {
+            shootSpread(24, 0.006f, 0.0f, ist::PI*2.0f/24, shots);
+            m_count = 0;
+            m_wait += 60.0f;
+        }
+    }
+};
+
+void EntityModule::dbgBenchmarkRoutines()
+{
+    // 10000 体の敵を、敵毎の仮想関数 (従来の IRoutine 相当) と RoutineRunner の一括実行で同じだけ動かして比較。
+    // 仮想関数版は実際の IRoutine と違い atmQuery()/atmCall() を経由しないので、その分は有利になっている。
+    // 弾は BulletModule に渡さず数えるだけ。両者の弾の数と位置が一致することを確認する
+    const uint32 num_enemies = 10000;
+    const uint32 num_frames = 600;
+    const float32 dt = 1.0f;
+    const vec3 targets[] = {vec3(-0.5f, -0.5f, 0.0f), vec3(0.8f, 0.3f, 0.0f)};
+    const uint32 num_targets = _countof(targets);
+
+    RoutineRunner runner;
+    const RoutineProgramID programs[] = {
+        runner.findProgram("SingleShoot"),
+        runner.findProgram("CircularShoot"),
+        runner.findProgram("HomingPlayer"),
+        runner.findProgram("FanShoot"),
+    };
+    ist::vector<DbgVirtualRoutine*> routines;
+    SFMT rand;
+    rand.initialize(0);
+    for(uint32 i=0; i<num_enemies; ++i) {
+        EntityHandle h = EntityCreateHandle(EC_Enemy_Test, i+1);
+        vec2 pos = vec2(rand.genFloat32()-0.5f, rand.genFloat32()-0.5f) * 3.0f;
+        uint32 kind = rand.genInt32() % _countof(programs);
+        DbgVirtualRoutine *r = nullptr;
+        switch(kind) {
+        case 0: r = istNew(DbgVirtualSingleShoot)(); break;
+        case 1: r = istNew(DbgVirtualCircularShoot)(); break;
+        case 2: r = istNew(DbgVirtualHomingPlayer)(); break;
+        case 3: r = istNew(DbgVirtualFanShoot)(); break;
+        }
+        r->m_owner = h;
+        r->m_pos = pos;
+        routines.push_back(r);
+        runner.attach(h, programs[kind], vec3(pos, 0.0f));
+    }
+
+    RoutineRunner::ShotCont shots;
+    uint32 num_virtual_shots = 0;
+    ist::Timer timer;
+    for(uint32 fi=0; fi<num_frames; ++fi) {
+        for(uint32 i=0; i<num_enemies; ++i) {
+            routines[i]->update(dt, targets, num_targets, shots);
+        }
+        num_virtual_shots += (uint32)shots.size();
+        shots.clear();
+    }
+    float32 t_virtual = timer.getElapsedMillisec() / num_frames;
+
+    uint32 num_runner_shots = 0;
+    timer.reset();
+    for(uint32 fi=0; fi<num_frames; ++fi) {
+        runner.update(dt, targets, num_targets);
+        num_runner_shots += runner.discardShots();
+    }
+    float32 t_runner = timer.getElapsedMillisec() / num_frames;
+
+    float32 max_diff = 0.0f;
+    for(uint32 i=0; i<num_enemies; ++i) {
+        vec3 pos;
+        runner.getPosition(routines[i]->m_owner, pos);
+        max_diff = stl::max<float32>(max_diff, glm::length(vec2(pos)-routines[i]->m_pos));
+    }
+
+    istPrint("%u enemies, %u frames: virtual %.2fms (%u shots), bytecode %.2fms (%u shots), max position diff %f\n",
+        num_enemies, num_frames, t_virtual, num_virtual_shots, t_runner, num_runner_shots, max_diff);
+    istAssert(num_virtual_shots==num_runner_shots);
+
+    // 並列 update 中に死ぬ場合: Routine_Script::finalize() からの detach() はブロック毎の EntityCommandBuffer に積まれ、
+    // 区間の後に適用される。その間も他のスレッドから getPosition() できて、生き残ったものの位置が変わらないことを確認する
+    {
+        uint32 num_blocks = ceildiv(num_enemies, UpdateBlockSize);
+        ist::vector<EntityCommandBuffer*> cbuffers;
+        for(uint32 bi=0; bi<num_blocks; ++bi) { cbuffers.push_back(istNew(EntityCommandBuffer)()); }
+        ist::vector<uint8> killed(num_enemies);
+        uint32 num_killed = 0;
+        for(uint32 i=0; i<num_enemies; ++i) {
+            killed[i] = rand.genInt32()%3==0 ? 1 : 0;
+            num_killed += killed[i];
+        }
+        ist::vector<uint32> missing(num_blocks); // ブロック毎
+        ist::parallel_for(uint32(0), num_blocks,
+            [&](uint32 bi) {
+                EntityCommandBuffer *prev = EntityCommandBuffer::getCurrent();
+                EntityCommandBuffer::setCurrent(cbuffers[bi]);
+                uint32 b = bi*UpdateBlockSize;
+                uint32 e = stl::min<uint32>(b+UpdateBlockSize, num_enemies);
+                for(uint32 i=b; i<e; ++i) {
+                    EntityHandle h = routines[i]->m_owner;
+                    vec3 pos;
+                    if(!runner.getPosition(h, pos)) { ++missing[bi]; }
+                    if(killed[i]) { runner.detach(h); }
+                }
+                EntityCommandBuffer::setCurrent(prev);
+            });
+        for(uint32 bi=0; bi<num_blocks; ++bi) {
+            cbuffers[bi]->flush();
+            istDelete(cbuffers[bi]);
+        }
+
+        uint32 num_wrong = 0;
+        for(uint32 bi=0; bi<num_blocks; ++bi) { num_wrong += missing[bi]; }
+        for(uint32 i=0; i<num_enemies; ++i) {
+            vec3 pos;
+            bool alive = runner.getPosition(routines[i]->m_owner, pos);
+            if(alive==(killed[i]!=0) || (alive && vec2(pos)!=routines[i]->m_pos)) { ++num_wrong; }
+        }
+        istPrint("killed %u enemies during parallel update: %u remain, %u wrong\n",
+            num_killed, runner.getNumEntities(), num_wrong);
+        istAssert(runner.getNumEntities()==num_enemies-num_killed && num_wrong==0);
+    }
+
+    for(uint32 i=0; i<num_enemies; ++i) {
+        istDelete(routines[i]);
+    }
+}
+
+#endif // atm_enable_Benchmark
+
+
 } // namespace atm
@@ -3,11 +3,16 @@
 
 #include "Engine/Network/LevelEditorCommand.h"
 #include "EntityClass.h"
+#include "EntityComponent.h"
+#include "EntitySpatialIndex.h"
+#include "EntityCommandBuffer.h"
+#include "RoutineProgram.h"
 #include "Util.h"
 
 
 namespace atm {
 
+class DrawList;
 atmAPI EntityHandle atmCreateEntityHandle();
 
 class IEntity
@@ -16,7 +21,6 @@ friend class EntityModule;
 private:
     EntityHandle m_ehandle;
 
-    bool isValidHandle(EntityHandle h);
     void setHandle(uint32 h) { m_ehandle=h; }
 
     istSerializeBlock(
@@ -45,6 +49,15 @@ public:
     // 同期更新
     virtual void update(float32 dt) {}
 
+    // true を返す Entity の update() は、連続する他の true を返す Entity と並列に呼ばれる。
+    // その場合、他の Entity の生成や呼び出しなどは EntityCommandBuffer::getCurrent() に積む必要がある。
+    // (EntityCommandBuffer を参照)
+    virtual bool canUpdateInParallel() const { return false; }
+
+    // true を返す Entity には、CollisionModule::update() が衝突メッセージ (eventCollideBatch) を他の Entity と並列に配る。
+    // 制約は canUpdateInParallel() と同じで、他の Entity の生成や呼び出しなどは EntityCommandBuffer::getCurrent() に積む必要がある
+    virtual bool canReceiveCollisionInParallel() const { return false; }
+
     // 非同期更新。
     // Entity 間の更新は並列に行われるが、その間、衝突判定や描画などの他のモジュールの更新は行われない。
     // (それらは Entity の更新が全て終わってから行われる)
@@ -55,10 +68,19 @@ public:
     // (渡すだけ。この中で i3d::Device などの描画 API を直接呼んではならない)
     virtual void draw() {}
 
+    // true を返す Entity の draw() は並列に呼ばれる。その間、各 pass への描画要求は DrawList::getCurrent() に積まれる。
+    // DrawList が扱わない pass (PassForward_Generic など) を使うものは false のままにすること。(DrawList を参照)
+    virtual bool canDrawInParallel() const { return false; }
+
 
     // fid に対応するメソッドを引数 args で呼ぶ。
     // Routine や外部スクリプトとの連動用。
     virtual bool call(FunctionID fid, const void *args, void *ret=nullptr) { return false; }
+    // call(FID_getPosition) / call(FID_getTransformMatrix) と同じ結果を返す。atmECallBlock() が型付きの速い版で上書きする
+    virtual bool queryPosition(vec3 &out);
+    virtual bool queryTransformMatrix(mat4 &out);
+    // atmECallSuper(IEntity) 用。登録するメソッドはない
+    template<class Builder> void buildECallTable(Builder &builder) const {}
 
     virtual void jsonize(stl::string &out) {}
 };
@@ -91,8 +113,28 @@ public:
     void frameEnd();
 
     IEntity* getEntity(EntityHandle h);
+    // Entity が多すぎる (EntityMaxIndex) 場合は nullptr
     IEntity* createEntity(EntityClassID cid);
+    // IEntity を持たない、コンポーネントだけの Entity を作る。(EntityComponentStore を参照) 作れなければ 0
+    EntityHandle createComponentEntity(EntityClassID cid, uint32 component_flags);
     void deleteEntity(EntityHandle h);
+    // h が生きている Entity (またはコンポーネントだけの Entity) を指しているか。
+    // 削除された Entity の handle は、slot が再利用された後でも世代が違うので false になる
+    bool isValidHandle(EntityHandle h) const
+    {
+        uint32 iid = EntityGetIndex(h);
+        return h!=0 && iid<m_slot_handles.size() && m_slot_handles[iid]==h;
+    }
+    // IEntity を持つ生きている Entity を隙間なく詰めたもの。順序は不定
+    const Entities& getLiveEntities() const { return m_dense; }
+
+    EntityComponentStore& getComponents() { return m_components; }
+    EntityTransformHierarchy& getTransformHierarchy() { return m_hierarchy; }
+    // カテゴリ毎の位置の索引。近くの Entity を探す時に使う
+    const EntitySpatialIndex& getSpatialIndex() const { return m_spatial; }
+    EntitySpatialIndex& getSpatialIndex() { return m_spatial; }
+    // RoutineProgram で動く Entity をまとめて実行するもの
+    RoutineRunner& getRoutineRunner() { return m_routines; }
 
     void handleStateQuery(EntitiesQueryContext &ctx);
 
@@ -117,18 +159,64 @@ public:
         });
     }
 
+#ifdef atm_enable_Benchmark
+    void dbgBenchmarkComponents();
+    void dbgBenchmarkECall();
+    void dbgBenchmarkTransformHierarchy();
+    void dbgBenchmarkSpatialIndex();
+    void dbgBenchmarkParallelUpdate();
+    void dbgBenchmarkMessages();
+    void dbgBenchmarkHandles();
+    void dbgBenchmarkEntityPool();
+    void dbgBenchmarkDraw();
+    void dbgBenchmarkRoutines();
+#endif // atm_enable_Benchmark
+
 private:
-    void generateHandle(EntityClassID classid);
+    static const uint32 UpdateBlockSize = 32; // 並列 update の粒度
+    static const uint32 DrawBlockSize = 64;   // 並列 draw の粒度
+    static const uint32 InvalidIndex = 0xFFFFFFFF;
+
+    // slot が足りなければ false。その場合 getGeneratedHandle() は 0 を返す
+    bool generateHandle(EntityClassID classid);
     EntityHandle getGeneratedHandle();
+    // generateHandle() で作った handle の Entity を m_entities と m_dense に登録する
+    void registerEntity(IEntity *e);
+    // 2 フレーム前に死んだ Entity の slot を再利用可能にする
+    void recycleSlots();
+    void updateEntities(Handles &handles, float32 dt);
+    void updateEntitiesParallel(Handles &handles, uint32 first, uint32 last, float32 dt);
+    // canDrawInParallel() なものを並列にブロック毎の m_dlists に積む。ブロック数を返す
+    uint32 drawEntitiesParallel();
+    // m_dlists をブロック順に繋げて (m_sort_draw_list であれば PSet 毎に並べ替えて) 各 pass に渡す
+    void flushDrawLists(uint32 num_blocks);
+    // m_routines をプレイヤーを狙わせて進め、撃った弾を BulletModule に渡す
+    void updateRoutines(float32 dt);
 
     Entities    m_entities;
     Handles     m_all;
     Handles     m_vacants;
     Handles     m_dead;      // 死亡を検出できるようにするため、死んだ Entity の handle は 1 frame は無効なままにする必要がある。
     Handles     m_dead_prev; // 
+    uint32      m_vacant_head; // m_vacants は先頭から使う。同じ slot がすぐ再利用されないので、世代が一周しにくくなる
+    Handles     m_slot_handles; // slot 毎の現在の handle。空いていれば 0
+    ist::vector<uint8> m_generations; // slot 毎の次に使う世代
+    Entities    m_dense;
+    ist::vector<uint32> m_dense_index; // slot -> m_dense の index
+    EntityComponentStore m_components;
+    RoutineRunner m_routines;
 
     // 以下 serialize 不要
     EntityHandle m_tmp_handle;
+    EntityTransformHierarchy m_hierarchy;
+    EntitySpatialIndex m_spatial;
+    ist::vector<EntityCommandBuffer*> m_cbuffers; // 並列 update のブロック毎
+    bool m_parallel_update;
+    ist::vector<DrawList*> m_dlists; // 並列 draw のブロック毎
+    DrawList *m_dlist_merged;
+    bool m_parallel_draw;
+    bool m_sort_draw_list;
+    ist::raw_vector<vec3> m_routine_targets;
 
     void resizeTasks(uint32 n);
 
@@ -139,6 +227,13 @@ private:
         istSerialize(m_vacants)
         istSerialize(m_dead)
         istSerialize(m_dead_prev)
+        istSerialize(m_vacant_head)
+        istSerialize(m_slot_handles)
+        istSerialize(m_generations)
+        istSerialize(m_dense)
+        istSerialize(m_dense_index)
+        istSerialize(m_components)
+        istSerialize(m_routines)
     )
 };
 
@@ -4,33 +4,223 @@
 #include "FunctionID.h"
 
 
+// atmECallBlock() は call() と、それが引く FunctionID -> thunk の表 (ECallTable) を作る buildECallTable() を生成する。
+// 表はクラス毎に最初の call() で一度だけ作られ、以降は表を引いてメソッドを直接呼ぶ。
+// (以前は call() の度に switch と atmECallSuper() による super の call() の連鎖を辿っていた)
+// 特に頻繁に引かれる getPosition と getTransformMatrix は、引数の詰め替えなしに型付きで返す
+// queryPosition()/queryTransformMatrix() も生成する。(atmGetPosition() などから使う)
 #define atmECallBlock(...) \
     virtual bool call(FunctionID fid, const void *args, void *ret)\
     {\
         typedef std::remove_reference<decltype(*this)>::type this_t;\
+        return atm::ECallTable<this_t>::getInstance(*this).call(*this, fid, args, ret);\
+    }\
+    virtual bool queryPosition(vec3 &out)\
+    {\
+        typedef std::remove_reference<decltype(*this)>::type this_t;\
+        return atm::ECallTable<this_t>::getInstance(*this).getPosition(*this, out);\
+    }\
+    virtual bool queryTransformMatrix(mat4 &out)\
+    {\
+        typedef std::remove_reference<decltype(*this)>::type this_t;\
+        return atm::ECallTable<this_t>::getInstance(*this).getTransformMatrix(*this, out);\
+    }\
+    template<class Builder>\
+    void buildECallTable(Builder &builder) const\
+    {\
+        typedef std::remove_const<std::remove_reference<decltype(*this)>::type>::type this_t;\
         __VA_ARGS__\
-        return false;\
     }
 
 #define atmMethodBlock(...)    \
-    switch(fid) {\
-    __VA_ARGS__\
-    }
+    __VA_ARGS__
 
 #define atmECall(funcname)         \
-    case FID_##funcname: ist::BinaryCall(&this_t::funcname, *this, ret, args); return true;
+    builder.template addMethod<this_t>(FID_##funcname, &this_t::funcname);
 
 #define atmECallSuper(classname)   \
-    if(this->classname::call(fid, args, ret)) { return true; }
+    this->classname::buildECallTable(builder);
 
 #define atmECallDelegate(obj)   \
-    if(obj && obj->call(fid, args, ret)) {}
+    builder.template addDelegate<this_t>(&this_t::obj);
 
 
 namespace atm {
 
 class IEntity;
 
+// C の atmECallBlock() から作られる FunctionID -> thunk の表。
+// 同じ FunctionID が複数あれば先に登録されたもの (= 以前の switch と super の連鎖で先に見つかるもの) が使われる。
+// delegate (atmECallDelegate()) は、それより後に登録されたメソッドの呼び出しと見つからなかった場合に、以前と同じく先に呼ばれる。
+template<class C>
+class ECallTable
+{
+public:
+    typedef void (*MethodInvoker)(C &o, const void *fn, const void *args, void *ret);
+    typedef void (*DelegateInvoker)(C &o, const void *member, FunctionID fid, const void *args, void *ret);
+    typedef void (*PositionInvoker)(C &o, const void *fn, vec3 &out);
+    typedef void (*TransformInvoker)(C &o, const void *fn, mat4 &out);
+    static const uint32 MaxDelegates = 4;
+    static const uint32 StorageSize = 4; // メンバ関数ポインタの格納用。void* 単位
+
+    struct Method
+    {
+        MethodInvoker invoke;
+        uint32 order;
+        void *fn[StorageSize];
+    };
+    struct Delegate
+    {
+        DelegateInvoker invoke;
+        uint32 order;
+        void *member[StorageSize];
+    };
+    // getPosition/getTransformMatrix の型付きの呼び出し。
+    // それより先に登録された delegate がある場合は call() と結果が変わりうるので作らない (call() にまわす)
+    template<class Invoker>
+    struct Getter
+    {
+        Invoker invoke;
+        void *fn[StorageSize];
+    };
+
+    static const ECallTable& getInstance(const C &o)
+    {
+        ECallTable &t = s_instance;
+        if(!t.m_built) {
+            ist::SpinMutex::ScopedLock lock(t.m_mutex);
+            if(!t.m_built) {
+                o.buildECallTable(t);
+                t.m_built = true;
+            }
+        }
+        return t;
+    }
+
+    bool call(C &o, FunctionID fid, const void *args, void *ret) const
+    {
+        if((uint32)fid>=(uint32)FID_End) { return false; }
+        const Method &m = m_methods[fid];
+        for(uint32 i=0; i<m_num_delegates; ++i) {
+            const Delegate &d = m_delegates[i];
+            if(m.invoke && d.order>m.order) { break; }
+            d.invoke(o, d.member, fid, args, ret);
+        }
+        if(!m.invoke) { return false; }
+        m.invoke(o, m.fn, args, ret);
+        return true;
+    }
+
+    bool getPosition(C &o, vec3 &out) const
+    {
+        if(!m_get_position.invoke) { return call(o, FID_getPosition, nullptr, &out); }
+        m_get_position.invoke(o, m_get_position.fn, out);
+        return true;
+    }
+
+    bool getTransformMatrix(C &o, mat4 &out) const
+    {
+        if(!m_get_transform.invoke) { return call(o, FID_getTransformMatrix, nullptr, &out); }
+        m_get_transform.invoke(o, m_get_transform.fn, out);
+        return true;
+    }
+
+    // 以下 buildECallTable() から呼ばれる
+    template<class Base, class F>
+    void addMethod(FunctionID fid, F fn)
+    {
+        static_assert(sizeof(F)<=sizeof(void*)*StorageSize, "member function pointer is too large");
+        Method &m = m_methods[fid];
+        if(!m.invoke) {
+            m.invoke = &InvokeMethod<Base, F>;
+            m.order = m_order;
+            memcpy(m.fn, &fn, sizeof(F));
+            if(m_num_delegates==0) {
+                addGetter<Base>(fid, fn);
+            }
+        }
+        ++m_order;
+    }
+
+    template<class Base, class M>
+    void addDelegate(M member)
+    {
+        static_assert(sizeof(M)<=sizeof(void*)*StorageSize, "member pointer is too large");
+        istAssert(m_num_delegates<MaxDelegates);
+        Delegate &d = m_delegates[m_num_delegates++];
+        d.invoke = &InvokeDelegate<Base, M>;
+        d.order = m_order++;
+        memcpy(d.member, &member, sizeof(M));
+    }
+
+private:
+    // 引数なしの const メンバ関数で、戻り値が vec3 か mat4 のものだけ型付きの呼び出しを作る
+    template<class Base, class F>
+    void addGetter(FunctionID fid, F fn) {}
+
+    template<class Base, class R, class Owner>
+    void addGetter(FunctionID fid, R (Owner::*fn)() const)
+    {
+        typedef typename std::remove_const<typename std::remove_reference<R>::type>::type value_t;
+        setGetter<Base>(fid, fn, (value_t*)nullptr);
+    }
+
+    template<class Base, class F>
+    void setGetter(FunctionID fid, F fn, const vec3*)
+    {
+        if(fid==FID_getPosition) {
+            m_get_position.invoke = &InvokeGetter<Base, F, vec3>;
+            memcpy(m_get_position.fn, &fn, sizeof(F));
+        }
+    }
+
+    template<class Base, class F>
+    void setGetter(FunctionID fid, F fn, const mat4*)
+    {
+        if(fid==FID_getTransformMatrix) {
+            m_get_transform.invoke = &InvokeGetter<Base, F, mat4>;
+            memcpy(m_get_transform.fn, &fn, sizeof(F));
+        }
+    }
+
+    template<class Base, class F>
+    void setGetter(FunctionID fid, F fn, const void*) {}
+
+    template<class Base, class F>
+    static void InvokeMethod(C &o, const void *fn, const void *args, void *ret)
+    {
+        ist::BinaryCall(*(const F*)fn, static_cast<Base&>(o), ret, args);
+    }
+
+    template<class Base, class F, class T>
+    static void InvokeGetter(C &o, const void *fn, T &out)
+    {
+        out = (static_cast<Base&>(o).*(*(const F*)fn))();
+    }
+
+    template<class Base, class M>
+    static void InvokeDelegate(C &o, const void *member, FunctionID fid, const void *args, void *ret)
+    {
+        if(auto *d = static_cast<Base&>(o).*(*(const M*)member)) {
+            d->call(fid, args, ret);
+        }
+    }
+
+    // static 領域に置いて 0 初期化されることを前提にしているので、コンストラクタは持たない
+    Method          m_methods[FID_End];
+    Delegate        m_delegates[MaxDelegates];
+    Getter<PositionInvoker>     m_get_position;
+    Getter<TransformInvoker>    m_get_transform;
+    uint32          m_num_delegates;
+    uint32          m_order;
+    volatile bool   m_built;
+    ist::SpinMutex  m_mutex;
+
+    static ECallTable s_instance;
+};
+template<class C> ECallTable<C> ECallTable<C>::s_instance;
+
+
 template<class C>
 inline bool atmCallImpl(C *e, FunctionID fid)
 {
@@ -88,6 +278,30 @@ inline bool atmQueryImpl(C *e, FunctionID fid, Ret &ret, const Arg &args)
     return e->call(fid, &args, &ret);
 }
 
+// getPosition/getTransformMatrix 専用の速い版。見つからなければ vec3()/mat4() を返す
+template<class C>
+inline vec3 atmGetPosition(C *e)
+{
+    vec3 ret;
+    if(e) { e->queryPosition(ret); }
+    return ret;
+}
+inline vec3 atmGetPosition(EntityHandle h)
+{
+    return atmGetPosition(atmGetEntity(h));
+}
+template<class C>
+inline mat4 atmGetTransformMatrix(C *e)
+{
+    mat4 ret;
+    if(e) { e->queryTransformMatrix(ret); }
+    return ret;
+}
+inline mat4 atmGetTransformMatrix(EntityHandle h)
+{
+    return atmGetTransformMatrix(atmGetEntity(h));
+}
+
 template<class T>
 inline T atmGetProperyImpl(EntityHandle h, FunctionID fid)
 {
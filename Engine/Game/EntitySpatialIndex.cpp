@@ -0,0 +1,189 @@
+﻿#include "atmPCH.h"
+#include "types.h"
+#include "Util.h"
+#include "Engine/Game/World.h"
+#include "Engine/Game/EntityModule.h"
+#include "Engine/Game/EntityQuery.h"
+#include "EntitySpatialIndex.h"
+
+namespace atm {
+
+void EntitySpatialIndex::Category::clear()
+{
+    handles.clear();
+    positions.clear();
+    cells.clear();
+    bl = vec2(0.0f);
+    cell_size = rcp_cell_size = vec2(1.0f);
+}
+
+ivec2 EntitySpatialIndex::Category::getCell(const vec3 &pos) const
+{
+    ivec2 c = ivec2((vec2(pos)-bl)*rcp_cell_size);
+    return glm::clamp(c, ivec2(0), ivec2(GridDiv-1));
+}
+
+
+EntitySpatialIndex::EntitySpatialIndex()
+    : m_category_mask((1<<ECA_Player)|(1<<ECA_Enemy))
+{
+    clear();
+}
+
+void EntitySpatialIndex::clear()
+{
+    for(uint32 ci=0; ci<ECA_End; ++ci) {
+        m_categories[ci].clear();
+    }
+}
+
+void EntitySpatialIndex::build(const EntityHandle *handles, uint32 num, IEntity *const *entities, uint32 num_entities)
+{
+    for(uint32 ci=0; ci<ECA_End; ++ci) {
+        m_tmp_handles[ci].clear();
+        m_tmp_positions[ci].clear();
+    }
+
+    // 位置を持つものをカテゴリ毎に集める
+    for(uint32 i=0; i<num; ++i) {
+        EntityHandle h = handles[i];
+        uint32 cat = EntityGetCategory(h);
+        if(cat>=ECA_End || (m_category_mask & (1<<cat))==0) { continue; }
+        uint32 iid = EntityGetIndex(h);
+        IEntity *e = iid<num_entities ? entities[iid] : nullptr;
+        vec3 pos;
+        if(!e || !atmQuery(e, getPosition, pos)) { continue; }
+        m_tmp_handles[cat].push_back(h);
+        m_tmp_positions[cat].push_back(vec4(pos, 0.0f));
+    }
+
+    // セル順に並べ替える (counting sort)
+    for(uint32 ci=0; ci<ECA_End; ++ci) {
+        Category &cat = m_categories[ci];
+        const HandleCont &src_handles = m_tmp_handles[ci];
+        const PositionCont &src_positions = m_tmp_positions[ci];
+        uint32 n = (uint32)src_handles.size();
+        cat.clear();
+        if(n==0) { continue; }
+
+        vec2 bl = vec2(src_positions[0]);
+        vec2 ur = bl;
+        for(uint32 i=1; i<n; ++i) {
+            bl = glm::min(bl, vec2(src_positions[i]));
+            ur = glm::max(ur, vec2(src_positions[i]));
+        }
+        cat.bl = bl;
+        cat.cell_size = glm::max((ur-bl)/float32(GridDiv), vec2(0.01f));
+        cat.rcp_cell_size = vec2(1.0f)/cat.cell_size;
+
+        m_tmp_cells.resize(n);
+        cat.cells.resize(GridDiv*GridDiv+1, 0);
+        for(uint32 i=0; i<n; ++i) {
+            ivec2 c = cat.getCell(vec3(src_positions[i]));
+            uint32 cell = c.y*GridDiv + c.x;
+            m_tmp_cells[i] = cell;
+            ++cat.cells[cell+1];
+        }
+        for(uint32 i=1; i<cat.cells.size(); ++i) {
+            cat.cells[i] += cat.cells[i-1];
+        }
+        cat.handles.resize(n);
+        cat.positions.resize(n);
+        for(uint32 i=0; i<n; ++i) {
+            uint32 d = cat.cells[m_tmp_cells[i]]++;
+            cat.handles[d] = src_handles[i];
+            cat.positions[d] = src_positions[i];
+        }
+        // 上で開始 index を次のセルの開始位置までずらしたので戻す
+        for(uint32 i=(uint32)cat.cells.size()-1; i>0; --i) {
+            cat.cells[i] = cat.cells[i-1];
+        }
+        cat.cells[0] = 0;
+    }
+}
+
+bool EntitySpatialIndex::findNearest(EntityCategoryID cat, const vec3 &pos, Result &out, EntityClassID classid) const
+{
+    return findKNearest(cat, pos, 1, &out, classid)==1;
+}
+
+uint32 EntitySpatialIndex::findKNearest(EntityCategoryID ci, const vec3 &pos, uint32 k, Result *out, EntityClassID classid) const
+{
+    const Category &cat = m_categories[ci];
+    if(k==0 || cat.handles.empty()) { return 0; }
+
+    // pos のあるセルから外側へ 1 周ずつ調べ、未調査のセルがこれまでの k 番目より遠くなったら打ち切る
+    const int32 div = GridDiv;
+    ivec2 center = cat.getCell(pos);
+    uint32 found = 0;
+    for(int32 r=0; ; ++r) {
+        int32 xb = center.x-r, xe = center.x+r;
+        int32 yb = center.y-r, ye = center.y+r;
+        for(int32 y=stl::max<int32>(yb,0); y<=stl::min<int32>(ye,div-1); ++y) {
+            bool edge_row = y==yb || y==ye;
+            for(int32 x=stl::max<int32>(xb,0); x<=stl::min<int32>(xe,div-1); ++x) {
+                if(!edge_row && x!=xb && x!=xe) { continue; }
+                uint32 cell = y*div + x;
+                for(uint32 i=cat.cells[cell]; i<cat.cells[cell+1]; ++i) {
+                    EntityHandle h = cat.handles[i];
+                    if(classid!=EC_Unknown && EntityGetClassID(h)!=classid) { continue; }
+                    vec3 p = vec3(cat.positions[i]);
+                    vec3 d = p-pos;
+                    float32 d2 = glm::dot(d, d);
+                    if(found==k && d2>=out[k-1].dist2) { continue; }
+                    // 挿入ソート。k は小さい想定
+                    uint32 j = found<k ? found++ : k-1;
+                    while(j>0 && out[j-1].dist2>d2) { out[j]=out[j-1]; --j; }
+                    out[j].handle = h;
+                    out[j].dist2 = d2;
+                    out[j].pos = p;
+                }
+            }
+        }
+
+        if(xb<=0 && yb<=0 && xe>=div-1 && ye>=div-1) { break; }
+        if(found==k) {
+            // 未調査のセルの中の点までの距離の下限
+            float32 bound = FLT_MAX;
+            if(xb>0)    { bound = stl::min<float32>(bound, stl::max<float32>(pos.x-(cat.bl.x+cat.cell_size.x*xb), 0.0f)); }
+            if(xe<div-1){ bound = stl::min<float32>(bound, stl::max<float32>((cat.bl.x+cat.cell_size.x*(xe+1))-pos.x, 0.0f)); }
+            if(yb>0)    { bound = stl::min<float32>(bound, stl::max<float32>(pos.y-(cat.bl.y+cat.cell_size.y*yb), 0.0f)); }
+            if(ye<div-1){ bound = stl::min<float32>(bound, stl::max<float32>((cat.bl.y+cat.cell_size.y*(ye+1))-pos.y, 0.0f)); }
+            if(bound*bound >= out[k-1].dist2) { break; }
+        }
+    }
+    return found;
+}
+
+uint32 EntitySpatialIndex::findInRadius(EntityCategoryID ci, const vec3 &pos, float32 radius, ResultCont &out, EntityClassID classid) const
+{
+    const Category &cat = m_categories[ci];
+    if(cat.handles.empty()) { return 0; }
+
+    uint32 found = 0;
+    float32 r2 = radius*radius;
+    ivec2 bl = cat.getCell(pos-vec3(radius));
+    ivec2 ur = cat.getCell(pos+vec3(radius));
+    for(int32 y=bl.y; y<=ur.y; ++y) {
+        for(int32 x=bl.x; x<=ur.x; ++x) {
+            uint32 cell = y*GridDiv + x;
+            for(uint32 i=cat.cells[cell]; i<cat.cells[cell+1]; ++i) {
+                EntityHandle h = cat.handles[i];
+                if(classid!=EC_Unknown && EntityGetClassID(h)!=classid) { continue; }
+                vec3 p = vec3(cat.positions[i]);
+                vec3 d = p-pos;
+                float32 d2 = glm::dot(d, d);
+                if(d2>r2) { continue; }
+                Result r;
+                r.handle = h;
+                r.dist2 = d2;
+                r.pos = p;
+                out.push_back(r);
+                ++found;
+            }
+        }
+    }
+    return found;
+}
+
+} // namespace atm
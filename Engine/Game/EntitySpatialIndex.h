@@ -0,0 +1,77 @@
+﻿#ifndef atm_Engine_Game_EntitySpatialIndex_h
+#define atm_Engine_Game_EntitySpatialIndex_h
+
+#include "EntityClass.h"
+
+namespace atm {
+
+class IEntity;
+
+// Entity の位置をカテゴリ (EntityCategoryID) 毎に xy 平面の格子に振り分けたもの。
+// EntityModule::update() 内で作り直され (sync update の前と asyncupdate の前の 2 回)、
+// クエリは読み取りのみなので asyncupdate 中に並列に呼んでも問題ない。
+// 位置は作り直した時点のもの。結果の handle は既に削除されている可能性があるので、使う側で確認すること。
+class atmAPI EntitySpatialIndex
+{
+public:
+    static const uint32 GridDiv = 32;
+
+    struct Result
+    {
+        EntityHandle handle;
+        float32 dist2; // 距離の二乗
+        vec3 pos;
+
+        Result() : handle(0), dist2(0.0f) {}
+    };
+    typedef ist::vector<Result> ResultCont;
+
+    typedef ist::raw_vector<EntityHandle>   HandleCont;
+    typedef ist::raw_vector<vec4>           PositionCont;
+    typedef ist::raw_vector<uint32>         IndexCont;
+
+    struct Category
+    {
+        HandleCont      handles;    // セル順
+        PositionCont    positions;
+        IndexCont       cells;      // セル毎の開始 index。末尾は要素数
+        vec2            bl;
+        vec2            cell_size;
+        vec2            rcp_cell_size;
+
+        void clear();
+        ivec2 getCell(const vec3 &pos) const;
+    };
+
+public:
+    EntitySpatialIndex();
+    void clear();
+    // 対象にするカテゴリ。(1<<ECA_Player) のような bit の集合
+    void setCategoryMask(uint32 v) { m_category_mask=v; }
+    uint32 getCategoryMask() const { return m_category_mask; }
+
+    // handles: 対象になりうる Entity 全部、entities: EntityGetIndex() で引ける IEntity* の表
+    void build(const EntityHandle *handles, uint32 num, IEntity *const *entities, uint32 num_entities);
+
+    // classid が EC_Unknown 以外であれば、そのクラスのものだけが対象になる
+    bool findNearest(EntityCategoryID cat, const vec3 &pos, Result &out, EntityClassID classid=EC_Unknown) const;
+    // 近い順に最大 k 個 out に入れ、その数を返す
+    uint32 findKNearest(EntityCategoryID cat, const vec3 &pos, uint32 k, Result *out, EntityClassID classid=EC_Unknown) const;
+    // radius 以内のものを out に追加する (順不同)。追加した数を返す
+    uint32 findInRadius(EntityCategoryID cat, const vec3 &pos, float32 radius, ResultCont &out, EntityClassID classid=EC_Unknown) const;
+
+    uint32 getNumEntities(EntityCategoryID cat) const { return (uint32)m_categories[cat].handles.size(); }
+    const Category& getCategory(EntityCategoryID cat) const { return m_categories[cat]; }
+
+private:
+    Category    m_categories[ECA_End];
+    uint32      m_category_mask;
+
+    // 以下 build() の作業用
+    HandleCont      m_tmp_handles[ECA_End];
+    PositionCont    m_tmp_positions[ECA_End];
+    IndexCont       m_tmp_cells;
+};
+
+} // namespace atm
+#endif // atm_Engine_Game_EntitySpatialIndex_h
@@ -19,12 +19,40 @@ namespace atm {
 FluidModule::FluidModule()
     : m_current_fluid_task(0)
     , m_gravity_strength(15.0f)
+    , m_render_front(0)
+    , m_render_packed(false)
 {
+    m_packed_valid[0] = m_packed_valid[1] = false;
     wdmAddNode("SPH/gravity_strength", &m_gravity_strength, wdmMakeRange(0.0f, 100.0f));
+    wdmAddNode("SPH/render_packed", &m_render_packed);
+    wdmAddNode("SPH/substeps", &m_world.substeps, wdmMakeRange(1, 8));
+    wdmAddNode("SPH/max_substeps", &m_world.max_substeps, wdmMakeRange(1, 8));
+    wdmAddNode("SPH/adaptive_substeps", &m_world.adaptive_substeps);
+    wdmAddNode("SPH/cfl_number", &m_world.cfl_number, wdmMakeRange(0.1f, 2.0f));
+    wdmAddNode("SPH/sleeping", &m_world.sleeping_enabled);
+    wdmAddNode("SPH/sleep_speed", &m_world.sleep_speed, wdmMakeRange(0.0f, 1.0f));
+    wdmAddNode("SPH/islands", &m_world.islands_enabled);
+    wdmAddNode("SPH/dead_compaction", &m_world.dead_compaction_enabled);
+#ifdef atm_enable_Benchmark
+    wdmAddNode("SPH/dbgBenchmarkRigidGrid()", &FluidModule::dbgBenchmarkRigidGrid, this);
+    wdmAddNode("SPH/dbgBenchmarkFluidSpawn()", &FluidModule::dbgBenchmarkFluidSpawn, this);
+    wdmAddNode("SPH/dbgBenchmarkFluidSnapshot()", &FluidModule::dbgBenchmarkFluidSnapshot, this);
+    wdmAddNode("SPH/dbgBenchmarkFluidPacking()", &FluidModule::dbgBenchmarkFluidPacking, this);
+    wdmAddNode("SPH/dbgBenchmarkSubsteps()", &FluidModule::dbgBenchmarkSubsteps, this);
+    wdmAddNode("SPH/dbgBenchmarkSleeping()", &FluidModule::dbgBenchmarkSleeping, this);
+    wdmAddNode("SPH/dbgBenchmarkIslands()", &FluidModule::dbgBenchmarkIslands, this);
+    wdmAddNode("SPH/dbgBenchmarkCheckpoint()", &FluidModule::dbgBenchmarkCheckpoint, this);
+    wdmAddNode("SPH/dbgBenchmarkParticleChurn()", &FluidModule::dbgBenchmarkParticleChurn, this);
+#endif // atm_enable_Benchmark
+#ifdef atm_enable_StateSave
+    wdmAddNode("SPH/dbgSaveCheckpoint()", &FluidModule::dbgSaveCheckpoint, this);
+    wdmAddNode("SPH/dbgLoadCheckpoint()", &FluidModule::dbgLoadCheckpoint, this);
+#endif // atm_enable_StateSave
 }
 
 FluidModule::~FluidModule()
 {
+    wdmEraseNode("SPH");
 }
 
 void FluidModule::initialize()
@@ -34,7 +62,7 @@ void FluidModule::initialize()
 
 void FluidModule::frameBegin()
 {
-    m_world.clearRigidsAndForces();
+    m_world.clearForces();
     m_current_fluid_task = 0;
 }
 
@@ -51,22 +79,6 @@ void FluidModule::update( float32 dt )
         }
     }
 
-    {
-        // 床
-        psym::RigidPlane plane;
-        plane.id = 0;
-        plane.bb.bl_x = -PSYM_GRID_SIZE;
-        plane.bb.bl_y = -PSYM_GRID_SIZE;
-        plane.bb.bl_z = -PSYM_GRID_SIZE;
-        plane.bb.ur_x =  PSYM_GRID_SIZE;
-        plane.bb.ur_y =  PSYM_GRID_SIZE;
-        plane.bb.ur_z =  PSYM_GRID_SIZE;
-        plane.nx = 0.0f;
-        plane.ny = 0.0f;
-        plane.nz = 1.0f;
-        plane.distance = 0.0f;
-        m_world.addRigid(plane);
-    }
     {
         // 重力
         psym::DirectionalForce grav;
@@ -81,37 +93,26 @@ void FluidModule::update( float32 dt )
 
 void FluidModule::asyncupdate( float32 dt )
 {
-    m_mutex_particles.lock();
-    m_particles_to_gpu.clear();
-
-    ist::parallel_for(size_t(0), m_new_fluid_ctx.size(),
-        [&](size_t i){
-            AddFluidContext &ctx = m_new_fluid_ctx[i];
-            const ParticleSet *rc           = atmGetParticleSet(ctx.psid);
-            uint32 num_particles            = ctx.num;
-            const PSetParticle *fluid_in    = rc->getParticleData();
-            psym::Particle *fluid_out       = &m_new_fluid[ctx.index];
+    flushFluid();
 
-            simdvec4 zero(vec4(0.0f, 0.0f, 0.0f, 0.0f));
-            simdmat4 t(ctx.mat);
-            for(uint32 i=0; i<num_particles; ++i) {
-                simdvec4 p(vec4(fluid_in[i].position, 1.0f));
-                istAlign(16) vec4 pos = glm::vec4_cast(t * p);
-                pos.z = stl::max<float32>(pos.z, 0.0f);
-                fluid_out[i].position = reinterpret_cast<const psym::simdvec4&>(pos);
-                fluid_out[i].velocity = reinterpret_cast<const psym::simdvec4&>(zero);
-            }
-        });
-    if(!m_new_fluid.empty()) {
-        addFluid(&m_new_fluid[0], m_new_fluid.size());
+    // 描画用データは psym に裏バッファへ直接書かせる。描画側は表を読んでいるのでロック不要
+    uint32 back_index = m_render_front^1;
+    RenderParticleCont &back = m_render_particles[back_index];
+    back.resize(m_world.getNumParticles());
+    m_world.update(dt, back.empty() ? NULL : &back[0]);
+    back.resize(m_world.getNumParticles());
+    m_packed_valid[back_index] = m_render_packed;
+    if(m_render_packed) {
+        PackedParticleCont &packed = m_packed_particles[back_index];
+        packed.resize(back.size());
+        if(!back.empty()) {
+            EncodeFluidParticles(&back[0], &packed[0], back.size());
+        }
+    }
+    {
+        ist::ScopedLock<ist::Mutex> l(m_mutex_particles);
+        m_render_front ^= 1;
     }
-    m_new_fluid_ctx.clear();
-    m_new_fluid.clear();
-
-    m_particles_to_gpu.insert(m_particles_to_gpu.end(), m_world.getParticles(), m_world.getParticles()+m_world.getNumParticles());
-    m_mutex_particles.unlock();
-
-    m_world.update(dt);
 }
 
 void FluidModule::draw()
@@ -123,15 +124,59 @@ void FluidModule::frameEnd()
 {
 }
 
-size_t FluidModule::copyParticlesToGL()
+size_t FluidModule::copyParticlesToGL(bool &out_packed)
 {
-    if(m_particles_to_gpu.empty()) { return 0; }
-
     ist::ScopedLock<ist::Mutex> l(m_mutex_particles);
+    const RenderParticleCont &front = m_render_particles[m_render_front];
+    out_packed = m_packed_valid[m_render_front];
+    if(front.empty()) { return 0; }
+
     i3d::DeviceContext *dc = atmGetGLDeviceContext();
     Buffer *vb = atmGetVertexBuffer(VBO_GB_FLUID);
-    MapAndWrite(dc, vb, &m_particles_to_gpu[0], m_particles_to_gpu.size()*sizeof(psym::Particle));
-    return m_particles_to_gpu.size();
+    if(out_packed) {
+        const PackedParticleCont &packed = m_packed_particles[m_render_front];
+        MapAndWrite(dc, vb, &packed[0], packed.size()*sizeof(FluidPackedParticle));
+    }
+    else {
+        MapAndWrite(dc, vb, &front[0], front.size()*sizeof(psym::RenderParticle));
+    }
+    return front.size();
+}
+
+inline uint16 QuantizeGridPosition(float32 v)
+{
+    // 範囲はシェーダ (GBuffer_FluidBlood.glsl) と共通。床の外に出たものは端に clamp される
+    const float32 scale = 65535.0f / GLSL_FLUID_PACKED_SIZE;
+    return uint16(clamp<float32>((v-GLSL_FLUID_PACKED_POS)*scale + 0.5f, 0.0f, 65535.0f));
+}
+
+inline float32 DequantizeGridPosition(uint16 v)
+{
+    return float32(v)*(GLSL_FLUID_PACKED_SIZE/65535.0f) + GLSL_FLUID_PACKED_POS;
+}
+
+void EncodeFluidParticles(const psym::RenderParticle *src, FluidPackedParticle *dst, uint32 num)
+{
+    const uint32 block_size = 4096;
+    ist::parallel_for(uint32(0), ceildiv(num, block_size),
+        [&](uint32 bi){
+            uint32 last = std::min<uint32>((bi+1)*block_size, num);
+            for(uint32 i=bi*block_size; i<last; ++i) {
+                const psym::RenderParticle &s = src[i];
+                FluidPackedParticle &d = dst[i];
+                d.x = QuantizeGridPosition(s.x);
+                d.y = QuantizeGridPosition(s.y);
+                d.z = QuantizeGridPosition(s.z);
+                d.pad = 0;
+                d.energy = s.energy;
+                d.density = s.density;
+            }
+        });
+}
+
+vec3 DecodeFluidPosition(const FluidPackedParticle &v)
+{
+    return vec3(DequantizeGridPosition(v.x), DequantizeGridPosition(v.y), DequantizeGridPosition(v.z));
 }
 
 size_t FluidModule::getNumParticles() const
@@ -139,7 +184,14 @@ size_t FluidModule::getNumParticles() const
     return m_world.getNumParticles();
 }
 
-void FluidModule::addRigid(const CollisionEntity &v)
+size_t FluidModule::getNumSleepingParticles() const
+{
+    return m_world.last_num_sleeping_particles;
+}
+
+// CollisionEntity を psym の rigid に変換して f に渡す
+template<class F>
+inline void ConvertToRigid(const CollisionEntity &v, F &f)
 {
     switch(v.getShapeType()) {
     case CS_Sphere:
@@ -157,7 +209,7 @@ void FluidModule::addRigid(const CollisionEntity &v)
             dst.y = src.pos_r.y;
             dst.z = src.pos_r.z;
             dst.radius = src.pos_r.w;
-            m_world.addRigid(dst);
+            f(dst);
         }
         break;
 
@@ -176,7 +228,7 @@ void FluidModule::addRigid(const CollisionEntity &v)
             dst.ny = src.plane.y;
             dst.nz = src.plane.z;
             dst.distance = src.plane.w;
-            m_world.addRigid(dst);
+            f(dst);
         }
         break;
 
@@ -200,7 +252,7 @@ void FluidModule::addRigid(const CollisionEntity &v)
                 dst.planes[i].nz = src.planes[i].z;
                 dst.planes[i].distance = src.planes[i].w;
             }
-            m_world.addRigid(dst);
+            f(dst);
         }
         break;
 
@@ -210,22 +262,117 @@ void FluidModule::addRigid(const CollisionEntity &v)
     }
 }
 
+struct RigidAdder
+{
+    psym::World &world;
+    uint32 index;
+    RigidAdder(psym::World &w) : world(w), index(CollisionEntity::InvalidRigidIndex) {}
+    template<class T> void operator()(const T &v) { index=(uint32)world.addRigid(v); }
+};
+
+struct RigidSetter
+{
+    psym::World &world;
+    uint32 index;
+    RigidSetter(psym::World &w, uint32 i) : world(w), index(i) {}
+    template<class T> void operator()(const T &v) { world.setRigid(index, v); }
+};
+
+uint32 AddRigid(psym::World &world, const CollisionEntity &v)
+{
+    RigidAdder f(world);
+    ConvertToRigid(v, f);
+    return f.index;
+}
+
+void SetRigid(psym::World &world, uint32 i, const CollisionEntity &v)
+{
+    RigidSetter f(world, i);
+    ConvertToRigid(v, f);
+}
+
+void FluidModule::clearRigids()
+{
+    m_world.clearRigids();
+    {
+        // 床
+        psym::RigidPlane plane;
+        plane.id = 0;
+        plane.bb.bl_x = -PSYM_GRID_SIZE;
+        plane.bb.bl_y = -PSYM_GRID_SIZE;
+        plane.bb.bl_z = -PSYM_GRID_SIZE;
+        plane.bb.ur_x =  PSYM_GRID_SIZE;
+        plane.bb.ur_y =  PSYM_GRID_SIZE;
+        plane.bb.ur_z =  PSYM_GRID_SIZE;
+        plane.nx = 0.0f;
+        plane.ny = 0.0f;
+        plane.nz = 1.0f;
+        plane.distance = 0.0f;
+        m_world.addRigid(plane);
+    }
+}
+
+uint32 FluidModule::addRigid(const CollisionEntity &v)
+{
+    return AddRigid(m_world, v);
+}
+
+void FluidModule::setRigid(uint32 i, const CollisionEntity &v)
+{
+    SetRigid(m_world, i, v);
+}
+
 void FluidModule::addForce( const psym::PointForce &v )
 {
     m_world.addForce(v);
 }
 
-void FluidModule::addFluid( psym::Particle *particles, uint32 num )
+// 呼び出し側スレッドのステージに num 個分の領域を確保
+inline psym::Particle* StageFluid(FluidModule::FluidStages &stages, uint32 num)
 {
-    const float32 energy_base = 2400.0f;
-    const float32 energy_diffuse = 600.0f;
-    for(uint32 i=0; i<num; ++i) {
-        particles[i].energy = energy_base + (m_rand.genFloat32()*energy_diffuse);
-        particles[i].density = 0.0f;
-        particles[i].hash = 0;
-        particles[i].hit_to = 0;
+    FluidModule::FluidStage &stage = stages.local();
+    ParticleCont &particles = stage.particles;
+    size_t pos = particles.size();
+    particles.resize(pos+num);
+    FluidModule::StagedChunk chunk = {(uint32)pos, num};
+    stage.chunks.push_back(chunk);
+    return &particles[pos];
+}
+
+// ステージのスレッドへの割り当てや走査順は実行毎に変わるので、psym に書く順序は内容で決める
+struct LessStagedRange
+{
+    bool operator()(const FluidModule::StagedRange &a, const FluidModule::StagedRange &b) const
+    {
+        uint32 n = stl::min<uint32>(a.num, b.num);
+        for(uint32 i=0; i<n; ++i) {
+            // energy などは flushFluid() で上書きされるので position と velocity だけ比べる
+            int c = memcmp(&a.src[i], &b.src[i], sizeof(psym::simdvec4)*2);
+            if(c!=0) { return c<0; }
+        }
+        return a.num<b.num;
+    }
+};
+
+struct LessAddFluidContext
+{
+    bool operator()(const FluidModule::AddFluidContext &a, const FluidModule::AddFluidContext &b) const
+    {
+        if(a.psid!=b.psid) { return a.psid<b.psid; }
+        if(a.num!=b.num) { return a.num<b.num; }
+        return memcmp(&a.mat, &b.mat, sizeof(mat4))<0;
     }
-    m_world.addParticles(particles, num);
+};
+
+psym::Particle* FluidModule::allocFluid(uint32 num)
+{
+    return StageFluid(m_stages, num);
+}
+
+void FluidModule::addFluid(const psym::Particle *particles, uint32 num)
+{
+    if(num==0) { return; }
+    istMemcpy(StageFluid(m_stages, num), particles, sizeof(psym::Particle)*num);
 }
 
 void FluidModule::addFluid(PSET_RID psid, const mat4 &t, uint32 num)
@@ -234,12 +381,109 @@ void FluidModule::addFluid(PSET_RID psid, const mat4 &t, uint32 num)
     AddFluidContext ctx;
     ctx.psid = psid;
     ctx.mat = t;
-    ctx.index = m_new_fluid.size();
+    ctx.index = 0;
     ctx.num = num==0 ? pset->getNumParticles() : std::min<uint32>(num, pset->getNumParticles());
-    m_new_fluid.resize(m_new_fluid.size()+ctx.num);
-    m_new_fluid_ctx.push_back(ctx);
+    m_stages.local().contexts.push_back(ctx);
 }
 
+void FluidModule::flushFluid()
+{
+    // 各スレッドのステージの内容を集めて内容順に並べ、psym 側のどこに書くかを決める
+    m_flush_ranges.clear();
+    m_flush_ctx.clear();
+    for(FluidStages::iterator i=m_stages.begin(); i!=m_stages.end(); ++i) {
+        FluidStage &stage = *i;
+        each(stage.chunks, [&](const StagedChunk &c){
+            if(c.num==0) { return; }
+            StagedRange r = {&stage.particles[c.offset], 0, c.num};
+            m_flush_ranges.push_back(r);
+        });
+        m_flush_ctx.insert(m_flush_ctx.end(), stage.contexts.begin(), stage.contexts.end());
+    }
+    stl::sort(m_flush_ranges.begin(), m_flush_ranges.end(), LessStagedRange());
+    stl::sort(m_flush_ctx.begin(), m_flush_ctx.end(), LessAddFluidContext());
+    uint32 total = 0;
+    each(m_flush_ranges, [&](StagedRange &r){
+        r.index = total;
+        total += r.num;
+    });
+    each(m_flush_ctx, [&](AddFluidContext &ctx){
+        ctx.index = total;
+        total += ctx.num;
+    });
+
+    // psym の空きに直接書き込む
+    size_t num_alloc = total;
+    psym::Particle *dst = m_world.allocParticles(num_alloc);
+    uint32 num_dst = (uint32)num_alloc;
+
+    ist::parallel_for(size_t(0), m_flush_ranges.size(),
+        [&](size_t i){
+            const StagedRange &r = m_flush_ranges[i];
+            if(r.index>=num_dst) { return; }
+            uint32 num_particles = std::min<uint32>(r.num, num_dst-r.index);
+            istMemcpy(dst+r.index, r.src, sizeof(psym::Particle)*num_particles);
+        });
+    ist::parallel_for(size_t(0), m_flush_ctx.size(),
+        [&](size_t i){
+            const AddFluidContext &ctx      = m_flush_ctx[i];
+            if(ctx.index>=num_dst) { return; }
+            const ParticleSet *rc           = atmGetParticleSet(ctx.psid);
+            uint32 num_particles            = std::min<uint32>(ctx.num, num_dst-ctx.index);
+            const PSetParticle *fluid_in    = rc->getParticleData();
+            psym::Particle *fluid_out       = dst+ctx.index;
+
+            simdvec4 zero(vec4(0.0f, 0.0f, 0.0f, 0.0f));
+            simdmat4 t(ctx.mat);
+            for(uint32 i=0; i<num_particles; ++i) {
+                simdvec4 p(vec4(fluid_in[i].position, 1.0f));
+                istAlign(16) vec4 pos = glm::vec4_cast(t * p);
+                pos.z = stl::max<float32>(pos.z, 0.0f);
+                fluid_out[i].position = reinterpret_cast<const psym::simdvec4&>(pos);
+                fluid_out[i].velocity = reinterpret_cast<const psym::simdvec4&>(zero);
+            }
+        });
+
+    // energy は乱数を使うので直列で
+    const float32 energy_base = 2400.0f;
+    const float32 energy_diffuse = 600.0f;
+    for(uint32 i=0; i<num_dst; ++i) {
+        dst[i].energy = energy_base + (m_rand.genFloat32()*energy_diffuse);
+        dst[i].density = 0.0f;
+        dst[i].hash = 0;
+        dst[i].hit_to = 0;
+    }
+
+    for(FluidStages::iterator i=m_stages.begin(); i!=m_stages.end(); ++i) {
+        i->particles.clear();
+        i->chunks.clear();
+        i->contexts.clear();
+    }
+}
+
+#ifdef atm_enable_StateSave
+static const char s_checkpoint_path[] = "State/fluid.psym";
+
+void FluidModule::dbgSaveCheckpoint()
+{
+    mkdir("State");
+    ist::FileStream fs(s_checkpoint_path, "wb");
+    if(!fs.isOpened() || !m_world.saveCheckpoint(fs, true)) {
+        istPrint("FluidModule::dbgSaveCheckpoint(): failed to write %s\n", s_checkpoint_path);
+    }
+}
+
+void FluidModule::dbgLoadCheckpoint()
+{
+    ist::FileStream fs(s_checkpoint_path, "rb");
+    if(!fs.isOpened() || !m_world.loadCheckpoint(fs)) {
+        istPrint("FluidModule::dbgLoadCheckpoint(): failed to read %s\n", s_checkpoint_path);
+    }
+    // rigid は保存時の CollisionEntity と対応しているとは限らないので作り直させる
+    atmGetCollisionModule()->requestRigidsRebuild();
+}
+#endif // atm_enable_StateSave
+
 void FluidModule::handleStateQuery( EntitiesQueryContext &ctx )
 {
     const psym::Particle *particles = m_world.getParticles();
@@ -251,4 +495,686 @@ void FluidModule::handleStateQuery( EntitiesQueryContext &ctx )
     }
 }
 
+
+#ifdef atm_enable_Benchmark
+
+void FluidModule::dbgBenchmarkRigidGrid()
+{
+    // rigid の数を変えながら、rigid grid あり/なしで psym::World::update() の時間を比較
+    const uint32 num_particles = 20000;
+    const uint32 num_frames = 10;
+    const uint32 rigid_counts[] = {10, 100, 1000, 5000};
+
+    SFMT rand;
+    rand.initialize(0);
+    ParticleCont particles(num_particles);
+    for(uint32 i=0; i<num_particles; ++i) {
+        istAlign(16) vec4 pos((rand.genFloat32()-0.5f)*4.0f, (rand.genFloat32()-0.5f)*4.0f, rand.genFloat32()*0.2f, 1.0f);
+        istAlign(16) vec4 zero(0.0f);
+        psym::Particle &p = particles[i];
+        p.position = reinterpret_cast<const psym::simdvec4&>(pos);
+        p.velocity = reinterpret_cast<const psym::simdvec4&>(zero);
+        p.energy = 10000.0f;
+        p.density = 0.0f;
+        p.hash = 0;
+        p.hit_to = 0;
+    }
+
+    psym::World *worlds[2] = { istNew(psym::World)(), istNew(psym::World)() };
+    for(uint32 ri=0; ri<_countof(rigid_counts); ++ri) {
+        uint32 num_rigids = rigid_counts[ri];
+        float32 elapsed[2] = {0.0f, 0.0f};
+        for(uint32 wi=0; wi<2; ++wi) {
+            psym::World &world = *worlds[wi];
+            world.num_active_particles = 0;
+            world.clearRigidsAndForces();
+            world.rigid_grid_enabled = wi==0;
+            world.addParticles(&particles[0], particles.size());
+
+            rand.initialize(ri);
+            for(uint32 i=0; i<num_rigids; ++i) {
+                float32 x = (rand.genFloat32()-0.5f)*4.8f;
+                float32 y = (rand.genFloat32()-0.5f)*4.8f;
+                float32 r = 0.02f + rand.genFloat32()*0.08f;
+                if(i%2==0) {
+                    psym::RigidSphere s;
+                    s.id = i+1;
+                    s.x = x; s.y = y; s.z = 0.0f;
+                    s.radius = r;
+                    s.bb.bl_x = x-r; s.bb.bl_y = y-r; s.bb.bl_z = -r;
+                    s.bb.ur_x = x+r; s.bb.ur_y = y+r; s.bb.ur_z =  r;
+                    world.addRigid(s);
+                }
+                else {
+                    psym::RigidBox b;
+                    b.id = i+1;
+                    b.x = x; b.y = y; b.z = 0.0f;
+                    b.bb.bl_x = x-r; b.bb.bl_y = y-r; b.bb.bl_z = -r;
+                    b.bb.ur_x = x+r; b.bb.ur_y = y+r; b.bb.ur_z =  r;
+                    const float32 normals[6][3] = {{1,0,0},{-1,0,0},{0,1,0},{0,-1,0},{0,0,1},{0,0,-1}};
+                    for(uint32 pi=0; pi<6; ++pi) {
+                        b.planes[pi].nx = normals[pi][0];
+                        b.planes[pi].ny = normals[pi][1];
+                        b.planes[pi].nz = normals[pi][2];
+                        b.planes[pi].distance = -r;
+                    }
+                    world.addRigid(b);
+                }
+            }
+
+            ist::Timer timer;
+            for(uint32 f=0; f<num_frames; ++f) {
+                psym::DirectionalForce grav;
+                grav.nx = 0.0f;
+                grav.ny = 0.0f;
+                grav.nz = -1.0f;
+                grav.strength = m_gravity_strength;
+                world.clearForces();
+                world.addForce(grav);
+                world.update(1.0f);
+            }
+            elapsed[wi] = timer.getElapsedMillisec();
+        }
+
+        // グリッドの有無で結果が変わってはいけない
+        istAssert(worlds[0]->getNumParticles()==worlds[1]->getNumParticles());
+        istAssert(memcmp(worlds[0]->getParticles(), worlds[1]->getParticles(), sizeof(psym::Particle)*worlds[0]->getNumParticles())==0);
+        istPrint("rigid grid %u particles, %u rigids, %u frames: grid %.2fms, brute force %.2fms\n",
+            num_particles, num_rigids, num_frames, elapsed[0], elapsed[1]);
+    }
+    istDelete(worlds[1]);
+    istDelete(worlds[0]);
+}
+
+void FluidModule::dbgBenchmarkFluidSpawn()
+{
+    // 多数のスレッドから少量ずつ流体を追加する状況 (敵の一斉撃破など) で、
+    // mutex で守った共有バッファとスレッド毎のステージを比較
+    const uint32 num_submits = 100000;
+    const uint32 particles_per_submit = 8;
+
+    psym::Particle src[particles_per_submit];
+    istMemset(src, 0, sizeof(src));
+
+    ist::Mutex mutex;
+    ParticleCont shared;
+    ist::Timer timer;
+    ist::parallel_for(uint32(0), num_submits,
+        [&](uint32 i){
+            ist::ScopedLock<ist::Mutex> l(mutex);
+            shared.insert(shared.end(), src, src+particles_per_submit);
+        });
+    float32 t_mutex = timer.getElapsedMillisec();
+
+    FluidStages stages;
+    timer.reset();
+    ist::parallel_for(uint32(0), num_submits,
+        [&](uint32 i){
+            istMemcpy(StageFluid(stages, particles_per_submit), src, sizeof(src));
+        });
+    float32 t_staged = timer.getElapsedMillisec();
+
+    size_t num_staged = 0;
+    for(FluidStages::iterator i=stages.begin(); i!=stages.end(); ++i) {
+        num_staged += i->particles.size();
+    }
+    istAssert(shared.size()==num_staged && num_staged==num_submits*particles_per_submit);
+    istPrint("fluid spawn %u submits x %u particles, %u threads: mutex %.2fms, per-thread stage %.2fms\n",
+        num_submits, particles_per_submit, (uint32)stages.size(), t_mutex, t_staged);
+}
+
+void FluidModule::dbgBenchmarkFluidSnapshot()
+{
+    // 描画用スナップショットの作成 + GPU への転送 (ここでは memcpy で代用) にかかる時間と転送量を比較。
+    // 従来: psym::Particle を丸ごとコピー + 丸ごと転送。新: update() 中に RenderParticle を書き出し + 転送
+    const uint32 num_particles = 100000;
+    const uint32 num_frames = 10;
+
+    SFMT rand;
+    rand.initialize(0);
+    ParticleCont particles(num_particles);
+    for(uint32 i=0; i<num_particles; ++i) {
+        istAlign(16) vec4 pos((rand.genFloat32()-0.5f)*4.0f, (rand.genFloat32()-0.5f)*4.0f, rand.genFloat32()*0.5f, 1.0f);
+        istAlign(16) vec4 zero(0.0f);
+        psym::Particle &p = particles[i];
+        p.position = reinterpret_cast<const psym::simdvec4&>(pos);
+        p.velocity = reinterpret_cast<const psym::simdvec4&>(zero);
+        p.energy = 10000.0f;
+        p.density = 0.0f;
+        p.hash = 0;
+        p.hit_to = 0;
+    }
+    psym::World *world = istNew(psym::World)();
+    world->addParticles(&particles[0], particles.size());
+
+    ParticleCont snapshot_full;
+    RenderParticleCont snapshot_render;
+    ist::raw_vector<char> gpu(sizeof(psym::Particle)*PSYM_MAX_PARTICLE_NUM);
+    float32 t_update = 0.0f, t_update_render = 0.0f, t_full = 0.0f, t_render = 0.0f;
+    size_t bytes_full = 0, bytes_render = 0;
+    ist::Timer timer;
+    for(uint32 f=0; f<num_frames; ++f) {
+        // 従来
+        timer.reset();
+        snapshot_full.clear();
+        snapshot_full.insert(snapshot_full.end(), world->getParticles(), world->getParticles()+world->getNumParticles());
+        istMemcpy(&gpu[0], &snapshot_full[0], snapshot_full.size()*sizeof(psym::Particle));
+        t_full += timer.getElapsedMillisec();
+        bytes_full += snapshot_full.size()*sizeof(psym::Particle)*2;
+
+        timer.reset();
+        world->update(1.0f);
+        t_update += timer.getElapsedMillisec();
+
+        // 新
+        snapshot_render.resize(world->getNumParticles());
+        timer.reset();
+        world->update(1.0f, &snapshot_render[0]);
+        snapshot_render.resize(world->getNumParticles());
+        t_update_render += timer.getElapsedMillisec();
+        timer.reset();
+        istMemcpy(&gpu[0], &snapshot_render[0], snapshot_render.size()*sizeof(psym::RenderParticle));
+        t_render += timer.getElapsedMillisec();
+        bytes_render += snapshot_render.size()*sizeof(psym::RenderParticle)*2;
+
+        const psym::Particle *wp = world->getParticles();
+        for(size_t i=0; i<snapshot_render.size(); ++i) {
+            const float32 *pos = (const float32*)&wp[i].position;
+            istAssert(snapshot_render[i].x==pos[0] && snapshot_render[i].y==pos[1] && snapshot_render[i].z==pos[2]);
+            istAssert(snapshot_render[i].density==wp[i].density);
+        }
+    }
+    // 新方式のスナップショット作成コストは update() の増分とみなす
+    t_render += std::max<float32>(t_update_render-t_update, 0.0f);
+    istPrint("fluid snapshot %u particles, %u frames: full copy %.2fms %.2fMB/frame, render data %.2fms %.2fMB/frame\n",
+        num_particles, num_frames,
+        t_full, float32(bytes_full)/num_frames/(1024.0f*1024.0f),
+        t_render, float32(bytes_render)/num_frames/(1024.0f*1024.0f));
+
+    istDelete(world);
+}
+
+void FluidModule::dbgBenchmarkFluidPacking()
+{
+    const uint32 num_particles = PSYM_MAX_PARTICLE_NUM;
+    const uint32 num_frames = 10;
+
+    SFMT rand;
+    rand.initialize(0);
+    RenderParticleCont src(num_particles);
+    for(uint32 i=0; i<num_particles; ++i) {
+        psym::RenderParticle &p = src[i];
+        p.x = GLSL_FLUID_PACKED_POS + rand.genFloat32()*GLSL_FLUID_PACKED_SIZE;
+        p.y = GLSL_FLUID_PACKED_POS + rand.genFloat32()*GLSL_FLUID_PACKED_SIZE;
+        p.z = rand.genFloat32()*0.5f;
+        p.energy = rand.genFloat32()*3000.0f;
+        p.density = rand.genFloat32()*1000.0f;
+    }
+    PackedParticleCont dst(num_particles);
+
+    ist::Timer timer;
+    for(uint32 f=0; f<num_frames; ++f) {
+        EncodeFluidParticles(&src[0], &dst[0], num_particles);
+    }
+    float32 t_encode = timer.getElapsedMillisec() / num_frames;
+
+    // 精度: position は範囲の 1/65535 の半分、half は相対誤差 2^-11 以内
+    const float32 pos_tolerance = GLSL_FLUID_PACKED_SIZE/65535.0f*0.5f + 0.00001f;
+    const float32 half_tolerance = 1.0f/2048.0f;
+    float32 max_pos_error = 0.0f, max_param_error = 0.0f;
+    for(uint32 i=0; i<num_particles; ++i) {
+        vec3 pos = DecodeFluidPosition(dst[i]);
+        vec3 d = glm::abs(pos - vec3(src[i].x, src[i].y, src[i].z));
+        max_pos_error = std::max<float32>(max_pos_error, std::max<float32>(d.x, std::max<float32>(d.y, d.z)));
+        if(src[i].energy > 1.0f) {
+            max_param_error = std::max<float32>(max_param_error, std::abs(float32(dst[i].energy)-src[i].energy)/src[i].energy);
+        }
+        if(src[i].density > 1.0f) {
+            max_param_error = std::max<float32>(max_param_error, std::abs(float32(dst[i].density)-src[i].density)/src[i].density);
+        }
+    }
+    istAssert(max_pos_error <= pos_tolerance);
+    istAssert(max_param_error <= half_tolerance);
+
+    // 範囲外は端に丸められる
+    {
+        psym::RenderParticle outside = {-10.0f, 10.0f, 0.0f, 0.0f, 0.0f};
+        FluidPackedParticle packed;
+        EncodeFluidParticles(&outside, &packed, 1);
+        istAssert(packed.x==0 && packed.y==65535);
+    }
+
+    istPrint("fluid packing %u particles: encode %.2fms (%.1fM particles/s), %u -> %u bytes/particle (%.2fMB -> %.2fMB), max error pos %f param %f\n",
+        num_particles, t_encode, float32(num_particles)/(t_encode*1000.0f),
+        (uint32)sizeof(psym::RenderParticle), (uint32)sizeof(FluidPackedParticle),
+        float32(sizeof(psym::RenderParticle)*num_particles)/(1024.0f*1024.0f),
+        float32(sizeof(FluidPackedParticle)*num_particles)/(1024.0f*1024.0f),
+        max_pos_error, max_param_error);
+}
+
+void FluidModule::dbgBenchmarkSubsteps()
+{
+    // 高速なパーティクル (レーザーで飛ばされた血など) が壁に当たる状況で、sub-step 数毎の処理時間と安定性を比較。
+    // 安定性は最終的な最大速度と、壁 (z=0 の plane) を突き抜けたパーティクルの数で見る
+    const uint32 num_particles = 20000;
+    const uint32 num_frames = 30;
+    const int32 substep_counts[] = {1, 2, 4, 0}; // 0: adaptive
+
+    SFMT rand;
+    rand.initialize(0);
+    ParticleCont particles(num_particles);
+    for(uint32 i=0; i<num_particles; ++i) {
+        float32 speed = 10.0f + rand.genFloat32()*40.0f;
+        float32 angle = glm::radians(rand.genFloat32()*360.0f);
+        istAlign(16) vec4 pos((rand.genFloat32()-0.5f)*2.0f, (rand.genFloat32()-0.5f)*2.0f, rand.genFloat32()*0.2f, 1.0f);
+        istAlign(16) vec4 vel(std::cos(angle)*speed, std::sin(angle)*speed, -speed*0.5f, 0.0f);
+        psym::Particle &p = particles[i];
+        p.position = reinterpret_cast<const psym::simdvec4&>(pos);
+        p.velocity = reinterpret_cast<const psym::simdvec4&>(vel);
+        p.energy = 10000.0f;
+        p.density = 0.0f;
+        p.hash = 0;
+        p.hit_to = 0;
+    }
+
+    psym::World *world = istNew(psym::World)();
+    psym::World *verify = istNew(psym::World)();
+    for(uint32 ci=0; ci<_countof(substep_counts); ++ci) {
+        psym::World *worlds[2] = {world, verify};
+        float32 elapsed = 0.0f;
+        int32 total_substeps = 0;
+        for(uint32 wi=0; wi<2; ++wi) {
+            psym::World &w = *worlds[wi];
+            w.num_active_particles = 0;
+            w.clearRigidsAndForces();
+            w.adaptive_substeps = substep_counts[ci]==0;
+            w.substeps = w.adaptive_substeps ? 1 : substep_counts[ci];
+            w.max_substeps = 8;
+            w.addParticles(&particles[0], particles.size());
+            psym::RigidPlane floor;
+            floor.id = 1;
+            floor.nx = 0.0f; floor.ny = 0.0f; floor.nz = 1.0f;
+            floor.distance = 0.0f;
+            w.addRigid(floor);
+
+            ist::Timer timer;
+            for(uint32 f=0; f<num_frames; ++f) {
+                psym::DirectionalForce grav;
+                grav.nx = 0.0f;
+                grav.ny = 0.0f;
+                grav.nz = -1.0f;
+                grav.strength = m_gravity_strength;
+                w.clearForces();
+                w.addForce(grav);
+                w.update(1.0f);
+                if(wi==0) { total_substeps += w.last_num_substeps; }
+            }
+            if(wi==0) { elapsed = timer.getElapsedMillisec(); }
+        }
+
+        // 同じ入力なら結果は毎回同じでなければならない
+        istAssert(world->getNumParticles()==verify->getNumParticles());
+        istAssert(memcmp(world->getParticles(), verify->getParticles(), sizeof(psym::Particle)*world->getNumParticles())==0);
+
+        uint32 num_penetrated = 0;
+        float32 max_speed = 0.0f;
+        const psym::Particle *ps = world->getParticles();
+        for(size_t i=0; i<world->getNumParticles(); ++i) {
+            const float32 *pos = (const float32*)&ps[i].position;
+            const float32 *vel = (const float32*)&ps[i].velocity;
+            if(pos[2] < -PSYM_CELL_SIZE) { ++num_penetrated; }
+            max_speed = std::max<float32>(max_speed, std::sqrt(vel[0]*vel[0] + vel[1]*vel[1] + vel[2]*vel[2]));
+        }
+        istPrint("substeps %s%d: %.2fms/frame (%.2f substeps/frame), penetrated %u/%u, max speed %.2f\n",
+            substep_counts[ci]==0 ? "adaptive " : "", substep_counts[ci],
+            elapsed/num_frames, float32(total_substeps)/num_frames, num_penetrated, num_particles, max_speed);
+    }
+    istDelete(verify);
+    istDelete(world);
+}
+
+// 各セル内のパーティクルの重心。sleep の有無での見た目の差の比較用
+static void dbgComputeCellCentroids(const psym::World &world, ist::raw_vector<vec4> &out)
+{
+    static const float32 rcpcellsize = 1.0f/PSYM_CELL_SIZE;
+    out.clear();
+    out.resize(PSYM_GRID_CELL_NUM, vec4(0.0f));
+    const psym::Particle *ps = world.getParticles();
+    for(size_t i=0; i<world.getNumParticles(); ++i) {
+        const float32 *pos = (const float32*)&ps[i].position;
+        int32 xi = clamp<int32>(int32((pos[0]-PSYM_GRID_POS)*rcpcellsize), 0, PSYM_GRID_DIV-1);
+        int32 yi = clamp<int32>(int32((pos[1]-PSYM_GRID_POS)*rcpcellsize), 0, PSYM_GRID_DIV-1);
+        out[yi*PSYM_GRID_DIV+xi] += vec4(pos[0], pos[1], pos[2], 1.0f);
+    }
+    for(size_t i=0; i<out.size(); ++i) {
+        if(out[i].w > 0.0f) { out[i] /= out[i].w; }
+    }
+}
+
+void FluidModule::dbgBenchmarkSleeping()
+{
+    // 床に溜まって静止した流体の中を球が横切り、途中で新しい流体が落ちてくる状況で、sleep の有無を比較。
+    // 見た目の差は、両方で空でないセルの重心の位置の差の最大値で見る
+    const float32 spacing = 0.01f;
+    const int32 div = 140;
+    const uint32 num_warmup = 120;
+    const uint32 num_frames = 120;
+
+    ParticleCont pool;
+    for(int32 yi=0; yi<div; ++yi) {
+        for(int32 xi=0; xi<div; ++xi) {
+            istAlign(16) vec4 pos((xi-div/2)*spacing, (yi-div/2)*spacing, spacing*0.5f, 1.0f);
+            istAlign(16) vec4 zero(0.0f);
+            psym::Particle p;
+            p.position = reinterpret_cast<const psym::simdvec4&>(pos);
+            p.velocity = reinterpret_cast<const psym::simdvec4&>(zero);
+            p.energy = 100000.0f;
+            p.density = 0.0f;
+            p.hash = 0;
+            p.hit_to = 0;
+            pool.push_back(p);
+        }
+    }
+    ParticleCont drop;
+    drop.insert(drop.end(), pool.begin(), pool.begin()+500);
+    for(size_t i=0; i<drop.size(); ++i) {
+        istAlign(16) vec4 pos(0.3f+(i%20)*spacing, -0.3f+(i/20)*spacing, 0.3f, 1.0f);
+        istAlign(16) vec4 vel(0.0f, 0.0f, -5.0f, 0.0f);
+        drop[i].position = reinterpret_cast<const psym::simdvec4&>(pos);
+        drop[i].velocity = reinterpret_cast<const psym::simdvec4&>(vel);
+    }
+
+    psym::World *worlds[2] = { istNew(psym::World)(), istNew(psym::World)() };
+    float32 elapsed[2] = {0.0f, 0.0f};
+    float32 sleeping_ratio = 0.0f;
+    for(uint32 wi=0; wi<2; ++wi) {
+        psym::World &world = *worlds[wi];
+        world.sleeping_enabled = wi==0;
+        world.addParticles(&pool[0], pool.size());
+        psym::RigidPlane floor;
+        floor.id = 1;
+        floor.nx = 0.0f; floor.ny = 0.0f; floor.nz = 1.0f;
+        floor.distance = 0.0f;
+        world.addRigid(floor);
+        psym::RigidSphere sphere;
+        sphere.id = 2;
+        sphere.x = sphere.y = sphere.z = 10.0f;
+        sphere.radius = 0.1f;
+        sphere.bb.bl_x = sphere.bb.bl_y = sphere.bb.bl_z = 10.0f-sphere.radius;
+        sphere.bb.ur_x = sphere.bb.ur_y = sphere.bb.ur_z = 10.0f+sphere.radius;
+        size_t sphere_index = world.addRigid(sphere);
+
+        psym::DirectionalForce grav;
+        grav.nx = 0.0f;
+        grav.ny = 0.0f;
+        grav.nz = -1.0f;
+        grav.strength = m_gravity_strength;
+        world.addForce(grav);
+
+        for(uint32 f=0; f<num_warmup; ++f) {
+            world.update(1.0f);
+        }
+
+        uint32 total_sleeping = 0;
+        ist::Timer timer;
+        for(uint32 f=0; f<num_frames; ++f) {
+            // 30-60 frame: 球が横切る
+            if(f>=30 && f<60) {
+                float32 x = -0.7f + 1.4f*(f-30)/30.0f;
+                sphere.x = x; sphere.y = 0.0f; sphere.z = 0.0f;
+                sphere.bb.bl_x = x-sphere.radius; sphere.bb.bl_y = -sphere.radius; sphere.bb.bl_z = -sphere.radius;
+                sphere.bb.ur_x = x+sphere.radius; sphere.bb.ur_y =  sphere.radius; sphere.bb.ur_z =  sphere.radius;
+                world.setRigid(sphere_index, sphere);
+            }
+            // 80 frame: 新しい流体が落ちてくる
+            if(f==80) {
+                world.addParticles(&drop[0], drop.size());
+            }
+            world.update(1.0f);
+            total_sleeping += world.last_num_sleeping_particles;
+        }
+        elapsed[wi] = timer.getElapsedMillisec();
+        if(wi==0) {
+            sleeping_ratio = float32(total_sleeping) / (num_frames*world.getNumParticles());
+        }
+    }
+
+    ist::raw_vector<vec4> centroids[2];
+    dbgComputeCellCentroids(*worlds[0], centroids[0]);
+    dbgComputeCellCentroids(*worlds[1], centroids[1]);
+    float32 max_drift = 0.0f;
+    uint32 num_mismatch_cells = 0;
+    for(uint32 i=0; i<PSYM_GRID_CELL_NUM; ++i) {
+        const vec4 &a = centroids[0][i];
+        const vec4 &b = centroids[1][i];
+        if((a.w>0.0f) != (b.w>0.0f)) { ++num_mismatch_cells; }
+        else if(a.w>0.0f) { max_drift = std::max<float32>(max_drift, glm::length(vec3(a)-vec3(b))); }
+    }
+
+    istPrint("sleeping %u particles, %u frames: sleep %.2fms, no sleep %.2fms (x%.2f), %.1f%% asleep, max centroid drift %f (cell %f), %u cells occupied by only one side\n",
+        (uint32)worlds[1]->getNumParticles(), num_frames, elapsed[0], elapsed[1], elapsed[1]/std::max<float32>(elapsed[0], 0.001f),
+        sleeping_ratio*100.0f, max_drift, PSYM_CELL_SIZE, num_mismatch_cells);
+    istDelete(worlds[1]);
+    istDelete(worlds[0]);
+}
+
+void FluidModule::dbgBenchmarkIslands()
+{
+    // 同じ数のパーティクルを何個の塊に分けて置くかを変えながら、island 分割あり/なしで psym::World::update() の時間を比較
+    const uint32 num_particles = 40000;
+    const uint32 num_frames = 10;
+    const uint32 cluster_divs[] = {1, 2, 4, 8}; // 塊の数はこれの 2 乗
+
+    psym::World *worlds[2] = { istNew(psym::World)(), istNew(psym::World)() };
+    for(uint32 ci=0; ci<_countof(cluster_divs); ++ci) {
+        const uint32 div = cluster_divs[ci];
+        const uint32 num_clusters = div*div;
+        const float32 spacing = 4.0f / div;
+        const float32 radius = spacing * 0.3f;
+
+        SFMT rand;
+        rand.initialize(ci);
+        ParticleCont particles(num_particles);
+        for(uint32 i=0; i<num_particles; ++i) {
+            uint32 c = i % num_clusters;
+            float32 cx = -2.0f + spacing*(c%div + 0.5f);
+            float32 cy = -2.0f + spacing*(c/div + 0.5f);
+            istAlign(16) vec4 pos(cx+(rand.genFloat32()-0.5f)*radius, cy+(rand.genFloat32()-0.5f)*radius, rand.genFloat32()*0.2f, 1.0f);
+            istAlign(16) vec4 zero(0.0f);
+            psym::Particle &p = particles[i];
+            p.position = reinterpret_cast<const psym::simdvec4&>(pos);
+            p.velocity = reinterpret_cast<const psym::simdvec4&>(zero);
+            p.energy = 10000.0f;
+            p.density = 0.0f;
+            p.hash = 0;
+            p.hit_to = 0;
+        }
+
+        float32 elapsed[2] = {0.0f, 0.0f};
+        for(uint32 wi=0; wi<2; ++wi) {
+            psym::World &world = *worlds[wi];
+            world.num_active_particles = 0;
+            world.clearRigidsAndForces();
+            world.islands_enabled = wi==0;
+            world.sleeping_enabled = false;
+            world.addParticles(&particles[0], particles.size());
+
+            ist::Timer timer;
+            for(uint32 f=0; f<num_frames; ++f) {
+                psym::DirectionalForce grav;
+                grav.nx = 0.0f;
+                grav.ny = 0.0f;
+                grav.nz = -1.0f;
+                grav.strength = m_gravity_strength;
+                world.clearForces();
+                world.addForce(grav);
+                world.update(1.0f);
+            }
+            elapsed[wi] = timer.getElapsedMillisec();
+        }
+
+        // island 分割の有無で結果が変わってはいけない
+        istAssert(worlds[0]->getNumParticles()==worlds[1]->getNumParticles());
+        istAssert(memcmp(worlds[0]->getParticles(), worlds[1]->getParticles(), sizeof(psym::Particle)*worlds[0]->getNumParticles())==0);
+        istPrint("islands %u particles in %u clusters, %u frames: %d islands %.2fms, single %.2fms\n",
+            num_particles, num_clusters, num_frames, worlds[0]->last_num_islands, elapsed[0], elapsed[1]);
+    }
+    istDelete(worlds[1]);
+    istDelete(worlds[0]);
+}
+
+void FluidModule::dbgBenchmarkCheckpoint()
+{
+    // 最大数のパーティクルで save/load の時間とサイズを計測し、
+    // load したものと元のものをそれぞれ進めて結果が一致することを確認する
+    const uint32 num_particles = PSYM_MAX_PARTICLE_NUM;
+    const uint32 num_warmup = 10;
+    const uint32 num_frames = 10;
+
+    SFMT rand;
+    rand.initialize(0);
+    ParticleCont particles(num_particles);
+    for(uint32 i=0; i<num_particles; ++i) {
+        istAlign(16) vec4 pos((rand.genFloat32()-0.5f)*4.0f, (rand.genFloat32()-0.5f)*4.0f, rand.genFloat32()*0.5f, 1.0f);
+        istAlign(16) vec4 vel((rand.genFloat32()-0.5f), (rand.genFloat32()-0.5f), 0.0f, 0.0f);
+        psym::Particle &p = particles[i];
+        p.position = reinterpret_cast<const psym::simdvec4&>(pos);
+        p.velocity = reinterpret_cast<const psym::simdvec4&>(vel);
+        p.energy = 1000.0f + rand.genFloat32()*1000.0f;
+        p.density = 0.0f;
+        p.hash = 0;
+        p.hit_to = 0;
+    }
+
+    psym::World *world = istNew(psym::World)();
+    psym::World *restored = istNew(psym::World)();
+    world->addParticles(&particles[0], particles.size());
+    {
+        psym::RigidPlane floor;
+        floor.id = 1;
+        floor.nx = 0.0f; floor.ny = 0.0f; floor.nz = 1.0f;
+        floor.distance = 0.0f;
+        world->addRigid(floor);
+        psym::RigidSphere sphere;
+        sphere.id = 2;
+        sphere.x = 0.5f; sphere.y = 0.5f; sphere.z = 0.0f;
+        sphere.radius = 0.2f;
+        sphere.bb.bl_x = 0.3f; sphere.bb.bl_y = 0.3f; sphere.bb.bl_z = -0.2f;
+        sphere.bb.ur_x = 0.7f; sphere.bb.ur_y = 0.7f; sphere.bb.ur_z =  0.2f;
+        world->addRigid(sphere);
+    }
+
+    psym::DirectionalForce grav;
+    grav.nx = 0.0f;
+    grav.ny = 0.0f;
+    grav.nz = -1.0f;
+    grav.strength = m_gravity_strength;
+    psym::World *worlds[2] = {world, restored};
+
+    for(uint32 f=0; f<num_warmup; ++f) {
+        world->clearForces();
+        world->addForce(grav);
+        world->update(1.0f);
+    }
+
+    for(uint32 ci=0; ci<2; ++ci) {
+        const bool compress = ci==1;
+        ist::MemoryStream ms;
+        ist::Timer timer;
+        bool saved = world->saveCheckpoint(ms, compress);
+        float32 t_save = timer.getElapsedMillisec();
+        uint64 bytes = ms.getWritePos();
+
+        timer.reset();
+        bool loaded = restored->loadCheckpoint(ms);
+        float32 t_load = timer.getElapsedMillisec();
+        istAssert(saved && loaded);
+        istAssert(restored->getNumParticles()==world->getNumParticles());
+        istAssert(memcmp(restored->getParticles(), world->getParticles(), sizeof(psym::Particle)*world->getNumParticles())==0);
+
+        // 両方を進めても結果は一致しなければならない
+        for(uint32 f=0; f<num_frames; ++f) {
+            for(uint32 wi=0; wi<2; ++wi) {
+                worlds[wi]->clearForces();
+                worlds[wi]->addForce(grav);
+                worlds[wi]->update(1.0f);
+            }
+        }
+        istAssert(restored->getNumParticles()==world->getNumParticles());
+        istAssert(memcmp(restored->getParticles(), world->getParticles(), sizeof(psym::Particle)*world->getNumParticles())==0);
+
+        istPrint("checkpoint %u particles (%s): save %.2fms, load %.2fms, %.2fMB\n",
+            (uint32)world->getNumParticles(), compress ? "compressed" : "raw",
+            t_save, t_load, float32(bytes)/(1024.0f*1024.0f));
+    }
+
+    // 壊れたデータは読み込めないこと
+    {
+        ist::MemoryStream ms;
+        uint32 garbage[4] = {0, 0, 0, 0};
+        ms.write(garbage, sizeof(garbage));
+        istAssert(!restored->loadCheckpoint(ms));
+    }
+
+    istDelete(restored);
+    istDelete(world);
+}
+
+void FluidModule::dbgBenchmarkParticleChurn()
+{
+    // 毎フレーム大量に死んで大量に生まれる状況で、死んだパーティクルを sort 前に取り除く場合と
+    // 死んだものも含めて sort する場合の psym::World::update() の時間を比較
+    const uint32 num_particles = 60000;
+    const uint32 num_spawn = 6000; // 毎フレーム追加する数。寿命は平均 10 フレーム程度
+    const uint32 num_frames = 60;
+
+    psym::World *worlds[2] = { istNew(psym::World)(), istNew(psym::World)() };
+    float32 elapsed[2] = {0.0f, 0.0f};
+    uint32 total_dead = 0;
+    ParticleCont spawn(num_spawn);
+    for(uint32 wi=0; wi<2; ++wi) {
+        psym::World &world = *worlds[wi];
+        world.dead_compaction_enabled = wi==0;
+        world.sleeping_enabled = false;
+
+        SFMT rand;
+        rand.initialize(0);
+        auto gen = [&](psym::Particle *dst, uint32 num) {
+            for(uint32 i=0; i<num; ++i) {
+                istAlign(16) vec4 pos((rand.genFloat32()-0.5f)*4.0f, (rand.genFloat32()-0.5f)*4.0f, rand.genFloat32()*0.5f, 1.0f);
+                istAlign(16) vec4 zero(0.0f);
+                psym::Particle &p = dst[i];
+                p.position = reinterpret_cast<const psym::simdvec4&>(pos);
+                p.velocity = reinterpret_cast<const psym::simdvec4&>(zero);
+                p.energy = 1.0f + rand.genFloat32()*19.0f;
+                p.density = 0.0f;
+                p.hash = 0;
+                p.hit_to = 0;
+            }
+        };
+        ParticleCont initial(num_particles);
+        gen(&initial[0], num_particles);
+        world.addParticles(&initial[0], initial.size());
+
+        ist::Timer timer;
+        for(uint32 f=0; f<num_frames; ++f) {
+            gen(&spawn[0], num_spawn);
+            world.addParticles(&spawn[0], spawn.size());
+            size_t before = world.getNumParticles();
+            world.update(1.0f);
+            if(wi==0) { total_dead += uint32(before - world.getNumParticles()); }
+        }
+        elapsed[wi] = timer.getElapsedMillisec();
+    }
+
+    // 寿命は並び順に依存しないので、生き残る数は一致するはず
+    istAssert(worlds[0]->getNumParticles()==worlds[1]->getNumParticles());
+    istPrint("particle churn %u frames, ~%u particles, %.1f deaths/frame: compaction %.2fms, sort with dead %.2fms\n",
+        num_frames, (uint32)worlds[0]->getNumParticles(), float32(total_dead)/num_frames, elapsed[0], elapsed[1]);
+    istDelete(worlds[1]);
+    istDelete(worlds[0]);
+}
+
+#endif // atm_enable_Benchmark
+
 } // namespace atm
@@ -9,6 +9,23 @@ namespace atm {
 
 struct CollisionEntity;
 typedef ist::raw_vector<psym::Particle> ParticleCont;
+typedef ist::raw_vector<psym::RenderParticle> RenderParticleCont;
+
+// 量子化した描画用パーティクル (12 byte)。position は GLSL_FLUID_PACKED_POS/SIZE (床の範囲 = psym のグリッドの 2 倍) を 16bit に正規化、energy/density は half
+// 範囲外は端に clamp される。精度は 0.16mm 程度
+struct FluidPackedParticle
+{
+    uint16 x, y, z, pad;
+    float16 energy, density;
+};
+typedef ist::raw_vector<FluidPackedParticle> PackedParticleCont;
+
+void EncodeFluidParticles(const psym::RenderParticle *src, FluidPackedParticle *dst, uint32 num);
+vec3 DecodeFluidPosition(const FluidPackedParticle &v);
+
+// CollisionEntity を psym の rigid に変換して world に追加/上書きする。AddRigid() の戻り値は rigid の index
+uint32 AddRigid(psym::World &world, const CollisionEntity &v);
+void SetRigid(psym::World &world, uint32 i, const CollisionEntity &v);
 
 class atmAPI FluidModule : public IAtomicGameModule
 {
@@ -18,11 +35,36 @@ public:
     {
         PSET_RID psid;
         mat4 mat;
-        uint32 index;
+        uint32 index; // flushFluid() で psym 側の書き込み先の offset が入る
         uint32 num;
     };
     typedef ist::vector<AddFluidContext> AddFluidCtxCont;
 
+    // addFluid()/allocFluid() 一回分の、FluidStage::particles 内の範囲
+    struct StagedChunk
+    {
+        uint32 offset;
+        uint32 num;
+    };
+    typedef ist::raw_vector<StagedChunk> StagedChunkCont;
+
+    // addFluid() の要求をスレッド毎に溜めておく場所。ロックなしで追加でき、asyncupdate() でまとめて psym に書き込む
+    struct FluidStage
+    {
+        ParticleCont    particles;
+        StagedChunkCont chunks;
+        AddFluidCtxCont contexts;
+    };
+    typedef tbb::enumerable_thread_specific<FluidStage> FluidStages;
+
+    struct StagedRange
+    {
+        const psym::Particle *src;
+        uint32 index;
+        uint32 num;
+    };
+    typedef ist::vector<StagedRange> StagedRangeCont;
+
 public:
     FluidModule();
     ~FluidModule();
@@ -34,29 +76,65 @@ public:
     void draw();
     void frameEnd();
 
-    size_t copyParticlesToGL();
+    // out_packed には送ったデータが FluidPackedParticle か psym::RenderParticle かが入る
+    size_t copyParticlesToGL(bool &out_packed);
     void taskAsyncupdate(float32 dt);
     size_t getNumParticles() const;
+    size_t getNumSleepingParticles() const;
 
-    // rigid/force は毎フレームクリアされるので、毎フレーム突っ込む必要がある
-    void addRigid(const CollisionEntity &v);
+    // rigid は保持され続ける。CollisionModule::copyRigitsToPSym() が変更のあったものだけを更新する
+    // (clearRigids() は床も追加し直す)
+    void clearRigids();
+    uint32 addRigid(const CollisionEntity &v);
+    void setRigid(uint32 i, const CollisionEntity &v);
+    // force は毎フレームクリアされるので、毎フレーム突っ込む必要がある
     void addForce(const psym::PointForce &v);
-    void addFluid(psym::Particle *particles, uint32 num);
+    // 以下の流体追加は任意のスレッドから呼べる。実際に psym に追加されるのは次の asyncupdate()。
+    // energy などは追加時に設定されるので、position と velocity だけ埋めればよい。
+    // allocFluid() の戻り値は、同じスレッドから次に追加するまで有効。
+    // psym 側での並びはどのスレッドから追加されたかによらず、追加された内容 (position, velocity や psid, 行列) の順になる。
+    // 内容が同じものは入れ替わっても結果が同じなので、リプレイの再現性は保たれる
+    psym::Particle* allocFluid(uint32 num);
+    void addFluid(const psym::Particle *particles, uint32 num);
     void addFluid(PSET_RID psid, const mat4 &t, uint32 num=0);
 
     void handleStateQuery(EntitiesQueryContext &ctx);
 
+#ifdef atm_enable_Benchmark
+    void dbgBenchmarkRigidGrid();
+    void dbgBenchmarkFluidSpawn();
+    void dbgBenchmarkFluidSnapshot();
+    void dbgBenchmarkFluidPacking();
+    void dbgBenchmarkSubsteps();
+    void dbgBenchmarkSleeping();
+    void dbgBenchmarkIslands();
+    void dbgBenchmarkCheckpoint();
+    void dbgBenchmarkParticleChurn();
+#endif // atm_enable_Benchmark
+#ifdef atm_enable_StateSave
+    void dbgSaveCheckpoint();
+    void dbgLoadCheckpoint();
+#endif // atm_enable_StateSave
+
 private:
+    void flushFluid();
+
     psym::World         m_world;
     SFMT                m_rand;
     float32             m_gravity_strength;
 
     // 以下シリアライズ不要
     ist::Mutex          m_mutex_particles;
-    ParticleCont        m_particles_to_gpu; // GPU 転送用
+    // GPU 転送用。psym が裏に直接書き、書き終わったら表と入れ替える。copyParticlesToGL() は表を読む
+    RenderParticleCont  m_render_particles[2];
+    PackedParticleCont  m_packed_particles[2];
+    bool                m_packed_valid[2];  // m_packed_particles[i] の方を送る
+    uint32              m_render_front;
+    bool                m_render_packed;    // true なら量子化した形式で GPU に送る
     uint32              m_current_fluid_task;
-    ParticleCont        m_new_fluid;
-    AddFluidCtxCont     m_new_fluid_ctx;
+    FluidStages         m_stages;
+    StagedRangeCont     m_flush_ranges;
+    AddFluidCtxCont     m_flush_ctx;
 
     istSerializeBlock(
         istSerializeBase(super)
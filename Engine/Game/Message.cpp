@@ -1,13 +1,28 @@
 ﻿#include "atmPCH.h"
 #include "ist/ist.h"
 #include "types.h"
+#include "Engine/Game/World.h"
 #include "Engine/Game/EntityModule.h"
+#include "Engine/Game/EntityQuery.h"
 #include "Message.h"
 
 
 namespace atm {
 
 
+void MessageTraits<DamageMessage>::deliver(EntityHandle to, const DamageMessage *messages, uint32 num)
+{
+    if(IEntity *e = atmGetEntity(to)) {
+        // eventDamageBatch() を持たないものは damage() を一つずつ呼ぶ
+        if(!atmCall(e, eventDamageBatch, atmArgs(messages, num))) {
+            for(uint32 i=0; i<num; ++i) {
+                atmCall(e, damage, messages[i].damage);
+            }
+        }
+    }
+}
+
+
 MessageRouter* MessageRouter::s_instance;
 
 void MessageRouter::initializeInstance()
@@ -29,72 +44,28 @@ MessageRouter* MessageRouter::getInstance()
 
 MessageRouter::MessageRouter()
 {
+    m_streams[MT_Damage] = istNew(MessageStream<DamageMessage>)();
 }
 
 MessageRouter::~MessageRouter()
 {
-}
-
-uint32 MessageRouter::getMessageBlockNum() const
-{
-    return m_blocks.size();
-}
-
-void MessageRouter::resizeMessageBlock(uint32 num)
-{
-    while(m_blocks.size() < num) {
-        m_blocks.push_back(istNew(MessageBlock)());
+    for(uint32 i=0; i<MT_End; ++i) {
+        istDelete(m_streams[i]);
     }
 }
 
-MessageRouter::MessageBlock* MessageRouter::getMessageBlock(uint32 i)
-{
-    return m_blocks[i];
-}
-
-void MessageRouter::clear()
+void MessageRouter::deliver()
 {
-    for(uint32 i=0; i<m_blocks.size(); ++i) {
-        m_blocks[i]->clear();
+    for(uint32 i=0; i<MT_End; ++i) {
+        m_streams[i]->deliver();
     }
 }
 
-
-
-MessageIterator::MessageIterator()
-: m_num_blocks(0)
-, m_num_messages(0)
-, m_block_index(0)
-, m_message_index(0)
-, m_current_block(nullptr)
-{
-    MessageRouter *router = atmGetMessageRouter();
-    m_num_blocks = router->getMessageBlockNum();
-    m_current_block = router->getMessageBlock(0);
-    m_num_messages = m_current_block->size();
-}
-
-bool atm::MessageIterator::hasNext()
+void MessageRouter::clear()
 {
-    MessageRouter *router = atmGetMessageRouter();
-    for(; m_block_index<m_num_blocks; ++m_block_index) {
-        if(m_message_index < m_num_messages) {
-            return true;
-        }
-        if(m_block_index+1==m_num_blocks) {
-            break;
-        }
-        m_current_block = router->getMessageBlock(m_block_index+1);
-        m_num_messages = m_current_block->size();
-        m_message_index = 0;
+    for(uint32 i=0; i<MT_End; ++i) {
+        m_streams[i]->clear();
     }
-    return false;
 }
 
-const CallInfo& atm::MessageIterator::iterate()
-{
-    return (*m_current_block)[m_message_index++];
-}
-
-
 } // namespace atm
@@ -1,17 +1,10 @@
 ﻿#ifndef atm_Message_h
 #define atm_Message_h
 
-namespace atm {
+#include "psym/parallel_deterministic_sort.h"
 
+namespace atm {
 
-struct CallInfo
-{
-    EntityHandle from;
-    EntityHandle to;
-    uint32 call_id;
-    uint32 pad;
-    variant argument;
-};
 
 struct DamageMessage
 {
@@ -22,18 +15,138 @@ struct DamageMessage
 };
 
 
+// MessageRouter が扱うメッセージの種類
+enum MessageTypeID {
+    MT_Damage,
+    MT_End,
+};
 
-class MessageRouter
+// T 毎に type と deliver() を定義する。deliver() は to 宛ての num 個のメッセージをまとめて渡す (Message.cpp)
+template<class T> struct MessageTraits;
+template<> struct MessageTraits<DamageMessage>
+{
+    static const MessageTypeID type = MT_Damage;
+    static void deliver(EntityHandle to, const DamageMessage *messages, uint32 num);
+};
+
+
+class IMessageStream
+{
+public:
+    virtual ~IMessageStream() {}
+    virtual void clear()=0;
+    virtual void gather()=0;
+    virtual void deliver()=0;
+};
+
+// 型 T のメッセージの流れ。
+// push() はスレッド毎のバッファに追加するだけなので、asyncupdate 中などに並列に呼んでもロック不要。
+// gather() で全バッファを集めて receiver 順に並べ替え、deliver() で receiver 毎にまとめて渡す。
+// handle の上位 bit はカテゴリとクラスなので、receiver 順に並べれば Entity の種類毎にまとまる。
+// 並べ替えは (to, from, 内容) の全順序で行うので、どのスレッドから送られたかに関わらず渡す順序は同じになる。
+// (T は from, to を持つ隙間のない POD であること)
+template<class T>
+class MessageStream : public IMessageStream
 {
-istNonCopyable(MessageRouter);
 public:
-    typedef ist::vector<CallInfo>       MessageBlock;
-    typedef ist::vector<MessageBlock*>  MessageBlockCont;
+    typedef ist::vector<T> MessageCont;
+    typedef tbb::enumerable_thread_specific<MessageCont> LocalCont;
+    struct ReceiverRange
+    {
+        EntityHandle to;
+        uint32 begin;
+        uint32 num;
+    };
+    typedef ist::vector<ReceiverRange> ReceiverCont;
+
+    struct Less
+    {
+        bool operator()(const T &a, const T &b) const
+        {
+            if(a.to!=b.to)      { return a.to<b.to; }
+            if(a.from!=b.from)  { return a.from<b.from; }
+            return memcmp(&a, &b, sizeof(T)) < 0;
+        }
+    };
 
+public:
+    void push(const T &m) { m_locals.local().push_back(m); }
+
+    void clear() override
+    {
+        for(typename LocalCont::iterator i=m_locals.begin(); i!=m_locals.end(); ++i) { i->clear(); }
+        m_messages.clear();
+        m_receivers.clear();
+    }
+
+    void gather() override
+    {
+        m_tmp_locals.clear();
+        m_tmp_offsets.clear();
+        uint32 num_messages = 0;
+        for(typename LocalCont::iterator i=m_locals.begin(); i!=m_locals.end(); ++i) {
+            if(i->empty()) { continue; }
+            m_tmp_locals.push_back(&*i);
+            m_tmp_offsets.push_back(num_messages);
+            num_messages += (uint32)i->size();
+        }
+        m_messages.resize(num_messages);
+        m_receivers.clear();
+        if(num_messages==0) { return; }
+
+        // 書き込み先が重ならないのでロック不要
+        ist::parallel_for(uint32(0), (uint32)m_tmp_locals.size(),
+            [&](uint32 i) {
+                MessageCont &local = *m_tmp_locals[i];
+                stl::copy(local.begin(), local.end(), m_messages.begin()+m_tmp_offsets[i]);
+                local.clear();
+            });
+        parallel_deterministic_sort(m_messages.begin(), m_messages.end(), Less());
+
+        ReceiverRange r = {m_messages[0].to, 0, 0};
+        for(uint32 i=0; i<num_messages; ++i) {
+            if(m_messages[i].to!=r.to) {
+                m_receivers.push_back(r);
+                r.to = m_messages[i].to;
+                r.begin = i;
+                r.num = 0;
+            }
+            ++r.num;
+        }
+        m_receivers.push_back(r);
+    }
+
+    void deliver() override
+    {
+        gather();
+        for(uint32 ri=0; ri<m_receivers.size(); ++ri) {
+            const ReceiverRange &r = m_receivers[ri];
+            MessageTraits<T>::deliver(r.to, &m_messages[r.begin], r.num);
+        }
+        m_messages.clear();
+        m_receivers.clear();
+    }
+
+    const MessageCont&  getMessages() const     { return m_messages; }
+    const ReceiverCont& getReceivers() const    { return m_receivers; }
+
+private:
+    LocalCont       m_locals;
+    MessageCont     m_messages;  // gather() で receiver 順に並べたもの
+    ReceiverCont    m_receivers;
+    ist::vector<MessageCont*> m_tmp_locals;
+    ist::vector<uint32> m_tmp_offsets;
+};
+
+
+// メッセージの種類毎の MessageStream を持つ。
+// EntityModule::update() の最初に deliver() され、前フレームの update 以降に送られたものが渡される。
+class atmAPI MessageRouter
+{
+istNonCopyable(MessageRouter);
 private:
     static MessageRouter *s_instance;
-    MessageBlockCont m_blocks;
-    SpinMutex m_lock_status;
+    IMessageStream *m_streams[MT_End];
 
     MessageRouter();
 
@@ -43,33 +156,19 @@ public:
     static void finalizeInstance();
     static MessageRouter* getInstance();
 
-    uint32 getMessageBlockNum() const;
-    void resizeMessageBlock(uint32 num);
-    MessageBlock* getMessageBlock(uint32 i);
+    template<class T>
+    MessageStream<T>& getStream() { return *static_cast<MessageStream<T>*>(m_streams[MessageTraits<T>::type]); }
+    template<class T>
+    void send(const T &m) { getStream<T>().push(m); }
 
+    // 全種類を MessageTypeID 順に渡す
+    void deliver();
     void clear();
 };
 
 
-#define atmGetMessageRouter()            MessageRouter::getInstance()
-#define atmPushCallMessage(block, mes)   atmGetMessageRouter()->getMessageBlock(block)->addTask(mes)
-
-
-class MessageIterator
-{
-private:
-    typedef MessageRouter::MessageBlock MessageBlock;
-    uint32 m_num_blocks;
-    uint32 m_num_messages;
-    uint32 m_block_index;
-    uint32 m_message_index;
-    MessageBlock *m_current_block;
-
-public:
-    MessageIterator();
-    bool hasNext();
-    const CallInfo& iterate();
-};
+#define atmGetMessageRouter()   MessageRouter::getInstance()
+#define atmSendMessage(mes)     atmGetMessageRouter()->send(mes)
 
 } // namespace atm
 #endif // atm_Message_h
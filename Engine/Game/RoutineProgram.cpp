@@ -0,0 +1,588 @@
+﻿#include "atmPCH.h"
+#include "types.h"
+#include "Engine/Game/World.h"
+#include "Engine/Game/BulletModule.h"
+#include "Engine/Game/EntityModule.h"
+#include "RoutineProgram.h"
+
+namespace atm {
+
+namespace {
+
+    struct RoutineOpInfo
+    {
+        const char *name;
+        RoutineOp op;
+        uint32 num_n;   // 整数の引数の数 (n)
+        uint32 num_f;   // 実数の引数の数 (f)
+        bool has_target;
+    };
+    const RoutineOpInfo g_op_info[] = {
+        {"stop",        RO_Stop,        0, 0, false},
+        {"wait",        RO_Wait,        0, 1, false},
+        {"jump",        RO_Jump,        0, 0, true },
+        {"repeat",      RO_Repeat,      1, 0, true },
+        {"velocity",    RO_Velocity,    0, 2, false},
+        {"accel",       RO_Accel,       0, 2, false},
+        {"homing",      RO_Homing,      0, 2, false},
+        {"aim",         RO_Aim,         0, 0, false},
+        {"direction",   RO_Direction,   0, 2, false},
+        {"rotate",      RO_Rotate,      0, 1, false},
+        {"shoot",       RO_Shoot,       1, 2, false},
+        {"fan",         RO_Fan,         1, 2, false},
+        {"ring",        RO_Ring,        1, 1, false},
+    };
+
+    const RoutineOpInfo* FindRoutineOp(const stl::string &name)
+    {
+        for(size_t i=0; i<_countof(g_op_info); ++i) {
+            if(name==g_op_info[i].name) { return &g_op_info[i]; }
+        }
+        return nullptr;
+    }
+
+    // 組み込みのプログラム。Entity/Enemy/Routine.cpp の同名の IRoutine とほぼ同じ動きをする
+    const char *g_builtin_programs[][2] = {
+        {"SingleShoot",
+            "homing 0.0035 0\n"
+            "loop: wait 150\n"
+            "aim\n"
+            "shoot 5 0.007 0.0015\n"
+            "jump loop\n"},
+        {"CircularShoot",
+            "direction 1 0\n"
+            "loop: wait 20\n"
+            "shoot 10 0.008 0.001\n"
+            "rotate 10\n"
+            "jump loop\n"},
+        {"HomingPlayer",
+            "homing 0.0002 0.98\n"
+            "stop\n"},
+        {"FanShoot",
+            "homing 0.0002 0.98\n"
+            "loop: wait 60\n"
+            "aim\n"
+            "fan 5 0.01 60\n"
+            "repeat 3 loop\n"
+            "wait 120\n"
+            "ring 24 0.006\n"
+            "jump loop\n"},
+    };
+
+} // namespace
+
+
+RoutineProgram::RoutineProgram()
+{
+}
+
+bool RoutineProgram::compile(const char *name, const char *source)
+{
+    m_name = name;
+    m_instructions.clear();
+
+    struct Fixup { uint32 inst; stl::string label; uint32 line; };
+    stl::vector<stl::pair<stl::string, uint32> > labels;
+    stl::vector<Fixup> fixups;
+    bool ok = true;
+
+    // 行と ';' で区切って一命令ずつ読む
+    stl::string src = source;
+    uint32 line = 1;
+    size_t pos = 0;
+    while(ok && pos<src.size()) {
+        size_t end = src.find_first_of(";\n", pos);
+        if(end==stl::string::npos) { end = src.size(); }
+        stl::string stmt = src.substr(pos, end-pos);
+        size_t comment = stmt.find('#');
+        if(comment!=stl::string::npos) { stmt.resize(comment); }
+
+        stl::vector<stl::string> tokens;
+        {
+            size_t s = 0;
+            while((s=stmt.find_first_not_of(" \t\r", s))!=stl::string::npos) {
+                size_t e = stmt.find_first_of(" \t\r", s);
+                if(e==stl::string::npos) { e = stmt.size(); }
+                tokens.push_back(stmt.substr(s, e-s));
+                s = e;
+            }
+        }
+        size_t ti = 0;
+        while(ti<tokens.size() && tokens[ti][tokens[ti].size()-1]==':') {
+            stl::string label = tokens[ti].substr(0, tokens[ti].size()-1);
+            size_t li = 0;
+            while(li<labels.size() && labels[li].first!=label) { ++li; }
+            if(li!=labels.size()) {
+                istPrint("RoutineProgram::compile(): %s: line %u: duplicate label \"%s\"\n", name, line, label.c_str());
+                ok = false;
+                break;
+            }
+            labels.push_back(stl::make_pair(label, size()));
+            ++ti;
+        }
+        if(!ok) { break; }
+        if(ti<tokens.size()) {
+            const RoutineOpInfo *info = FindRoutineOp(tokens[ti]);
+            if(!info) {
+                istPrint("RoutineProgram::compile(): %s: line %u: unknown instruction \"%s\"\n", name, line, tokens[ti].c_str());
+                ok = false;
+                break;
+            }
+            if(tokens.size()-ti-1 != info->num_n+info->num_f+(info->has_target ? 1 : 0)) {
+                istPrint("RoutineProgram::compile(): %s: line %u: wrong number of arguments for \"%s\"\n", name, line, info->name);
+                ok = false;
+                break;
+            }
+            RoutineInstruction inst;
+            istMemset(&inst, 0, sizeof(inst));
+            inst.op = (uint8)info->op;
+            ++ti;
+            if(info->num_n) {
+                int32 n = atoi(tokens[ti++].c_str());
+                if(n<1 || n>255) {
+                    istPrint("RoutineProgram::compile(): %s: line %u: count must be 1-255\n", name, line);
+                    ok = false;
+                    break;
+                }
+                inst.n = (uint8)n;
+            }
+            for(uint32 fi=0; fi<info->num_f; ++fi) {
+                inst.f[fi] = (float32)atof(tokens[ti++].c_str());
+            }
+            if(info->has_target) {
+                Fixup f = {size(), tokens[ti++], line};
+                fixups.push_back(f);
+            }
+            m_instructions.push_back(inst);
+        }
+
+        if(end<src.size() && src[end]=='\n') { ++line; }
+        pos = end+1;
+    }
+
+    // 飛び先を解決
+    for(size_t i=0; ok && i<fixups.size(); ++i) {
+        const Fixup &f = fixups[i];
+        size_t li = 0;
+        while(li<labels.size() && labels[li].first!=f.label) { ++li; }
+        if(li==labels.size()) {
+            istPrint("RoutineProgram::compile(): %s: line %u: undefined label \"%s\"\n", name, f.line, f.label.c_str());
+            ok = false;
+            break;
+        }
+        m_instructions[f.inst].target = (uint16)labels[li].second;
+    }
+    if(ok && size()>0xFFFF) {
+        istPrint("RoutineProgram::compile(): %s: too many instructions\n", name);
+        ok = false;
+    }
+
+    if(!ok) { m_instructions.clear(); }
+    return ok;
+}
+
+
+
+void RoutineRunner::Batch::clear()
+{
+    handles.clear();
+    pos_x.clear(); pos_y.clear();
+    vel_x.clear(); vel_y.clear();
+    accel_x.clear(); accel_y.clear();
+    homing.clear(); damping.clear();
+    aim_x.clear(); aim_y.clear();
+    wait.clear();
+    pc.clear(); loop.clear();
+}
+
+uint32 RoutineRunner::Batch::push_back(EntityHandle h, const vec3 &pos)
+{
+    uint32 i = size();
+    handles.push_back(h);
+    pos_x.push_back(pos.x); pos_y.push_back(pos.y);
+    vel_x.push_back(0.0f); vel_y.push_back(0.0f);
+    accel_x.push_back(0.0f); accel_y.push_back(0.0f);
+    homing.push_back(0.0f); damping.push_back(1.0f);
+    aim_x.push_back(0.0f); aim_y.push_back(1.0f);
+    wait.push_back(0.0f);
+    pc.push_back(0); loop.push_back(0);
+    return i;
+}
+
+void RoutineRunner::Batch::swapRemove(uint32 i)
+{
+    uint32 last = size()-1;
+    if(i!=last) {
+        handles[i]=handles[last];
+        pos_x[i]=pos_x[last]; pos_y[i]=pos_y[last];
+        vel_x[i]=vel_x[last]; vel_y[i]=vel_y[last];
+        accel_x[i]=accel_x[last]; accel_y[i]=accel_y[last];
+        homing[i]=homing[last]; damping[i]=damping[last];
+        aim_x[i]=aim_x[last]; aim_y[i]=aim_y[last];
+        wait[i]=wait[last];
+        pc[i]=pc[last]; loop[i]=loop[last];
+    }
+    handles.pop_back();
+    pos_x.pop_back(); pos_y.pop_back();
+    vel_x.pop_back(); vel_y.pop_back();
+    accel_x.pop_back(); accel_y.pop_back();
+    homing.pop_back(); damping.pop_back();
+    aim_x.pop_back(); aim_y.pop_back();
+    wait.pop_back();
+    pc.pop_back(); loop.pop_back();
+}
+
+void RoutineRunner::Batch::restart(uint32 i)
+{
+    accel_x[i] = accel_y[i] = 0.0f;
+    homing[i] = 0.0f;
+    damping[i] = 1.0f;
+    aim_x[i] = 0.0f; aim_y[i] = 1.0f;
+    wait[i] = 0.0f;
+    pc[i] = loop[i] = 0;
+}
+
+
+RoutineRunner::RoutineRunner()
+{
+    for(size_t i=0; i<_countof(g_builtin_programs); ++i) {
+        registerProgram(g_builtin_programs[i][0], g_builtin_programs[i][1]);
+    }
+}
+
+void RoutineRunner::clear()
+{
+    for(size_t i=0; i<m_batches.size(); ++i) {
+        m_batches[i].clear();
+    }
+    m_sparse_batch.clear();
+    m_sparse_index.clear();
+    discardShots();
+}
+
+RoutineProgramID RoutineRunner::registerProgram(const char *name, const char *source)
+{
+    RoutineProgram prog;
+    if(!prog.compile(name, source)) { return InvalidProgram; }
+
+    RoutineProgramID pid = findProgram(name);
+    if(pid==InvalidProgram) {
+        pid = (RoutineProgramID)m_programs.size();
+        m_programs.push_back(prog);
+        m_batches.push_back(Batch());
+    }
+    else {
+        m_programs[pid] = prog;
+        Batch &b = m_batches[pid];
+        for(uint32 i=0; i<b.size(); ++i) { b.restart(i); }
+    }
+    return pid;
+}
+
+RoutineProgramID RoutineRunner::findProgram(const char *name) const
+{
+    for(size_t i=0; i<m_programs.size(); ++i) {
+        if(strcmp(m_programs[i].getName(), name)==0) { return (RoutineProgramID)i; }
+    }
+    return InvalidProgram;
+}
+
+const RoutineProgram* RoutineRunner::getProgram(RoutineProgramID pid) const
+{
+    return pid<m_programs.size() ? &m_programs[pid] : nullptr;
+}
+
+uint32 RoutineRunner::findIndex(EntityHandle h) const
+{
+    uint32 iid = EntityGetIndex(h);
+    if(h==0 || iid>=m_sparse_batch.size() || m_sparse_batch[iid]==InvalidProgram) { return InvalidIndex; }
+    uint32 i = m_sparse_index[iid];
+    // slot が再利用されていれば別の Entity
+    if(m_batches[m_sparse_batch[iid]].handles[i]!=h) { return InvalidIndex; }
+    return i;
+}
+
+void RoutineRunner::attach(EntityHandle h, RoutineProgramID pid, const vec3 &pos)
+{
+    if(pid>=m_programs.size()) { return; }
+    // 並列 update 中は他のスレッドが Batch を読んでいるので、区間の後で行う
+    if(EntityCommandBuffer *cb=EntityCommandBuffer::getCurrent()) {
+        cb->defer([=](){ attach(h, pid, pos); });
+        return;
+    }
+    detach(h);
+    uint32 iid = EntityGetIndex(h);
+    if(iid >= m_sparse_batch.size()) {
+        m_sparse_batch.resize(iid+1, InvalidProgram);
+        m_sparse_index.resize(iid+1, InvalidIndex);
+    }
+    m_sparse_batch[iid] = pid;
+    m_sparse_index[iid] = m_batches[pid].push_back(h, pos);
+}
+
+bool RoutineRunner::detach(EntityHandle h)
+{
+    uint32 i = findIndex(h);
+    if(i==InvalidIndex) { return false; }
+    // swapRemove() で他の Entity の位置も動くので、並列 update 中は区間の後で行う
+    if(EntityCommandBuffer *cb=EntityCommandBuffer::getCurrent()) {
+        cb->defer([=](){ detach(h); });
+        return true;
+    }
+
+    uint32 iid = EntityGetIndex(h);
+    Batch &b = m_batches[m_sparse_batch[iid]];
+    b.swapRemove(i);
+    if(i<b.size()) {
+        m_sparse_index[EntityGetIndex(b.handles[i])] = i;
+    }
+    m_sparse_batch[iid] = InvalidProgram;
+    m_sparse_index[iid] = InvalidIndex;
+    return true;
+}
+
+bool RoutineRunner::getPosition(EntityHandle h, vec3 &out) const
+{
+    uint32 i = findIndex(h);
+    if(i==InvalidIndex) { return false; }
+    const Batch &b = m_batches[m_sparse_batch[EntityGetIndex(h)]];
+    out = vec3(b.pos_x[i], b.pos_y[i], 0.0f);
+    return true;
+}
+
+void RoutineRunner::setPosition(EntityHandle h, const vec3 &v)
+{
+    uint32 i = findIndex(h);
+    if(i==InvalidIndex) { return; }
+    Batch &b = m_batches[m_sparse_batch[EntityGetIndex(h)]];
+    b.pos_x[i] = v.x;
+    b.pos_y[i] = v.y;
+}
+
+uint32 RoutineRunner::getNumEntities() const
+{
+    uint32 r = 0;
+    for(size_t i=0; i<m_batches.size(); ++i) { r += m_batches[i].size(); }
+    return r;
+}
+
+void RoutineRunner::update(float32 dt, const vec3 *targets, uint32 num_targets)
+{
+    // 全プログラムの Entity をブロックに分けて並列に処理する。ブロックの分け方は固定
+    m_jobs.clear();
+    for(uint32 bi=0; bi<m_batches.size(); ++bi) {
+        uint32 num = m_batches[bi].size();
+        for(uint32 first=0; first<num; first+=BlockSize) {
+            Job job = {bi, first, stl::min<uint32>(first+BlockSize, num)};
+            m_jobs.push_back(job);
+        }
+    }
+    if(m_jobs.empty()) { return; }
+    while(m_shots.size() < m_jobs.size()) { m_shots.push_back(ShotCont()); }
+
+    ist::parallel_for(uint32(0), (uint32)m_jobs.size(),
+        [&](uint32 ji) {
+            updateBlock(m_jobs[ji], dt, targets, num_targets, m_shots[ji]);
+        });
+}
+
+void RoutineRunner::updateBlock(const Job &job, float32 dt, const vec3 *targets, uint32 num_targets, ShotCont &shots)
+{
+    Batch &b = m_batches[job.batch];
+    const RoutineProgram &prog = m_programs[job.batch];
+    float32 *px = b.pos_x.begin();
+    float32 *py = b.pos_y.begin();
+    float32 *vx = b.vel_x.begin();
+    float32 *vy = b.vel_y.begin();
+    const float32 *ax = b.accel_x.begin();
+    const float32 *ay = b.accel_y.begin();
+    const float32 *homing = b.homing.begin();
+    const float32 *damping = b.damping.begin();
+    float32 *wait = b.wait.begin();
+
+    // 一番近い対象への方向 (dx,dy) と、速度と位置の更新。対象が無ければ方向は 0
+    // first は BlockSize の倍数なので 16 byte align されている
+    const __m128 dt4 = _mm_set1_ps(dt);
+    const __m128 zero4 = _mm_setzero_ps();
+    const __m128 eps4 = _mm_set1_ps(1e-12f);
+    uint32 i = job.first;
+    for(; i+4<=job.last; i+=4) {
+        __m128 x = _mm_load_ps(px+i);
+        __m128 y = _mm_load_ps(py+i);
+        __m128 best = _mm_set1_ps(FLT_MAX);
+        __m128 dx = zero4, dy = zero4;
+        for(uint32 ti=0; ti<num_targets; ++ti) {
+            __m128 tx = _mm_sub_ps(_mm_set1_ps(targets[ti].x), x);
+            __m128 ty = _mm_sub_ps(_mm_set1_ps(targets[ti].y), y);
+            __m128 d2 = _mm_add_ps(_mm_mul_ps(tx, tx), _mm_mul_ps(ty, ty));
+            __m128 closer = _mm_cmplt_ps(d2, best);
+            best = _mm_min_ps(d2, best);
+            dx = _mm_or_ps(_mm_and_ps(closer, tx), _mm_andnot_ps(closer, dx));
+            dy = _mm_or_ps(_mm_and_ps(closer, ty), _mm_andnot_ps(closer, dy));
+        }
+        __m128 len = _mm_sqrt_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), eps4));
+        dx = _mm_div_ps(dx, len);
+        dy = _mm_div_ps(dy, len);
+
+        __m128 h = _mm_load_ps(homing+i);
+        __m128 d = _mm_load_ps(damping+i);
+        __m128 nvx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(vx+i), d), _mm_mul_ps(dx, h)), _mm_load_ps(ax+i));
+        __m128 nvy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(vy+i), d), _mm_mul_ps(dy, h)), _mm_load_ps(ay+i));
+        _mm_store_ps(vx+i, nvx);
+        _mm_store_ps(vy+i, nvy);
+        _mm_store_ps(px+i, _mm_add_ps(x, _mm_mul_ps(nvx, dt4)));
+        _mm_store_ps(py+i, _mm_add_ps(y, _mm_mul_ps(nvy, dt4)));
+
+        // 待ち時間が終わったものだけ命令を進める
+        __m128 w = _mm_sub_ps(_mm_load_ps(wait+i), dt4);
+        _mm_store_ps(wait+i, w);
+        int mask = _mm_movemask_ps(_mm_cmple_ps(w, zero4));
+        if(mask!=0) {
+            istAlign(16) float32 dir_x[4];
+            istAlign(16) float32 dir_y[4];
+            _mm_store_ps(dir_x, dx);
+            _mm_store_ps(dir_y, dy);
+            for(uint32 l=0; l<4; ++l) {
+                if(mask & (1<<l)) { execute(b, prog, i+l, dir_x[l], dir_y[l], shots); }
+            }
+        }
+    }
+    for(; i<job.last; ++i) {
+        float32 best = FLT_MAX;
+        float32 dx = 0.0f, dy = 0.0f;
+        for(uint32 ti=0; ti<num_targets; ++ti) {
+            float32 tx = targets[ti].x - px[i];
+            float32 ty = targets[ti].y - py[i];
+            float32 d2 = tx*tx + ty*ty;
+            if(d2<best) { best=d2; dx=tx; dy=ty; }
+        }
+        float32 len = std::sqrt(stl::max<float32>(dx*dx + dy*dy, 1e-12f));
+        dx /= len;
+        dy /= len;
+        vx[i] = vx[i]*damping[i] + dx*homing[i] + ax[i];
+        vy[i] = vy[i]*damping[i] + dy*homing[i] + ay[i];
+        px[i] += vx[i]*dt;
+        py[i] += vy[i]*dt;
+        wait[i] -= dt;
+        if(wait[i]<=0.0f) { execute(b, prog, i, dx, dy, shots); }
+    }
+}
+
+void RoutineRunner::execute(Batch &b, const RoutineProgram &prog, uint32 i, float32 dir_x, float32 dir_y, ShotCont &shots)
+{
+    const RoutineInstruction *insts = prog.getInstructions();
+    uint32 num = prog.size();
+    EntityHandle owner = b.handles[i];
+    vec3 pos(b.pos_x[i], b.pos_y[i], 0.0f);
+
+    for(uint32 step=0; step<MaxStepsPerFrame; ++step) {
+        // 末尾まで来たら止まる
+        if(b.pc[i]>=num) {
+            b.wait[i] = FLT_MAX;
+            return;
+        }
+        const RoutineInstruction &inst = insts[b.pc[i]++];
+        switch(inst.op) {
+        case RO_Stop:
+            --b.pc[i];
+            b.wait[i] = FLT_MAX;
+            return;
+        case RO_Wait:
+            // 余った時間は引き継ぐので、周期は dt によらず正確になる
+            b.wait[i] += inst.f[0];
+            if(b.wait[i]>0.0f) { return; }
+            break;
+        case RO_Jump:
+            b.pc[i] = inst.target;
+            break;
+        case RO_Repeat:
+            if(++b.loop[i] < inst.n) { b.pc[i]=inst.target; }
+            else { b.loop[i]=0; }
+            break;
+        case RO_Velocity:
+            b.vel_x[i] = inst.f[0];
+            b.vel_y[i] = inst.f[1];
+            break;
+        case RO_Accel:
+            b.accel_x[i] = inst.f[0];
+            b.accel_y[i] = inst.f[1];
+            break;
+        case RO_Homing:
+            b.homing[i] = inst.f[0];
+            b.damping[i] = inst.f[1];
+            break;
+        case RO_Aim:
+            if(dir_x!=0.0f || dir_y!=0.0f) {
+                b.aim_x[i] = dir_x;
+                b.aim_y[i] = dir_y;
+            }
+            break;
+        case RO_Direction:
+            {
+                vec2 d = glm::normalize(vec2(inst.f[0], inst.f[1]));
+                b.aim_x[i] = d.x;
+                b.aim_y[i] = d.y;
+            }
+            break;
+        case RO_Rotate:
+            {
+                float32 r = ist::DegToRad(inst.f[0]);
+                float32 c = std::cos(r), s = std::sin(r);
+                float32 x = b.aim_x[i], y = b.aim_y[i];
+                b.aim_x[i] = x*c - y*s;
+                b.aim_y[i] = x*s + y*c;
+            }
+            break;
+        case RO_Shoot:
+            {
+                vec3 aim(b.aim_x[i], b.aim_y[i], 0.0f);
+                for(uint32 k=0; k<inst.n; ++k) {
+                    Shot s = {pos, aim*(inst.f[0] + inst.f[1]*k), owner};
+                    shots.push_back(s);
+                }
+            }
+            break;
+        case RO_Fan:
+        case RO_Ring:
+            {
+                // Fan は f[1] 度の範囲に両端を含めて、Ring は全周に等間隔に
+                float32 spread = inst.op==RO_Fan ? ist::DegToRad(inst.f[1]) : ist::PI*2.0f;
+                float32 step_angle = inst.op==RO_Fan ? (inst.n>1 ? spread/(inst.n-1) : 0.0f) : spread/inst.n;
+                float32 start = inst.op==RO_Fan ? -spread*0.5f : 0.0f;
+                float32 base = std::atan2(b.aim_y[i], b.aim_x[i]);
+                for(uint32 k=0; k<inst.n; ++k) {
+                    float32 a = base + start + step_angle*k;
+                    Shot s = {pos, vec3(std::cos(a), std::sin(a), 0.0f)*inst.f[0], owner};
+                    shots.push_back(s);
+                }
+            }
+            break;
+        }
+    }
+    // 一フレームの上限に達したら次のフレームで続きから
+    b.wait[i] = 0.0f;
+}
+
+void RoutineRunner::flushShots()
+{
+    BulletModule *bullets = atmGetBulletModule();
+    for(size_t bi=0; bi<m_shots.size(); ++bi) {
+        ShotCont &shots = m_shots[bi];
+        for(size_t i=0; i<shots.size(); ++i) {
+            bullets->shootBullet(shots[i].pos, shots[i].vel, shots[i].owner);
+        }
+        shots.clear();
+    }
+}
+
+uint32 RoutineRunner::discardShots()
+{
+    uint32 r = 0;
+    for(size_t bi=0; bi<m_shots.size(); ++bi) {
+        r += (uint32)m_shots[bi].size();
+        m_shots[bi].clear();
+    }
+    return r;
+}
+
+} // namespace atm
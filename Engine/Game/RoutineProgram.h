@@ -0,0 +1,188 @@
+﻿#ifndef atm_Engine_Game_RoutineProgram_h
+#define atm_Engine_Game_RoutineProgram_h
+
+namespace atm {
+
+// RoutineProgram の命令。引数は RoutineInstruction の n, target, f に入る
+enum RoutineOp {
+    RO_Stop,        // 停止。移動は続く
+    RO_Wait,        // f[0] フレーム待つ
+    RO_Jump,        // target へ飛ぶ
+    RO_Repeat,      // n 回目までは target へ戻る。入れ子にはできない
+    RO_Velocity,    // 速度を (f[0], f[1]) にする
+    RO_Accel,       // 以降毎フレーム 速度 += (f[0], f[1])
+    RO_Homing,      // 以降毎フレーム 速度 = 速度*f[1] + 一番近いプレイヤーへの方向*f[0]
+    RO_Aim,         // 発射方向を一番近いプレイヤーへ向ける
+    RO_Direction,   // 発射方向を (f[0], f[1]) にする
+    RO_Rotate,      // 発射方向を f[0] 度回す
+    RO_Shoot,       // 発射方向に n 発。i 発目の速さは f[0]+f[1]*i
+    RO_Fan,         // 発射方向を中心に f[1] 度の範囲に n 発。速さは f[0]
+    RO_Ring,        // 発射方向から全周に n 発。速さは f[0]
+
+    RO_End,
+};
+
+struct RoutineInstruction
+{
+    uint8 op;       // RoutineOp
+    uint8 n;
+    uint16 target;  // 飛び先の命令の index
+    float32 f[2];
+};
+
+// 敵の行動を記述する命令列。テキストの命令リストから compile() で作る。
+// 一行 (または ';' 区切り) に一命令で、"label:" で飛び先を定義できる。'#' 以降はコメント。例:
+//   homing 0.0035 0
+//   loop: wait 150
+//   aim
+//   shoot 5 0.007 0.0015
+//   jump loop
+class atmAPI RoutineProgram
+{
+public:
+    typedef ist::raw_vector<RoutineInstruction> InstructionCont;
+
+public:
+    RoutineProgram();
+    // 失敗したらエラーを出力して false を返す。その場合は命令列は空になる
+    bool compile(const char *name, const char *source);
+
+    const char* getName() const                         { return m_name.c_str(); }
+    uint32 size() const                                 { return (uint32)m_instructions.size(); }
+    const RoutineInstruction* getInstructions() const   { return m_instructions.empty() ? nullptr : &m_instructions[0]; }
+
+private:
+    stl::string     m_name;
+    InstructionCont m_instructions;
+};
+
+
+typedef uint32 RoutineProgramID;
+
+// RoutineProgram で動く Entity の状態をプログラム毎にまとめて SoA で持ち、一括で実行する。
+// 毎フレームの移動 (homing, 加速, 位置の更新) と待ち時間の判定は SSE で 4 つずつ処理し、
+// 待ち時間が終わったものだけ命令を解釈する。
+// 撃った弾はブロック毎に溜めておき、flushShots() でブロック順に BulletModule に渡すので、結果はスレッドの実行順に依存しない。
+// 位置はここが持つ。対象の Entity は getPosition() で受け取って自分に反映する。(Entity/Enemy/Routine.cpp の Routine_Script)
+// 並列 update 中 (EntityCommandBuffer::getCurrent() がある時) の attach()/detach() は、Batch を詰め直すので
+// EntityCommandBuffer に積まれ、その区間の update が終わった後に適用される。それまでは付いたまま (外れたまま) に見える。
+class atmAPI RoutineRunner
+{
+public:
+    static const RoutineProgramID InvalidProgram = 0xFFFFFFFF;
+    static const uint32 InvalidIndex = 0xFFFFFFFF;
+    static const uint32 BlockSize = 1024;       // 並列に処理する粒度。4 の倍数であること
+    static const uint32 MaxStepsPerFrame = 64;  // wait しないプログラムで止まらなくならないように
+
+    struct Shot
+    {
+        vec3 pos;
+        vec3 vel;
+        EntityHandle owner;
+    };
+    typedef ist::raw_vector<Shot> ShotCont;
+
+    // 同じプログラムを実行している Entity の状態
+    struct Batch
+    {
+        typedef ist::raw_vector<EntityHandle>   HandleCont;
+        typedef ist::raw_vector<float32>        FloatCont;
+        typedef ist::raw_vector<uint16>         PCCont;
+
+        HandleCont  handles;
+        FloatCont   pos_x, pos_y;
+        FloatCont   vel_x, vel_y;
+        FloatCont   accel_x, accel_y;
+        FloatCont   homing, damping;
+        FloatCont   aim_x, aim_y;   // 発射方向
+        FloatCont   wait;           // 0 以下になったら命令を進める
+        PCCont      pc, loop;
+
+        istSerializeBlock(
+            istSerialize(handles)
+            istSerialize(pos_x)
+            istSerialize(pos_y)
+            istSerialize(vel_x)
+            istSerialize(vel_y)
+            istSerialize(accel_x)
+            istSerialize(accel_y)
+            istSerialize(homing)
+            istSerialize(damping)
+            istSerialize(aim_x)
+            istSerialize(aim_y)
+            istSerialize(wait)
+            istSerialize(pc)
+            istSerialize(loop)
+        )
+
+        uint32 size() const { return (uint32)handles.size(); }
+        void clear();
+        uint32 push_back(EntityHandle h, const vec3 &pos);
+        // i 番目を末尾の要素で上書きして詰める
+        void swapRemove(uint32 i);
+        // プログラムを先頭から実行し直す状態にする。位置と速度はそのまま
+        void restart(uint32 i);
+    };
+
+public:
+    RoutineRunner();
+    // 実行中の Entity を全部外す。プログラムは残る
+    void clear();
+
+    // 同じ名前のものがあれば置き換え、それを実行中の Entity は先頭からやり直す。失敗したら InvalidProgram
+    RoutineProgramID registerProgram(const char *name, const char *source);
+    RoutineProgramID findProgram(const char *name) const;
+    const RoutineProgram* getProgram(RoutineProgramID pid) const;
+    uint32 getNumPrograms() const { return (uint32)m_programs.size(); }
+
+    // 既に他のプログラムを実行していれば付け替える
+    void attach(EntityHandle h, RoutineProgramID pid, const vec3 &pos);
+    // 付いていなければ false
+    bool detach(EntityHandle h);
+    bool has(EntityHandle h) const { return findIndex(h)!=InvalidIndex; }
+    bool getPosition(EntityHandle h, vec3 &out) const;
+    void setPosition(EntityHandle h, const vec3 &v);
+    uint32 getNumEntities() const;
+
+    // targets: 狙う対象 (プレイヤー) の位置
+    void update(float32 dt, const vec3 *targets, uint32 num_targets);
+    // update() で撃たれた弾をブロック順に BulletModule に渡す
+    void flushShots();
+    // flushShots() せずに捨てる。撃たれた数を返す
+    uint32 discardShots();
+
+private:
+    struct Job
+    {
+        uint32 batch;
+        uint32 first;
+        uint32 last;
+    };
+    typedef ist::vector<RoutineProgram> ProgramCont;
+    typedef ist::vector<Batch>          BatchCont;
+    typedef ist::raw_vector<uint32>     IndexCont;
+    typedef ist::raw_vector<Job>        JobCont;
+
+    uint32 findIndex(EntityHandle h) const;
+    void updateBlock(const Job &job, float32 dt, const vec3 *targets, uint32 num_targets, ShotCont &shots);
+    void execute(Batch &b, const RoutineProgram &prog, uint32 i, float32 dir_x, float32 dir_y, ShotCont &shots);
+
+    BatchCont       m_batches;      // プログラム毎
+    IndexCont       m_sparse_batch; // EntityGetIndex(handle) -> プログラム
+    IndexCont       m_sparse_index; // EntityGetIndex(handle) -> Batch 内の index
+
+    // 以下 serialize 不要
+    // ID は登録順なので、同じ順で登録していればロード後も変わらない
+    ProgramCont     m_programs;
+    JobCont         m_jobs;
+    ist::vector<ShotCont> m_shots; // ブロック毎
+
+    istSerializeBlock(
+        istSerialize(m_batches)
+        istSerialize(m_sparse_batch)
+        istSerialize(m_sparse_index)
+    )
+};
+
+} // namespace atm
+#endif // atm_Engine_Game_RoutineProgram_h
@@ -0,0 +1,100 @@
+﻿#include "atmPCH.h"
+#include "types.h"
+#include "Renderer.h"
+#include "DrawList.h"
+
+namespace atm {
+
+namespace {
+    istThreadLocal DrawList *g_current_dlist;
+
+    struct LessPSetType
+    {
+        bool operator()(const DrawList::PSetEntry &a, const DrawList::PSetEntry &b) const
+        {
+            if(a.target!=b.target) { return a.target<b.target; }
+            return a.psid<b.psid;
+        }
+    };
+} // namespace
+
+DrawList* DrawList::getCurrent()        { return g_current_dlist; }
+void DrawList::setCurrent(DrawList *v)  { g_current_dlist=v; }
+
+
+DrawList::DrawList()
+{
+}
+
+void DrawList::clear()
+{
+    m_psets.clear();
+    m_bloodstains.clear();
+    m_directional_lights.clear();
+    m_point_lights.clear();
+}
+
+bool DrawList::empty() const
+{
+    return m_psets.empty() && m_bloodstains.empty() && m_directional_lights.empty() && m_point_lights.empty();
+}
+
+void DrawList::addParticles(PSET_RID psid, const PSetInstance &inst, uint32 n, PSetTarget target)
+{
+    if(!PassGBuffer_Fluid::culling(psid, inst)) { return; }
+    PSetEntry e;
+    e.inst = inst;
+    e.psid = psid;
+    e.num = n;
+    e.target = target;
+    m_psets.push_back(e);
+}
+
+void DrawList::addBloodstainParticles(const mat4 &t, const BloodstainParticle *bsp, uint32 num_bsp)
+{
+    if(num_bsp==0) { return; }
+    BloodstainEntry e = {t, bsp, num_bsp};
+    m_bloodstains.push_back(e);
+}
+
+void DrawList::addLight(const DirectionalLight &v)  { m_directional_lights.push_back(v); }
+void DrawList::addLight(const PointLight &v)        { m_point_lights.push_back(v); }
+
+void DrawList::append(const DrawList &other)
+{
+    m_psets.insert(m_psets.end(), other.m_psets.begin(), other.m_psets.end());
+    m_bloodstains.insert(m_bloodstains.end(), other.m_bloodstains.begin(), other.m_bloodstains.end());
+    m_directional_lights.insert(m_directional_lights.end(), other.m_directional_lights.begin(), other.m_directional_lights.end());
+    m_point_lights.insert(m_point_lights.end(), other.m_point_lights.begin(), other.m_point_lights.end());
+}
+
+void DrawList::sortByPSet()
+{
+    stl::stable_sort(m_psets.begin(), m_psets.end(), LessPSetType());
+}
+
+void DrawList::flush()
+{
+    istAssert(getCurrent()==nullptr); // pass に直接渡すため
+    PassGBuffer_Fluid *fluid = atmGetFluidPass();
+    PassForward_Barrier *barrier = atmGetBarrierPass();
+    for(uint32 i=0; i<m_psets.size(); ++i) {
+        const PSetEntry &e = m_psets[i];
+        switch(e.target) {
+        case PT_Fluid:      fluid->addCulledParticles(e.psid, e.inst, e.num); break;
+        case PT_FluidSolid: fluid->addCulledParticlesSolid(e.psid, e.inst, e.num); break;
+        case PT_Barrier:    barrier->addCulledParticles(e.psid, e.inst, e.num); break;
+        }
+    }
+    PassDeferred_Bloodstain *bloodstain = atmGetBloodStainPass();
+    for(uint32 i=0; i<m_bloodstains.size(); ++i) {
+        const BloodstainEntry &e = m_bloodstains[i];
+        bloodstain->addBloodstainParticles(e.transform, e.particles, e.num);
+    }
+    PassDeferred_Lights *lights = atmGetLightPass();
+    for(uint32 i=0; i<m_directional_lights.size(); ++i) { lights->addLight(m_directional_lights[i]); }
+    for(uint32 i=0; i<m_point_lights.size(); ++i)       { lights->addLight(m_point_lights[i]); }
+    clear();
+}
+
+} // namespace atm
@@ -0,0 +1,68 @@
+﻿#ifndef atm_Engine_Graphics_DrawList_h
+#define atm_Engine_Graphics_DrawList_h
+
+namespace atm {
+
+// 並列に IEntity::draw() している間の、各 pass への描画要求を溜めておくもの。
+// EntityModule::draw() はブロック毎にこれを用意し、全ブロックが終わった後にブロック順に flush() する。
+// 並列 draw 中は getCurrent() でそのスレッドのものが得られ (それ以外の時は nullptr)、
+// PassGBuffer_Fluid、PassForward_Barrier、PassDeferred_Bloodstain、PassDeferred_Lights の add*() は自動的にこれに積まれる。
+// culling は積む時に行うので、並列に処理される。
+class atmAPI DrawList
+{
+public:
+    static DrawList* getCurrent();
+    static void setCurrent(DrawList *v);
+
+    enum PSetTarget {
+        PT_Fluid,
+        PT_FluidSolid,
+        PT_Barrier,
+    };
+    struct PSetEntry
+    {
+        PSetInstance inst;
+        PSET_RID psid;
+        uint32 num;
+        PSetTarget target;
+    };
+    struct BloodstainEntry
+    {
+        mat4 transform;
+        const BloodstainParticle *particles;
+        uint32 num;
+    };
+    typedef ist::vector<PSetEntry>          PSetEntries;
+    typedef ist::raw_vector<BloodstainEntry> BloodstainEntries;
+    typedef ist::vector<DirectionalLight>   DirectionalLights;
+    typedef ist::vector<PointLight>         PointLights;
+
+public:
+    DrawList();
+    void clear();
+    bool empty() const;
+    uint32 getNumPSets() const { return (uint32)m_psets.size(); }
+
+    void addParticles(PSET_RID psid, const PSetInstance &inst, uint32 n, PSetTarget target);
+    void addBloodstainParticles(const mat4 &t, const BloodstainParticle *bsp, uint32 num_bsp);
+    void addLight(const DirectionalLight &v);
+    void addLight(const PointLight &v);
+
+    // other を後ろに繋げる
+    void append(const DrawList &other);
+    // PSet の種類毎にまとめる。同じ種類の中の順序は保つ
+    void sortByPSet();
+    // 積まれた順に各 pass に渡して空にする
+    void flush();
+
+    const PSetEntries& getPSets() const { return m_psets; }
+
+private:
+    PSetEntries         m_psets;
+    BloodstainEntries   m_bloodstains;
+    DirectionalLights   m_directional_lights;
+    PointLights         m_point_lights;
+};
+
+} // namespace atm
+#endif // atm_Engine_Graphics_DrawList_h
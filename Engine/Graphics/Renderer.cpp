@@ -303,7 +303,7 @@ void AtomicRenderer::passOutput()
     istSPrintf(buf, "FPS: %u", atmGetRenderingSystem()->getAverageFPS());
     m_stext->addText(vec2(5.0f, 5.0f), buf);
     if(atmGetGame()) {
-        istSPrintf(buf, "Particles: %d", atmGetFluidModule()->getNumParticles());
+        istSPrintf(buf, "Particles: %d (sleeping: %d)", atmGetFluidModule()->getNumParticles(), atmGetFluidModule()->getNumSleepingParticles());
         m_stext->addText(vec2(5.0f, 25.0f), buf);
     }
 
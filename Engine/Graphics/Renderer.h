@@ -181,6 +181,7 @@ public:
 
 } // namespace atm
 
+#include "DrawList.h"
 #include "Renderer_GBuffer.h"
 #include "Renderer_DeferredShading.h"
 #include "Renderer_ForwardShading.h"
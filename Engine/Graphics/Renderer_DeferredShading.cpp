@@ -103,6 +103,10 @@ void PassDeferred_Bloodstain::draw()
 void PassDeferred_Bloodstain::addBloodstainParticles( const mat4 &t, const BloodstainParticle *bsp, uint32 num_bsp )
 {
     if(num_bsp==0) { return; }
+    if(DrawList *dl=DrawList::getCurrent()) {
+        dl->addBloodstainParticles(t, bsp, num_bsp);
+        return;
+    }
 
     BloodstainParticleSet tmp;
     tmp.transform   = t;
@@ -335,11 +339,19 @@ void PassDeferred_Lights::drawPointLights()
 
 void PassDeferred_Lights::addLight( const DirectionalLight& v )
 {
+    if(DrawList *dl=DrawList::getCurrent()) {
+        dl->addLight(v);
+        return;
+    }
     m_directional_lights.push_back(v);
 }
 
 void PassDeferred_Lights::addLight( const PointLight& v )
 {
+    if(DrawList *dl=DrawList::getCurrent()) {
+        dl->addLight(v);
+        return;
+    }
     m_point_lights.push_back(v);
 }
 
@@ -182,16 +182,17 @@ void PassForward_Barrier::draw()
 
 void PassForward_Barrier::addParticles( PSET_RID psid, const PSetInstance &inst, uint32 n )
 {
+    if(DrawList *dl=DrawList::getCurrent()) {
+        dl->addParticles(psid, inst, n, DrawList::PT_Barrier);
+        return;
+    }
     if(!PassGBuffer_Fluid::culling(psid, inst)) { return; }
+    PassGBuffer_Fluid::pushParticles(m_solids, psid, inst, n);
+}
 
-    const ParticleSet *rc = atmGetParticleSet(psid);
-    uint32 num_particles = rc->getNumParticles();
-    PSetUpdateInfo tmp;
-    tmp.psid        = psid;
-    tmp.instanceid  = m_solids.instance_data.size();
-    tmp.num = n!=0 ? std::min(n, num_particles) : num_particles;
-    m_solids.update_info.push_back(tmp);
-    m_solids.instance_data.push_back(inst);
+void PassForward_Barrier::addCulledParticles( PSET_RID psid, const PSetInstance &inst, uint32 n )
+{
+    PassGBuffer_Fluid::pushParticles(m_solids, psid, inst, n);
 }
 
 
@@ -46,7 +46,10 @@ public:
     void beforeDraw();
     void draw();
 
+    // 並列 draw 中は DrawList に積まれる
     void addParticles(PSET_RID psid, const PSetInstance &inst, uint32 n=0);
+    // culling 済みのもの (DrawList::flush() から)
+    void addCulledParticles(PSET_RID psid, const PSetInstance &inst, uint32 n=0);
 
 private:
     PSetDrawData m_solids;
@@ -90,18 +90,31 @@ void PassGBuffer_Fluid::drawFluid()
     i3d::DeviceContext  *dc = atmGetGLDeviceContext();
     VertexArray         *va_cube  = atmGetVertexArray(VA_FLUID_CUBE);
     Buffer              *vbo_fluid= atmGetVertexBuffer(VBO_GB_FLUID);
-    AtomicShader        *sh_fluid = atmGetShader(SH_GBUFFER_FLUID_SPHERICAL);
 
     if(atmGetGame()) {
         // copy fluid particles (ispc -> GL)
-        const uint32 num_particles = atmGetFluidModule()->copyParticlesToGL();
+        bool packed = false;
+        const uint32 num_particles = atmGetFluidModule()->copyParticlesToGL(packed);
         if(num_particles > 0) {
-            const VertexDesc descs[] = {
-                {GLSL_INSTANCE_POSITION, I3D_FLOAT32,4,  0, false, 1},
-                {GLSL_INSTANCE_VELOCITY, I3D_FLOAT32,4, 16, false, 1},
-                {GLSL_INSTANCE_PARAM,    I3D_FLOAT32,4, 32, false, 1},
-            };
-            va_cube->setAttributes(1, vbo_fluid, 0, sizeof(psym::Particle), descs, _countof(descs));
+            AtomicShader *sh_fluid = NULL;
+            if(packed) {
+                // FluidPackedParticle。position は 0.0-1.0 に正規化された値になるので shader 側で戻す
+                const VertexDesc descs[] = {
+                    {GLSL_INSTANCE_POSITION, I3D_UINT16, 3, 0, true,  1},
+                    {GLSL_INSTANCE_PARAM,    I3D_FLOAT16,2, 8, false, 1},
+                };
+                va_cube->setAttributes(1, vbo_fluid, 0, sizeof(FluidPackedParticle), descs, _countof(descs));
+                sh_fluid = atmGetShader(SH_GBUFFER_FLUID_SPHERICAL_PACKED);
+            }
+            else {
+                // psym::RenderParticle。position.w は 1.0、param は x: energy, y: density になる
+                const VertexDesc descs[] = {
+                    {GLSL_INSTANCE_POSITION, I3D_FLOAT32,3,  0, false, 1},
+                    {GLSL_INSTANCE_PARAM,    I3D_FLOAT32,2, 12, false, 1},
+                };
+                va_cube->setAttributes(1, vbo_fluid, 0, sizeof(psym::RenderParticle), descs, _countof(descs));
+                sh_fluid = atmGetShader(SH_GBUFFER_FLUID_SPHERICAL);
+            }
             sh_fluid->assign(dc);
             dc->setVertexArray(va_cube);
             dc->setDepthStencilState(atmGetDepthStencilState(DS_GBUFFER_FLUID));
@@ -172,30 +185,44 @@ void PassGBuffer_Fluid::drawParticleSets( PSetDrawData &pdd )
 
 void PassGBuffer_Fluid::addParticles( PSET_RID psid, const PSetInstance &inst, uint32 n )
 {
+    if(DrawList *dl=DrawList::getCurrent()) {
+        dl->addParticles(psid, inst, n, DrawList::PT_Fluid);
+        return;
+    }
     if(!culling(psid, inst)) { return; }
-
-    const ParticleSet *rc = atmGetParticleSet(psid);
-    uint32 num_particles = rc->getNumParticles();
-    PSetUpdateInfo tmp;
-    tmp.psid        = psid;
-    tmp.instanceid  = m_rigid_sp.instance_data.size();
-    tmp.num = n!=0 ? std::min(n, num_particles) : num_particles;
-    m_rigid_sp.update_info.push_back(tmp);
-    m_rigid_sp.instance_data.push_back(inst);
+    pushParticles(m_rigid_sp, psid, inst, n);
 }
 
 void PassGBuffer_Fluid::addParticlesSolid( PSET_RID psid, const PSetInstance &inst, uint32 n )
 {
+    if(DrawList *dl=DrawList::getCurrent()) {
+        dl->addParticles(psid, inst, n, DrawList::PT_FluidSolid);
+        return;
+    }
     if(!culling(psid, inst)) { return; }
+    pushParticles(m_rigid_so, psid, inst, n);
+}
+
+void PassGBuffer_Fluid::addCulledParticles( PSET_RID psid, const PSetInstance &inst, uint32 n )
+{
+    pushParticles(m_rigid_sp, psid, inst, n);
+}
 
+void PassGBuffer_Fluid::addCulledParticlesSolid( PSET_RID psid, const PSetInstance &inst, uint32 n )
+{
+    pushParticles(m_rigid_so, psid, inst, n);
+}
+
+void PassGBuffer_Fluid::pushParticles( PSetDrawData &pdd, PSET_RID psid, const PSetInstance &inst, uint32 n )
+{
     const ParticleSet *rc = atmGetParticleSet(psid);
     uint32 num_particles = rc->getNumParticles();
     PSetUpdateInfo tmp;
     tmp.psid        = psid;
-    tmp.instanceid  = m_rigid_so.instance_data.size();
+    tmp.instanceid  = pdd.instance_data.size();
     tmp.num = n!=0 ? std::min(n, num_particles) : num_particles;
-    m_rigid_so.update_info.push_back(tmp);
-    m_rigid_so.instance_data.push_back(inst);
+    pdd.update_info.push_back(tmp);
+    pdd.instance_data.push_back(inst);
 }
 
 bool PassGBuffer_Fluid::culling( PSET_RID psid, const PSetInstance &inst )
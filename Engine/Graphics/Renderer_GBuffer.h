@@ -26,10 +26,15 @@ public:
     void beforeDraw();
     void draw();
 
+    // 並列 draw 中は DrawList に積まれる
     void addParticles(PSET_RID psid, const PSetInstance &inst, uint32 n=0);
     void addParticlesSolid(PSET_RID psid, const PSetInstance &inst, uint32 n=0);
+    // culling 済みのもの (DrawList::flush() から)
+    void addCulledParticles(PSET_RID psid, const PSetInstance &inst, uint32 n=0);
+    void addCulledParticlesSolid(PSET_RID psid, const PSetInstance &inst, uint32 n=0);
 
     static bool culling(PSET_RID psid, const PSetInstance &inst);
+    static void pushParticles(PSetDrawData &pdd, PSET_RID psid, const PSetInstance &inst, uint32 n);
     static void drawParticleSets(PSetDrawData &pdd);
 
 private:
@@ -28,6 +28,7 @@ enum SH_RID {
     SH_GBUFFER_FLOOR,
     SH_GBUFFER_PARTICLES,
     SH_GBUFFER_FLUID_SPHERICAL,
+    SH_GBUFFER_FLUID_SPHERICAL_PACKED,
     SH_GBUFFER_FLUID_SOLID,
     SH_GBUFFER_RIGID_SPHERICAL,
     SH_GBUFFER_RIGID_SOLID,
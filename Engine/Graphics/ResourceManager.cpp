@@ -146,7 +146,7 @@ bool GraphicResourceManager::initialize()
         CreateDistanceFieldQuads(m_va[VA_DISTANCE_FIELD],
             m_vbo[VBO_DISTANCE_FIELD_QUAD], m_vbo[VBO_DISTANCE_FIELD_POS], m_vbo[VBO_DISTANCE_FIELD_DIST]);
 
-        m_vbo[VBO_GB_FLUID]             = CreateVertexBuffer(dev, sizeof(psym::Particle)*PSYM_MAX_PARTICLE_NUM, I3D_USAGE_DYNAMIC);
+        m_vbo[VBO_GB_FLUID]             = CreateVertexBuffer(dev, sizeof(psym::RenderParticle)*PSYM_MAX_PARTICLE_NUM, I3D_USAGE_DYNAMIC);
         m_vbo[VBO_GB_RIGID_SPHERICAL]   = CreateVertexBuffer(dev, sizeof(PSetParticle)*MAX_RIGID_PARTICLES, I3D_USAGE_DYNAMIC);
         m_vbo[VBO_GB_RIGID_SOLID]       = CreateVertexBuffer(dev, sizeof(PSetParticle)*MAX_RIGID_PARTICLES, I3D_USAGE_DYNAMIC);
         m_vbo[VBO_FW_RIGID_BARRIER]     = CreateVertexBuffer(dev, sizeof(PSetParticle)*MAX_RIGID_PARTICLES, I3D_USAGE_DYNAMIC);
@@ -173,6 +173,7 @@ bool GraphicResourceManager::initialize()
         //m_shader[SH_GBUFFER_FLUID]      = CreateAtomicShader("GBuffer_Fluid");
         //m_shader[SH_GBUFFER_RIGID]      = CreateAtomicShader("GBuffer_Rigid");
         m_shader[SH_GBUFFER_FLUID_SPHERICAL]= CreateAtomicShader("GBuffer_FluidBlood");
+        m_shader[SH_GBUFFER_FLUID_SPHERICAL_PACKED]= CreateAtomicShader("GBuffer_FluidBloodPacked");
         m_shader[SH_GBUFFER_FLUID_SOLID]    = CreateAtomicShader("GBuffer_FluidSolid");
         m_shader[SH_GBUFFER_RIGID_SPHERICAL]= CreateAtomicShader("GBuffer_RigidSpherical");
         m_shader[SH_GBUFFER_RIGID_SOLID]    = CreateAtomicShader("GBuffer_RigidSolid");
@@ -126,6 +126,7 @@ public:
     bool        isDead() const          { return m_life<=0.0f; }
     float32     getLife() const         { return m_life; }
     IRoutine*   getRoutine()            { return m_routine; }
+    const IRoutine* getRoutine() const  { return m_routine; }
     const vec4& getDamageColor() const  { return m_damage_color; }
     void        damage(float32 d)       { m_delta_damage += d; }
 
@@ -206,6 +207,11 @@ public:
         //atmDeleteEntity(getHandle());
     }
 
+    void eventDamage(const DamageMessage *m) override
+    {
+        damage(m->damage);
+    }
+
     virtual void eventFluid(const FluidMessage *m)
     {
         addBloodstain(getInvTransformMatrix(), (vec4&)m->position);
@@ -213,6 +219,8 @@ public:
     }
 
 
+    bool canDrawInParallel() const override { return true; }
+
     void draw() override
     {
         PSetInstance inst;
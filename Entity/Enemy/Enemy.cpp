@@ -75,6 +75,20 @@ public:
     void setState(State s) { m_state=s; m_st_frame=0; }
     State getState() const { return m_state; }
 
+    // 他の Entity に触るのは削除と爆発だけで、どちらも EntityCommandBuffer に積まれるので、Routine 次第
+    bool canUpdateInParallel() const override
+    {
+        const IRoutine *routine = getRoutine();
+        return !routine || routine->canUpdateInParallel();
+    }
+
+    // eventCollide() はダメージを受けるだけで、破壊時の処理は DeferIfParallel() されるので、こちらも Routine 次第
+    bool canReceiveCollisionInParallel() const override
+    {
+        const IRoutine *routine = getRoutine();
+        return !routine || routine->canUpdateInParallel();
+    }
+
     void setLightRadius(float32 v)          { m_light_radius=v; }
     void setExplosionSE(SE_RID v)           { m_explosion_se=v; }
     void setExplosionChannel(SE_CHANNEL v)  { m_explosion_channel=v; }
@@ -193,8 +207,15 @@ public:
     {
         setState(State_Fadeout);
         setRoutine(RCID_Null);
-        atmGetFluidModule()->addFluid(getModel(), getTransformMatrix());
-        atmPlaySE(m_explosion_channel, m_explosion_se, getPositionAbs(), true);
+        PSET_RID model = getModel();
+        mat4 trans = getTransformMatrix();
+        vec3 pos = getPositionAbs();
+        SE_CHANNEL channel = m_explosion_channel;
+        SE_RID se = m_explosion_se;
+        DeferIfParallel([=](){
+            atmGetFluidModule()->addFluid(model, trans);
+            atmPlaySE(channel, se, pos, true);
+        });
     }
 
     void eventCollide(const CollideMessage *m) override
@@ -60,6 +60,7 @@ atmExportClass(HatchBase);
 class HatchSmall : public HatchBase
 {
 typedef HatchBase super;
+istDefinePoolNewST(HatchSmall);
 private:
     istSerializeBlock(
         istSerializeBase(super)
@@ -74,6 +75,7 @@ atmExportClass(HatchSmall);
 class HatchLarge : public HatchBase
 {
 typedef HatchBase super;
+istDefinePoolNewST(HatchLarge);
 private:
 public:
 };
@@ -8,6 +8,7 @@ namespace atm {
 class HomingMine : public Breakable<Entity_Direction>
 {
 typedef Breakable<Entity_Direction> super;
+istDefinePoolNewST(HomingMine);
 private:
     istSerializeBlock(
         istSerializeBase(super)
@@ -22,6 +23,7 @@ atmExportClass(HomingMine);
 class LaserMissile : public Breakable<Entity_Direction>
 {
 typedef Breakable<Entity_Direction> super;
+istDefinePoolNewST(LaserMissile);
 private:
     istSerializeBlock(
         istSerializeBase(super)
@@ -9,6 +9,7 @@ namespace atm {
 class BreakableParts : public Breakable<Entity_Direction>
 {
 typedef Breakable<Entity_Direction> super;
+istDefinePoolNewST(BreakableParts);
 private:
     istSerializeBlock(
         istSerializeBase(super)
@@ -23,6 +24,7 @@ atmExportClass(BreakableParts);
 class BreakableCore : public Breakable<Entity_Direction>
 {
 typedef Breakable<Entity_Direction> super;
+istDefinePoolNewST(BreakableCore);
 private:
     istSerializeBlock(
         istSerializeBase(super)
@@ -39,6 +41,7 @@ atmExportClass(BreakableCore);
 class RollerParts : public Unbreakable<Entity_Direction>
 {
 typedef Unbreakable<Entity_Direction>  super;
+istDefinePoolNewST(RollerParts);
 private:
     istSerializeBlock(
         istSerializeBase(super)
@@ -166,6 +169,7 @@ atmExportClass(RollerBase);
 class TriRollerSmall : public RollerBase
 {
 typedef RollerBase super;
+istDefinePoolNewST(TriRollerSmall);
 private:
     istSerializeBlock(
         istSerializeBase(super)
@@ -180,6 +184,7 @@ atmExportClass(TriRollerSmall);
 class TriRollerLarge : public RollerBase
 {
 typedef RollerBase super;
+istDefinePoolNewST(TriRollerLarge);
 private:
     istSerializeBlock(
         istSerializeBase(super)
@@ -194,6 +199,7 @@ atmExportClass(TriRollerLarge);
 class PentaRoller : public RollerBase
 {
 typedef RollerBase super;
+istDefinePoolNewST(PentaRoller);
 private:
     istSerializeBlock(
         istSerializeBase(super)
@@ -210,6 +216,7 @@ atmExportClass(PentaRoller);
 class Shell : public Breakable<Entity_Direction>
 {
 typedef Breakable<Entity_Direction> super;
+istDefinePoolNewST(Shell);
 private:
     istSerializeBlock(
         istSerializeBase(super)
@@ -224,6 +231,7 @@ atmExportClass(Shell);
 class Zab : public Breakable<Entity_Direction>
 {
 typedef Breakable<Entity_Direction> super;
+istDefinePoolNewST(Zab);
 private:
     istSerializeBlock(
         istSerializeBase(super)
@@ -238,6 +246,7 @@ atmExportClass(Zab);
 class SmallNucleus : public Breakable<Entity_Direction>
 {
 typedef Breakable<Entity_Direction> super;
+istDefinePoolNewST(SmallNucleus);
 private:
     istSerializeBlock(
         istSerializeBase(super)
@@ -76,7 +76,7 @@ public:
 	{
 		m_time += dt;
 		IEntity *e = getEntity();
-		vec3 pos; atmQuery(e, getPosition, pos);
+		vec3 pos = atmGetPosition(e);
 		vec3 player_pos = GetNearestPlayerPosition(pos);
 		vec3 dir = vec3(glm::normalize(vec2(player_pos)-vec2(pos)), 0.0f);
 		if(moddiv(m_time, 150.0f)) {
@@ -110,7 +110,7 @@ public:
 			setState(State_Laser);
 
 			IEntity *e = getEntity();
-			vec3 pos; atmQuery(e, getPosition, pos);
+			vec3 pos = atmGetPosition(e);
 			vec3 dir = glm::normalize(tpos-pos);
 			m_laser = atmGetBulletModule()->createLaser(pos+dir*0.2f, dir, e->getHandle());
 		}
@@ -120,7 +120,7 @@ public:
 	{
 		IEntity *e = getEntity();
 		vec3 v = glm::normalize(vec3(m->direction.x,m->direction.y,0.0f)) * (m->direction.w * 0.1f);
-		vec3 pos; atmQuery(e, getPosition, pos);
+		vec3 pos = atmGetPosition(e);
 		pos += v;
 		pos.z = 0.0f;
 		atmCall(e, setPosition, pos);
@@ -450,12 +450,13 @@ private:
 
 public:
 	Routine_CircularShoot() : m_time(0.0f), m_cycle(0) {}
+	bool canUpdateInParallel() const override { return true; }
 
 	void update(float32 dt)
 	{
 		m_time += dt;
 		IEntity *e = getEntity();
-		vec3 pos; atmQuery(e, getPosition, pos);
+		vec3 pos = atmGetPosition(e);
 		vec4 dir = vec4(0.0f, 1.0f, 0.0f, 1.0);
 		if(moddiv(m_time, 20.0f)) {
 			for(int i=0; i<10; ++i) {
@@ -499,13 +500,14 @@ public:
 public:
 	Routine_HomingPlayer() : m_time(0.0f)
 	{}
+	bool canUpdateInParallel() const override { return true; }
 
 	void update(float32 dt)
 	{
 		m_time += dt;
 
 		IEntity *e = getEntity();
-		vec3 pos; atmQuery(e, getPosition, pos);
+		vec3 pos = atmGetPosition(e);
 		m_target_pos = GetNearestPlayerPosition(pos);
 
 		//if(moddiv(m_time, 10.0f)) {
@@ -517,7 +519,7 @@ public:
 	void asyncupdate(float32 dt)
 	{
 		IEntity *e = getEntity();
-		vec3 pos; atmQuery(e, getPosition, pos);
+		vec3 pos = atmGetPosition(e);
 		m_vel *= 0.98f;
 		m_vel += glm::normalize(m_target_pos-pos) * 0.0002f;
 		pos += m_vel*dt;
@@ -538,7 +540,7 @@ public:
 	void instruct(const vec3 &tpos, EntityHandle tobj)
 	{
 		IEntity *e = getEntity();
-		vec3 pos; atmQuery(e, getPosition, pos);
+		vec3 pos = atmGetPosition(e);
 		vec3 vel = glm::normalize(tpos-pos)*0.015f;
 		ShootSimpleBullet(e->getHandle(), pos, vel);
 	}
@@ -573,6 +575,7 @@ public:
 
 public:
 	Routine_Pinball() {}
+	bool canUpdateInParallel() const override { return true; }
 
 	void setVelocity(const vec3 &v) { m_vel=v; }
 	void setAccel(const vec3 &v)    { m_accel=v; }
@@ -580,7 +583,7 @@ public:
 	void asyncupdate(float32 dt)
 	{
 		IEntity *e = getEntity();
-		vec3 pos; atmQuery(e, getPosition, pos);
+		vec3 pos = atmGetPosition(e);
 		pos += m_vel * dt;
 		m_vel += m_accel;
 		atmCall(e, setPosition, pos);
@@ -611,6 +614,71 @@ atmImplementRoutine(Routine_Pinball);
 atmExportClass(Routine_Pinball);
 
 
+// RoutineProgram で動くもの。setRoutineProgram() で実行するプログラムを指定する。
+// 移動と弾の発射は EntityModule の RoutineRunner が同じプログラムのもの全部をまとめて行うので、ここでは位置を受け取るだけ。
+// 例: atmCall(e, setRoutine, RCID_Routine_Script);
+//     atmCall(e, setRoutineProgram, atmGetEntityModule()->getRoutineRunner().findProgram("SingleShoot"));
+class Routine_Script : public IRoutine, public Attr_MessageHandler
+{
+typedef IRoutine super;
+typedef Attr_MessageHandler mhandler;
+private:
+	RoutineProgramID m_program;
+
+	istSerializeBlock(
+		istSerializeBase(super)
+		istSerializeBase(mhandler)
+		istSerialize(m_program)
+	)
+
+public:
+	atmECallBlock(
+		atmMethodBlock(
+			atmECall(setRoutineProgram)
+		)
+		atmECallSuper(mhandler)
+	)
+
+public:
+	Routine_Script() : m_program(RoutineRunner::InvalidProgram) {}
+	bool canUpdateInParallel() const override { return true; }
+
+	void finalize() override
+	{
+		atmGetEntityModule()->getRoutineRunner().detach(getEntity()->getHandle());
+	}
+
+	void setRoutineProgram(RoutineProgramID v)
+	{
+		m_program = v;
+		IEntity *e = getEntity();
+		vec3 pos = atmGetPosition(e);
+		atmGetEntityModule()->getRoutineRunner().attach(e->getHandle(), v, pos);
+	}
+
+	void update(float32 dt) override
+	{
+		IEntity *e = getEntity();
+		vec3 pos;
+		if(atmGetEntityModule()->getRoutineRunner().getPosition(e->getHandle(), pos)) {
+			atmCall(e, setPosition, pos);
+		}
+	}
+
+	void eventCollide(const CollideMessage *m) override
+	{
+		IEntity *e = getEntity();
+		vec3 pos;
+		if(atmGetEntityModule()->getRoutineRunner().getPosition(e->getHandle(), pos)) {
+			pos += glm::normalize(vec3(m->direction.x,m->direction.y,0.0f)) * (m->direction.w * 0.1f);
+			atmGetEntityModule()->getRoutineRunner().setPosition(e->getHandle(), pos);
+		}
+	}
+};
+atmImplementRoutine(Routine_Script);
+atmExportClass(Routine_Script);
+
+
 
 
 
@@ -665,7 +733,7 @@ public:
 		m_frame++;
 
 		IEntity *e = getEntity();
-		vec3 pos; atmQuery(e, getPosition, pos);
+		vec3 pos = atmGetPosition(e);
 		m_target_pos = GetNearestPlayerPosition(pos);
 
 		if(m_frame%5==0) {
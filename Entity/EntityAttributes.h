@@ -341,8 +341,10 @@ public:
     atmECallBlock(
         atmMethodBlock(
             atmECall(eventCollide)
+            atmECall(eventCollideBatch)
             atmECall(eventFluid)
             atmECall(eventDamage)
+            atmECall(eventDamageBatch)
             atmECall(eventDestroy)
             atmECall(eventKill)
         )
@@ -350,8 +352,12 @@ public:
     wdmScope(void addDebugNodes(const wdmString &path) {})
 
     virtual void eventCollide(const CollideMessage *m)  {}
+    // 同じ receiver 宛ての衝突メッセージをまとめて受け取る。デフォルトでは eventCollide() に一つずつ回す
+    virtual void eventCollideBatch(const CollideMessage *m, uint32 num) { for(uint32 i=0; i<num; ++i) { eventCollide(m+i); } }
     virtual void eventFluid(const FluidMessage *m)      {}
     virtual void eventDamage(const DamageMessage *m)    {}
+    // MessageRouter から同じ receiver 宛てのダメージをまとめて受け取る。デフォルトでは eventDamage() に一つずつ回す
+    virtual void eventDamageBatch(const DamageMessage *m, uint32 num) { for(uint32 i=0; i<num; ++i) { eventDamage(m+i); } }
     virtual void eventDestroy(const DestroyMessage *m)  {}
     virtual void eventKill(const KillMessage *m)        {}
     void update(float32 dt)     {}
@@ -418,12 +418,21 @@ public:
 };
 
 
+// 親の world 行列は EntityTransformHierarchy が毎フレーム親から順に計算してキャッシュに入れる。
+// キャッシュが無い間 (setParent() 直後やデシリアライズ直後) は以前と同じく親に問い合わせる。
+// 親が削除されると hierarchy から外れてキャッシュが更新されなくなるので、その時はキャッシュを使わない。
+// (問い合わせも失敗するので、以前と同じく親の影響を含まない行列になる)
 template<class T>
 class TAttr_HaveParent : public T
 {
 typedef T super;
 private:
     EntityHandle m_parent;
+    // 以下 serialize 不要
+    mat4 m_ptrans;      // 親の world 行列
+    mat4 m_iptrans;     // その逆行列
+    mat4 m_prot;        // 親の computeRotationMatrix()
+    bool m_ptrans_valid;
 
     istSerializeBlock(
         istSerializeBase(super)
@@ -439,9 +448,11 @@ public:
             atmECall(setDirectionAbs)
             atmECall(getParent)
             atmECall(setParent)
+            atmECall(setParentTransformMatrix)
             atmECall(move)
             atmECall(orient)
             atmECall(computeTransformMatrix)
+            atmECall(computeLocalTransformMatrix)
             atmECall(computeRotationMatrix)
         )
         atmECallSuper(super)
@@ -461,10 +472,41 @@ public:
     )
 
 public:
-    TAttr_HaveParent() : m_parent(0)
+    TAttr_HaveParent() : m_parent(0), m_ptrans_valid(false)
     {}
     EntityHandle getParent() const { return m_parent; }
-    void setParent(EntityHandle v) { m_parent=v; }
+    void setParent(EntityHandle v)
+    {
+        m_parent = v;
+        m_ptrans_valid = false;
+        if(atmGetWorld()) { atmGetEntityModule()->getTransformHierarchy().setDirty(); }
+    }
+
+    // EntityTransformHierarchy から呼ばれる
+    void setParentTransformMatrix(const mat4 &trans, const mat4 &itrans, const mat4 &rot)
+    {
+        m_ptrans = trans;
+        m_iptrans = itrans;
+        m_prot = rot;
+        m_ptrans_valid = true;
+    }
+
+    // キャッシュがあって、親がまだ生きているか
+    bool isParentCacheValid() const
+    {
+        return m_ptrans_valid && atmGetWorld() && atmGetEntityModule()->isValidHandle(m_parent);
+    }
+
+    bool getParentTransformMatrix(mat4 &out) const
+    {
+        if(isParentCacheValid()) { out=m_ptrans; return true; }
+        return atmQuery(getParent(), getTransformMatrix, out);
+    }
+    bool getParentInvTransformMatrix(mat4 &out) const
+    {
+        if(isParentCacheValid()) { out=m_iptrans; return true; }
+        return atmQuery(getParent(), getInvTransformMatrix, out);
+    }
 
     bool isParentDead()
     {
@@ -481,7 +523,7 @@ public:
     {
         vec3 pos = super::getPosition();
         mat4 pmat;
-        if(atmQuery(getParent(), getTransformMatrix, pmat)) {
+        if(getParentTransformMatrix(pmat)) {
             vec4 tmp = vec4(pos, 1.0f);
             tmp = pmat * tmp;
             pos = vec3(tmp);
@@ -491,7 +533,7 @@ public:
     void setPositionAbs(const vec3 &pos)
     {
         mat4 pmat;
-        if(atmQuery(getParent(), getInvTransformMatrix, pmat)) {
+        if(getParentInvTransformMatrix(pmat)) {
             vec4 tmp = vec4(pos, 1.0f);
             tmp = pmat * tmp;
             super::setPosition(vec3(tmp));
@@ -506,7 +548,7 @@ public:
         vec3 ret;
         if(super::call(FID_getDirection, nullptr, &ret)) {
             mat4 pmat;
-            if(atmQuery(getParent(), getTransformMatrix, pmat)) {
+            if(getParentTransformMatrix(pmat)) {
                 ret = vec3(pmat*vec4(ret,0.0f));
             }
         }
@@ -516,7 +558,7 @@ public:
     {
         vec3 m = v;
         mat4 pmat;
-        if(atmQuery(getParent(), getInvTransformMatrix, pmat)) {
+        if(getParentInvTransformMatrix(pmat)) {
             m = vec3(pmat*vec4(v,0.0f));
         }
         super::call(FID_setDirection, &m, nullptr);
@@ -526,7 +568,7 @@ public:
     {
         vec3 m = v;
         mat4 pmat;
-        if(atmQuery(getParent(), getInvTransformMatrix, pmat)) {
+        if(getParentInvTransformMatrix(pmat)) {
             m = vec3(pmat*vec4(v,0.0f));
         }
         super::move(m);
@@ -536,7 +578,7 @@ public:
     {
         vec3 m = v;
         mat4 pmat;
-        if(atmQuery(getParent(), getInvTransformMatrix, pmat)) {
+        if(getParentInvTransformMatrix(pmat)) {
             m = vec3(pmat*vec4(v,0.0f));
         }
         super::call(FID_orient, &m, nullptr);
@@ -546,17 +588,26 @@ public:
     {
         mat4 mat = super::computeTransformMatrix();
         mat4 pmat;
-        if(atmQuery(getParent(), getTransformMatrix, pmat)) {
+        if(getParentTransformMatrix(pmat)) {
             mat = pmat * mat;
         }
         return mat;
     }
 
+    // 親の影響を含まない行列
+    mat4 computeLocalTransformMatrix() const
+    {
+        return super::computeTransformMatrix();
+    }
+
     mat4 computeRotationMatrix() const
     {
         mat4 mat = super::computeRotationMatrix();
         mat4 pmat;
-        if(atmQuery(getParent(), computeRotationMatrix, pmat)) {
+        if(isParentCacheValid()) {
+            mat = m_prot * mat;
+        }
+        else if(atmQuery(getParent(), computeRotationMatrix, pmat)) {
             mat = pmat * mat;
         }
         return mat;
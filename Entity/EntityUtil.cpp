@@ -6,9 +6,15 @@ namespace atm {
 
 void UpdateCollisionSphere(CollisionSphere &o, const vec3& pos, float32 r)
 {
-    o.pos_r = vec4(pos, r);
-    o.bb.ur = o.pos_r + vec4( r, r, r, 0.0f);
-    o.bb.bl = o.pos_r + vec4(-r,-r,-r, 0.0f);
+    vec4 pos_r = vec4(pos, r);
+    vec4 ur = pos_r + vec4( r, r, r, 0.0f);
+    vec4 bl = pos_r + vec4(-r,-r,-r, 0.0f);
+    if(pos_r!=o.pos_r || ur!=o.bb.ur || bl!=o.bb.bl) {
+        o.setRigidDirty();
+    }
+    o.pos_r = pos_r;
+    o.bb.ur = ur;
+    o.bb.bl = bl;
 }
 
 void UpdateCollisionBox(CollisionBox &o, const mat4& t, const vec3 &size)
@@ -42,6 +48,10 @@ void UpdateCollisionBox(CollisionBox &o, const mat4& t, const vec3 &size)
     };
 
     const vec3 pos = vec3(t[3]);
+    const vec4 prev_position = o.position;
+    const BoundingBox prev_bb = o.bb;
+    vec4 prev_planes[6];
+    memcpy(prev_planes, o.planes, sizeof(prev_planes));
     o.position = vec4(pos, 0.0f);
     o.trans = t;
     o.size = vec4(size, 0.0f);
@@ -54,17 +64,23 @@ void UpdateCollisionBox(CollisionBox &o, const mat4& t, const vec3 &size)
         o.bb.ur = glm::max(o.bb.ur, t);
         o.bb.bl = glm::min(o.bb.bl, t);
     }
+    // 静止しているものは psym への再出力を省けるよう、変化があった時だけ dirty にする
+    if( o.position!=prev_position || o.bb.ur!=prev_bb.ur || o.bb.bl!=prev_bb.bl ||
+        memcmp(o.planes, prev_planes, sizeof(o.planes))!=0 )
+    {
+        o.setRigidDirty();
+    }
 }
 
 
 vec3 GetNearestPlayerPosition(const vec3 &pos)
 {
-    vec3 ret;
-    atmEnumlateEntity(
-        [&](EntityHandle h){ return EntityGetClassID(h)==EC_Player; },
-        [&](IEntity *e){ atmQuery(e, getPosition, ret); }
-    );
-    return ret;
+    // 全 Entity を走査すると敵の数 x Entity の数になるので、EntityModule が毎フレーム作る索引を使う
+    EntitySpatialIndex::Result r;
+    if(atmGetEntityModule()->getSpatialIndex().findNearest(ECA_Player, pos, r, EC_Player)) {
+        return r.pos;
+    }
+    return vec3();
 }
 
 void ShootSimpleBullet(EntityHandle owner, const vec3 &pos, const vec3 &vel)
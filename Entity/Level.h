@@ -79,6 +79,8 @@ public:
         super::asyncupdate(dt);
     }
 
+    bool canDrawInParallel() const override { return true; }
+
     void draw() override
     {
         PSetInstance inst;
@@ -54,6 +54,8 @@ public:
         transform::updateTransformMatrix();
     }
 
+    bool canDrawInParallel() const override { return true; }
+
     const vec4& getDiffuse() const { return m_difuse; }
     const vec4& getAmbient() const { return m_ambient; }
     void setDiffuse(const vec4 &v) { m_difuse=v; }
@@ -12,6 +12,7 @@ istSEnumBlock(RoutineClassID,
     istSEnum(RCID_Routine_CircularShoot),
     istSEnum(RCID_Routine_HomingPlayer),
     istSEnum(RCID_Routine_Pinball),
+    istSEnum(RCID_Routine_Script),
 
     istSEnum(RCID_Routine_AlcantareaDemo),
 
@@ -57,8 +58,12 @@ public:
     virtual void update(float32 dt)     {}
     virtual void asyncupdate(float32 dt){}
     virtual void draw() {}
+    // update() と eventCollide() が他の Entity の生成や呼び出しをしなければ true にできる。
+    // (IEntity::canUpdateInParallel(), IEntity::canReceiveCollisionInParallel() を参照)
+    virtual bool canUpdateInParallel() const { return false; }
 
     virtual bool call(FunctionID fid, const void *args, void *ret) { return false; }
+    template<class Builder> void buildECallTable(Builder &builder) const {}
 };
 
 
@@ -14,8 +14,10 @@ istSEnumBlock(FunctionID,
     istSEnum(FID_decRefCount),
     istSEnum(FID_damage),
     istSEnum(FID_eventCollide),
+    istSEnum(FID_eventCollideBatch),
     istSEnum(FID_eventFluid),
     istSEnum(FID_eventDamage),
+    istSEnum(FID_eventDamageBatch),
     istSEnum(FID_eventDestroy),
     istSEnum(FID_eventKill),
 
@@ -108,7 +110,10 @@ istSEnumBlock(FunctionID,
     istSEnum(FID_computeRotationMatrix),
     istSEnum(FID_getInvTransformMatrix),
     istSEnum(FID_updateTransformMatrix),
+    istSEnum(FID_computeLocalTransformMatrix),
+    istSEnum(FID_setParentTransformMatrix),
     istSEnum(FID_setRoutine),
+    istSEnum(FID_setRoutineProgram),
     istSEnum(FID_setLightRadius),
     istSEnum(FID_setExplosionSE),
     istSEnum(FID_setExplosionChannel),
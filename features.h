@@ -37,6 +37,7 @@
 #   define atm_enable_GBufferViewer
 #   define atm_enable_ShaderLiveEdit
 #   define atm_enable_StateSave
+#   define atm_enable_Benchmark
 #endif // ist_env_Master
 
 #endif //atm_features_h
@@ -90,8 +90,11 @@ void MemoryStream::setReadPos(uint64 pos, SeekDir dir)
 uint64 MemoryStream::write(const void* p, uint64 s)
 {
     size_t after = m_writepos+(size_t)s;
-    m_buffer.resize(after);
+    if(after > m_buffer.size()) {
+        m_buffer.resize(after);
+    }
     istMemcpy(&m_buffer[0]+m_writepos, p, (size_t)s);
+    m_writepos = after;
     return s;
 }
 uint64 MemoryStream::getWritePos() const { return m_writepos; }
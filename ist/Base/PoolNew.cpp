@@ -82,10 +82,13 @@ void PoolManager::printPoolStates()
     char buf[512];
     for(size_t i=0; i<m.all_pools.size(); ++i) {
         const PoolBase &pool = *m.all_pools[i];
+        const PoolBase::Stats &st = pool.getStats();
         istSPrintf(buf,
             "pool %s\n"
             "  num blocks: %d\n"
-            , pool.getClassName(), pool.getNumBlocks());
+            "  allocated: %d, reused: %d, recycled: %d, live: %d (peak %d)\n"
+            , pool.getClassName(), pool.getNumBlocks()
+            , (int)st.num_allocated, (int)st.num_reused, (int)st.num_recycled, (int)st.num_live, (int)st.peak_live);
         istPrint(buf);
     }
 }
@@ -96,6 +99,7 @@ const char* PoolBase::getClassName() const{ return m_classname; }
 PoolBase::PoolBase( const char *classname )
 {
     m_classname = classname;
+    istMemset(&m_stats, 0, sizeof(m_stats));
     PoolManager::addPool(this);
 }
 
@@ -108,6 +108,16 @@ class istAPI PoolBase
 {
 istNoncpyable(PoolBase);
 public:
+    // 統計。PoolManager::printPoolStates() で表示される
+    struct Stats
+    {
+        size_t num_allocated;   // ヒープから確保した数
+        size_t num_reused;      // プールから再利用した数
+        size_t num_recycled;    // プールに戻された数
+        size_t num_live;        // 現在使われている数
+        size_t peak_live;       // num_live の最大値
+    };
+
     PoolBase(const char *classname);
     virtual ~PoolBase();
     virtual void release();
@@ -117,9 +127,28 @@ public:
     virtual size_t getNumBlocks() const=0;
 
     const char* getClassName() const;
+    const Stats& getStats() const { return m_stats; }
+    // 現在の使用数は引き継ぐ
+    void resetStats()
+    {
+        size_t live = m_stats.num_live;
+        Stats st = {0, 0, 0, live, live};
+        m_stats = st;
+    }
+
+protected:
+    // 以下派生クラスがロック中に呼ぶ
+    void countAllocate(bool reused)
+    {
+        ++(reused ? m_stats.num_reused : m_stats.num_allocated);
+        if(++m_stats.num_live > m_stats.peak_live) { m_stats.peak_live=m_stats.num_live; }
+    }
+    void countRecycle()             { ++m_stats.num_recycled; --m_stats.num_live; }
+    void countReserve(size_t n)     { m_stats.num_allocated+=n; }
 
 private:
     const char *m_classname;
+    Stats m_stats;
 };
 
 
@@ -243,6 +272,7 @@ public:
         MutexT::ScopedLock lock(m_mutex);
         while(m_pool.size()<size) {
             m_pool.push_back(Pair(0, Allocator().allocate(getBlockSize(), getAlign())));
+            countReserve(1);
         }
     }
 
@@ -263,16 +293,20 @@ public:
             if(!m_pool.empty()) {
                 void *ret = m_pool.back().second;
                 m_pool.pop_back();
+                countAllocate(true);
                 return ret;
             }
+            countAllocate(false);
         }
         return Allocator().allocate(getBlockSize(), getAlign());
     }
 
     void recycle( void *p )
     {
+        if(p==NULL) { return; }
         MutexT::ScopedLock lock(m_mutex);
         m_pool.push_back(Pair(0, p));
+        countRecycle();
     }
 
 private:
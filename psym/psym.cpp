@@ -3,18 +3,20 @@
 #include "parallel_deterministic_sort.h"
 
 #define PSYM_TASK_GRANULARITY 256
+#define PSYM_CELL_TASK_GRANULARITY 32 // ̃ZXgꍇ̗x
+#define PSYM_COMPACT_BLOCK_SIZE 1024
 
 namespace psym {
 
 void impIntegrateDOL(ispc::Particle * all_particles, ispc::GridData * grid, int32_t xi, int32_t yi);
 void impUpdateVelocityDOL(ispc::Particle * all_particles, ispc::GridData * grid, int32_t xi, int32_t yi);
 void sphInitializeConstantsDOL();
-void sphIntegrateDOL(ispc::Particle * all_particles, ispc::GridData * grid, int32_t xi, int32_t yi);
+float sphIntegrateDOL(ispc::Particle * all_particles, ispc::GridData * grid, int32_t xi, int32_t yi, float timestep);
 void sphProcessCollisionDOL(
     ispc::Particle * all_particles, ispc::GridData * grid, int32_t xi, int32_t yi,
-    ispc::RigidSphere * spheres, int32_t num_spheres,
+    ispc::RigidSphere * spheres, int32_t * sphere_indices, int32_t num_spheres,
     ispc::RigidPlane * planes, int32_t num_planes,
-    ispc::RigidBox * boxes, int32_t num_boxes );
+    ispc::RigidBox * boxes, int32_t * box_indices, int32_t num_boxes );
 void sphProcessExternalForceDOL(
     ispc::Particle * all_particles, ispc::GridData * grid, int32_t xi, int32_t yi,
     ispc::PointForce * pforce, int32_t num_pforce,
@@ -44,7 +46,9 @@ inline void simd_store(void *address, T v)
     _mm_store_ps((float*)address, (const simdvec4&)v);
 }
 
-void SoAnize( int32 num, const Particle *particles, ispc::Particle_SOA8 *out )
+// sleeping Ȃ density  hit_to  AoS 玝Ă (sleep ͍ČvZȂ)
+// keep_hits Ȃ hit_to  AoS 玝Ă (sub-step rł̃Obh̍蒼ŁA܂ł̏Փ˂Ȃ)
+void SoAnize( int32 num, const Particle *particles, ispc::Particle_SOA8 *out, bool sleeping, bool keep_hits )
 {
     int32 blocks = soa_blocks(num);
     for(int32 bi=0; bi<blocks; ++bi) {
@@ -68,8 +72,17 @@ void SoAnize( int32 num, const Particle *particles, ispc::Particle_SOA8 *out )
         simd_store(out[bi].vy+4, soav.y());
         simd_store(out[bi].vz+4, soav.z());
 
-        simd_store(out[bi].hit_to+0, _mm_set1_epi32(0));
-        simd_store(out[bi].hit_to+4, _mm_set1_epi32(0));
+        if(sleeping || keep_hits) {
+            int32 e = std::min<int32>(SIMD_LANES, num-i);
+            for(int32 ei=0; ei<e; ++ei) {
+                if(sleeping) { out[bi].density[ei] = particles[i+ei].density; }
+                out[bi].hit_to[ei] = particles[i+ei].hit_to;
+            }
+        }
+        else {
+            simd_store(out[bi].hit_to+0, _mm_set1_epi32(0));
+            simd_store(out[bi].hit_to+4, _mm_set1_epi32(0));
+        }
 
         //// sv
         //simdvec4 soas;
@@ -137,89 +150,242 @@ inline uint32 GenHash(const Particle &particle)
     return r;
 }
 
+// LbVɍڂĂ邤ɕ`p̃f[^oĂ
+inline void MakeRenderData(int32 num, const Particle *particles, RenderParticle *out)
+{
+    for(int32 i=0; i<num; ++i) {
+        const float32 *pos = (const float32*)&particles[i].position;
+        RenderParticle &r = out[i];
+        r.x = pos[0];
+        r.y = pos[1];
+        r.z = pos[2];
+        r.energy = particles[i].energy;
+        r.density = particles[i].density;
+    }
+}
+
 inline void GenIndex(uint32 hash, int32 &xi, int32 &yi)
 {
     xi = (hash >> (PSYM_GRID_DIV_BITS*0)) & (PSYM_GRID_DIV-1);
     yi = (hash >> (PSYM_GRID_DIV_BITS*1)) & (PSYM_GRID_DIV-1);
 }
 
+// Z̃Xg̊evf f KpBΕ
+template<class F>
+inline void EachCells(const int32 *cells, int32 num, const F &f)
+{
+    if(num > PSYM_CELL_TASK_GRANULARITY) {
+        tbb::parallel_for(tbb::blocked_range<int>(0, num, PSYM_CELL_TASK_GRANULARITY),
+            [&](const tbb::blocked_range<int> &r) {
+                for(int i=r.begin(); i!=r.end(); ++i) { f(cells[i]); }
+            });
+    }
+    else {
+        for(int i=0; i<num; ++i) { f(cells[i]); }
+    }
+}
+
+// EachCells()  f ̖߂l̍őlԂ
+template<class F>
+inline float32 MaxCells(const int32 *cells, int32 num, const F &f)
+{
+    if(num > PSYM_CELL_TASK_GRANULARITY) {
+        return tbb::parallel_reduce(tbb::blocked_range<int>(0, num, PSYM_CELL_TASK_GRANULARITY), 0.0f,
+            [&](const tbb::blocked_range<int> &r, float32 v) -> float32 {
+                for(int i=r.begin(); i!=r.end(); ++i) { v = std::max<float32>(v, f(cells[i])); }
+                return v;
+            },
+            [](float32 a, float32 b) { return std::max<float32>(a, b); });
+    }
+    else {
+        float32 v = 0.0f;
+        for(int i=0; i<num; ++i) { v = std::max<float32>(v, f(cells[i])); }
+        return v;
+    }
+}
+
+// rigid  BoundingBox  rigid grid ͈̔ (ur ͊܂)
+inline void GetRigidGridRange(const ispc::BoundingBox &bb, int32 &bx, int32 &by, int32 &ux, int32 &uy)
+{
+    static const float32 rcpcellsize = 1.0f/(PSYM_GRID_SIZE/PSYM_RIGID_GRID_DIV);
+    // Z̋Eɂ傤ǐڂĂꍇRȂ悤ɏL
+    const float32 margin = 0.0001f;
+    bx = clamp<int32>(int32((bb.bl_x-margin-PSYM_GRID_POS)*rcpcellsize), 0, PSYM_RIGID_GRID_DIV-1);
+    by = clamp<int32>(int32((bb.bl_y-margin-PSYM_GRID_POS)*rcpcellsize), 0, PSYM_RIGID_GRID_DIV-1);
+    ux = clamp<int32>(int32((bb.ur_x+margin-PSYM_GRID_POS)*rcpcellsize), 0, PSYM_RIGID_GRID_DIV-1);
+    uy = clamp<int32>(int32((bb.ur_y+margin-PSYM_GRID_POS)*rcpcellsize), 0, PSYM_RIGID_GRID_DIV-1);
+}
+
+// rigid Obhɓo^B1 pass ڂŊeZ̐𐔂A2 pass ڂŋl߂B
+// eZ index ͏ɂȂ̂ŁA菇͑S rigid Ɣ肵ĂƕςȂ
+template<class T>
+void BinRigids(
+    const ist::raw_vector<T> &rigids, ist::raw_vector<int32> &indices,
+    RigidGridCell (*grid)[PSYM_RIGID_GRID_DIV], int32 RigidGridCell::*begin, int32 RigidGridCell::*num)
+{
+    for(int32 yi=0; yi<PSYM_RIGID_GRID_DIV; ++yi) {
+        for(int32 xi=0; xi<PSYM_RIGID_GRID_DIV; ++xi) {
+            grid[yi][xi].*num = 0;
+        }
+    }
+
+    int32 num_rigids = (int32)rigids.size();
+    int32 bx, by, ux, uy;
+    for(int32 i=0; i<num_rigids; ++i) {
+        GetRigidGridRange(rigids[i].bb, bx, by, ux, uy);
+        for(int32 yi=by; yi<=uy; ++yi) {
+            for(int32 xi=bx; xi<=ux; ++xi) {
+                ++(grid[yi][xi].*num);
+            }
+        }
+    }
+
+    int32 total = 0;
+    for(int32 yi=0; yi<PSYM_RIGID_GRID_DIV; ++yi) {
+        for(int32 xi=0; xi<PSYM_RIGID_GRID_DIV; ++xi) {
+            RigidGridCell &c = grid[yi][xi];
+            c.*begin = total;
+            total += c.*num;
+            c.*num = 0;
+        }
+    }
+
+    indices.resize(total);
+    for(int32 i=0; i<num_rigids; ++i) {
+        GetRigidGridRange(rigids[i].bb, bx, by, ux, uy);
+        for(int32 yi=by; yi<=uy; ++yi) {
+            for(int32 xi=bx; xi<=ux; ++xi) {
+                RigidGridCell &c = grid[yi][xi];
+                indices[c.*begin + (c.*num)++] = i;
+            }
+        }
+    }
+}
+
 World::World()
-    :  num_active_particles(0)
+    : num_active_particles(0)
+    , rigid_grid_dirty(true)
+    , rigid_grid_enabled(true)
+    , substeps(1)
+    , max_substeps(4)
+    , adaptive_substeps(false)
+    , cfl_number(0.5f)
+    , regrid_distance(PSYM_SEARCH_SKIN*0.5f)
+    , last_num_substeps(1)
+    , last_num_regrids(0)
+    , sleeping_enabled(true)
+    , sleep_speed(0.05f)
+    , sleep_frames(30)
+    , last_num_sleeping_cells(0)
+    , last_num_sleeping_particles(0)
+    , islands_enabled(true)
+    , dead_compaction_enabled(true)
+    , last_num_islands(0)
 {
     istMemset(particles_soa, 0, sizeof(particles_soa));
     istMemset(cell, 0, sizeof(cell));
     istMemset(particles, 0, sizeof(particles));
+    istMemset(rigid_grid, 0, sizeof(rigid_grid));
+    istMemset(cell_rest_frames, 0, sizeof(cell_rest_frames));
+    istMemset(cell_sleeping, 0, sizeof(cell_sleeping));
+    istMemset(cell_prev_num, 0, sizeof(cell_prev_num));
+    istMemset(cell_speed, 0, sizeof(cell_speed));
+    istMemset(tile_island, 0, sizeof(tile_island));
+    disturbAll();
 }
 
-void World::update(float32 dt)
+void World::buildRigidGrid()
 {
-    GridData *ce = &cell[0][0];
-    ispc::PointForce       *point_f = force_point.empty() ? NULL : &force_point[0];
-    ispc::DirectionalForce *dir_f   = force_directional.empty() ? NULL : &force_directional[0];
-    ispc::BoxForce         *box_f   = force_box.empty() ? NULL : &force_box[0];
+    BinRigids(collision_spheres, rigid_grid_spheres, rigid_grid, &RigidGridCell::sphere_begin, &RigidGridCell::sphere_num);
+    BinRigids(collision_boxes,   rigid_grid_boxes,   rigid_grid, &RigidGridCell::box_begin,    &RigidGridCell::box_num);
+    rigid_grid_dirty = false;
+}
 
-    ispc::RigidSphere  *point_c = collision_spheres.empty() ? NULL : &collision_spheres[0];
-    ispc::RigidPlane   *plane_c = collision_planes.empty() ? NULL : &collision_planes[0];
-    ispc::RigidBox     *box_c   = collision_boxes.empty() ? NULL : &collision_boxes[0];
+float32 World::computeMaxSpeed() const
+{
+    // max ͌ɂȂ̂ŕłʂ͌I
+    float32 speed_sq = tbb::parallel_reduce(tbb::blocked_range<int>(0, (int32)num_active_particles, 1024), 0.0f,
+        [&](const tbb::blocked_range<int> &r, float32 v) -> float32 {
+            for(int i=r.begin(); i!=r.end(); ++i) {
+                const float32 *vel = (const float32*)&particles[i].velocity;
+                v = std::max<float32>(v, vel[0]*vel[0] + vel[1]*vel[1] + vel[2]*vel[2]);
+            }
+            return v;
+        },
+        [](float32 a, float32 b) { return std::max<float32>(a, b); });
+    return std::sqrt(speed_sq);
+}
 
+int32 World::computeNumSubsteps() const
+{
+    int32 num_max = std::max<int32>(max_substeps, 1);
+    int32 num = clamp<int32>(substeps, 1, num_max);
+    if(adaptive_substeps && cfl_number > 0.0f) {
+        // CFL : 1 sub-step Őiދ cfl_number*PSYM_CELL_SIZE ȉɂȂ悤ɕ
+        float32 distance = computeMaxSpeed() * PSYM_TIMESTEP;
+        float32 required = std::ceil(distance / (cfl_number*PSYM_CELL_SIZE));
+        num = clamp<int32>(int32(std::min<float32>(required, float32(num_max))), num, num_max);
+    }
+    return num;
+}
 
-    sphInitializeConstantsDOL();
+void World::buildGrid(float32 energy_decay, bool keep_hits)
+{
+    GridData *ce = &cell[0][0];
 
     // clear grid
     tbb::parallel_for(tbb::blocked_range<int>(0, PSYM_GRID_CELL_NUM, PSYM_TASK_GRANULARITY),
         [&](const tbb::blocked_range<int> &r) {
             for(int i=r.begin(); i!=r.end(); ++i) {
                 ce[i].begin = ce[i].end = 0;
+                (&cell_speed[0][0])[i] = 0.0f;
             }
         });
 
-    // gen hash
-    tbb::parallel_for(tbb::blocked_range<int>(0, (int32)num_active_particles, 1024),
-        [&](const tbb::blocked_range<int> &r) {
-            for(int i=r.begin(); i!=r.end(); ++i) {
-                particles[i].energy = std::max<float32>(particles[i].energy-dt, 0.0f);
-                particles[i].hash = GenHash(particles[i]);
-            }
-        });
+    // gen hash & 񂾃p[eBN̏
+    if(dead_compaction_enabled) {
+        compactParticles(energy_decay);
+    }
+    else {
+        tbb::parallel_for(tbb::blocked_range<int>(0, (int32)num_active_particles, PSYM_COMPACT_BLOCK_SIZE),
+            [&](const tbb::blocked_range<int> &r) {
+                for(int i=r.begin(); i!=r.end(); ++i) {
+                    particles[i].energy = std::max<float32>(particles[i].energy-energy_decay, 0.0f);
+                    particles[i].hash = GenHash(particles[i]);
+                }
+            });
+    }
 
     // p[eBN hash  sort
     // tbb:parallel_sort()  non-stable ȂłȂA񓯂 key ͖̂̂񏇏ς\邽߁AO sortB
     //  non-stable f[^Ȃ疈񏇏B
     parallel_deterministic_sort(particles, particles+num_active_particles, 
         [&](const Particle &a, const Particle &b) { return a.hash < b.hash; } );
+    if(!dead_compaction_enabled) {
+        // ł͍̂ŏ bit Ă̂ŖɏW܂Ă
+        Particle *first_dead = std::partition_point(particles, particles+num_active_particles,
+            [](const Particle &a) { return (a.hash & 0x80000000) == 0; });
+        num_active_particles = std::distance(particles, first_dead);
+    }
 
     // p[eBNǂ grid ɓĂ邩Zo
-    tbb::parallel_for(tbb::blocked_range<int>(0, (int32)num_active_particles, 1024),
+    const int32 num_particles = (int32)num_active_particles;
+    tbb::parallel_for(tbb::blocked_range<int>(0, num_particles, 1024),
         [&](const tbb::blocked_range<int> &r) {
             for(int i=r.begin(); i!=r.end(); ++i) {
                 int32 prev = i-1;
                 int32 next = i+1;
                 uint32 cell = particles[i].hash;
                 uint32 cell_prev = (prev==-1) ? -1 : particles[prev].hash;
-                uint32 cell_next = (next==PSYM_MAX_PARTICLE_NUM) ? -2 : particles[next].hash;
-                if((cell & 0x80000000) != 0) { // ŏ bit Ă玀ł鈵
-                    if((cell_prev & 0x80000000) == 0) { // 
-                        num_active_particles = i;
-                    }
+                uint32 cell_next = (next==num_particles) ? -2 : particles[next].hash;
+                if(cell != cell_prev) {
+                    ce[cell].begin = i;
                 }
-                else {
-                    if(cell != cell_prev) {
-                        ce[cell].begin = i;
-                    }
-                    if(cell != cell_next) {
-                        ce[cell].end = i + 1;
-                    }
+                if(cell != cell_next) {
+                    ce[cell].end = i + 1;
                 }
             }
     });
-    {
-        if( (particles[0].hash & 0x80000000) != 0 ) {
-            num_active_particles = 0;
-        }
-        else if( (particles[PSYM_MAX_PARTICLE_NUM-1].hash & 0x80000000) == 0 ) {
-            num_active_particles = PSYM_MAX_PARTICLE_NUM;
-        }
-    }
 
     {
         int32 soai = 0;
@@ -229,7 +395,11 @@ void World::update(float32 dt)
         }
     }
 
+    updateSleepStates();
+    buildIslands();
+
     // AoS -> SoA
+    const bool *sleeping = &cell_sleeping[0][0];
     tbb::parallel_for(tbb::blocked_range<int>(0, PSYM_GRID_CELL_NUM, PSYM_TASK_GRANULARITY),
         [&](const tbb::blocked_range<int> &r) {
             for(int i=r.begin(); i!=r.end(); ++i) {
@@ -237,65 +407,267 @@ void World::update(float32 dt)
                 if(n == 0) { continue; }
                 Particle *p = &particles[ce[i].begin];
                 ispc::Particle_SOA8 *t = &particles_soa[ce[i].soai];
-                SoAnize(n, p, t);
+                SoAnize(n, p, t, sleeping[i], keep_hits);
             }
     });
+}
+
+void World::compactParticles(float32 energy_decay)
+{
+    // energy ̌ hash ̐AubNɐĂp[eBN𐔂
+    const int32 num = (int32)num_active_particles;
+    const int32 block_size = PSYM_COMPACT_BLOCK_SIZE;
+    const int32 num_blocks = (num + block_size-1) / block_size;
+    compact_counts.resize(num_blocks);
+    tbb::parallel_for(0, num_blocks, [&](int32 bi) {
+        int32 last = std::min<int32>((bi+1)*block_size, num);
+        int32 alive = 0;
+        for(int32 i=bi*block_size; i<last; ++i) {
+            particles[i].energy = std::max<float32>(particles[i].energy-energy_decay, 0.0f);
+            particles[i].hash = GenHash(particles[i]);
+            alive += (particles[i].hash & 0x80000000) == 0;
+        }
+        compact_counts[bi] = alive;
+    });
 
+    int32 num_alive = 0;
+    for(int32 bi=0; bi<num_blocks; ++bi) {
+        num_alive += compact_counts[bi];
+    }
+    num_active_particles = num_alive;
+    if(num_alive == num) { return; }
 
-    // SPH
-    tbb::parallel_for(tbb::blocked_range<int>(0, PSYM_GRID_CELL_NUM, PSYM_TASK_GRANULARITY),
+    // [0, num_alive) ̌ (񂾂)  [num_alive, num) ̐Ă̂Ŗ߂B
+    // Ɩ߂͓̂ŁAړƈړ悪dȂȂ̂ŕɓB
+    // Ԃ͕ς邪Ǎ sort ̂ŖȂ
+    compact_holes.resize(num_blocks);   // ubŇ̐ -> ̊Jnʒu
+    compact_sources.resize(num_blocks); // ubN̖߂̂̐ -> Jnʒu
+    tbb::parallel_for(0, num_blocks, [&](int32 bi) {
+        int32 first = bi*block_size;
+        int32 last = std::min<int32>(first+block_size, num);
+        int32 holes = 0, sources = 0;
+        if(last <= num_alive) {
+            holes = (last-first) - compact_counts[bi];
+        }
+        else if(first >= num_alive) {
+            sources = compact_counts[bi];
+        }
+        else {
+            for(int32 i=first; i<last; ++i) {
+                bool dead = (particles[i].hash & 0x80000000) != 0;
+                if(i < num_alive) { holes += dead; }
+                else              { sources += !dead; }
+            }
+        }
+        compact_holes[bi] = holes;
+        compact_sources[bi] = sources;
+    });
+    int32 hole_pos = 0, source_pos = 0;
+    for(int32 bi=0; bi<num_blocks; ++bi) {
+        int32 h = compact_holes[bi], s = compact_sources[bi];
+        compact_holes[bi] = hole_pos;
+        compact_sources[bi] = source_pos;
+        hole_pos += h;
+        source_pos += s;
+    }
+
+    compact_indices.resize(hole_pos*2);
+    int32 *hole_indices = &compact_indices[0];
+    int32 *source_indices = &compact_indices[hole_pos];
+    tbb::parallel_for(0, num_blocks, [&](int32 bi) {
+        int32 first = bi*block_size;
+        int32 last = std::min<int32>(first+block_size, num);
+        int32 hi = compact_holes[bi], si = compact_sources[bi];
+        for(int32 i=first; i<last; ++i) {
+            bool dead = (particles[i].hash & 0x80000000) != 0;
+            if(i < num_alive) { if(dead) { hole_indices[hi++] = i; } }
+            else              { if(!dead) { source_indices[si++] = i; } }
+        }
+    });
+    tbb::parallel_for(tbb::blocked_range<int>(0, hole_pos, 256),
         [&](const tbb::blocked_range<int> &r) {
             for(int i=r.begin(); i!=r.end(); ++i) {
-                int32 n = ce[i].end - ce[i].begin;
-                if(n == 0) { continue; }
-                int xi, yi;
-                GenIndex(i, xi, yi);
-                sphUpdateDensityDOL((ispc::Particle*)particles_soa, ce, xi, yi);
+                particles[hole_indices[i]] = particles[source_indices[i]];
             }
-    });
-#ifdef psym_enable_neighbor_density_estimation
+        });
+}
+
+void World::updateSleepStates()
+{
+    const GridData *ce = &cell[0][0];
+    uint16 *rest = &cell_rest_frames[0][0];
+    bool *sleeping = &cell_sleeping[0][0];
+    int32 *prev_num = &cell_prev_num[0][0];
+    const uint16 rest_max = 0xffff;
+    // PointForce ͑Sp[eBNɂ̂őSN
+    const bool wake_all = !sleeping_enabled || !force_point.empty();
+
+    // p[eBN̏o肪Arigid ꍇ͐Î~ĂȂƂɂ
     tbb::parallel_for(tbb::blocked_range<int>(0, PSYM_GRID_CELL_NUM, PSYM_TASK_GRANULARITY),
         [&](const tbb::blocked_range<int> &r) {
             for(int i=r.begin(); i!=r.end(); ++i) {
                 int32 n = ce[i].end - ce[i].begin;
-                if(n == 0) { continue; }
                 int xi, yi;
                 GenIndex(i, xi, yi);
-                sphUpdateDensity2DOL((ispc::Particle*)particles_soa, ce, xi, yi);
+                if(n == 0) {
+                    rest[i] = rest_max;
+                }
+                else if(wake_all || n != prev_num[i] || rigid_grid_disturbed[yi>>PSYM_RIGID_GRID_SHIFT][xi>>PSYM_RIGID_GRID_SHIFT]) {
+                    rest[i] = 0;
+                }
+                prev_num[i] = n;
             }
     });
-#endif // psym_enable_neighbor_density_estimation
+
+    // gƎ͂̃ZS sleep_frames ȏÎ~Ă sleep
     tbb::parallel_for(tbb::blocked_range<int>(0, PSYM_GRID_CELL_NUM, PSYM_TASK_GRANULARITY),
         [&](const tbb::blocked_range<int> &r) {
             for(int i=r.begin(); i!=r.end(); ++i) {
-                int32 n = ce[i].end - ce[i].begin;
-                if(n == 0) { continue; }
+                sleeping[i] = false;
+                if(wake_all || ce[i].end == ce[i].begin) { continue; }
                 int xi, yi;
                 GenIndex(i, xi, yi);
-                sphUpdateForceDOL((ispc::Particle*)particles_soa, ce, xi, yi);
+                const int32 nx_beg = std::max<int32>(xi-1, 0);
+                const int32 nx_end = std::min<int32>(xi+1, PSYM_GRID_DIV-1);
+                const int32 ny_beg = std::max<int32>(yi-1, 0);
+                const int32 ny_end = std::min<int32>(yi+1, PSYM_GRID_DIV-1);
+                uint16 min_rest = rest_max;
+                for(int32 nyi=ny_beg; nyi<=ny_end; ++nyi) {
+                    for(int32 nxi=nx_beg; nxi<=nx_end; ++nxi) {
+                        min_rest = std::min<uint16>(min_rest, cell_rest_frames[nyi][nxi]);
+                    }
+                }
+                sleeping[i] = min_rest >= sleep_frames;
             }
     });
+
+    int32 num_cells = 0;
+    int32 num_particles = 0;
+    for(int i=0; i!=PSYM_GRID_CELL_NUM; ++i) {
+        if(sleeping[i]) {
+            ++num_cells;
+            num_particles += ce[i].end - ce[i].begin;
+        }
+    }
+    last_num_sleeping_cells = num_cells;
+    last_num_sleeping_particles = num_particles;
+}
+
+void World::updateRestFrames()
+{
+    const GridData *ce = &cell[0][0];
+    uint16 *rest = &cell_rest_frames[0][0];
+    const bool *sleeping = &cell_sleeping[0][0];
+    const float32 *speed = &cell_speed[0][0];
+    const uint16 rest_max = 0xffff;
     tbb::parallel_for(tbb::blocked_range<int>(0, PSYM_GRID_CELL_NUM, PSYM_TASK_GRANULARITY),
         [&](const tbb::blocked_range<int> &r) {
             for(int i=r.begin(); i!=r.end(); ++i) {
-                int32 n = ce[i].end - ce[i].begin;
-                if(n == 0) { continue; }
-                int xi, yi;
-                GenIndex(i, xi, yi);
-                sphProcessExternalForceDOL(
-                    (ispc::Particle*)particles_soa, ce, xi, yi,
-                    point_f,    (int32)force_point.size(),
-                    dir_f,      (int32)force_directional.size(),
-                    box_f,      (int32)force_box.size() );
-                sphProcessCollisionDOL(
-                    (ispc::Particle*)particles_soa, ce, xi, yi,
-                    point_c,    (int32)collision_spheres.size(),
-                    plane_c,    (int32)collision_planes.size(),
-                    box_c,      (int32)collision_boxes.size() );
-                sphIntegrateDOL((ispc::Particle*)particles_soa, ce, xi, yi);
+                if(ce[i].end == ce[i].begin) {
+                    rest[i] = rest_max;
+                }
+                else if(!sleeping[i]) {
+                    rest[i] = speed[i] <= sleep_speed ? std::min<uint16>(rest[i], rest_max-1)+1 : 0;
+                }
             }
     });
+    istMemset(rigid_grid_disturbed, 0, sizeof(rigid_grid_disturbed));
+}
+
+void World::disturbRigidGrid(const ispc::BoundingBox &bb)
+{
+    int32 bx, by, ux, uy;
+    GetRigidGridRange(bb, bx, by, ux, uy);
+    for(int32 yi=by; yi<=uy; ++yi) {
+        for(int32 xi=bx; xi<=ux; ++xi) {
+            rigid_grid_disturbed[yi][xi] = true;
+        }
+    }
+}
+
+void World::disturbAll()
+{
+    for(int32 yi=0; yi<PSYM_RIGID_GRID_DIV; ++yi) {
+        for(int32 xi=0; xi<PSYM_RIGID_GRID_DIV; ++xi) {
+            rigid_grid_disturbed[yi][xi] = true;
+        }
+    }
+}
+
+float32 World::simulate(float32 timestep)
+{
+    GridData *ce = &cell[0][0];
+    float32 *cell_max_speed = &cell_speed[0][0];
+    ispc::Particle *all_particles = (ispc::Particle*)particles_soa;
+    ispc::PointForce       *point_f = force_point.empty() ? NULL : &force_point[0];
+    ispc::DirectionalForce *dir_f   = force_directional.empty() ? NULL : &force_directional[0];
+    ispc::BoxForce         *box_f   = force_box.empty() ? NULL : &force_box[0];
+
+    ispc::RigidSphere  *point_c = collision_spheres.empty() ? NULL : &collision_spheres[0];
+    ispc::RigidPlane   *plane_c = collision_planes.empty() ? NULL : &collision_planes[0];
+    ispc::RigidBox     *box_c   = collision_boxes.empty() ? NULL : &collision_boxes[0];
 
+    // SPH
+    auto density = [&](int32 i) {
+        int xi, yi;
+        GenIndex(i, xi, yi);
+        sphUpdateDensityDOL(all_particles, ce, xi, yi);
+    };
+#ifdef psym_enable_neighbor_density_estimation
+    auto density2 = [&](int32 i) {
+        int xi, yi;
+        GenIndex(i, xi, yi);
+        sphUpdateDensity2DOL(all_particles, ce, xi, yi);
+    };
+#endif // psym_enable_neighbor_density_estimation
+    auto force = [&](int32 i) {
+        int xi, yi;
+        GenIndex(i, xi, yi);
+        sphUpdateForceDOL(all_particles, ce, xi, yi);
+    };
+    auto integrate = [&](int32 i) -> float32 {
+        int xi, yi;
+        GenIndex(i, xi, yi);
+        sphProcessExternalForceDOL(
+            all_particles, ce, xi, yi,
+            point_f,    (int32)force_point.size(),
+            dir_f,      (int32)force_directional.size(),
+            box_f,      (int32)force_box.size() );
+        if(rigid_grid_enabled) {
+            const RigidGridCell &rc = rigid_grid[yi>>PSYM_RIGID_GRID_SHIFT][xi>>PSYM_RIGID_GRID_SHIFT];
+            sphProcessCollisionDOL(
+                all_particles, ce, xi, yi,
+                point_c,    rigid_grid_spheres.begin()+rc.sphere_begin, rc.sphere_num,
+                plane_c,    (int32)collision_planes.size(),
+                box_c,      rigid_grid_boxes.begin()+rc.box_begin,      rc.box_num );
+        }
+        else {
+            // index  NULL ̏ꍇSƔ
+            sphProcessCollisionDOL(
+                all_particles, ce, xi, yi,
+                point_c,    NULL, (int32)collision_spheres.size(),
+                plane_c,    (int32)collision_planes.size(),
+                box_c,      NULL, (int32)collision_boxes.size() );
+        }
+        float32 s = sphIntegrateDOL(all_particles, ce, xi, yi, timestep);
+        cell_max_speed[i] = std::max<float32>(cell_max_speed[i], s);
+        return s;
+    };
+
+    // island ɓƗ^XNƂđSHi߂Bisland Ԃ͊Ȃ̂ island ܂͕svB
+    // island ͍HɓKvŁAZ΂ɕɏ
+    const int32 num_islands = (int32)island_ranges.size()-1;
+    island_speeds.resize(std::max<int32>(num_islands, 0));
+    tbb::parallel_for(0, num_islands, [&](int32 ii) {
+        const int32 *cells = island_cells.begin()+island_ranges[ii];
+        const int32 num = island_ranges[ii+1]-island_ranges[ii];
+        EachCells(cells, num, density);
+#ifdef psym_enable_neighbor_density_estimation
+        EachCells(cells, num, density2);
+#endif // psym_enable_neighbor_density_estimation
+        EachCells(cells, num, force);
+        island_speeds[ii] = MaxCells(cells, num, integrate);
+    });
 
     //// impulse
     //tbb::parallel_for(tbb::blocked_range<int>(0, PSYM_GRID_CELL_NUM, PSYM_TASK_GRANULARITY),
@@ -329,6 +701,98 @@ void World::update(float32 dt)
     //        }
     //});
 
+    float32 max_speed = 0.0f;
+    for(int32 ii=0; ii<num_islands; ++ii) {
+        max_speed = std::max<float32>(max_speed, island_speeds[ii]);
+    }
+    return max_speed;
+}
+
+void World::buildIslands()
+{
+    const GridData *ce = &cell[0][0];
+    const bool *sleeping = &cell_sleeping[0][0];
+    const int32 tile_size = 1<<PSYM_RIGID_GRID_SHIFT;
+
+    // vZKv (ł sleep łȂ) Z܂ tile 𒲂ׂ
+    tbb::parallel_for(0, PSYM_RIGID_GRID_DIV*PSYM_RIGID_GRID_DIV, [&](int32 ti) {
+        const int32 tx = ti%PSYM_RIGID_GRID_DIV;
+        const int32 ty = ti/PSYM_RIGID_GRID_DIV;
+        int32 &label = tile_island[ty][tx];
+        label = -2;
+        for(int32 yi=ty*tile_size; yi<(ty+1)*tile_size && label==-2; ++yi) {
+            for(int32 xi=tx*tile_size; xi<(tx+1)*tile_size; ++xi) {
+                int32 i = yi*PSYM_GRID_DIV + xi;
+                if(ce[i].end != ce[i].begin && !sleeping[i]) { label = -1; break; }
+            }
+        }
+    });
+
+    // א (΂ߊ܂)  tile 𓯂 island ɂ܂Ƃ߂B
+    // אڂĂȂ tile m 1 tile ȏ㗣ĂAp[eBNmeƂ͂ȂB
+    // sleep ̃Z simulate() ɏȂ̂ŁAEƂ island ܂ŎQƂĂȂ
+    int32 num_islands = 0;
+    if(!islands_enabled) {
+        for(int32 ty=0; ty<PSYM_RIGID_GRID_DIV; ++ty) {
+            for(int32 tx=0; tx<PSYM_RIGID_GRID_DIV; ++tx) {
+                if(tile_island[ty][tx]==-1) { tile_island[ty][tx]=0; num_islands=1; }
+            }
+        }
+    }
+    else {
+        island_stack.clear();
+        for(int32 ty=0; ty<PSYM_RIGID_GRID_DIV; ++ty) {
+            for(int32 tx=0; tx<PSYM_RIGID_GRID_DIV; ++tx) {
+                if(tile_island[ty][tx]!=-1) { continue; }
+                const int32 label = num_islands++;
+                tile_island[ty][tx] = label;
+                island_stack.push_back(ty*PSYM_RIGID_GRID_DIV + tx);
+                while(!island_stack.empty()) {
+                    const int32 t = island_stack.back();
+                    island_stack.pop_back();
+                    const int32 cx = t%PSYM_RIGID_GRID_DIV;
+                    const int32 cy = t/PSYM_RIGID_GRID_DIV;
+                    for(int32 ny=std::max<int32>(cy-1, 0); ny<=std::min<int32>(cy+1, PSYM_RIGID_GRID_DIV-1); ++ny) {
+                        for(int32 nx=std::max<int32>(cx-1, 0); nx<=std::min<int32>(cx+1, PSYM_RIGID_GRID_DIV-1); ++nx) {
+                            if(tile_island[ny][nx]==-1) {
+                                tile_island[ny][nx] = label;
+                                island_stack.push_back(ny*PSYM_RIGID_GRID_DIV + nx);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // island ̃Z̃XgBZ̏Ԃ̓Obh̏̂܂܂ɂĂ
+    island_ranges.clear();
+    island_ranges.resize(num_islands+1, 0);
+    for(int32 i=0; i!=PSYM_GRID_CELL_NUM; ++i) {
+        if(ce[i].end == ce[i].begin || sleeping[i]) { continue; }
+        int xi, yi;
+        GenIndex(i, xi, yi);
+        ++island_ranges[tile_island[yi>>PSYM_RIGID_GRID_SHIFT][xi>>PSYM_RIGID_GRID_SHIFT]+1];
+    }
+    for(int32 ii=0; ii<num_islands; ++ii) {
+        island_ranges[ii+1] += island_ranges[ii];
+    }
+    island_cells.resize(island_ranges[num_islands]);
+    island_stack.clear();
+    island_stack.insert(island_stack.end(), island_ranges.begin(), island_ranges.end());
+    for(int32 i=0; i!=PSYM_GRID_CELL_NUM; ++i) {
+        if(ce[i].end == ce[i].begin || sleeping[i]) { continue; }
+        int xi, yi;
+        GenIndex(i, xi, yi);
+        island_cells[island_stack[tile_island[yi>>PSYM_RIGID_GRID_SHIFT][xi>>PSYM_RIGID_GRID_SHIFT]]++] = i;
+    }
+    last_num_islands = num_islands;
+}
+
+void World::writeBack(RenderParticle *render_out)
+{
+    GridData *ce = &cell[0][0];
+
     // SoA -> AoS
     tbb::parallel_for(tbb::blocked_range<int>(0, PSYM_GRID_CELL_NUM, PSYM_TASK_GRANULARITY),
         [&](const tbb::blocked_range<int> &r) {
@@ -338,41 +802,269 @@ void World::update(float32 dt)
                     Particle *p = &particles[ce[i].begin];
                     ispc::Particle_SOA8 *t = &particles_soa[ce[i].soai];
                     AoSnize(n, t, p);
+                    if(render_out) {
+                        MakeRenderData(n, p, render_out+ce[i].begin);
+                    }
                 }
             }
     });
 }
 
+void World::update(float32 dt, RenderParticle *render_out)
+{
+    sphInitializeConstantsDOL();
+
+    if(rigid_grid_dirty) {
+        buildRigidGrid();
+    }
+
+    const int32 num_substeps = computeNumSubsteps();
+    const float32 timestep = PSYM_TIMESTEP / num_substeps;
+    int32 num_regrids = 0;
+
+    // ߖT͗אڃZ܂łTȂ̂ŁAObhg񂹂̂͋߂Â 2 q̈ړʂ̘aT̗]Ɏ܂Ԃ
+    const float32 max_moved = std::max<float32>(std::min<float32>(regrid_distance, PSYM_SEARCH_SKIN*0.5f), 0.0f);
+    buildGrid(dt, false);
+    float32 moved = 0.0f;
+    for(int32 si=0; si<num_substeps; ++si) {
+        if(moved > max_moved) {
+            // ߖT̏񂪌ÂȂĂ̂ō蒼Bhit_to ͂ update() ɓ̂p
+            writeBack(NULL);
+            buildGrid(0.0f, true);
+            moved = 0.0f;
+            ++num_regrids;
+        }
+        moved += simulate(timestep) * timestep;
+    }
+    writeBack(render_out);
+    updateRestFrames();
+
+    last_num_substeps = num_substeps;
+    last_num_regrids = num_regrids;
+}
 
 void World::clearRigidsAndForces()
+{
+    clearRigids();
+    clearForces();
+}
+
+void World::clearRigids()
 {
     collision_spheres.clear();
     collision_planes.clear();
     collision_boxes.clear();
+    rigid_grid_dirty = true;
+    disturbAll();
+}
 
+void World::clearForces()
+{
     force_point.clear();
     force_directional.clear();
     force_box.clear();
 }
 
-void World::addRigid(const RigidSphere &v)  { collision_spheres.push_back(v); }
-void World::addRigid(const RigidPlane &v)   { collision_planes.push_back(v); }
-void World::addRigid(const RigidBox &v)     { collision_boxes.push_back(v); }
+// rigid ǉ/ύXꂽ炻̎͂ sleep Bplane ͑Sɂ̂őSN
+size_t World::addRigid(const RigidSphere &v)  { collision_spheres.push_back(v); rigid_grid_dirty=true; disturbRigidGrid(v.bb); return collision_spheres.size()-1; }
+size_t World::addRigid(const RigidPlane &v)   { collision_planes.push_back(v); disturbAll(); return collision_planes.size()-1; }
+size_t World::addRigid(const RigidBox &v)     { collision_boxes.push_back(v); rigid_grid_dirty=true; disturbRigidGrid(v.bb); return collision_boxes.size()-1; }
+
+void World::setRigid(size_t i, const RigidSphere &v)
+{
+    if(memcmp(&collision_spheres[i], &v, sizeof(v))!=0) {
+        disturbRigidGrid(collision_spheres[i].bb);
+        disturbRigidGrid(v.bb);
+    }
+    collision_spheres[i] = v;
+    rigid_grid_dirty = true;
+}
+
+void World::setRigid(size_t i, const RigidPlane &v)
+{
+    if(memcmp(&collision_planes[i], &v, sizeof(v))!=0) {
+        disturbAll();
+    }
+    collision_planes[i] = v;
+}
+
+void World::setRigid(size_t i, const RigidBox &v)
+{
+    if(memcmp(&collision_boxes[i], &v, sizeof(v))!=0) {
+        disturbRigidGrid(collision_boxes[i].bb);
+        disturbRigidGrid(v.bb);
+    }
+    collision_boxes[i] = v;
+    rigid_grid_dirty = true;
+}
 void World::addForce(const PointForce &v)       { force_point.push_back(v); }
 void World::addForce(const DirectionalForce &v) { force_directional.push_back(v); }
 void World::addForce(const BoxForce &v)         { force_box.push_back(v); }
 
 void World::addParticles( const Particle *p, size_t num )
 {
-    num = std::min<size_t>(num, PSYM_MAX_PARTICLE_NUM-num_active_particles);
+    Particle *dst = allocParticles(num);
     for(size_t i=0; i<num; ++i) {
-        particles[num_active_particles+i] = p[i];
+        dst[i] = p[i];
     }
+}
+
+Particle* World::allocParticles( size_t &num )
+{
+    num = std::min<size_t>(num, PSYM_MAX_PARTICLE_NUM-num_active_particles);
+    Particle *r = particles+num_active_particles;
     num_active_particles += num;
+    return r;
 }
 
 const Particle* World::getParticles() const { return particles; }
 size_t World::getNumParticles() const       { return num_active_particles; }
 
 
+// `FbN|Cǧ`:
+// [CheckpointHeader] ɑĊez [uint32 oCg][f[^] ̌`ŕԁB
+// k̃f[^ [uint32 k̃TCY x ubN][kf[^...]BubN͌f[^ CheckpointBlockSize 
+struct CheckpointHeader
+{
+    uint32 magic;
+    uint32 version;
+    uint32 flags;
+    uint32 num_particles;
+};
+enum CheckpointFlags {
+    Checkpoint_Compressed = 1 << 0,
+};
+static const uint32 CheckpointMagic = 0x4d595350; // "PSYM"
+static const uint32 CheckpointVersion = 1;
+static const uint32 CheckpointBlockSize = 256*1024;
+
+inline uint32 CheckpointNumBlocks(uint32 size) { return (size + CheckpointBlockSize-1) / CheckpointBlockSize; }
+
+static bool WriteCheckpointArray(ist::IBinaryStream &s, const void *data, uint32 size, bool compress)
+{
+    if(s.write(&size, sizeof(size))!=sizeof(size)) { return false; }
+    if(size==0) { return true; }
+    if(!compress) { return s.write(data, size)==size; }
+
+    const uint32 num_blocks = CheckpointNumBlocks(size);
+    const uint32 bound = (uint32)compressBound(CheckpointBlockSize);
+    ist::raw_vector<uint32> sizes(num_blocks);
+    ist::raw_vector<char> buf(num_blocks*bound);
+    tbb::parallel_for(uint32(0), num_blocks, [&](uint32 bi) {
+        uint32 pos = bi*CheckpointBlockSize;
+        uLongf len = bound;
+        int r = compress2((Bytef*)&buf[bi*bound], &len, (const Bytef*)data+pos, std::min<uint32>(CheckpointBlockSize, size-pos), Z_BEST_SPEED);
+        sizes[bi] = r==Z_OK ? (uint32)len : 0;
+    });
+    for(uint32 bi=0; bi<num_blocks; ++bi) {
+        if(sizes[bi]==0) { return false; }
+    }
+    if(s.write(&sizes[0], sizeof(uint32)*num_blocks)!=sizeof(uint32)*num_blocks) { return false; }
+    for(uint32 bi=0; bi<num_blocks; ++bi) {
+        if(s.write(&buf[bi*bound], sizes[bi])!=sizes[bi]) { return false; }
+    }
+    return true;
+}
+
+// size ͌ĂяoœǂŊmFς݂̃oCg
+static bool ReadCheckpointData(ist::IBinaryStream &s, void *data, uint32 size, bool compressed)
+{
+    if(size==0) { return true; }
+    if(!compressed) { return s.read(data, size)==size; }
+
+    const uint32 num_blocks = CheckpointNumBlocks(size);
+    ist::raw_vector<uint32> sizes(num_blocks);
+    ist::raw_vector<uint32> offsets(num_blocks);
+    if(s.read(&sizes[0], sizeof(uint32)*num_blocks)!=sizeof(uint32)*num_blocks) { return false; }
+    uint32 total = 0;
+    for(uint32 bi=0; bi<num_blocks; ++bi) {
+        offsets[bi] = total;
+        total += sizes[bi];
+    }
+    ist::raw_vector<char> buf(total);
+    if(total==0 || s.read(&buf[0], total)!=total) { return false; }
+
+    ist::raw_vector<uint32> results(num_blocks);
+    tbb::parallel_for(uint32(0), num_blocks, [&](uint32 bi) {
+        uint32 pos = bi*CheckpointBlockSize;
+        uLongf len = std::min<uint32>(CheckpointBlockSize, size-pos);
+        int r = uncompress((Bytef*)data+pos, &len, (const Bytef*)&buf[offsets[bi]], sizes[bi]);
+        results[bi] = r==Z_OK && len==std::min<uint32>(CheckpointBlockSize, size-pos);
+    });
+    for(uint32 bi=0; bi<num_blocks; ++bi) {
+        if(!results[bi]) { return false; }
+    }
+    return true;
+}
+
+static bool ReadCheckpointFixed(ist::IBinaryStream &s, void *data, uint32 size, bool compressed)
+{
+    uint32 stored = 0;
+    if(s.read(&stored, sizeof(stored))!=sizeof(stored) || stored!=size) { return false; }
+    return ReadCheckpointData(s, data, size, compressed);
+}
+
+template<class T>
+static bool WriteCheckpointVector(ist::IBinaryStream &s, const ist::raw_vector<T> &v, bool compress)
+{
+    return WriteCheckpointArray(s, v.empty() ? NULL : &v[0], uint32(sizeof(T)*v.size()), compress);
+}
+
+template<class T>
+static bool ReadCheckpointVector(ist::IBinaryStream &s, ist::raw_vector<T> &v, bool compressed)
+{
+    uint32 size = 0;
+    if(s.read(&size, sizeof(size))!=sizeof(size) || size%sizeof(T)!=0) { return false; }
+    v.resize(size/sizeof(T));
+    return ReadCheckpointData(s, v.empty() ? NULL : &v[0], size, compressed);
+}
+
+bool World::saveCheckpoint(ist::IBinaryStream &s, bool compress) const
+{
+    CheckpointHeader header;
+    header.magic = CheckpointMagic;
+    header.version = CheckpointVersion;
+    header.flags = compress ? Checkpoint_Compressed : 0;
+    header.num_particles = (uint32)num_active_particles;
+    if(s.write(&header, sizeof(header))!=sizeof(header)) { return false; }
+
+    return WriteCheckpointArray(s, particles, uint32(sizeof(Particle)*num_active_particles), compress)
+        && WriteCheckpointVector(s, collision_spheres, compress)
+        && WriteCheckpointVector(s, collision_planes, compress)
+        && WriteCheckpointVector(s, collision_boxes, compress)
+        && WriteCheckpointVector(s, force_point, compress)
+        && WriteCheckpointVector(s, force_directional, compress)
+        && WriteCheckpointVector(s, force_box, compress)
+        && WriteCheckpointArray(s, cell_rest_frames, sizeof(cell_rest_frames), compress)
+        && WriteCheckpointArray(s, cell_prev_num, sizeof(cell_prev_num), compress)
+        && WriteCheckpointArray(s, rigid_grid_disturbed, sizeof(rigid_grid_disturbed), compress);
+}
+
+bool World::loadCheckpoint(ist::IBinaryStream &s)
+{
+    CheckpointHeader header;
+    if(s.read(&header, sizeof(header))!=sizeof(header)) { return false; }
+    if(header.magic!=CheckpointMagic || header.version!=CheckpointVersion || header.num_particles>PSYM_MAX_PARTICLE_NUM) { return false; }
+    const bool compressed = (header.flags & Checkpoint_Compressed)!=0;
+
+    bool r = ReadCheckpointFixed(s, particles, uint32(sizeof(Particle)*header.num_particles), compressed)
+        && ReadCheckpointVector(s, collision_spheres, compressed)
+        && ReadCheckpointVector(s, collision_planes, compressed)
+        && ReadCheckpointVector(s, collision_boxes, compressed)
+        && ReadCheckpointVector(s, force_point, compressed)
+        && ReadCheckpointVector(s, force_directional, compressed)
+        && ReadCheckpointVector(s, force_box, compressed)
+        && ReadCheckpointFixed(s, cell_rest_frames, sizeof(cell_rest_frames), compressed)
+        && ReadCheckpointFixed(s, cell_prev_num, sizeof(cell_prev_num), compressed)
+        && ReadCheckpointFixed(s, rigid_grid_disturbed, sizeof(rigid_grid_disturbed), compressed);
+    // rŎsꍇ͒r[ȏԂɂȂ̂ŋɂĂ
+    num_active_particles = r ? header.num_particles : 0;
+    if(!r) {
+        clearRigidsAndForces();
+    }
+    rigid_grid_dirty = true;
+    return r;
+}
+
+
 } // namespace psym
@@ -47,27 +47,81 @@ psymGlobalNamespace(
     istSerializeRaw(psym::Particle);
 )
 
+// `ɕKvȍŏ̏BWorld::update() ڏo
+struct RenderParticle
+{
+    float32 x, y, z;
+    float32 energy;
+    float32 density;
+};
+
+// PSYM_RIGID_GRID_DIV ̃Obh 1 ZBWorld::rigid_grid_spheres/boxes ͈̔͂
+struct RigidGridCell
+{
+    int32 sphere_begin, sphere_num;
+    int32 box_begin, box_num;
+};
+
 
 
 class istAlign(16) World
 {
 public:
     World();
-    void update(float32 dt);
+    // render_out  NULL łȂ΁AXṼp[eBN̕`pf[^oB
+    // render_out  update() O getNumParticles() ̗̈悪Kv (update() Ő邱Ƃ͂Ȃ)
+    // dt  energy ̌ɂgBV~[V͏ PSYM_TIMESTEP i
+    void update(float32 dt, RenderParticle *render_out=NULL);
 
     void clearRigidsAndForces();
-
-    void addRigid(const RigidSphere &v);
-    void addRigid(const RigidPlane &v);
-    void addRigid(const RigidBox &v);
+    void clearRigids();
+    void clearForces();
+
+    // rigid ͖t[蒼Kv͂ȂB߂l index  setRigid() ɂʂɍXVł
+    size_t addRigid(const RigidSphere &v);
+    size_t addRigid(const RigidPlane &v);
+    size_t addRigid(const RigidBox &v);
+    void setRigid(size_t i, const RigidSphere &v);
+    void setRigid(size_t i, const RigidPlane &v);
+    void setRigid(size_t i, const RigidBox &v);
     void addForce(const PointForce &v);
     void addForce(const DirectionalForce &v);
     void addForce(const BoxForce &v);
     void addParticles(const Particle *p, size_t num_particles);
+    // num ̗̈𖖔ɊmۂĕԂB󂫂ȂꍇAnum ͊mۂłɌ
+    Particle* allocParticles(size_t &num);
 
     const Particle* getParticles() const;
     size_t getNumParticles() const;
 
+    // oCĩ`FbN|CgBp[eBNArigidAforceAsleep ̏Ԃ̂܂܏oB
+    // compress Ȃ zlib ňk (ubNɕ)BloadCheckpoint()  update()  save _瑱ꍇƓʂɂȂB
+    // ݒ (substeps Ȃ) ͊܂܂Ȃ
+    bool saveCheckpoint(ist::IBinaryStream &s, bool compress=false) const;
+    bool loadCheckpoint(ist::IBinaryStream &s);
+
+private:
+    void buildRigidGrid();
+    float32 computeMaxSpeed() const;
+    int32 computeNumSubsteps() const;
+    // p[eBN hash ŕבւăObhASoA ɕϊBeZ sleep ԂŌ܂B
+    // energy_decay  energy lBkeep_hits Ȃ hit_to NAp (sub-step r̍蒼p)
+    void buildGrid(float32 energy_decay, bool keep_hits);
+    // energy  hash 𐶐A񂾃p[eBN菜đOɋl߂
+    void compactParticles(float32 energy_decay);
+    // vZKvȃZ݂ɊȂ island ɕBbuildGrid() Ă΂
+    void buildIslands();
+    // 1 sub-step ̃V~[VBisland ɕɐi߂B߂l͍ő呬x
+    float32 simulate(float32 timestep);
+    void writeBack(RenderParticle *render_out);
+    // buildGrid() ̌ɌĂԁBeZ sleep 邩߂
+    void updateSleepStates();
+    // update() ̍ŌɌĂԁBeZÎ~Ă frame XV
+    void updateRestFrames();
+    // bb ɂ rigid grid ̃ZN
+    void disturbRigidGrid(const ispc::BoundingBox &bb);
+    void disturbAll();
+
 public:
     Particle particles[PSYM_MAX_PARTICLE_NUM]; // need serialize
 
@@ -80,6 +134,55 @@ public:
     ist::raw_vector<RigidPlane>    collision_planes;
     ist::raw_vector<RigidBox>      collision_boxes;
 
+    // sphere  box ̓Obhɓo^ĂAeZ͋߂̂̂Ƃ肷B
+    // rigid ɕύX update() ō蒼Bplane ͐Ȃ̂őSƔ肷
+    RigidGridCell           rigid_grid[PSYM_RIGID_GRID_DIV][PSYM_RIGID_GRID_DIV];
+    ist::raw_vector<int32>  rigid_grid_spheres;
+    ist::raw_vector<int32>  rigid_grid_boxes;
+    bool                    rigid_grid_dirty;
+    bool                    rigid_grid_enabled; // false ƑS rigid Ɣ肷 (rp)
+
+    // sub-stepBupdate() 1  (PSYM_TIMESTEP) 𕪊Đi߂B
+    // sub-step Ԃł̓Obh (ߖT̏) g񂵁Aőړʂ regrid_distance 𒴂蒼
+    int32   substeps;           // Œᕪ
+    int32   max_substeps;       // ̏
+    bool    adaptive_substeps;  // true ȂO̍ő呬x CFL 𖞂悤ɕ𑝂₷
+    float32 cfl_number;         // 1 sub-step Őiŗǂ (PSYM_CELL_SIZE ɑ΂䗦)
+    float32 regrid_distance;    // PSYM_SEARCH_SKIN*0.5 𒴂l͖B̒萔ł͗]Ȃ̂ŁAĂ sub-step ɍ蒼
+    int32   last_num_substeps;  // ȉvpBO update() ̕ƃObh̍蒼
+    int32   last_num_regrids;
+
+    // sleepBÎ~ĂZƂ̎͂̃ZÎ~ĂÃŽvZȂB
+    // ͂̃ZAp[eBNo肵A߂ rigid APointForce ÂꂩŋN
+    bool    sleeping_enabled;
+    float32 sleep_speed;        // Z̍ő呬xȉȂÎ~Ƃ݂Ȃ
+    int32   sleep_frames;       //  frame Î~ sleep
+    uint16  cell_rest_frames[PSYM_GRID_DIV][PSYM_GRID_DIV]; // Î~Ă frame B̃Z͏ɍől
+    bool    cell_sleeping[PSYM_GRID_DIV][PSYM_GRID_DIV];
+    int32   cell_prev_num[PSYM_GRID_DIV][PSYM_GRID_DIV];    // ÕZ̃p[eBN
+    float32 cell_speed[PSYM_GRID_DIV][PSYM_GRID_DIV];       //  update() ł̃Z̍ő呬x
+    bool    rigid_grid_disturbed[PSYM_RIGID_GRID_DIV][PSYM_RIGID_GRID_DIV]; // O update() ȍ~ rigid ω
+    int32   last_num_sleeping_cells;        // vp
+    int32   last_num_sleeping_particles;
+
+    // islandBrigid grid Ɠ傫 tile PʂŁAאڂ tile m܂Ƃ߂́B
+    // ꂽ͕̂̉ʁX̃^XNőSHi߂邽߁ÅԂœ҂ɍςށB
+    // false ƑŜ 1  island ɂȂ (rp)
+    bool                        islands_enabled;
+    int32                       last_num_islands;   // vp
+    int32                       tile_island[PSYM_RIGID_GRID_DIV][PSYM_RIGID_GRID_DIV]; // tile  island ԍB-2 ȂvZsv
+    ist::raw_vector<int32>      island_cells;       // island ɕׂvZKvȃZ index
+    ist::raw_vector<int32>      island_ranges;      // island_cells ̊e island ̊Jnʒu (island +1 )
+    ist::raw_vector<int32>      island_stack;       // Ɨp
+    ist::raw_vector<float32>    island_speeds;
+
+    // 񂾃p[eBN sort ̑OɎ菜Bfalse Ǝ񂾂̂܂߂ sort ĖɏW߂ (rp)
+    bool                        dead_compaction_enabled;
+    ist::raw_vector<int32>      compact_counts;     // ȉƗp
+    ist::raw_vector<int32>      compact_holes;
+    ist::raw_vector<int32>      compact_sources;
+    ist::raw_vector<int32>      compact_indices;
+
     ist::raw_vector<PointForce>       force_point;
     ist::raw_vector<DirectionalForce> force_directional;
     ist::raw_vector<BoxForce>         force_box;
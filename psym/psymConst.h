@@ -8,6 +8,19 @@
 #define PSYM_GRID_DIV 256
 #define PSYM_GRID_DIV_BITS 8
 #define PSYM_GRID_CELL_NUM (PSYM_GRID_DIV*PSYM_GRID_DIV)
+#define PSYM_CELL_SIZE (PSYM_GRID_SIZE/PSYM_GRID_DIV)
+
+// q̉eaBߖT͗אڃZ܂łTȂ̂ PSYM_CELL_SIZE ȉł邱
+#define PSYM_SMOOTH_LEN 0.02f
+// ߖTT̗]BObh蒼ɓėǂ̂́A߂Â 2 q̈ړʂ̘aɎ܂ (= eX̔) ܂
+#define PSYM_SEARCH_SKIN (PSYM_CELL_SIZE-PSYM_SMOOTH_LEN)
+
+// World::update() 1 Ői߂鎞ԁBsub-step ꍇ͂𕪊
+#define PSYM_TIMESTEP 0.01f
+
+// rigid o^p̑eObhBPSYM_GRID_DIV ̃Z 8x8  1 ZɂȂ
+#define PSYM_RIGID_GRID_DIV 32
+#define PSYM_RIGID_GRID_SHIFT 3
 
 #define psym_enable_neighbor_density_estimation
 
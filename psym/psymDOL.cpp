@@ -18,18 +18,18 @@ void sphInitializeConstantsDOL()
     ispc::sphInitializeConstants();
 }
 
-void sphIntegrateDOL(ispc::Particle * all_particles, ispc::GridData * grid, int32_t xi, int32_t yi)
+float sphIntegrateDOL(ispc::Particle * all_particles, ispc::GridData * grid, int32_t xi, int32_t yi, float timestep)
 {
-    ispc::sphIntegrate(all_particles, grid, xi, yi);
+    return ispc::sphIntegrate(all_particles, grid, xi, yi, timestep);
 }
 
 void sphProcessCollisionDOL(
     ispc::Particle * all_particles, ispc::GridData * grid, int32_t xi, int32_t yi,
-    ispc::RigidSphere * spheres, int32_t num_spheres,
+    ispc::RigidSphere * spheres, int32_t * sphere_indices, int32_t num_spheres,
     ispc::RigidPlane * planes, int32_t num_planes,
-    ispc::RigidBox * boxes, int32_t num_boxes )
+    ispc::RigidBox * boxes, int32_t * box_indices, int32_t num_boxes )
 {
-    ispc::sphProcessCollision(all_particles, grid, xi, yi, spheres, num_spheres, planes, num_planes, boxes, num_boxes);
+    ispc::sphProcessCollision(all_particles, grid, xi, yi, spheres, sphere_indices, num_spheres, planes, num_planes, boxes, box_indices, num_boxes);
 }
 
 void sphProcessExternalForceDOL(
@@ -1,4 +1,5 @@
 #include "Common.h"
+#include "../psym/psymConst.h"
 
 #ifdef GLSL_VS
 ia_out(GLSL_POSITION)           vec4 ia_VertexPosition;
@@ -19,7 +20,12 @@ vs_out vec4 vs_FluidParam;
 
 void main()
 {
+#ifdef atm_FluidPacked
+    // position is 16bit normalized within (GLSL_FLUID_PACKED_POS, GLSL_FLUID_PACKED_SIZE)
+    vec4 fractionPos = vec4(ia_InstancePosition.xyz*GLSL_FLUID_PACKED_SIZE + GLSL_FLUID_PACKED_POS, 1.0);
+#else
     vec4 fractionPos = ia_InstancePosition;
+#endif
     vec4 vert = ia_VertexPosition+fractionPos;
     vert.w = 1.0;
 
@@ -27,7 +33,7 @@ void main()
     vs_VertexNormal     = vec4(ia_VertexNormal, 0.04);
     vs_VertexColor      = vec4(0.8, 0.1, 0.2, 120.0);
     vs_FluidParam       = ia_InstanceParam;
-    vs_InstancePosition = ia_InstancePosition;
+    vs_InstancePosition = fractionPos;
     gl_Position         = u_RS.ModelViewProjectionMatrix * vert;
 }
 
@@ -0,0 +1,2 @@
+#define atm_FluidPacked
+#include "GBuffer_FluidBlood.glsl"
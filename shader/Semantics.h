@@ -45,3 +45,7 @@
 #define GLSL_FILL_BINDING               4
 #define GLSL_MULTIRESOLUTION_BINDING    5
 #define GLSL_DEBUG_BUFFER_BINDING       6
+
+// FluidPackedParticle position range (covers the floor, which is twice the psym grid). needs psym/psymConst.h
+#define GLSL_FLUID_PACKED_POS           (-PSYM_GRID_SIZE)
+#define GLSL_FLUID_PACKED_SIZE          (PSYM_GRID_SIZE*2.0f)